@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <acrn_common.h>
+
+#include "coalesced_io.h"
+#include "inout.h"
+#include "mem.h"
+#include "sbuf.h"
+#include "timer.h"
+#include "log.h"
+
+/* Delay to emulate the writes left in the ring when the guest stops accessing devices */
+#define COALESCED_IO_DRAIN_PERIOD_NS	1000000L
+
+static char coalesced_io_page[4096] __aligned(4096);
+static struct vmctx *coalesced_io_ctx;
+static bool coalesced_io_enabled;
+/*
+ * Held for reading while a request is emulated and for writing while the
+ * ring is drained, so posted writes are never emulated at the same time
+ * as another access, and a request never overtakes them.
+ */
+static pthread_rwlock_t coalesced_io_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* set between coalesced_io_enter() and coalesced_io_exit() */
+static __thread bool coalesced_io_emulating;
+static bool coalesced_io_timer_armed;
+static struct acrn_timer coalesced_io_timer = {
+	.clockid = CLOCK_MONOTONIC,
+};
+
+static void
+coalesced_io_emulate(struct vmctx *ctx, struct acrn_coalesced_io *entry)
+{
+	struct acrn_pio_request pio_req;
+	struct acrn_mmio_request mmio_req;
+	int vcpu = 0;
+	int err;
+
+	if (entry->type == ACRN_IOREQ_TYPE_PORTIO) {
+		memset(&pio_req, 0, sizeof(pio_req));
+		pio_req.direction = ACRN_IOREQ_DIR_WRITE;
+		pio_req.address = entry->addr;
+		pio_req.size = entry->size;
+		pio_req.value = (uint32_t)entry->value;
+		err = emulate_inout(ctx, &vcpu, &pio_req);
+	} else {
+		memset(&mmio_req, 0, sizeof(mmio_req));
+		mmio_req.direction = ACRN_IOREQ_DIR_WRITE;
+		mmio_req.address = entry->addr;
+		mmio_req.size = entry->size;
+		mmio_req.value = entry->value;
+		err = emulate_mem(ctx, &mmio_req);
+	}
+
+	if (err)
+		pr_dbg("%s: unhandled write to 0x%lx, type %u\n", __func__, entry->addr, entry->type);
+}
+
+/* Returns the number of writes emulated */
+static int
+coalesced_io_flush(struct vmctx *ctx)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)coalesced_io_page;
+	struct acrn_coalesced_io entry;
+	bool emulating;
+	int count = 0;
+
+	pthread_rwlock_wrlock(&coalesced_io_lock);
+	/* the emulated writes must not drain the ring again */
+	emulating = coalesced_io_emulating;
+	coalesced_io_emulating = true;
+	while (sbuf_get(sbuf, (uint8_t *)&entry) == sizeof(entry)) {
+		coalesced_io_emulate(ctx, &entry);
+		count++;
+	}
+	coalesced_io_emulating = emulating;
+	pthread_rwlock_unlock(&coalesced_io_lock);
+	return count;
+}
+
+/*
+ * Emulate the writes posted to the ring, in order, for the users of device
+ * state that don't go through a request, such as the VGA display. Does
+ * nothing while a request is emulated by the calling thread, the ring was
+ * drained before it.
+ */
+void
+coalesced_io_drain(struct vmctx *ctx)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)coalesced_io_page;
+
+	if (!coalesced_io_enabled || coalesced_io_emulating || sbuf_is_empty(sbuf))
+		return;
+
+	coalesced_io_flush(ctx);
+}
+
+static void
+coalesced_io_arm_timer(void)
+{
+	struct itimerspec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_nsec = COALESCED_IO_DRAIN_PERIOD_NS;
+	if (acrn_timer_settime(&coalesced_io_timer, &ts))
+		__atomic_store_n(&coalesced_io_timer_armed, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * The timer only runs while the guest accesses the device model: it stops
+ * once a period went by without any posted write, so an idle VM is left
+ * alone. It is armed again by the next request.
+ */
+static void
+coalesced_io_timer_handler(void *arg, uint64_t nexp)
+{
+	if (coalesced_io_flush((struct vmctx *)arg) > 0)
+		coalesced_io_arm_timer();
+	else
+		__atomic_store_n(&coalesced_io_timer_armed, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Called before emulating a request: emulates the writes the guest posted
+ * before it, and keeps the ring from being drained until
+ * coalesced_io_exit(), as the drained writes could hit the same device.
+ * Requests of different vCPUs are still emulated in parallel.
+ */
+void
+coalesced_io_enter(struct vmctx *ctx)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)coalesced_io_page;
+
+	if (!coalesced_io_enabled)
+		return;
+
+	pthread_rwlock_rdlock(&coalesced_io_lock);
+	/*
+	 * A drain in progress holds the lock for writing, so the writes found
+	 * in the ring or being emulated by someone else are all done once we
+	 * hold it again.
+	 */
+	if (!sbuf_is_empty(sbuf)) {
+		pthread_rwlock_unlock(&coalesced_io_lock);
+		coalesced_io_flush(ctx);
+		pthread_rwlock_rdlock(&coalesced_io_lock);
+	}
+	coalesced_io_emulating = true;
+
+	if (!__atomic_exchange_n(&coalesced_io_timer_armed, true, __ATOMIC_ACQ_REL))
+		coalesced_io_arm_timer();
+}
+
+void
+coalesced_io_exit(void)
+{
+	if (!coalesced_io_emulating)
+		return;
+
+	coalesced_io_emulating = false;
+	pthread_rwlock_unlock(&coalesced_io_lock);
+}
+
+int
+coalesced_io_init(struct vmctx *ctx)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)coalesced_io_page;
+	int error;
+
+	sbuf_init(sbuf, sizeof(coalesced_io_page), sizeof(struct acrn_coalesced_io));
+	error = vm_setup_coalesced_io(ctx, (uint64_t)coalesced_io_page);
+	if (error)
+		return error;
+
+	error = acrn_timer_init(&coalesced_io_timer, coalesced_io_timer_handler, ctx);
+	if (error) {
+		pr_err("%s: failed to init the drain timer\n", __func__);
+		return error;
+	}
+
+	coalesced_io_ctx = ctx;
+	coalesced_io_enabled = true;
+	return 0;
+}
+
+void
+coalesced_io_deinit(void)
+{
+	if (!coalesced_io_enabled)
+		return;
+
+	acrn_timer_deinit(&coalesced_io_timer);
+	coalesced_io_drain(coalesced_io_ctx);
+	coalesced_io_enabled = false;
+	coalesced_io_ctx = NULL;
+}
+
+/*
+ * Returns 0 if writes to [addr, addr + size) are coalesced from now on. A
+ * failure is not fatal: the writes are then emulated one by one as usual.
+ */
+int
+register_coalesced_io(uint32_t type, uint64_t addr, uint64_t size)
+{
+	struct acrn_coalesced_io_zone zone;
+
+	if (!coalesced_io_enabled)
+		return -ENODEV;
+
+	memset(&zone, 0, sizeof(zone));
+	zone.type = type;
+	zone.addr = addr;
+	zone.size = size;
+	return vm_assign_coalesced_io(coalesced_io_ctx, &zone);
+}
+
+int
+unregister_coalesced_io(uint32_t type, uint64_t addr, uint64_t size)
+{
+	struct acrn_coalesced_io_zone zone;
+	int error;
+
+	if (!coalesced_io_enabled)
+		return -ENODEV;
+
+	memset(&zone, 0, sizeof(zone));
+	zone.type = type;
+	zone.addr = addr;
+	zone.size = size;
+	error = vm_deassign_coalesced_io(coalesced_io_ctx, &zone);
+
+	/*
+	 * The handler of the zone may go away once it returns. From a request,
+	 * the ring was drained before it and the zone stays handled.
+	 */
+	coalesced_io_drain(coalesced_io_ctx);
+	return error;
+}
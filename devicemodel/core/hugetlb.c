@@ -860,6 +860,25 @@ void hugetlb_unsetup_memory(struct vmctx *ctx)
 	}
 }
 
+/*
+ * Report the host mappings of the guest memory regions, so that they can
+ * be registered once with the kernel (e.g. as io_uring fixed buffers).
+ * At most max entries of iov are filled; the number of regions is
+ * returned.
+ */
+int hugetlb_get_mem_regions(struct iovec *iov, int max)
+{
+	int i;
+
+	for (i = 0; (i < mem_idx) && (i < max); i++) {
+		iov[i].iov_base = mmap_mem_regions[i].hva_base;
+		iov[i].iov_len = mmap_mem_regions[i].gpa_end -
+			mmap_mem_regions[i].gpa_start;
+	}
+
+	return mem_idx;
+}
+
 bool
 vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 			struct vm_mem_region *ret_region)
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "inout.h"
 #include "log.h"
@@ -45,6 +46,12 @@ static struct {
 	void		*arg;
 } inout_handlers[MAX_IOPORTS];
 
+/*
+ * I/O BARs can be relocated by one vCPU while other vCPUs are dispatched
+ * concurrently, so handler lookups are done under the read lock.
+ */
+static pthread_rwlock_t inout_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
 static int
 default_inout(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 	      uint32_t *eax, void *arg)
@@ -102,9 +109,11 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *pio_reques
 		((bytes != 1) && (bytes != 2) && (bytes != 4)))
 		return -1;
 
+	pthread_rwlock_rdlock(&inout_rwlock);
 	handler = inout_handlers[port].handler;
 	flags = inout_handlers[port].flags;
 	arg = inout_handlers[port].arg;
+	pthread_rwlock_unlock(&inout_rwlock);
 
 	if (pio_request->direction == ACRN_IOREQ_DIR_READ) {
 		if (!(flags & IOPORT_F_IN))
@@ -156,14 +165,18 @@ register_inout(struct inout_port *iop)
 		return -1;
 	}
 
+	pthread_rwlock_wrlock(&inout_rwlock);
+
 	/*
 	 * Verify that the new registration is not overwriting an already
 	 * allocated i/o range.
 	 */
 	if ((iop->flags & IOPORT_F_DEFAULT) == 0) {
 		for (i = iop->port; i < iop->port + iop->size; i++) {
-			if ((inout_handlers[i].flags & IOPORT_F_DEFAULT) == 0)
+			if ((inout_handlers[i].flags & IOPORT_F_DEFAULT) == 0) {
+				pthread_rwlock_unlock(&inout_rwlock);
 				return -1;
+			}
 		}
 	}
 
@@ -174,6 +187,7 @@ register_inout(struct inout_port *iop)
 		inout_handlers[i].arg = iop->arg;
 	}
 
+	pthread_rwlock_unlock(&inout_rwlock);
 	return 0;
 }
 
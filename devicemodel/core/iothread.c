@@ -285,6 +285,11 @@ iothread_parse_options(char *str, struct iothreads_option *iothr_opt)
 	 *   - 2nd iothread instance <-> Service VM CPU 0,1
 	 *   - 3rd iothread instance <-> No CPU affinity settings
 	 *
+	 * - create 1 iothread instance per virtqueue for virtio-blk
+	 *   ... virtio-blk iothread=vq[@0/1],mq=2,...
+	 *   virtio-blk turns "vq" into the number of virtqueues before calling
+	 *   this function.
+	 *
 	 */
 	if (str != NULL) {
 		/*
@@ -72,6 +72,7 @@
 #include "vdisplay.h"
 #include "iothread.h"
 #include "vm_event.h"
+#include "coalesced_io.h"
 
 #define	VM_MAXCPU		16	/* maximum virtual cpus */
 
@@ -113,6 +114,34 @@ static bool cmd_monitor;
 static char *progname;
 static const int BSP;
 
+/*
+ * Optional pool of ioreq dispatch threads. When enabled with
+ * "--ioreq_threads", vm_loop() only discovers pending requests and hands
+ * each of them to the dispatch thread owning that vCPU's slot, so a slow
+ * device handler no longer blocks the requests of the other vCPUs.
+ */
+#define IOREQ_DISPATCH_POLL_NS	20000L
+
+struct ioreq_dispatcher {
+	pthread_t	tid;
+	int		idx;
+	struct vmctx	*ctx;
+	pthread_cond_t	cond;
+	uint64_t	pending;	/* vCPUs posted to this dispatcher */
+	bool		running;	/* handling a request right now */
+	bool		stop;
+};
+
+static struct iothreads_option ioreq_thr_opt;
+static uint64_t ioreq_last_seq;
+static struct ioreq_dispatcher *ioreq_dispatchers;
+static int ioreq_dispatcher_num;
+/* vCPUs whose request is owned by a dispatcher and not yet completed */
+static uint64_t ioreq_inflight;
+/* protects ioreq_inflight and the pending/running/stop state of dispatchers */
+static pthread_mutex_t ioreq_dispatch_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_done_cond = PTHREAD_COND_INITIALIZER;
+
 static cpuset_t cpumask;
 
 static void vm_loop(struct vmctx *ctx);
@@ -156,7 +185,7 @@ usage(int code)
 		"       %*s [--vtpm2 sock_path] [--virtio_poll interval]\n"
 		"       %*s [--cpu_affinity lapic_id] [--lapic_pt] [--rtvm] [--windows]\n"
 		"       %*s [--debugexit] [--logger_setting param_setting]\n"
-		"       %*s [--ssram] <vm>\n"
+		"       %*s [--ssram] [--ioreq_threads num[@cpus]] <vm>\n"
 		"       -B: bootargs for kernel\n"
 		"       -E: elf image path\n"
 		"       -h: help\n"
@@ -186,7 +215,9 @@ usage(int code)
 		"       --logger_setting: params like console,level=4;kmsg,level=3\n"
 		"       --windows: support Oracle virtio-blk, virtio-net and virtio-input devices\n"
 		"            for windows guest with secure boot\n"
-		"       --virtio_msi: force virtio to use single-vector MSI\n",
+		"       --virtio_msi: force virtio to use single-vector MSI\n"
+		"       --ioreq_threads: dispatch I/O requests of different vCPUs in parallel\n"
+		"            its params: thread number[@cpu:cpu/cpu...], e.g. 4@2:3/4\n",
 		progname, (int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
@@ -465,7 +496,11 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_PCI_CFG] = vmexit_pci_emul,
 };
 
-static void
+/*
+ * Returns true if the request has been completed to the HSM, false if the
+ * completion is postponed to vm_system_reset() or vm_suspend_resume().
+ */
+static bool
 handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 {
 	enum vm_exitcode exitcode;
@@ -477,7 +512,10 @@ handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 		exit(1);
 	}
 
+	/* Writes posted earlier by the guest must be emulated first */
+	coalesced_io_enter(ctx);
 	(*handler[exitcode])(ctx, io_req, &vcpu);
+	coalesced_io_exit();
 
 	/* We cannot notify the HSM/hypervisor on the request completion at this
 	 * point if the User VM is in suspend or system reset mode, as the VM is
@@ -488,9 +526,10 @@ handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 	 */
 	if ((VM_SUSPEND_SYSTEM_RESET == vm_get_suspend_mode()) ||
 		(VM_SUSPEND_SUSPEND == vm_get_suspend_mode()))
-		return;
+		return false;
 
 	vm_notify_request_done(ctx, vcpu);
+	return true;
 }
 
 static int
@@ -794,6 +833,225 @@ vm_suspend_resume(struct vmctx *ctx)
 	vm_run(ctx);
 }
 
+/*
+ * Return the vCPUs which may have a request to handle. The hypervisor
+ * publishes them in the pending bitmap of the first slot, which makes the
+ * lookup proportional to the outstanding requests rather than to the vCPU
+ * number. Fall back to all vCPUs if the hypervisor doesn't maintain it.
+ */
+static inline uint64_t
+ioreq_pending_vcpus(void)
+{
+	if (atomic_load(&ioreq_buf[0].pending_seq) == 0UL)
+		return (1UL << guest_ncpus) - 1UL;
+
+	return atomic_load(&ioreq_buf[0].pending_bitmap);
+}
+
+static void *
+ioreq_dispatch_thread(void *param)
+{
+	struct ioreq_dispatcher *disp = param;
+	uint64_t pending;
+	int vcpu_id;
+
+	pthread_mutex_lock(&ioreq_dispatch_mtx);
+	while (!disp->stop) {
+		if (disp->pending == 0UL) {
+			pthread_cond_wait(&disp->cond, &ioreq_dispatch_mtx);
+			continue;
+		}
+
+		pending = disp->pending;
+		disp->pending = 0UL;
+		disp->running = true;
+		pthread_mutex_unlock(&ioreq_dispatch_mtx);
+
+		while (pending != 0UL) {
+			vcpu_id = ffsl(pending) - 1;
+			pending &= ~(1UL << vcpu_id);
+
+			/*
+			 * A request whose completion is postponed by a pending
+			 * reset/suspend stays in flight, so that vm_loop()
+			 * doesn't dispatch it a second time.
+			 */
+			if (handle_vmexit(disp->ctx, &ioreq_buf[vcpu_id], vcpu_id)) {
+				pthread_mutex_lock(&ioreq_dispatch_mtx);
+				ioreq_inflight &= ~(1UL << vcpu_id);
+				pthread_mutex_unlock(&ioreq_dispatch_mtx);
+			}
+		}
+
+		pthread_mutex_lock(&ioreq_dispatch_mtx);
+		disp->running = false;
+		pthread_cond_broadcast(&ioreq_done_cond);
+	}
+	pthread_mutex_unlock(&ioreq_dispatch_mtx);
+
+	return NULL;
+}
+
+/*
+ * Hand every newly pending ioreq over to the dispatcher owning its vCPU.
+ * Returns true if at least one request was posted.
+ */
+static bool
+ioreq_dispatch_pending(void)
+{
+	struct acrn_io_request *io_req;
+	struct ioreq_dispatcher *disp;
+	bool posted = false;
+	uint64_t pending;
+	int vcpu_id;
+
+	pthread_mutex_lock(&ioreq_dispatch_mtx);
+	ioreq_last_seq = atomic_load(&ioreq_buf[0].pending_seq);
+	pending = ioreq_pending_vcpus() & ~ioreq_inflight;
+	while (pending != 0UL) {
+		vcpu_id = ffsl(pending) - 1;
+		pending &= ~(1UL << vcpu_id);
+
+		io_req = &ioreq_buf[vcpu_id];
+		if ((atomic_load(&io_req->processed) != ACRN_IOREQ_STATE_PROCESSING) ||
+		    io_req->kernel_handled)
+			continue;
+
+		ioreq_inflight |= (1UL << vcpu_id);
+		disp = &ioreq_dispatchers[vcpu_id % ioreq_dispatcher_num];
+		disp->pending |= (1UL << vcpu_id);
+		pthread_cond_signal(&disp->cond);
+		posted = true;
+	}
+	pthread_mutex_unlock(&ioreq_dispatch_mtx);
+
+	return posted;
+}
+
+/*
+ * The HSM keeps waking up vm_loop() as long as any request is still being
+ * handled by a dispatcher. Instead of spinning on the ioctl, wait for a
+ * completion, but re-check the shared ioreq page periodically so that a new
+ * request on another vCPU is not held back by a slow device handler.
+ */
+static void
+ioreq_dispatch_wait(void)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&ioreq_dispatch_mtx);
+	/* No need to wait if new requests were inserted since the last scan */
+	if ((ioreq_inflight != 0UL) &&
+	    ((ioreq_last_seq == 0UL) ||
+	     (atomic_load(&ioreq_buf[0].pending_seq) == ioreq_last_seq))) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += IOREQ_DISPATCH_POLL_NS;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ioreq_done_cond, &ioreq_dispatch_mtx, &ts);
+	}
+	pthread_mutex_unlock(&ioreq_dispatch_mtx);
+}
+
+/*
+ * Wait until all dispatchers are idle. Requests left in flight have their
+ * completion postponed and are cleared together by vm_clear_ioreq().
+ */
+static void
+ioreq_dispatch_quiesce(void)
+{
+	int i;
+
+	if (ioreq_dispatchers == NULL)
+		return;
+
+	pthread_mutex_lock(&ioreq_dispatch_mtx);
+	for (i = 0; i < ioreq_dispatcher_num; i++) {
+		while (ioreq_dispatchers[i].pending != 0UL || ioreq_dispatchers[i].running)
+			pthread_cond_wait(&ioreq_done_cond, &ioreq_dispatch_mtx);
+	}
+	ioreq_inflight = 0UL;
+	pthread_mutex_unlock(&ioreq_dispatch_mtx);
+}
+
+static void
+ioreq_dispatch_deinit(void)
+{
+	int i;
+
+	if (ioreq_dispatchers == NULL)
+		return;
+
+	pthread_mutex_lock(&ioreq_dispatch_mtx);
+	for (i = 0; i < ioreq_dispatcher_num; i++) {
+		ioreq_dispatchers[i].stop = true;
+		pthread_cond_signal(&ioreq_dispatchers[i].cond);
+	}
+	pthread_mutex_unlock(&ioreq_dispatch_mtx);
+
+	for (i = 0; i < ioreq_dispatcher_num; i++) {
+		if (ioreq_dispatchers[i].tid != 0)
+			pthread_join(ioreq_dispatchers[i].tid, NULL);
+		pthread_cond_destroy(&ioreq_dispatchers[i].cond);
+	}
+
+	free(ioreq_dispatchers);
+	ioreq_dispatchers = NULL;
+	ioreq_dispatcher_num = 0;
+	ioreq_inflight = 0UL;
+}
+
+static int
+ioreq_dispatch_init(struct vmctx *ctx)
+{
+	struct ioreq_dispatcher *disp;
+	char tname[MAXCOMLEN + 1];
+	int i, num, ret;
+
+	num = MIN(ioreq_thr_opt.num, guest_ncpus);
+	if (num <= 0)
+		return 0;
+
+	ioreq_dispatchers = calloc(num, sizeof(struct ioreq_dispatcher));
+	if (ioreq_dispatchers == NULL) {
+		pr_err("%s: calloc returns NULL\n", __func__);
+		return -1;
+	}
+	ioreq_dispatcher_num = num;
+	ioreq_inflight = 0UL;
+	ioreq_last_seq = 0UL;
+
+	for (i = 0; i < num; i++) {
+		disp = &ioreq_dispatchers[i];
+		disp->idx = i;
+		disp->ctx = ctx;
+		pthread_cond_init(&disp->cond, NULL);
+
+		if (pthread_create(&disp->tid, NULL, ioreq_dispatch_thread, disp) != 0) {
+			pr_err("%s: failed to create ioreq dispatcher %d\n", __func__, i);
+			disp->tid = 0;
+			ioreq_dispatch_deinit();
+			return -1;
+		}
+
+		snprintf(tname, sizeof(tname), "ioreq %d", i);
+		pthread_setname_np(disp->tid, tname);
+
+		if ((ioreq_thr_opt.cpusets != NULL) &&
+		    (CPU_COUNT(ioreq_thr_opt.cpusets + i) != 0)) {
+			ret = pthread_setaffinity_np(disp->tid, sizeof(cpuset_t),
+					ioreq_thr_opt.cpusets + i);
+			if (ret != 0)
+				pr_err("%s: pthread_setaffinity_np fails %d\n", __func__, ret);
+		}
+	}
+
+	pr_info("%s: %d ioreq dispatch threads for %d vCPUs\n", __func__, num, guest_ncpus);
+	return 0;
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
@@ -805,24 +1063,40 @@ vm_loop(struct vmctx *ctx)
 		return;
 	}
 
+	if (ioreq_dispatch_init(ctx) != 0) {
+		pr_err("%s, failed to create ioreq dispatchers.\n", __func__);
+		return;
+	}
+
 	if (vm_run(ctx) != 0) {
 		pr_err("%s, failed to run VM.\n", __func__);
+		ioreq_dispatch_deinit();
 		return;
 	}
 
 	while (1) {
 		int vcpu_id;
+		uint64_t pending;
 		struct acrn_io_request *io_req;
 
 		error = vm_attach_ioreq_client(ctx);
 		if (error)
 			break;
 
-		for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
-			io_req = &ioreq_buf[vcpu_id];
-			if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
-				&& !io_req->kernel_handled)
-				handle_vmexit(ctx, io_req, vcpu_id);
+		if (ioreq_dispatchers != NULL) {
+			if (!ioreq_dispatch_pending())
+				ioreq_dispatch_wait();
+		} else {
+			pending = ioreq_pending_vcpus();
+			while (pending != 0UL) {
+				vcpu_id = ffsl(pending) - 1;
+				pending &= ~(1UL << vcpu_id);
+
+				io_req = &ioreq_buf[vcpu_id];
+				if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+					&& !io_req->kernel_handled)
+					handle_vmexit(ctx, io_req, vcpu_id);
+			}
 		}
 
 		if (VM_SUSPEND_FULL_RESET == vm_get_suspend_mode() ||
@@ -831,13 +1105,16 @@ vm_loop(struct vmctx *ctx)
 		}
 
 		if (VM_SUSPEND_SYSTEM_RESET == vm_get_suspend_mode()) {
+			ioreq_dispatch_quiesce();
 			vm_system_reset(ctx);
 		}
 
 		if (VM_SUSPEND_SUSPEND == vm_get_suspend_mode()) {
+			ioreq_dispatch_quiesce();
 			vm_suspend_resume(ctx);
 		}
 	}
+	ioreq_dispatch_deinit();
 	pr_err("VM loop exit\n");
 }
 
@@ -884,6 +1161,7 @@ enum {
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
 	CMD_OPT_FORCE_VIRTIO_MSI,
+	CMD_OPT_IOREQ_THREADS,
 };
 
 static struct option long_options[] = {
@@ -927,6 +1205,7 @@ static struct option long_options[] = {
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
 	{"virtio_msi",		no_argument,		0, CMD_OPT_FORCE_VIRTIO_MSI},
+	{"ioreq_threads",	required_argument,	0, CMD_OPT_IOREQ_THREADS},
 	{0,			0,			0,  0  },
 };
 
@@ -1138,6 +1417,11 @@ main(int argc, char *argv[])
 		case CMD_OPT_FORCE_VIRTIO_MSI:
 			virtio_msix = 0;
 			break;
+		case CMD_OPT_IOREQ_THREADS:
+			iothread_free_options(&ioreq_thr_opt);
+			if (iothread_parse_options(optarg, &ioreq_thr_opt) != 0)
+				errx(EX_USAGE, "invalid ioreq_threads param %s", optarg);
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -1227,6 +1511,11 @@ main(int argc, char *argv[])
 			goto mevent_fail;
 		}
 
+		error = coalesced_io_init(ctx);
+		if (error) {
+			pr_warn("COALESCED_IO capability is not supported by kernel or hypervisor!\n");
+		}
+
 		pr_notice("vm_init_vdevs\n");
 		if (vm_init_vdevs(ctx) < 0) {
 			pr_err("Unable to init vdev (%d)\n", errno);
@@ -1295,6 +1584,7 @@ main(int argc, char *argv[])
 
 		vm_event_deinit();
 		vm_deinit_vdevs(ctx);
+		coalesced_io_deinit();
 		mevent_deinit();
 		iothread_deinit();
 		vm_unsetup_memory(ctx);
@@ -1313,6 +1603,7 @@ vm_fail:
 		clean_vssram_configs();
 
 dev_fail:
+	coalesced_io_deinit();
 	iothread_deinit();
 	mevent_deinit();
 mevent_fail:
@@ -1327,6 +1618,7 @@ create_fail:
 		gfx_ui_deinit();
 	}
 	uninit_hugetlb();
+	iothread_free_options(&ioreq_thr_opt);
 	deinit_loggers();
 	exit(ret);
 }
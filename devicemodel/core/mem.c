@@ -56,7 +56,8 @@ RB_PROTOTYPE_STATIC(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare)
 /*
  * Per-VM cache. Since most accesses from a vCPU will be to
  * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * result of a lookup. vCPUs update it concurrently under the read
+ * lock, so it is only accessed atomically.
  */
 static struct mmio_rb_range	*mmio_hint __aligned(sizeof(struct mmio_rb_range *));
 
@@ -155,6 +156,7 @@ emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *hint, *entry = NULL;
+	struct mem_range mr;
 	int err;
 
 	pthread_rwlock_rdlock(&mmio_rwlock);
@@ -162,29 +164,36 @@ emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 	/*
 	 * First check the per-VM cache
 	 */
-	hint = mmio_hint;
+	hint = __atomic_load_n(&mmio_hint, __ATOMIC_RELAXED);
 
 	if (hint && paddr >= hint->mr_base && paddr <= hint->mr_end)
 		entry = hint;
 	else if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
 		/* Update the per-VM cache */
-		mmio_hint = entry;
+		__atomic_store_n(&mmio_hint, entry, __ATOMIC_RELAXED);
 	else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
 		pthread_rwlock_unlock(&mmio_rwlock);
 		return -ESRCH;
 	}
 
-	pthread_rwlock_unlock(&mmio_rwlock);
-
-	if (entry == NULL)
+	if (entry == NULL) {
+		pthread_rwlock_unlock(&mmio_rwlock);
 		return -EINVAL;
+	}
+
+	/*
+	 * Take a copy of the range while holding the lock: a BAR relocation
+	 * emulated on another vCPU may free the entry once it is dropped.
+	 */
+	mr = entry->mr_param;
+	pthread_rwlock_unlock(&mmio_rwlock);
 
 	if (mmio_req->direction == ACRN_IOREQ_DIR_READ)
 		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
-				size, &entry->mr_param);
+				size, &mr);
 	else
 		err = mem_write(ctx, 0, paddr, mmio_req->value,
-				size, &entry->mr_param);
+				size, &mr);
 
 	return err;
 }
@@ -245,8 +254,8 @@ unregister_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 			RB_REMOVE(mmio_rb_tree, rbt, entry);
 
 			/* flush Per-VM cache */
-			if (mmio_hint == entry)
-				mmio_hint = NULL;
+			if (__atomic_load_n(&mmio_hint, __ATOMIC_RELAXED) == entry)
+				__atomic_store_n(&mmio_hint, NULL, __ATOMIC_RELAXED);
 
 			free(entry);
 		}
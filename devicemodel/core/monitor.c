@@ -450,6 +450,80 @@ static void handle_blkrescan(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+static void handle_blkqos(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct vm_ops *ops;
+	int ret = 0;
+	int count = 0;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	LIST_FOREACH(ops, &vm_ops_head, list) {
+		if (ops->ops->blkqos) {
+			ret += ops->ops->blkqos(ops->arg, msg->data.devargs);
+			count++;
+		}
+	}
+
+	if (!count) {
+		ack.data.err = -1;
+		pr_err("No handler for id:%u\r\n", msg->msgid);
+	} else
+		ack.data.err = ret;
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+/* the ack carries the statistics as a string, empty if there are none */
+static void handle_blkstat(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct vm_ops *ops;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	memset(ack.data.devargs, 0, PARAM_LEN);
+
+	LIST_FOREACH(ops, &vm_ops_head, list) {
+		if (ops->ops->blkstat &&
+			!ops->ops->blkstat(ops->arg, msg->data.devargs, ack.data.devargs, PARAM_LEN))
+			break;
+	}
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_blksnap(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct vm_ops *ops;
+	int ret = 0;
+	int count = 0;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	LIST_FOREACH(ops, &vm_ops_head, list) {
+		if (ops->ops->blksnap) {
+			ret += ops->ops->blksnap(ops->arg, msg->data.devargs);
+			count++;
+		}
+	}
+
+	if (!count) {
+		ack.data.err = -1;
+		pr_err("No handler for id:%u\r\n", msg->msgid);
+	} else
+		ack.data.err = ret;
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
 static struct monitor_vm_ops pmc_ops = {
 	.stop       = NULL,
 	.resume     = vm_monitor_resume,
@@ -490,6 +564,9 @@ int monitor_init(struct vmctx *ctx)
 	ret += mngr_add_handler(monitor_fd, DM_RESUME, handle_resume, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_QUERY, handle_query, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_BLKRESCAN, handle_blkrescan, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLKQOS, handle_blkqos, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLKSTAT, handle_blkstat, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLKSNAP, handle_blksnap, NULL);
 
 	if (ret) {
 		pr_err("%s %d\r\n", __func__, __LINE__);
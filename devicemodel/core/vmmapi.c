@@ -308,6 +308,42 @@ vm_setup_asyncio(struct vmctx *ctx, uint64_t base)
 	return error;
 }
 
+int
+vm_setup_coalesced_io(struct vmctx *ctx, uint64_t base)
+{
+	int error;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_SETUP_COALESCED_IO, base);
+
+	if (error) {
+		pr_err("ACRN_IOCTL_SETUP_COALESCED_IO ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
+int
+vm_assign_coalesced_io(struct vmctx *ctx, struct acrn_coalesced_io_zone *zone)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_ASSIGN_COALESCED_IO, zone);
+	if (error) {
+		pr_err("ACRN_IOCTL_ASSIGN_COALESCED_IO ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_deassign_coalesced_io(struct vmctx *ctx, struct acrn_coalesced_io_zone *zone)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_DEASSIGN_COALESCED_IO, zone);
+	if (error) {
+		pr_err("ACRN_IOCTL_DEASSIGN_COALESCED_IO ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 int
 vm_parse_memsize(const char *optarg, size_t *ret_memsize)
 {
@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Shared read cache for read-only images.
+ *
+ * When many User VMs boot from the same base image, each DM reads the
+ * same blocks. This cache lives in a POSIX shared memory segment named
+ * after the identity of the image (device and inode), so every DM using
+ * that image attaches to the same segment and a block is read from disk
+ * roughly once.
+ *
+ * The cache is direct mapped: block N can only live in slot
+ * hash(N) % nslots. Each slot is protected by a sequence counter instead
+ * of a lock, so lookups never block:
+ *  - a reader samples the counter, copies the data out and samples it
+ *    again, the copy is only valid if the counter did not change and
+ *    was even;
+ *  - a writer moves the counter from even to odd with a CAS, fills the
+ *    slot and moves it to the next even value. A writer that loses the
+ *    CAS simply does not cache the block.
+ *
+ * Blocks are cached by their offset in the image file, not in the disk of
+ * a DM, so DMs exposing different ranges of the image share one segment.
+ *
+ * Only images that are never written may use the cache: the modification
+ * time and size of the file are part of the segment header, a stale
+ * segment is replaced instead of reused.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "block_cache.h"
+#include "log.h"
+
+#define BLKCACHE_MAGIC		0x48435242U	/* "BRCH" */
+#define BLKCACHE_VERSION	1
+#define BLKCACHE_BLOCK_SHIFT	12
+#define BLKCACHE_BLOCK_SIZE	(1UL << BLKCACHE_BLOCK_SHIFT)
+#define BLKCACHE_MIN_SLOTS	256
+#define BLKCACHE_MAX_RUN	64	/* blocks read with one pread on a miss */
+#define BLKCACHE_ATTACH_TRIES	100	/* 1ms each, waiting for the creator */
+
+struct blkcache_hdr {
+	uint32_t	magic;		/* written last by the creator */
+	uint32_t	version;
+	uint64_t	nslots;
+	uint64_t	dev;
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	uint32_t	users;
+	uint32_t	pad;
+	uint64_t	hits;		/* accumulated by all users */
+	uint64_t	misses;
+};
+
+struct blkcache_slot {
+	uint32_t	seq;		/* odd while the slot is being filled */
+	uint32_t	pad;
+	uint64_t	tag;		/* block number + 1, 0 if empty */
+};
+
+struct blkcache {
+	char			name[64];
+	struct blkcache_hdr	*hdr;
+	struct blkcache_slot	*slots;
+	uint8_t			*data;
+	size_t			map_size;
+	ino_t			shm_ino;	/* of the segment, which a stale one may replace */
+	uint64_t		mask;
+	uint64_t		hits;	/* this instance only */
+	uint64_t		misses;
+};
+
+static size_t
+blkcache_map_size(uint64_t nslots)
+{
+	return BLKCACHE_BLOCK_SIZE +
+		roundup(nslots * sizeof(struct blkcache_slot), BLKCACHE_BLOCK_SIZE) +
+		nslots * BLKCACHE_BLOCK_SIZE;
+}
+
+static void
+blkcache_layout(struct blkcache *cache, void *addr, uint64_t nslots)
+{
+	cache->hdr = addr;
+	cache->slots = (struct blkcache_slot *)((uint8_t *)addr + BLKCACHE_BLOCK_SIZE);
+	cache->data = (uint8_t *)addr + BLKCACHE_BLOCK_SIZE +
+		roundup(nslots * sizeof(struct blkcache_slot), BLKCACHE_BLOCK_SIZE);
+	cache->mask = nslots - 1;
+}
+
+static inline uint64_t
+blkcache_slot_idx(struct blkcache *cache, uint64_t blk)
+{
+	/* spread sequential blocks, 64-bit golden ratio */
+	return (blk * 0x9e3779b97f4a7c15UL >> 17) & cache->mask;
+}
+
+static void
+blkcache_copy_to_iov(const struct iovec *iov, int iovcnt, size_t skip,
+		const uint8_t *src, size_t len)
+{
+	size_t l;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = MIN(iov[i].iov_len - skip, len);
+		memcpy((uint8_t *)iov[i].iov_base + skip, src, l);
+		src += l;
+		len -= l;
+		skip = 0;
+	}
+}
+
+/*
+ * Copy [in, in + len) of block @blk to the iov at @skip if it is cached.
+ * A torn copy is harmless: the caller reads the block again on a miss.
+ */
+static bool
+blkcache_lookup(struct blkcache *cache, uint64_t blk, size_t in, size_t len,
+		const struct iovec *iov, int iovcnt, size_t skip)
+{
+	struct blkcache_slot *slot;
+	uint64_t idx;
+	uint32_t seq;
+
+	idx = blkcache_slot_idx(cache, blk);
+	slot = &cache->slots[idx];
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if ((seq & 1) || __atomic_load_n(&slot->tag, __ATOMIC_RELAXED) != blk + 1)
+		return false;
+
+	blkcache_copy_to_iov(iov, iovcnt, skip,
+			cache->data + (idx << BLKCACHE_BLOCK_SHIFT) + in, len);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static bool
+blkcache_present(struct blkcache *cache, uint64_t blk)
+{
+	return __atomic_load_n(&cache->slots[blkcache_slot_idx(cache, blk)].tag,
+			__ATOMIC_RELAXED) == blk + 1;
+}
+
+static void
+blkcache_fill(struct blkcache *cache, uint64_t blk, const uint8_t *src)
+{
+	struct blkcache_slot *slot;
+	uint64_t idx;
+	uint32_t seq;
+
+	idx = blkcache_slot_idx(cache, blk);
+	slot = &cache->slots[idx];
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(&slot->tag, blk + 1, __ATOMIC_RELAXED);
+	memcpy(cache->data + (idx << BLKCACHE_BLOCK_SHIFT), src, BLKCACHE_BLOCK_SIZE);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int
+blkcache_read_run(int fd, uint8_t *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0) {
+			/* the tail of the last block lies past the end of the image */
+			memset(buf, 0, len);
+			break;
+		}
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+ssize_t
+blkcache_preadv(struct blkcache *cache, int fd, const struct iovec *iov,
+		int iovcnt, off_t offset)
+{
+	uint64_t blk, hits, misses;
+	size_t total, done, in, len, n;
+	uint8_t *buf;
+	off_t cur, end, run;
+	int i;
+
+	for (i = 0, total = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	buf = NULL;
+	hits = misses = 0;
+	end = offset + total;
+	for (cur = offset; cur < end; cur += len) {
+		done = cur - offset;
+		blk = cur >> BLKCACHE_BLOCK_SHIFT;
+		in = cur & (BLKCACHE_BLOCK_SIZE - 1);
+		len = MIN(BLKCACHE_BLOCK_SIZE - in, end - cur);
+
+		if (blkcache_lookup(cache, blk, in, len, iov, iovcnt, done)) {
+			hits++;
+			continue;
+		}
+
+		/* read the whole run of missing blocks at once */
+		run = blk << BLKCACHE_BLOCK_SHIFT;
+		for (n = 1; n < BLKCACHE_MAX_RUN; n++) {
+			if (run + (off_t)(n << BLKCACHE_BLOCK_SHIFT) >= end ||
+					blkcache_present(cache, blk + n))
+				break;
+		}
+
+		/* aligned so that nocache (O_DIRECT) images work as well */
+		if (!buf && posix_memalign((void **)&buf, BLKCACHE_BLOCK_SIZE,
+					BLKCACHE_MAX_RUN * BLKCACHE_BLOCK_SIZE)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if (blkcache_read_run(fd, buf, n << BLKCACHE_BLOCK_SHIFT, run) < 0) {
+			i = errno;
+			free(buf);
+			errno = i;
+			return -1;
+		}
+
+		for (i = 0; i < n; i++)
+			blkcache_fill(cache, blk + i, buf + (i << BLKCACHE_BLOCK_SHIFT));
+		misses += n;
+
+		len = MIN(run + (off_t)(n << BLKCACHE_BLOCK_SHIFT), end) - cur;
+		blkcache_copy_to_iov(iov, iovcnt, done, buf + in, len);
+	}
+	free(buf);
+
+	cache->hits += hits;
+	cache->misses += misses;
+	if (hits)
+		__atomic_fetch_add(&cache->hdr->hits, hits, __ATOMIC_RELAXED);
+	if (misses)
+		__atomic_fetch_add(&cache->hdr->misses, misses, __ATOMIC_RELAXED);
+
+	return total;
+}
+
+static bool
+blkcache_hdr_match(struct blkcache_hdr *hdr, struct stat *st, uint64_t dev,
+		off_t size, size_t map_size)
+{
+	return hdr->version == BLKCACHE_VERSION &&
+		hdr->dev == dev && hdr->ino == (uint64_t)st->st_ino &&
+		hdr->size == size &&
+		hdr->mtime_sec == st->st_mtim.tv_sec &&
+		hdr->mtime_nsec == st->st_mtim.tv_nsec &&
+		blkcache_map_size(hdr->nslots) == map_size;
+}
+
+struct blkcache *
+blkcache_open(int fd, uint32_t size_mb)
+{
+	struct blkcache *cache;
+	struct blkcache_hdr *hdr;
+	struct stat st, shm_st;
+	uint64_t dev, nslots;
+	size_t map_size;
+	off_t size;
+	void *addr;
+	bool is_shm_creator;
+	int shm_fd, tries, retry;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	/* the whole file, whatever range of it this DM exposes */
+	size = S_ISBLK(st.st_mode) ? lseek(fd, 0, SEEK_END) : st.st_size;
+	if (size < 0)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	hdr = NULL;
+	map_size = 0;
+
+	/* for a block device, the identity is the device itself */
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	snprintf(cache->name, sizeof(cache->name), "/acrn-blkcache-%lx-%lx",
+			dev, (uint64_t)st.st_ino);
+
+	nslots = ((uint64_t)size_mb << 20) >> BLKCACHE_BLOCK_SHIFT;
+	nslots = MAX(nslots, BLKCACHE_MIN_SLOTS);
+	while (nslots & (nslots - 1))
+		nslots &= nslots - 1;
+
+	for (retry = 0; retry < 2; retry++) {
+		is_shm_creator = false;
+		shm_fd = shm_open(cache->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (shm_fd >= 0)
+			is_shm_creator = true;
+		else if (errno == EEXIST)
+			shm_fd = shm_open(cache->name, O_RDWR, 0600);
+		if (shm_fd < 0) {
+			pr_warn("blkcache: failed to open %s, error %s\n",
+					cache->name, strerror(errno));
+			goto err;
+		}
+
+		if (is_shm_creator) {
+			map_size = blkcache_map_size(nslots);
+			if (ftruncate(shm_fd, map_size) < 0) {
+				pr_warn("blkcache: can't resize %s to %lu\n",
+						cache->name, map_size);
+				close(shm_fd);
+				shm_unlink(cache->name);
+				goto err;
+			}
+		} else {
+			/* the creator may not have sized it yet */
+			shm_st.st_size = 0;
+			for (tries = 0; tries < BLKCACHE_ATTACH_TRIES; tries++) {
+				if (fstat(shm_fd, &shm_st) < 0 || shm_st.st_size > 0)
+					break;
+				usleep(1000);
+			}
+			map_size = shm_st.st_size;
+		}
+
+		addr = map_size ? mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, shm_fd, 0) : MAP_FAILED;
+		if (fstat(shm_fd, &shm_st) == 0)
+			cache->shm_ino = shm_st.st_ino;
+		close(shm_fd);
+		if (addr == MAP_FAILED) {
+			pr_warn("blkcache: failed to map %s\n", cache->name);
+			goto err;
+		}
+		hdr = addr;
+
+		if (is_shm_creator) {
+			hdr->version = BLKCACHE_VERSION;
+			hdr->nslots = nslots;
+			hdr->dev = dev;
+			hdr->ino = st.st_ino;
+			hdr->size = size;
+			hdr->mtime_sec = st.st_mtim.tv_sec;
+			hdr->mtime_nsec = st.st_mtim.tv_nsec;
+			__atomic_store_n(&hdr->magic, BLKCACHE_MAGIC, __ATOMIC_RELEASE);
+			break;
+		}
+
+		for (tries = 0; tries < BLKCACHE_ATTACH_TRIES; tries++) {
+			if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == BLKCACHE_MAGIC)
+				break;
+			usleep(1000);
+		}
+		if (hdr->magic == BLKCACHE_MAGIC &&
+				blkcache_hdr_match(hdr, &st, dev, size, map_size))
+			break;
+
+		/* left over by an older version of the image, replace it */
+		pr_info("blkcache: %s is stale, recreating it\n", cache->name);
+		munmap(addr, map_size);
+		shm_unlink(cache->name);
+		hdr = NULL;
+	}
+	if (!hdr)
+		goto err;
+
+	cache->map_size = map_size;
+	blkcache_layout(cache, hdr, hdr->nslots);
+	__atomic_fetch_add(&hdr->users, 1, __ATOMIC_RELAXED);
+
+	pr_info("blkcache: %s %s, %lu MiB\n", is_shm_creator ? "created" : "attached to",
+			cache->name, (hdr->nslots << BLKCACHE_BLOCK_SHIFT) >> 20);
+	return cache;
+
+err:
+	free(cache);
+	return NULL;
+}
+
+/*
+ * Unlink the segment, unless it was found stale and replaced meanwhile:
+ * the name then belongs to the users of the new one.
+ */
+static void
+blkcache_unlink(struct blkcache *cache)
+{
+	struct stat st;
+	int shm_fd;
+
+	shm_fd = shm_open(cache->name, O_RDONLY, 0600);
+	if (shm_fd < 0)
+		return;
+
+	if ((fstat(shm_fd, &st) == 0) && (st.st_ino == cache->shm_ino))
+		shm_unlink(cache->name);
+	close(shm_fd);
+}
+
+void
+blkcache_close(struct blkcache *cache)
+{
+	struct blkcache_hdr *hdr;
+
+	if (!cache)
+		return;
+
+	hdr = cache->hdr;
+	pr_info("blkcache: %s hits %lu misses %lu, all users hits %lu misses %lu\n",
+			cache->name, cache->hits, cache->misses,
+			__atomic_load_n(&hdr->hits, __ATOMIC_RELAXED),
+			__atomic_load_n(&hdr->misses, __ATOMIC_RELAXED));
+
+	/* the last user drops the segment so it does not pin Service VM memory */
+	if (__atomic_sub_fetch(&hdr->users, 1, __ATOMIC_ACQ_REL) == 0)
+		blkcache_unlink(cache);
+
+	munmap(hdr, cache->map_size);
+	free(cache);
+}
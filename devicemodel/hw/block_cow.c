@@ -0,0 +1,819 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Minimal sparse copy-on-write overlay format.
+ *
+ * Layout of the overlay file, all on-disk fields are little endian:
+ *
+ *   cluster 0        header
+ *   cluster 1..n     L1 table, one 64-bit entry per L2 table
+ *   ...              L2 tables and data clusters, appended on demand
+ *
+ * An L1 entry holds the file offset of an L2 table. An L2 table is one
+ * cluster of 64-bit entries, each holding the file offset of a data
+ * cluster. A zero entry means "not allocated": the data comes from the
+ * base image. The first write to a cluster copies it up from the base
+ * and allocates it at the end of the overlay.
+ *
+ * L2 tables are cached and written back lazily, from the block worker
+ * threads, when a cache slot is evicted or the guest flushes. The L1
+ * table is only written on flush, after the data and the L2 tables it
+ * points to are stable, so a crash never exposes a half-written cluster.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "block_cow.h"
+#include "block_cache.h"
+#include "log.h"
+
+#define COW_MAGIC		0x574f4341U	/* "ACOW" */
+#define COW_VERSION		1
+#define COW_CLUSTER_BITS	16		/* 64KiB clusters */
+#define COW_MIN_CLUSTER_BITS	12
+#define COW_MAX_CLUSTER_BITS	21
+#define COW_L2_CACHE_SIZE	32		/* 32 tables cover 16GiB with 64KiB clusters */
+#define COW_IOV_MAX		258
+
+struct cow_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;
+	uint32_t	cluster_bits;
+	uint32_t	l1_size;
+	uint64_t	l1_offset;
+	uint64_t	base_size;
+	char		base_path[256];
+} __attribute__((packed));
+
+struct cow_l2 {
+	uint32_t	l1_idx;		/* UINT32_MAX if the slot is empty */
+	bool		dirty;
+	uint64_t	lru;
+	uint64_t	*table;		/* little endian, as on disk */
+};
+
+struct cow_image {
+	int		fd;
+	int		base_fd;
+	struct blkcache	*base_cache;	/* shared read cache of the base, or NULL */
+	bool		ro;
+	off_t		size;
+	uint32_t	cluster_bits;
+	uint64_t	cluster_size;
+	uint32_t	l2_bits;
+	uint32_t	l1_size;
+	uint64_t	l1_offset;
+	uint64_t	*l1;		/* little endian, as on disk */
+	bool		l1_dirty;
+	uint64_t	next_free;
+	uint64_t	lru_clock;
+	struct cow_l2	l2_cache[COW_L2_CACHE_SIZE];
+	uint8_t		*cluster_buf;	/* copy-up buffer, protected by mtx */
+	pthread_mutex_t	mtx;
+};
+
+static int
+cow_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0) {
+			/* past the end of the file reads as zero */
+			memset(buf, 0, len);
+			break;
+		}
+		buf = (uint8_t *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static int
+cow_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf = (const uint8_t *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static void
+cow_iov_advance(struct iovec **iov, int *iovcnt, size_t len)
+{
+	while (len > 0 && *iovcnt > 0) {
+		if (len < (*iov)->iov_len) {
+			(*iov)->iov_base = (uint8_t *)(*iov)->iov_base + len;
+			(*iov)->iov_len -= len;
+			return;
+		}
+		len -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+}
+
+/* Fill @dst with the part of @iov covering [@skip, @skip + @len) */
+static int
+cow_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+		struct iovec *dst)
+{
+	size_t l;
+	int i, n;
+
+	for (i = 0, n = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = MIN(iov[i].iov_len - skip, len);
+		dst[n].iov_base = (uint8_t *)iov[i].iov_base + skip;
+		dst[n].iov_len = l;
+		n++;
+		skip = 0;
+		len -= l;
+	}
+	return n;
+}
+
+static int
+cow_preadv_full(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t ret;
+	int i;
+
+	while (iovcnt > 0) {
+		ret = preadv(fd, iov, iovcnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0) {
+			for (i = 0; i < iovcnt; i++)
+				memset(iov[i].iov_base, 0, iov[i].iov_len);
+			break;
+		}
+		cow_iov_advance(&iov, &iovcnt, ret);
+		off += ret;
+	}
+	return 0;
+}
+
+static int
+cow_pwritev_full(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = pwritev(fd, iov, iovcnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		cow_iov_advance(&iov, &iovcnt, ret);
+		off += ret;
+	}
+	return 0;
+}
+
+/* Read from the base image, through the shared read cache if there is one */
+static int
+cow_base_preadv(struct cow_image *img, struct iovec *iov, int iovcnt, off_t off)
+{
+	if (img->base_cache)
+		return blkcache_preadv(img->base_cache, img->base_fd, iov, iovcnt, off) < 0 ?
+			-errno : 0;
+
+	return cow_preadv_full(img->base_fd, iov, iovcnt, off);
+}
+
+static uint64_t
+cow_alloc_cluster(struct cow_image *img)
+{
+	uint64_t off;
+
+	off = img->next_free;
+	img->next_free += img->cluster_size;
+	return off;
+}
+
+static int
+cow_l2_writeback(struct cow_image *img, struct cow_l2 *l2)
+{
+	int ret;
+
+	if (!l2->dirty)
+		return 0;
+
+	ret = cow_pwrite_full(img->fd, l2->table, img->cluster_size,
+			le64toh(img->l1[l2->l1_idx]));
+	if (ret == 0)
+		l2->dirty = false;
+	return ret;
+}
+
+/*
+ * Look up the L2 table for @l1_idx, loading it into the cache if needed.
+ * With @alloc, a missing table is allocated, otherwise NULL is returned
+ * with *err set to 0. Called with img->mtx held.
+ */
+static struct cow_l2 *
+cow_l2_get(struct cow_image *img, uint32_t l1_idx, bool alloc, int *err)
+{
+	struct cow_l2 *l2, *victim;
+	uint64_t l2_off;
+	int i, ret;
+
+	*err = 0;
+	victim = NULL;
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++) {
+		l2 = &img->l2_cache[i];
+		if (l2->l1_idx == l1_idx) {
+			l2->lru = ++img->lru_clock;
+			return l2;
+		}
+		if (!victim || l2->lru < victim->lru)
+			victim = l2;
+	}
+
+	l2_off = le64toh(img->l1[l1_idx]);
+	if (l2_off == 0 && !alloc)
+		return NULL;
+
+	if (victim->dirty) {
+		/* data clusters referenced by the table must hit the disk first */
+		if (fdatasync(img->fd)) {
+			*err = -errno;
+			return NULL;
+		}
+		ret = cow_l2_writeback(img, victim);
+		if (ret < 0) {
+			*err = ret;
+			return NULL;
+		}
+	}
+	victim->l1_idx = UINT32_MAX;
+
+	if (l2_off) {
+		ret = cow_pread_full(img->fd, victim->table, img->cluster_size, l2_off);
+		if (ret < 0) {
+			*err = ret;
+			return NULL;
+		}
+	} else {
+		memset(victim->table, 0, img->cluster_size);
+		img->l1[l1_idx] = htole64(cow_alloc_cluster(img));
+		img->l1_dirty = true;
+		victim->dirty = true;
+	}
+
+	victim->l1_idx = l1_idx;
+	victim->lru = ++img->lru_clock;
+	return victim;
+}
+
+/*
+ * Return the overlay offset of data cluster @cluster, 0 if it is not
+ * allocated or a negative errno. Called with img->mtx held.
+ */
+static int64_t
+cow_cluster_lookup(struct cow_image *img, uint64_t cluster)
+{
+	struct cow_l2 *l2;
+	int err;
+
+	l2 = cow_l2_get(img, cluster >> img->l2_bits, false, &err);
+	if (!l2)
+		return err;
+	return le64toh(l2->table[cluster & ((1UL << img->l2_bits) - 1)]);
+}
+
+/*
+ * Copy @cluster up from the base image, merging in @len bytes of @iov
+ * (starting @skip bytes into it) at offset @in of the cluster.
+ * Called with img->mtx held.
+ */
+static int
+cow_copy_up(struct cow_image *img, uint64_t cluster, uint64_t in,
+		const struct iovec *iov, int iovcnt, size_t skip, size_t len)
+{
+	struct iovec sub[COW_IOV_MAX], biov;
+	struct cow_l2 *l2;
+	uint8_t *dst;
+	uint64_t host;
+	int i, cnt, ret;
+
+	if (in != 0 || len != img->cluster_size) {
+		biov.iov_base = img->cluster_buf;
+		biov.iov_len = img->cluster_size;
+		ret = cow_base_preadv(img, &biov, 1, cluster << img->cluster_bits);
+		if (ret < 0)
+			return ret;
+	}
+
+	cnt = cow_iov_slice(iov, iovcnt, skip, len, sub);
+	dst = img->cluster_buf + in;
+	for (i = 0; i < cnt; i++) {
+		memcpy(dst, sub[i].iov_base, sub[i].iov_len);
+		dst += sub[i].iov_len;
+	}
+
+	l2 = cow_l2_get(img, cluster >> img->l2_bits, true, &ret);
+	if (!l2)
+		return ret;
+
+	host = cow_alloc_cluster(img);
+	ret = cow_pwrite_full(img->fd, img->cluster_buf, img->cluster_size, host);
+	if (ret < 0)
+		return ret;
+
+	l2->table[cluster & ((1UL << img->l2_bits) - 1)] = htole64(host);
+	l2->dirty = true;
+	return 0;
+}
+
+static size_t
+cow_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	int i;
+
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Extend the extent [pos, pos + *len) mapped at @host over the following
+ * clusters as long as they are mapped the same way, so that one syscall
+ * covers it. Called with img->mtx held.
+ */
+static void
+cow_merge_extent(struct cow_image *img, off_t pos, int64_t host, uint64_t in,
+		size_t *len, size_t left)
+{
+	int64_t next;
+
+	while (*len < left) {
+		next = cow_cluster_lookup(img, (pos + *len) >> img->cluster_bits);
+		if (next < 0 || (host == 0) != (next == 0))
+			break;
+		if (host && next != (int64_t)(host + in + *len))
+			break;
+		*len += MIN(img->cluster_size, left - *len);
+	}
+}
+
+ssize_t
+cow_preadv(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	struct iovec sub[COW_IOV_MAX];
+	size_t total, done, len;
+	uint64_t in;
+	int64_t host;
+	off_t pos;
+	int cnt, ret;
+
+	total = cow_iov_len(iov, iovcnt);
+	if (iovcnt > COW_IOV_MAX || offset < 0 || offset + total > img->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (done = 0; done < total; done += len) {
+		pos = offset + done;
+		in = pos & (img->cluster_size - 1);
+		len = MIN(img->cluster_size - in, total - done);
+
+		pthread_mutex_lock(&img->mtx);
+		host = cow_cluster_lookup(img, pos >> img->cluster_bits);
+		if (host >= 0)
+			cow_merge_extent(img, pos, host, in, &len, total - done);
+		pthread_mutex_unlock(&img->mtx);
+		if (host < 0) {
+			errno = -host;
+			return -1;
+		}
+
+		/* allocated clusters are never moved, so no lock is needed here */
+		cnt = cow_iov_slice(iov, iovcnt, done, len, sub);
+		if (host)
+			ret = cow_preadv_full(img->fd, sub, cnt, host + in);
+		else
+			ret = cow_base_preadv(img, sub, cnt, pos);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+	}
+	return total;
+}
+
+ssize_t
+cow_pwritev(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	struct iovec sub[COW_IOV_MAX];
+	size_t total, done, len;
+	uint64_t in;
+	int64_t host;
+	off_t pos;
+	int cnt, ret;
+
+	if (img->ro) {
+		errno = EROFS;
+		return -1;
+	}
+
+	total = cow_iov_len(iov, iovcnt);
+	if (iovcnt > COW_IOV_MAX || offset < 0 || offset + total > img->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (done = 0; done < total; done += len) {
+		pos = offset + done;
+		in = pos & (img->cluster_size - 1);
+		len = MIN(img->cluster_size - in, total - done);
+
+		pthread_mutex_lock(&img->mtx);
+		host = cow_cluster_lookup(img, pos >> img->cluster_bits);
+		if (host == 0) {
+			/* the whole copy-up runs locked so that racing writers see one cluster */
+			ret = cow_copy_up(img, pos >> img->cluster_bits, in,
+					iov, iovcnt, done, len);
+			pthread_mutex_unlock(&img->mtx);
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			continue;
+		}
+		if (host > 0)
+			cow_merge_extent(img, pos, host, in, &len, total - done);
+		pthread_mutex_unlock(&img->mtx);
+		if (host < 0) {
+			errno = -host;
+			return -1;
+		}
+
+		cnt = cow_iov_slice(iov, iovcnt, done, len, sub);
+		ret = cow_pwritev_full(img->fd, sub, cnt, host + in);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+	}
+	return total;
+}
+
+int
+cow_flush(struct cow_image *img)
+{
+	bool meta;
+	int i, ret;
+
+	if (img->ro)
+		return 0;
+
+	pthread_mutex_lock(&img->mtx);
+
+	/* data first, then the L2 tables pointing at it, then L1 */
+	ret = fdatasync(img->fd) ? -errno : 0;
+
+	meta = img->l1_dirty;
+	for (i = 0; i < COW_L2_CACHE_SIZE && ret == 0; i++) {
+		if (img->l2_cache[i].dirty)
+			meta = true;
+		ret = cow_l2_writeback(img, &img->l2_cache[i]);
+	}
+	if (ret == 0 && img->l1_dirty) {
+		if (fdatasync(img->fd))
+			ret = -errno;
+		else
+			ret = cow_pwrite_full(img->fd, img->l1,
+					img->l1_size * sizeof(uint64_t), img->l1_offset);
+		if (ret == 0)
+			img->l1_dirty = false;
+	}
+	if (ret == 0 && meta && fdatasync(img->fd))
+		ret = -errno;
+
+	pthread_mutex_unlock(&img->mtx);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write the clusters the overlay holds from byte offset *@pos on back to
+ * the base image, which must have been opened read-write, up to about
+ * @max_bytes of them, and drop them from the overlay so that they are read
+ * from the base again. *@pos is moved past the clusters looked at, up to
+ * cow_size() at the end of the image.
+ *
+ * The base is synced before any cluster is dropped, so an interrupted
+ * commit loses nothing and can simply be started again. The caller must
+ * keep I/O to the image away for the duration of a call, since dropped
+ * clusters are no longer where a request in progress may look for them.
+ *
+ * Return the number of bytes written back, or -1 with errno set.
+ */
+int64_t
+cow_commit(struct cow_image *img, off_t *pos, uint64_t max_bytes)
+{
+	uint64_t nr_clusters, cluster, start, end, l2_span, done;
+	struct cow_l2 *l2;
+	int64_t host;
+	size_t len;
+	int ret;
+
+	pthread_mutex_lock(&img->mtx);
+
+	ret = 0;
+	done = 0;
+	l2_span = 1UL << img->l2_bits;
+	nr_clusters = roundup(img->size, img->cluster_size) >> img->cluster_bits;
+	start = *pos >> img->cluster_bits;
+	for (cluster = start; cluster < nr_clusters && done < max_bytes; cluster++) {
+		/* skip whole L2 tables that were never allocated */
+		if (!img->l1[cluster >> img->l2_bits]) {
+			cluster |= l2_span - 1;
+			continue;
+		}
+		host = cow_cluster_lookup(img, cluster);
+		if (host < 0) {
+			ret = host;
+			break;
+		}
+		if (host == 0)
+			continue;
+		len = MIN(img->cluster_size, img->size - (cluster << img->cluster_bits));
+		ret = cow_pread_full(img->fd, img->cluster_buf, len, host);
+		if (ret == 0)
+			ret = cow_pwrite_full(img->base_fd, img->cluster_buf, len,
+					cluster << img->cluster_bits);
+		if (ret < 0)
+			break;
+		done += len;
+	}
+	if (ret == 0 && done && fdatasync(img->base_fd))
+		ret = -errno;
+
+	end = MIN(cluster, nr_clusters);
+
+	/* the clusters are on the base now, the overlay can let go of them */
+	for (cluster = start; ret == 0 && done && cluster < end; cluster++) {
+		if (!img->l1[cluster >> img->l2_bits]) {
+			cluster |= l2_span - 1;
+			continue;
+		}
+		l2 = cow_l2_get(img, cluster >> img->l2_bits, false, &ret);
+		if (!l2)
+			break;
+		if (l2->table[cluster & (l2_span - 1)]) {
+			l2->table[cluster & (l2_span - 1)] = 0;
+			l2->dirty = true;
+		}
+	}
+	*pos = MIN(end << img->cluster_bits, (uint64_t)img->size);
+
+	pthread_mutex_unlock(&img->mtx);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return done;
+}
+
+void
+cow_set_base_cache(struct cow_image *img, struct blkcache *cache)
+{
+	img->base_cache = cache;
+}
+
+off_t
+cow_size(struct cow_image *img)
+{
+	return img->size;
+}
+
+static int
+cow_create(struct cow_image *img, const char *base_path, off_t base_size)
+{
+	struct cow_header *hdr;
+	uint64_t clusters, l1_bytes;
+	int ret;
+
+	clusters = roundup(base_size, img->cluster_size) >> img->cluster_bits;
+	img->l1_size = roundup(clusters, 1UL << img->l2_bits) >> img->l2_bits;
+	img->l1_offset = img->cluster_size;
+	l1_bytes = roundup(img->l1_size * sizeof(uint64_t), img->cluster_size);
+
+	hdr = calloc(1, img->cluster_size);
+	if (!hdr)
+		return -ENOMEM;
+
+	hdr->magic = htole32(COW_MAGIC);
+	hdr->version = htole32(COW_VERSION);
+	hdr->size = htole64(base_size);
+	hdr->cluster_bits = htole32(img->cluster_bits);
+	hdr->l1_size = htole32(img->l1_size);
+	hdr->l1_offset = htole64(img->l1_offset);
+	hdr->base_size = htole64(base_size);
+	strncpy(hdr->base_path, base_path, sizeof(hdr->base_path) - 1);
+
+	ret = cow_pwrite_full(img->fd, hdr, img->cluster_size, 0);
+	free(hdr);
+	if (ret < 0)
+		return ret;
+
+	/* the L1 table starts out as a hole */
+	if (ftruncate(img->fd, img->l1_offset + l1_bytes) || fdatasync(img->fd))
+		return -errno;
+
+	img->size = base_size;
+	return 0;
+}
+
+static int
+cow_load(struct cow_image *img, off_t base_size)
+{
+	struct cow_header hdr;
+	uint64_t clusters;
+	int ret;
+
+	ret = cow_pread_full(img->fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return ret;
+
+	if (le32toh(hdr.magic) != COW_MAGIC || le32toh(hdr.version) != COW_VERSION) {
+		pr_err("cow: not a supported overlay image\n");
+		return -EINVAL;
+	}
+
+	img->cluster_bits = le32toh(hdr.cluster_bits);
+	if (img->cluster_bits < COW_MIN_CLUSTER_BITS ||
+			img->cluster_bits > COW_MAX_CLUSTER_BITS) {
+		pr_err("cow: invalid cluster size 2^%u\n", img->cluster_bits);
+		return -EINVAL;
+	}
+	img->cluster_size = 1UL << img->cluster_bits;
+	img->l2_bits = img->cluster_bits - 3;
+	img->size = le64toh(hdr.size);
+	img->l1_size = le32toh(hdr.l1_size);
+	img->l1_offset = le64toh(hdr.l1_offset);
+
+	clusters = roundup(img->size, img->cluster_size) >> img->cluster_bits;
+	if (((uint64_t)img->l1_size << img->l2_bits) < clusters ||
+			(img->l1_offset & (img->cluster_size - 1)) || img->l1_offset == 0) {
+		pr_err("cow: corrupted overlay header\n");
+		return -EINVAL;
+	}
+
+	if (le64toh(hdr.base_size) != (uint64_t)base_size) {
+		pr_err("cow: base image size changed (%lu, expected %lu)\n",
+				(uint64_t)base_size, le64toh(hdr.base_size));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+struct cow_image *
+cow_open(const char *path, const char *base_path, int base_fd, off_t base_size,
+		bool ro)
+{
+	struct cow_image *img;
+	struct stat sbuf;
+	int i, ret;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+
+	img->base_fd = base_fd;
+	img->ro = ro;
+	img->cluster_bits = COW_CLUSTER_BITS;
+	img->cluster_size = 1UL << COW_CLUSTER_BITS;
+	img->l2_bits = COW_CLUSTER_BITS - 3;
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++)
+		img->l2_cache[i].l1_idx = UINT32_MAX;
+
+	img->fd = open(path, ro ? O_RDONLY : (O_RDWR | O_CREAT), 0644);
+	if (img->fd < 0) {
+		pr_err("cow: could not open overlay %s: %s\n", path, strerror(errno));
+		free(img);
+		return NULL;
+	}
+
+	if (fstat(img->fd, &sbuf) < 0) {
+		pr_err("cow: could not stat overlay %s\n", path);
+		goto fail;
+	}
+
+	if (sbuf.st_size == 0) {
+		if (ro) {
+			pr_err("cow: overlay %s is empty\n", path);
+			goto fail;
+		}
+		ret = cow_create(img, base_path, base_size);
+		if (ret == 0)
+			pr_info("cow: created overlay %s on top of %s\n", path, base_path);
+	} else
+		ret = cow_load(img, base_size);
+	if (ret < 0) {
+		pr_err("cow: could not set up overlay %s: %s\n", path, strerror(-ret));
+		goto fail;
+	}
+
+	if (fstat(img->fd, &sbuf) < 0)
+		goto fail;
+	img->next_free = roundup(sbuf.st_size, img->cluster_size);
+
+	img->l1 = calloc(img->l1_size, sizeof(uint64_t));
+	if (!img->l1)
+		goto fail;
+	if (cow_pread_full(img->fd, img->l1, img->l1_size * sizeof(uint64_t),
+				img->l1_offset) < 0)
+		goto fail;
+
+	img->cluster_buf = malloc(img->cluster_size);
+	if (!img->cluster_buf)
+		goto fail;
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++) {
+		img->l2_cache[i].table = malloc(img->cluster_size);
+		if (!img->l2_cache[i].table)
+			goto fail;
+	}
+
+	pthread_mutex_init(&img->mtx, NULL);
+	return img;
+
+fail:
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++)
+		free(img->l2_cache[i].table);
+	free(img->cluster_buf);
+	free(img->l1);
+	close(img->fd);
+	free(img);
+	return NULL;
+}
+
+void
+cow_close(struct cow_image *img)
+{
+	int i;
+
+	if (!img)
+		return;
+
+	if (cow_flush(img))
+		pr_err("cow: failed to flush overlay metadata: %s\n", strerror(errno));
+
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++)
+		free(img->l2_cache[i].table);
+	free(img->cluster_buf);
+	free(img->l1);
+	close(img->fd);
+	pthread_mutex_destroy(&img->mtx);
+	free(img);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Dirty block tracking for incremental backups.
+ *
+ * Every write to the disk sets the bits covering it in the live bitmap.
+ * Taking a snapshot moves the live bitmap to the snapshot bitmap and
+ * starts a new, empty one: the snapshot bitmap then lists exactly the
+ * blocks that changed between the previous snapshot and this one, which
+ * is what an incremental backup has to copy.
+ *
+ * The bitmaps live in a POSIX shared memory segment named after the DM
+ * and the device, so a backup tool can map it read-only while the VM is
+ * running. The segment is removed when the disk is closed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include "block_dirty.h"
+#include "log.h"
+
+#define BLKDIRTY_HDR_SIZE	4096UL
+
+struct blkdirty {
+	char			name[64];
+	struct blkdirty_hdr	*hdr;
+	uint64_t		*live;
+	uint64_t		*snap;
+	size_t			map_size;
+	uint32_t		shift;		/* log2 of the granularity */
+	uint64_t		nr_bits;
+};
+
+struct blkdirty *
+blkdirty_open(const char *ident, off_t size, uint32_t granularity)
+{
+	struct blkdirty *dirty;
+	struct blkdirty_hdr *hdr;
+	uint64_t nr_words;
+	size_t bitmap_size;
+	void *addr;
+	int shm_fd;
+
+	if (size <= 0 || granularity < 512 || (granularity & (granularity - 1))) {
+		pr_err("blkdirty: invalid granularity %u\n", granularity);
+		return NULL;
+	}
+
+	dirty = calloc(1, sizeof(*dirty));
+	if (!dirty)
+		return NULL;
+
+	snprintf(dirty->name, sizeof(dirty->name), "/acrn-blkdirty-%d-%s",
+			getpid(), ident);
+	dirty->shift = __builtin_ctz(granularity);
+	dirty->nr_bits = howmany(size, granularity);
+	nr_words = howmany(dirty->nr_bits, 64);
+	bitmap_size = roundup(nr_words * sizeof(uint64_t), BLKDIRTY_HDR_SIZE);
+	dirty->map_size = BLKDIRTY_HDR_SIZE + 2 * bitmap_size;
+
+	shm_fd = shm_open(dirty->name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (shm_fd < 0) {
+		pr_err("blkdirty: failed to open %s, error %s\n",
+				dirty->name, strerror(errno));
+		goto err;
+	}
+	if (ftruncate(shm_fd, dirty->map_size) < 0) {
+		pr_err("blkdirty: can't resize %s to %lu\n",
+				dirty->name, dirty->map_size);
+		close(shm_fd);
+		goto err_unlink;
+	}
+	addr = mmap(NULL, dirty->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shm_fd, 0);
+	close(shm_fd);
+	if (addr == MAP_FAILED) {
+		pr_err("blkdirty: failed to map %s\n", dirty->name);
+		goto err_unlink;
+	}
+
+	hdr = addr;
+	hdr->version = BLKDIRTY_VERSION;
+	hdr->size = size;
+	hdr->granularity = granularity;
+	hdr->nr_words = nr_words;
+	hdr->live_offset = BLKDIRTY_HDR_SIZE;
+	hdr->snap_offset = BLKDIRTY_HDR_SIZE + bitmap_size;
+	__atomic_store_n(&hdr->magic, BLKDIRTY_MAGIC, __ATOMIC_RELEASE);
+
+	dirty->hdr = hdr;
+	dirty->live = (uint64_t *)((uint8_t *)addr + hdr->live_offset);
+	dirty->snap = (uint64_t *)((uint8_t *)addr + hdr->snap_offset);
+
+	pr_info("blkdirty: tracking writes in %s, %u bytes per bit\n",
+			dirty->name, granularity);
+	return dirty;
+
+err_unlink:
+	shm_unlink(dirty->name);
+err:
+	free(dirty);
+	return NULL;
+}
+
+void
+blkdirty_close(struct blkdirty *dirty)
+{
+	if (!dirty)
+		return;
+
+	munmap(dirty->hdr, dirty->map_size);
+	shm_unlink(dirty->name);
+	free(dirty);
+}
+
+/*
+ * Called from the block worker threads, possibly concurrently for
+ * different requests of the same disk.
+ */
+void
+blkdirty_mark(struct blkdirty *dirty, off_t offset, off_t len)
+{
+	uint64_t bit, last, mask;
+
+	if (!dirty || len <= 0 || offset < 0)
+		return;
+
+	bit = (uint64_t)offset >> dirty->shift;
+	last = MIN((uint64_t)(offset + len - 1) >> dirty->shift, dirty->nr_bits - 1);
+	while (bit <= last) {
+		/* all the bits of this range that fall in the current word */
+		mask = ~0UL << (bit & 63);
+		if ((last >> 6) == (bit >> 6))
+			mask &= ~0UL >> (63 - (last & 63));
+		/* rewrites of hot blocks should not bounce the cache line */
+		if ((__atomic_load_n(&dirty->live[bit >> 6], __ATOMIC_RELAXED) & mask) != mask)
+			__atomic_fetch_or(&dirty->live[bit >> 6], mask, __ATOMIC_RELAXED);
+		bit = (bit | 63) + 1;
+	}
+}
+
+/*
+ * Start a new generation. The caller must make sure no write is in flight,
+ * so the snapshot bitmap matches the data at the time of the snapshot.
+ * Returns the new generation number.
+ */
+uint64_t
+blkdirty_snapshot(struct blkdirty *dirty)
+{
+	struct blkdirty_hdr *hdr = dirty->hdr;
+	uint64_t i;
+
+	for (i = 0; i < hdr->nr_words; i++)
+		dirty->snap[i] = __atomic_exchange_n(&dirty->live[i], 0, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&hdr->generation, 1, __ATOMIC_RELEASE);
+}
+
+const char *
+blkdirty_name(struct blkdirty *dirty)
+{
+	return dirty->name;
+}
@@ -30,6 +30,7 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <linux/falloc.h>
 #include <linux/fs.h>
 #include <errno.h>
@@ -39,16 +40,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <liburing.h>
 
 #include "dm.h"
 #include "block_if.h"
+#include "block_cow.h"
+#include "block_cache.h"
+#include "block_qos.h"
+#include "block_dirty.h"
 #include "ahci.h"
 #include "dm_string.h"
 #include "log.h"
 #include "iothread.h"
+#include "vmmapi.h"
 
 /*
  * Notes:
@@ -67,13 +74,41 @@
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 #define MAX_DISCARD_SEGMENT	256
+#define BLOCKIF_DIRTY_KB	64	/* default dirty bitmap granularity */
+#define BLOCKIF_ZERO_BUF	(64 * 1024)
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP	(1 << 0)
+
+/* the max number of iovecs of the requests merged into one operation */
+#define BLOCKIF_MERGE_IOV	64
+
+/* bounce pool size classes: 4KiB, 8KiB, ..., 1MiB, each keeping a few free buffers */
+#define BLOCKIF_BOUNCE_MIN	4096
+#define BLOCKIF_BOUNCE_CLASSES	9
+#define BLOCKIF_BOUNCE_DEPTH	16
+
+/* snapshot commit: bytes copied per freeze, and passes over the overlay */
+#define BLOCKIF_COMMIT_CHUNK	(16UL << 20)
+#define BLOCKIF_COMMIT_PASSES	4
 
 #define AIO_MODE_THREAD_POOL	0
 #define AIO_MODE_IO_URING	1
+#define AIO_MODE_IO_URING_SQPOLL	2
 
 /* the max number of entries for the io_uring submission/completion queue */
 #define MAX_IO_URING_ENTRIES	256
 
+/* guest memory is registered with the rings in chunks of at most 1G */
+#define IOU_FIXED_BUF_MAX_LEN	(1UL << 30)
+#define IOU_MAX_MEM_REGIONS	16
+
+/*
+ * With SQPOLL, the idle time (ms) before the kernel submission thread
+ * sleeps, and the bounds of the budget (ns) for spinning on completions.
+ */
+#define IOU_SQPOLL_IDLE_MS	100
+#define IOU_POLL_MIN_NS		1000
+#define IOU_POLL_MAX_NS		64000
+
 /*
  * Debug printf
  */
@@ -85,7 +120,8 @@ enum blockop {
 	BOP_READ,
 	BOP_WRITE,
 	BOP_FLUSH,
-	BOP_DISCARD
+	BOP_DISCARD,
+	BOP_WRITE_ZEROES
 };
 
 enum blockstat {
@@ -103,10 +139,22 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	uint64_t	     start_ns;	/* when it was enqueued */
+	uint64_t	     issue_ns;	/* when it passed the QoS throttle, 0 if not */
+
+	/* link and result while handed to the offload thread, see iou_offload() */
+	struct blockif_elem *onext;
+	int		     oerr;
+
+	/* requests merged into this one, see blockif_merge() */
+	struct blockif_elem *mnext;
+	int		     miovcnt;
+	struct iovec	     miov[BLOCKIF_MERGE_IOV];
 };
 
 struct blockif_queue {
 	int			closing;
+	bool			frozen;		/* no dispatch during a snapshot, see blockif_freeze() */
 
 	pthread_t		btid[BLOCKIF_NUMTHR];
 	pthread_mutex_t		mtx;
@@ -117,12 +165,29 @@ struct blockif_queue {
 	TAILQ_HEAD(, blockif_elem) pendq;
 	TAILQ_HEAD(, blockif_elem) busyq;
 	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+	bool			plugged;	/* hold off dispatch, see blockif_plug() */
+	uint64_t		nr_merged;
+	struct blockif_stats	stats;
 
 	int			in_flight;
 	struct io_uring		ring;
+	bool			fixed_file;	/* bc->fd is registered file 0 */
+	struct iovec		*fixed_bufs;	/* registered guest memory */
+	int			nr_fixed_bufs;
+	uint64_t		poll_ns;	/* completion spin budget */
 	struct iothread_mevent	iomvt;
 	struct iothread_ctx	*ioctx;
 
+	/* helper thread for what io_uring cannot do, see iou_offload() */
+	pthread_t		offload_tid;
+	pthread_mutex_t		offload_mtx;
+	pthread_cond_t		offload_cond;
+	struct blockif_elem	*offload_head;	/* waiting for the helper */
+	struct blockif_elem	*offload_tail;
+	struct blockif_elem	*offload_done;	/* done, to complete on the ring's thread */
+	int			offload_efd;	/* -1 until the helper is started */
+	bool			offload_stop;
+
 	struct blockif_ctxt	*bc;
 };
 
@@ -140,6 +205,12 @@ struct blockif_ops {
 
 struct blockif_ctxt {
 	int			fd;
+	struct cow_image	*cow;	/* sparse overlay on top of fd, or NULL */
+	struct blkcache		*rcache;	/* read cache shared with other VMs, or NULL */
+	struct blkqos		*qos;	/* I/O limits, or NULL; may be set at runtime */
+	struct blkdirty		*dirty;	/* writes since the last snapshot, or NULL */
+	char			*path;	/* of the image, recorded in snapshot overlays */
+	char			*snap_path;	/* overlay of the running snapshot, or NULL */
 	int			isblk;
 	int			candiscard;
 	int			rdonly;
@@ -157,6 +228,7 @@ struct blockif_ctxt {
 	int			bq_num;
 
 	int			aio_mode;
+	int			sqpoll_cpu;	/* -1 if not pinned */
 	const struct blockif_ops *ops;
 
 	/* write cache enable */
@@ -175,6 +247,14 @@ struct blockif_ctxt {
 	 * It indicates that consecutive requests are executed sequentially.
 	 */
 	uint8_t			bst_block;
+
+	/* whether adjacent requests are merged into one operation */
+	uint8_t			merge;
+
+	/* bounce buffers for misaligned requests, see blockif_bounce_get() */
+	pthread_mutex_t		bounce_mtx;
+	void			*bounce_free[BLOCKIF_BOUNCE_CLASSES][BLOCKIF_BOUNCE_DEPTH];
+	int			bounce_nfree[BLOCKIF_BOUNCE_CLASSES];
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -194,19 +274,49 @@ struct discard_range {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static int
+blockif_fsync(struct blockif_ctxt *bc)
+{
+	if (bc->cow)
+		return cow_flush(bc->cow) ? errno : 0;
+
+	return fsync(bc->fd) ? errno : 0;
+}
+
 static int
 blockif_flush_cache(struct blockif_ctxt *bc)
 {
 	int err;
 
 	err = 0;
-	if (!bc->wce) {
-		if (fsync(bc->fd))
-			err = errno;
-	}
+	if (!bc->wce)
+		err = blockif_fsync(bc);
 	return err;
 }
 
+static inline uint64_t
+blockif_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* bucket i holds values up to @base << (@shift * i), the last one anything bigger */
+static inline int
+blockif_hist_bucket(uint64_t val, uint64_t base, int shift)
+{
+	int i;
+
+	for (i = 0; i < BLOCKIF_HIST_BUCKETS - 1; i++) {
+		if (val <= (base << (shift * i)))
+			break;
+	}
+
+	return i;
+}
+
 static int
 blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 		enum blockop op)
@@ -223,6 +333,12 @@ blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 	TAILQ_REMOVE(&bq->freeq, be, link);
 	be->req = breq;
 	be->op = op;
+	be->start_ns = blockif_now_ns();
+	be->issue_ns = 0;
+
+	bq->stats.nr_reqs++;
+	bq->stats.inflight++;
+	bq->stats.depth_hist[blockif_hist_bucket(bq->stats.inflight, 1, 1)]++;
 
 	be->status = BST_PEND;
 	if (bq->bc->bst_block == 1) {
@@ -230,6 +346,7 @@ blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 		case BOP_READ:
 		case BOP_WRITE:
 		case BOP_DISCARD:
+		case BOP_WRITE_ZEROES:
 			off = breq->offset;
 			for (i = 0; i < breq->iovcnt; i++)
 				off += breq->iov[i].iov_len;
@@ -257,11 +374,171 @@ blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 	return (be->status == BST_PEND);
 }
 
+static off_t
+blockif_iov_len(const struct iovec *iov, int iovcnt)
+{
+	off_t len;
+	int i;
+
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static off_t
+blockif_req_len(struct blockif_req *br)
+{
+	return blockif_iov_len(br->iov, br->iovcnt);
+}
+
+/*
+ * The part of the disk @br covers, [*start, *end). The iovec of a virtio-blk
+ * discard or write zeroes holds range descriptors rather than data, as in
+ * blockif_discard_ranges(), so the extent spans all of its ranges.
+ */
+static void
+blockif_req_extent(struct blockif_req *br, enum blockop op, off_t *start,
+		off_t *end)
+{
+	struct discard_range *range;
+	off_t rstart, rend;
+	int i, n_range;
+
+	if ((op != BOP_DISCARD) && (op != BOP_WRITE_ZEROES)) {
+		*start = br->offset;
+		*end = br->offset + blockif_req_len(br);
+		return;
+	}
+
+	if (br->iovcnt != 1) {
+		*start = br->offset;
+		*end = br->offset + br->resid;
+		return;
+	}
+
+	range = br->iov[0].iov_base;
+	n_range = br->iov[0].iov_len / sizeof(*range);
+	*start = *end = 0;
+	for (i = 0; i < n_range; i++) {
+		rstart = range[i].sector * DEV_BSIZE;
+		rend = rstart + range[i].num_sectors * DEV_BSIZE;
+		if ((i == 0) || (rstart < *start))
+			*start = rstart;
+		if ((i == 0) || (rend > *end))
+			*end = rend;
+	}
+}
+
+/*
+ * Record that [offset, offset + len) of the file is about to change, for
+ * incremental backups. Done when the write is issued rather than queued,
+ * so a snapshot taken with the queues drained sees all of them.
+ */
+static void
+blockif_mark_dirty(struct blockif_ctxt *bc, off_t offset, off_t len)
+{
+	if (bc->dirty)
+		blkdirty_mark(bc->dirty, offset - bc->sub_file_start_lba, len);
+}
+
+/*
+ * Whether @tbe may be merged behind the chain started by @head. A request
+ * that was blocked (BST_BLOCK) only because it continues the chain can be
+ * merged, and nothing queued earlier may overlap it if either one writes.
+ */
+static bool
+blockif_can_merge(struct blockif_queue *bq, struct blockif_elem *head,
+		struct blockif_elem *tbe)
+{
+	struct blockif_elem *e, *m;
+	off_t start, end, estart, eend;
+
+	if ((tbe->op != head->op) || tbe->req->align_info.need_conversion ||
+	    ((tbe->status != BST_PEND) && (tbe->status != BST_BLOCK)))
+		return false;
+
+	if (tbe->status == BST_BLOCK) {
+		TAILQ_FOREACH(e, &bq->busyq, link) {
+			if (e->block != tbe->req->offset)
+				continue;
+			for (m = head; (m != NULL) && (m != e); m = m->mnext)
+				;
+			if (m == NULL)
+				return false;
+		}
+	}
+
+	start = tbe->req->offset;
+	end = start + blockif_req_len(tbe->req);
+	TAILQ_FOREACH(e, &bq->pendq, link) {
+		if (e == tbe)
+			break;
+		if ((e->op != BOP_READ) && (e->op != BOP_WRITE) &&
+		    (e->op != BOP_DISCARD) && (e->op != BOP_WRITE_ZEROES))
+			continue;
+		if ((e->op == BOP_READ) && (tbe->op == BOP_READ))
+			continue;
+		blockif_req_extent(e->req, e->op, &estart, &eend);
+		if ((estart < end) && (eend > start))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Take the pending requests that continue @be on disk along with it, so
+ * that they are issued as one vectored operation. The requests stay
+ * separate for completion: they are chained through mnext and each one
+ * gets its own callback.
+ */
+static void
+blockif_merge(struct blockif_queue *bq, struct blockif_elem *be, pthread_t t)
+{
+	struct blockif_elem *tail, *tbe;
+	struct blockif_req *br;
+	off_t end;
+	int n;
+
+	br = be->req;
+	if (!bq->bc->merge || ((be->op != BOP_READ) && (be->op != BOP_WRITE)) ||
+	    br->align_info.need_conversion || (br->iovcnt > BLOCKIF_MERGE_IOV))
+		return;
+
+	memcpy(be->miov, br->iov, br->iovcnt * sizeof(struct iovec));
+	n = br->iovcnt;
+	end = br->offset + blockif_req_len(br);
+
+	for (tail = be; ; tail = tbe) {
+		TAILQ_FOREACH(tbe, &bq->pendq, link) {
+			if ((tbe->req->offset == end) &&
+			    (n + tbe->req->iovcnt <= BLOCKIF_MERGE_IOV) &&
+			    blockif_can_merge(bq, be, tbe))
+				break;
+		}
+		if (tbe == NULL)
+			break;
+
+		TAILQ_REMOVE(&bq->pendq, tbe, link);
+		tbe->status = BST_BUSY;
+		tbe->tid = t;
+		TAILQ_INSERT_TAIL(&bq->busyq, tbe, link);
+
+		memcpy(&be->miov[n], tbe->req->iov, tbe->req->iovcnt * sizeof(struct iovec));
+		n += tbe->req->iovcnt;
+		end += blockif_req_len(tbe->req);
+		tail->mnext = tbe;
+		bq->nr_merged++;
+	}
+	be->miovcnt = n;
+}
+
 static int
 blockif_dequeue(struct blockif_queue *bq, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
+	if (bq->frozen)
+		return 0;
 	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->status == BST_PEND)
 			break;
@@ -272,30 +549,71 @@ blockif_dequeue(struct blockif_queue *bq, pthread_t t, struct blockif_elem **bep
 	be->status = BST_BUSY;
 	be->tid = t;
 	TAILQ_INSERT_TAIL(&bq->busyq, be, link);
+	blockif_merge(bq, be, t);
 	*bep = be;
 	return 1;
 }
 
+/* Run the callbacks of @be and of the requests merged into it */
+static void
+blockif_done(struct blockif_elem *be, int err)
+{
+	for (; be != NULL; be = be->mnext) {
+		be->status = BST_DONE;
+		(*be->req->callback)(be->req, err);
+	}
+}
+
 static void
 blockif_complete(struct blockif_queue *bq, struct blockif_elem *be)
 {
-	struct blockif_elem *tbe;
+	struct blockif_elem *tbe, *next;
+	uint64_t now;
 
-	if (be->status == BST_DONE || be->status == BST_BUSY)
-		TAILQ_REMOVE(&bq->busyq, be, link);
-	else
-		TAILQ_REMOVE(&bq->pendq, be, link);
+	for (; be != NULL; be = next) {
+		next = be->mnext;
+		be->mnext = NULL;
 
-	if (bq->bc->bst_block == 1) {
-		TAILQ_FOREACH(tbe, &bq->pendq, link) {
-			if (tbe->req->offset == be->block)
-				tbe->status = BST_PEND;
+		if (be->status == BST_DONE || be->status == BST_BUSY)
+			TAILQ_REMOVE(&bq->busyq, be, link);
+		else
+			TAILQ_REMOVE(&bq->pendq, be, link);
+
+		if (bq->bc->bst_block == 1) {
+			TAILQ_FOREACH(tbe, &bq->pendq, link) {
+				if (tbe->req->offset == be->block)
+					tbe->status = BST_PEND;
+			}
 		}
+		bq->stats.inflight--;
+		now = blockif_now_ns();
+		bq->stats.lat_hist[blockif_hist_bucket((now - be->start_ns) / 1000, 16, 2)]++;
+		if (be->issue_ns)
+			blkqos_complete(bq->bc->qos, now - be->issue_ns);
+
+		be->tid = 0;
+		be->status = BST_FREE;
+		be->req = NULL;
+		TAILQ_INSERT_TAIL(&bq->freeq, be, link);
+	}
+}
+
+/* Split the length done by a merged operation among its requests */
+static void
+blockif_account(struct blockif_elem *be, ssize_t len)
+{
+	ssize_t n;
+
+	if (be->mnext == NULL) {
+		be->req->resid -= len;
+		return;
+	}
+
+	for (; be != NULL; be = be->mnext) {
+		n = MIN(be->req->resid, len);
+		be->req->resid -= n;
+		len -= n;
 	}
-	be->tid = 0;
-	be->status = BST_FREE;
-	be->req = NULL;
-	TAILQ_INSERT_TAIL(&bq->freeq, be, link);
 }
 
 static int
@@ -314,23 +632,28 @@ discard_range_validate(struct blockif_ctxt *bc, off_t start, off_t size)
 	return 0;
 }
 
+/*
+ * Collect the ranges of a discard or write zeroes request as validated
+ * [offset, length] pairs in the backing file, and their flags if @flags
+ * is not NULL.
+ */
 static int
-blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
+blockif_discard_ranges(struct blockif_ctxt *bc, struct blockif_req *br, enum blockop op,
+		       off_t arg[][2], uint32_t *flags, int *nseg)
 {
-	int err;
 	struct discard_range *range;
-	int n_range, i, segment;
-	off_t arg[MAX_DISCARD_SEGMENT][2];
+	int n_range, i, segment, max_seg;
+	bool invalid;
 
-	err = 0;
 	n_range = 0;
 	segment = 0;
-	if (!bc->candiscard)
+	if ((op == BOP_DISCARD) && !bc->candiscard)
 		return EOPNOTSUPP;
 
 	if (bc->rdonly)
 		return EROFS;
 
+	max_seg = (op == BOP_DISCARD) ? bc->max_discard_seg : MAX_DISCARD_SEGMENT;
 	if (br->iovcnt == 1) {
 		/* virtio-blk use iov to transfer discard range */
 		n_range = br->iov[0].iov_len/sizeof(*range);
@@ -339,12 +662,20 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 			arg[i][0] = range[i].sector * DEV_BSIZE +
 					bc->sub_file_start_lba;
 			arg[i][1] = range[i].num_sectors * DEV_BSIZE;
+			if (flags)
+				flags[i] = range[i].flags;
 			segment++;
-			if (segment > bc->max_discard_seg) {
+			if (segment > max_seg) {
 				WPRINTF(("segment > max_discard_seg\n"));
 				return EINVAL;
 			}
-			if (discard_range_validate(bc, arg[i][0], arg[i][1])) {
+			if (op == BOP_DISCARD)
+				invalid = discard_range_validate(bc, arg[i][0], arg[i][1]);
+			else
+				invalid = !arg[i][1] ||
+					(arg[i][0] + arg[i][1] > bc->size + bc->sub_file_start_lba) ||
+					(range[i].num_sectors > blockif_max_write_zeroes_sectors(bc));
+			if (invalid) {
 				WPRINTF(("range [%ld: %ld] is invalid\n", arg[i][0], arg[i][1]));
 				return EINVAL;
 			}
@@ -353,9 +684,38 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 		/* ahci parse discard range to br->offset and br->reside */
 		arg[0][0] = br->offset + bc->sub_file_start_lba;
 		arg[0][1] = br->resid;
+		if (flags)
+			flags[0] = 0;
 		segment = 1;
 	}
+
+	*nseg = segment;
+	return 0;
+}
+
+/*
+ * Handle all the ranges of a discard, syncing the file once at the end
+ * rather than after each hole punched.
+ */
+static int
+blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	int err;
+	int i, segment;
+	off_t arg[MAX_DISCARD_SEGMENT][2];
+
+	/* a snapshot overlay keeps the old data anyway, discard is only a hint */
+	if (bc->cow) {
+		br->resid = 0;
+		return 0;
+	}
+
+	err = blockif_discard_ranges(bc, br, BOP_DISCARD, arg, NULL, &segment);
+	if (err)
+		return err;
+
 	for (i = 0; i < segment; i++) {
+		blockif_mark_dirty(bc, arg[i][0], arg[i][1]);
 		if (bc->isblk) {
 			err = ioctl(bc->fd, BLKDISCARD, arg[i]);
 		} else {
@@ -368,20 +728,88 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 			 */
 			err = fallocate(bc->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
 				arg[i][0], arg[i][1]);
-			if (!err)
-				err = fdatasync(bc->fd);
 		}
 		if (err) {
+			err = errno;
 			WPRINTF(("Failed to discard offset=%ld nbytes=%ld err code: %d\n",
 				 arg[i][0], arg[i][1], err));
 			return err;
 		}
 	}
+	if (!bc->isblk && fdatasync(bc->fd))
+		return errno;
 	br->resid = 0;
 
 	return 0;
 }
 
+/* Write zeroes the hard way, for overlays and file systems without FALLOC_FL_ZERO_RANGE */
+static int
+blockif_write_zero_buf(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	static char zeroes[BLOCKIF_ZERO_BUF] __attribute__((aligned(BLOCKIF_BOUNCE_MIN)));
+	struct iovec iov;
+	ssize_t n;
+
+	while (len > 0) {
+		iov.iov_base = zeroes;
+		iov.iov_len = MIN(len, BLOCKIF_ZERO_BUF);
+		if (bc->cow)
+			n = cow_pwritev(bc->cow, &iov, 1, off);
+		else
+			n = pwritev(bc->fd, &iov, 1, off);
+		if (n < 0)
+			return errno;
+		if (n == 0)
+			return EIO;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Zero the ranges of a write zeroes request. Ranges flagged UNMAP become
+ * holes if discard is enabled, others are zeroed keeping their blocks.
+ */
+static int
+blockif_process_write_zeroes(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	off_t arg[MAX_DISCARD_SEGMENT][2];
+	uint32_t flags[MAX_DISCARD_SEGMENT];
+	int err, i, mode, segment;
+
+	err = blockif_discard_ranges(bc, br, BOP_WRITE_ZEROES, arg, flags, &segment);
+	if (err)
+		return err;
+
+	for (i = 0; i < segment; i++) {
+		blockif_mark_dirty(bc, arg[i][0], arg[i][1]);
+		if (bc->cow) {
+			err = blockif_write_zero_buf(bc, arg[i][0], arg[i][1]);
+		} else if (bc->isblk) {
+			/* the kernel unmaps if the device zeroes that way, else writes zeroes */
+			err = ioctl(bc->fd, BLKZEROOUT, arg[i]) ? errno : 0;
+		} else {
+			mode = ((flags[i] & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) && bc->candiscard) ?
+				FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+			err = fallocate(bc->fd, mode | FALLOC_FL_KEEP_SIZE, arg[i][0], arg[i][1]) ?
+				errno : 0;
+			if (err == EOPNOTSUPP)
+				err = blockif_write_zero_buf(bc, arg[i][0], arg[i][1]);
+		}
+		if (err) {
+			WPRINTF(("Failed to write zeroes offset=%ld nbytes=%ld err code: %d\n",
+				 arg[i][0], arg[i][1], err));
+			return err;
+		}
+	}
+	br->resid = 0;
+
+	return blockif_flush_cache(bc);
+}
+
 static void
 blockif_init_iov_align_info(struct blockif_req *br)
 {
@@ -484,39 +912,42 @@ blockif_dump_align_info(struct blockif_req *br)
  *  - bounced_size = head + org_size + tail
  *
  *
- * Use a single bounce_iov to do the aligned READ/WRITE.
- *  - bounce_iov cnt = 1
- *  - bounce_iov.iov_base = return of posix_memalign (aligned to @alignment)
- *  - bounce_iov.len = bounced_size
- *  - Accessing from the offset `aligned_dn_start`
+ * The aligned request (bounce_iov[]) accesses `bounced_size` bytes from the offset `aligned_dn_start`.
+ * It is built by blockif_split_iov(), walking org_iov[] along the file offsets:
+ *  - a guest buffer whose address and file offset are misaligned by the same amount has an aligned
+ *    interior; the aligned interior is passed to the host as it is (direct piece).
+ *  - everything else, i.e. the ragged edges and buffers that can never line up, is gathered into
+ *    pieces of a single bounce buffer taken from the bounce pool (bounced piece). A bounced piece
+ *    always starts and ends on an alignment boundary, so the first one carries `head` and the last
+ *    one carries `tail`.
+ *  - if the request would need more than BLOCKIF_BOUNCE_IOV_MAX pieces, the whole request is
+ *    bounced. That keeps bounce_iov[], which is part of every blockif_req, small; requests split
+ *    in more pieces are scattered ones, for which the copy is cheap compared to the syscalls.
+ *
+ *  org_iov:     |<----- iov[0] ----->|<-------------- iov[1] -------------->|<--- iov[2] --->|
+ *  bounce_iov:  |<- bounced ->|<direct>|<-- bounced -->|<------- direct ------->|<--- bounced --->|
+ *               aligned_dn_start                                                        (+ tail)
  *
  *
  * For READ access:
  *    1. Do the aligned READ (using `bounce_iov`) from the offset `aligned_dn_start`, with the length `bounced_size`.
- *    2. AFTER the aligned READ is completed, copy the data from the bounce_iov to the org_iov.
- *       from                          | length
- *       ------------------------------|---------------
- *       bounce_iov.iov_base + head    | org_size
+ *    2. AFTER the aligned READ is completed, copy the data of the bounced pieces to the org_iov.
+ *       The direct pieces have been read in place.
  *
  *
  * For WRITE access:
- *    1. BEFORE the aligned WRITE is conducted, construct the bounced data with three parts in bounce_iov.
- *        (a). If head is not 0, get data of first alignment area -> head_area data (by doing aligned read)
+ *    1. BEFORE the aligned WRITE is conducted, construct the bounced pieces.
+ *        (a). If head is not 0, read the first alignment area into the first bounced piece
  *             from                | length
  *             --------------------|---------------
  *             aligned_dn_start    | alignment
  *
- *        (b). If tail is not 0, get data of last alignment area -> tail_area data (by doing aligned read)
+ *        (b). If tail is not 0, read the last alignment area into the end of the last bounced piece
  *             from                | length
  *             --------------------|---------------
  *             aligned_dn_end      | alignment
  *
- *        (c). Construct the bounced data in bounce_iov
- *             from                | to               | length        | source
- *             --------------------|------------------|---------------|---------------------------------
- *             aligned_dn_start    | start            | head          | head_area data from block device
- *             start               | end              | org_size      | data specified in org_iov[]
- *             end                 | end + tail       | tail          | tail_area data from block device
+ *        (c). Copy the data of org_iov[] that is not covered by a direct piece into the bounced pieces.
  *    2. Do the aligned WRITE (using `bounce_iov`) from the offset `aligned_dn_start`, with the length `bounced_size`.
  *
  *
@@ -573,218 +1004,335 @@ blockif_init_alignment_info(struct blockif_ctxt *bc, struct blockif_req *br)
 }
 
 /*
- * Use a single bounce_iov to do the aligned READ/WRITE.
- *  - bounce_iov cnt = 1
- *  - bounce_iov.iov_base = return of posix_memalign (aligned to @alignment)
- *  - bounce_iov.len = bounced_size
- *  - Accessing from the offset `aligned_dn_start`
+ * Bounce buffers come from a small per-disk pool of power-of-two size classes,
+ * so that misaligned requests do not pay for posix_memalign()/free() each time.
+ * Requests larger than the biggest class are allocated and freed directly.
  */
+static inline size_t
+blockif_bounce_align(struct blockif_ctxt *bc)
+{
+	return (bc->sectsz > BLOCKIF_BOUNCE_MIN) ? bc->sectsz : BLOCKIF_BOUNCE_MIN;
+}
+
 static int
-blockif_init_bounce_iov(struct blockif_req *br)
+blockif_bounce_class(size_t len)
 {
-	int ret = 0;
-	void *bounce_buf = NULL;
-	struct br_align_info *info = &br->align_info;
+	int cls = 0;
+
+	while ((cls < BLOCKIF_BOUNCE_CLASSES) && (((size_t)BLOCKIF_BOUNCE_MIN << cls) < len))
+		cls++;
 
-	ret = posix_memalign(&bounce_buf, info->alignment, info->bounced_size);
+	return cls;
+}
+
+static void *
+blockif_bounce_get(struct blockif_ctxt *bc, size_t len)
+{
+	int cls = blockif_bounce_class(len);
+	void *buf = NULL;
+	int ret;
+
+	if (cls < BLOCKIF_BOUNCE_CLASSES) {
+		pthread_mutex_lock(&bc->bounce_mtx);
+		if (bc->bounce_nfree[cls] > 0)
+			buf = bc->bounce_free[cls][--bc->bounce_nfree[cls]];
+		pthread_mutex_unlock(&bc->bounce_mtx);
+		if (buf)
+			return buf;
+		len = (size_t)BLOCKIF_BOUNCE_MIN << cls;
+	}
+
+	ret = posix_memalign(&buf, blockif_bounce_align(bc), len);
 	if (ret != 0) {
-		bounce_buf = NULL;
-		pr_err("%s: posix_memalign fails, error %s \n", __func__, strerror(-ret));
-	} else {
-		info->bounce_iov.iov_base = bounce_buf;
-		info->bounce_iov.iov_len = info->bounced_size;
+		pr_err("%s: posix_memalign fails, error %s \n", __func__, strerror(ret));
+		return NULL;
 	}
 
-	return ret;
+	return buf;
 }
 
 static void
-blockif_deinit_bounce_iov(struct blockif_req *br)
+blockif_bounce_put(struct blockif_ctxt *bc, void *buf, size_t len)
+{
+	int cls = blockif_bounce_class(len);
+
+	if (cls < BLOCKIF_BOUNCE_CLASSES) {
+		pthread_mutex_lock(&bc->bounce_mtx);
+		if (bc->bounce_nfree[cls] < BLOCKIF_BOUNCE_DEPTH) {
+			bc->bounce_free[cls][bc->bounce_nfree[cls]++] = buf;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&bc->bounce_mtx);
+	}
+
+	free(buf);
+}
+
+static void
+blockif_bounce_drain(struct blockif_ctxt *bc)
+{
+	int cls;
+
+	for (cls = 0; cls < BLOCKIF_BOUNCE_CLASSES; cls++) {
+		while (bc->bounce_nfree[cls] > 0)
+			free(bc->bounce_free[cls][--bc->bounce_nfree[cls]]);
+	}
+	pthread_mutex_destroy(&bc->bounce_mtx);
+}
+
+/*
+ * Build bounce_iov[] for a misaligned request, see the comment above
+ * blockif_init_alignment_info(). With @buf NULL, only the size of the bounce
+ * buffer needed is worked out. With @split false, the whole request is bounced.
+ *
+ * Returns the number of pieces, or -1 if there would be more than BLOCKIF_BOUNCE_IOV_MAX.
+ */
+static int
+blockif_split_iov(struct blockif_req *br, char *buf, size_t *bounce_len, bool split)
 {
 	struct br_align_info *info = &br->align_info;
+	struct iovec *biov = info->bounce_iov;
+	uint32_t alignment = info->alignment;
+	off_t pos = info->aligned_dn_start + info->head;	/* file offset of the next guest byte */
+	off_t seg = -1;		/* file offset of the open bounced piece, -1 if none */
+	size_t used = 0;
+	size_t len, lead, mid;
+	uintptr_t base;
+	int i, n = 0;
 
-	if (info->bounce_iov.iov_base == NULL) {
-		pr_err("%s: info->bounce_iov.iov_base is NULL %s \n", __func__);
-		return;
+	for (i = 0; i < br->iovcnt; i++) {
+		base = (uintptr_t)br->iov[i].iov_base;
+		len = br->iov[i].iov_len;
+		if (len == 0)
+			continue;
+
+		/*
+		 * The address and the file offset move together within a buffer,
+		 * so either both become aligned at some point or neither ever does.
+		 */
+		mid = 0;
+		lead = len;
+		if (split && ((base % alignment) == (pos % alignment))) {
+			lead = (alignment - pos % alignment) % alignment;
+			if (lead < len)
+				mid = (len - lead) / alignment * alignment;
+		}
+
+		if (mid == 0) {
+			if (seg < 0)
+				seg = pos - pos % alignment;
+			pos += len;
+			continue;
+		}
+
+		/* misaligned start of the buffer, closing the open bounced piece */
+		if (lead) {
+			if (seg < 0)
+				seg = pos - pos % alignment;
+			pos += lead;
+		}
+		if (seg >= 0) {
+			if (n >= BLOCKIF_BOUNCE_IOV_MAX)
+				return -1;
+			if (buf) {
+				biov[n].iov_base = buf + used;
+				biov[n].iov_len = pos - seg;
+			}
+			n++;
+			used += pos - seg;
+			seg = -1;
+		}
+
+		/* aligned interior */
+		if (n >= BLOCKIF_BOUNCE_IOV_MAX)
+			return -1;
+		if (buf) {
+			biov[n].iov_base = (void *)(base + lead);
+			biov[n].iov_len = mid;
+		}
+		n++;
+		pos += mid;
+
+		/* misaligned end of the buffer opens a new bounced piece */
+		if (lead + mid < len) {
+			seg = pos;
+			pos += len - lead - mid;
+		}
 	}
 
-	free(info->bounce_iov.iov_base);
-	info->bounce_iov.iov_base = NULL;
+	if (seg >= 0) {
+		if (n >= BLOCKIF_BOUNCE_IOV_MAX)
+			return -1;
+		if (buf) {
+			biov[n].iov_base = buf + used;
+			biov[n].iov_len = pos + info->tail - seg;
+		}
+		n++;
+		used += pos + info->tail - seg;
+	}
+
+	*bounce_len = used;
+	return n;
 }
 
 /*
- * For READ access:
- *    1. Do the aligned READ (using `bounce_iov`) from the offset `aligned_dn_start`, with the length `bounced_size`.
- *    2. AFTER the aligned READ is completed, copy the data from the bounce_iov to the org_iov.
- *       from                          | length
- *       ------------------------------|---------------
- *       bounce_iov.iov_base + head    | org_size
+ * Copy the data of the bounced pieces between bounce_iov[] and org_iov[].
+ * The direct pieces are skipped, they are guest memory already.
  */
 static void
-blockif_complete_bounced_read(struct blockif_req *br)
+blockif_copy_bounced(struct blockif_req *br, bool to_bounce)
 {
+	struct br_align_info *info = &br->align_info;
+	char *lo = info->bounce_buf;
+	char *hi = lo + info->bounce_len;
 	struct iovec *iov = br->iov;
+	size_t left, off, len;
+	bool bounced;
+	char *p;
+	int i, s;
+
+	i = 0;
+	off = 0;
+	for (s = 0; s < info->bounce_iovcnt; s++) {
+		p = info->bounce_iov[s].iov_base;
+		left = info->bounce_iov[s].iov_len;
+		bounced = (lo != NULL) && (p >= lo) && (p < hi);
+
+		/* only bounced pieces may carry head and tail */
+		if (s == 0) {
+			p += info->head;
+			left -= info->head;
+		}
+		if (s == info->bounce_iovcnt - 1)
+			left -= info->tail;
+
+		while (left > 0) {
+			len = iov[i].iov_len - off;
+			if (len > left)
+				len = left;
+			if (bounced) {
+				if (to_bounce)
+					memcpy(p, iov[i].iov_base + off, len);
+				else
+					memcpy(iov[i].iov_base + off, p, len);
+			}
+			p += len;
+			left -= len;
+			off += len;
+			if (off == iov[i].iov_len) {
+				i++;
+				off = 0;
+			}
+		}
+	}
+}
+
+static int
+blockif_init_bounce_iov(struct blockif_ctxt *bc, struct blockif_req *br)
+{
 	struct br_align_info *info = &br->align_info;
-	int length = info->org_size;
-	int i, len, done;
+	bool split = true;
+	size_t len;
+	void *buf;
 
-	if (info->bounce_iov.iov_base == NULL) {
-		pr_err("%s: info->bounce_iov.iov_base is NULL %s \n", __func__);
-		return;
+	if (blockif_split_iov(br, NULL, &len, split) < 0) {
+		/* too fragmented to be worth it, bounce the whole request */
+		split = false;
+		blockif_split_iov(br, NULL, &len, split);
 	}
 
-	done = info->head;
-	for (i = 0; i < br->iovcnt; i++) {
-		len = (iov[i].iov_len < length) ? iov[i].iov_len : length;
-		memcpy(iov[i].iov_base, info->bounce_iov.iov_base + done, len);
-
-		done += len;
-		length -= len;
-		if (length <= 0)
-			break;
+	buf = NULL;
+	if (len > 0) {
+		buf = blockif_bounce_get(bc, len);
+		if (buf == NULL)
+			return ENOMEM;
 	}
 
-	return;
-};
+	info->bounce_buf = buf;
+	info->bounce_len = len;
+	info->bounce_iovcnt = blockif_split_iov(br, buf, &len, split);
+
+	return 0;
+}
+
+static void
+blockif_deinit_bounce_iov(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	struct br_align_info *info = &br->align_info;
+
+	if (info->bounce_buf == NULL)
+		return;
+
+	blockif_bounce_put(bc, info->bounce_buf, info->bounce_len);
+	info->bounce_buf = NULL;
+}
+
+/*
+ * For READ access:
+ *    AFTER the aligned READ is completed, copy the data of the bounced pieces to the org_iov.
+ */
+static void
+blockif_complete_bounced_read(struct blockif_req *br)
+{
+	blockif_copy_bounced(br, false);
+}
 
 /*
  * It is used to read out the head/tail area to construct the bounced data.
  *
- * Allocate an aligned buffer for @b_iov and do an aligned read from @offset (with length @alignment).
+ * Do an aligned read from @offset (with length @alignment) into @area.
  * @offset shall be guaranteed to be aligned by caller (either aligned_dn_start or aligned_dn_end).
  */
 static int
-blockif_read_head_or_tail_area(int fd, struct iovec *b_iov, off_t offset, uint32_t alignment)
+blockif_read_head_or_tail_area(int fd, void *area, off_t offset, uint32_t alignment)
 {
-	int ret = 0;
-	int bytes_read;
-	void *area = NULL;
-
-	ret = posix_memalign(&area, alignment, alignment);
-	if (ret != 0) {
-		area = NULL;
-		pr_err("%s: posix_memalign fails, error %s \n", __func__, strerror(-ret));
-		return ret;
-	}
-
-	b_iov->iov_base = area;
-	b_iov->iov_len = alignment;
-	bytes_read = preadv(fd, b_iov, 1, offset);
-
-	if (bytes_read < 0) {
+	if (pread(fd, area, alignment, offset) < 0) {
 		pr_err("%s: read fails \n", __func__);
-		ret = errno;
+		return errno;
 	}
 
-	return ret;
+	return 0;
 }
 
 /*
  * For WRITE access:
- *    1. BEFORE the aligned WRITE is conducted, construct the bounced data with three parts in bounce_iov.
- *        (a). If head is not 0, get data of first alignment area -> head_area data (by doing aligned read)
- *             from                | length
- *             --------------------|---------------
- *             aligned_dn_start    | alignment
- *
- *        (b). If tail is not 0, get data of last alignment area -> tail_area data (by doing aligned read)
- *             from                | length
- *             --------------------|---------------
- *             aligned_dn_end      | alignment
- *
- *        (c). Construct the bounced data in bounce_iov
- *             from                | to               | length        | source
- *             --------------------|------------------|---------------|---------------------------------
- *             aligned_dn_start    | start            | head          | head_area data from block device
- *             start               | end              | org_size      | data specified in org_iov[]
- *             end                 | end + tail       | tail          | tail_area data from block device
- *    2. Do the aligned WRITE (using `bounce_iov`) from the offset `aligned_dn_start`, with the length `bounced_size`.
+ *    BEFORE the aligned WRITE is conducted, construct the bounced pieces.
+ *        (a). If head is not 0, read the first alignment area into the first bounced piece
+ *        (b). If tail is not 0, read the last alignment area into the end of the last bounced piece
+ *        (c). Copy the data of org_iov[] that is not covered by a direct piece into the bounced pieces.
  */
 static int
 blockif_init_bounced_write(struct blockif_ctxt *bc, struct blockif_req *br)
 {
-	struct iovec *iov = br->iov;
 	struct br_align_info *info = &br->align_info;
 	uint32_t alignment = info->alignment;
-	struct iovec head_iov, tail_iov;
-	uint32_t head = info->head;
-	uint32_t tail = info->tail;
-	int i, done, ret;
-
-	ret = 0;
-
-	if (info->bounce_iov.iov_base == NULL) {
-		pr_err("%s: info->bounce_iov.iov_base is NULL \n", __func__);
-		return -1;
-	}
-
-	memset(&head_iov, 0, sizeof(head_iov));
-	memset(&tail_iov, 0, sizeof(tail_iov));
+	struct iovec *last;
+	int ret;
 
-	/*
-	 * If head is not 0, get data of first alignment area, head_area data (by doing aligned read)
-	 *  from                | length
-	 *  --------------------|---------------
-	 *  aligned_dn_start    | alignment
-	 */
-	if (head != 0) {
-		ret = blockif_read_head_or_tail_area(bc->fd, &head_iov, info->aligned_dn_start, alignment);
-		if (ret < 0) {
+	if (info->head != 0) {
+		ret = blockif_read_head_or_tail_area(bc->fd, info->bounce_iov[0].iov_base,
+				info->aligned_dn_start, alignment);
+		if (ret) {
 			pr_err("%s: fails to read out the head area \n", __func__);
-			goto end;
+			return ret;
 		}
 	}
 
-	/*
-	 * If tail is not 0, get data of last alignment area, tail_area data (by doing aligned read)
-	 *  from                | length
-	 *  --------------------|---------------
-	 *  aligned_dn_end      | alignment
-	 */
-	if (tail != 0) {
-		ret = blockif_read_head_or_tail_area(bc->fd, &tail_iov, info->aligned_dn_end, alignment);
-		if (ret < 0) {
+	/* the tail area is the head area already if the request is within one alignment area */
+	if ((info->tail != 0) && ((info->head == 0) || (info->bounced_size > alignment))) {
+		last = &info->bounce_iov[info->bounce_iovcnt - 1];
+		ret = blockif_read_head_or_tail_area(bc->fd, last->iov_base + last->iov_len - alignment,
+				info->aligned_dn_end, alignment);
+		if (ret) {
 			pr_err("%s: fails to read out the tail area \n", __func__);
-			goto end;
+			return ret;
 		}
 	}
 
-	done = 0;
-	/*
-	 * Construct the bounced data in bounce_iov
-	 *  from                | to               | length        | source
-	 *  --------------------|------------------|---------------|---------------------------------
-	 *  aligned_dn_start    | start            | head          | head_area data from block device
-	 *  start               | end              | org_size      | data specified in org_iov[]
-	 *  end                 | end + tail       | tail          | tail_area data from block device
-	 */
-	if (head_iov.iov_base != NULL) {
-		memcpy(info->bounce_iov.iov_base, head_iov.iov_base, head);
-		done += head;
-	}
-
-	/* data specified in org_iov[] */
-	for (i = 0; i < br->iovcnt; i++) {
-		memcpy(info->bounce_iov.iov_base + done, iov[i].iov_base, iov[i].iov_len);
-		done += iov[i].iov_len;
-	}
-
-	if (tail_iov.iov_base != NULL) {
-		memcpy(info->bounce_iov.iov_base + done, tail_iov.iov_base + alignment - tail, tail);
-		done += tail;
-	}
-
-end:
-	if (head_iov.iov_base != NULL) {
-		free(head_iov.iov_base);
-	}
-
-	if (tail_iov.iov_base != NULL) {
-		free(tail_iov.iov_base);
-	}
+	blockif_copy_bounced(br, true);
 
-	return ret;
-};
+	return 0;
+}
 
 static void
 blockif_proc(struct blockif_queue *bq, struct blockif_elem *be)
@@ -792,7 +1340,11 @@ blockif_proc(struct blockif_queue *bq, struct blockif_elem *be)
 	struct blockif_req *br;
 	struct blockif_ctxt *bc;
 	struct br_align_info *info;
+	struct blockif_elem *tbe;
+	struct blkqos *qos;
 	ssize_t len, iovcnt;
+	uint64_t now;
+	uint32_t ops;
 	struct iovec *iovecs;
 	off_t offset;
 	int err;
@@ -801,33 +1353,56 @@ blockif_proc(struct blockif_queue *bq, struct blockif_elem *be)
 	bc = bq->bc;
 	info = &br->align_info;
 	err = 0;
+	iovecs = NULL;
+	iovcnt = 0;
+	offset = 0;
 
 	if ((be->op == BOP_READ) || (be->op == BOP_WRITE)) {
 		if (info->need_conversion) {
 			/* bounce_iov has been initialized in blockif_request */
-			iovecs = &(info->bounce_iov);
-			iovcnt = 1;
+			iovecs = info->bounce_iov;
+			iovcnt = info->bounce_iovcnt;
 			offset = info->aligned_dn_start;
+		} else if (be->mnext) {
+			/* requests merged by blockif_merge() */
+			iovecs = be->miov;
+			iovcnt = be->miovcnt;
+			offset = br->offset + bc->sub_file_start_lba;
 		} else {
 			/* use the original iov if no conversion is required */
 			iovecs = br->iov;
 			iovcnt = br->iovcnt;
 			offset = br->offset + bc->sub_file_start_lba;
 		}
+
+		qos = __atomic_load_n(&bc->qos, __ATOMIC_ACQUIRE);
+		if (qos) {
+			for (len = 0, ops = 0, tbe = be; tbe != NULL; tbe = tbe->mnext, ops++)
+				len += tbe->req->resid;
+			blkqos_throttle(qos, ops, len);
+			now = blockif_now_ns();
+			for (tbe = be; tbe != NULL; tbe = tbe->mnext)
+				tbe->issue_ns = now;
+		}
 	}
 
 	switch (be->op) {
 	case BOP_READ:
-		len = preadv(bc->fd, iovecs, iovcnt, offset);
+		if (bc->cow)
+			len = cow_preadv(bc->cow, iovecs, iovcnt, offset);
+		else if (bc->rcache)
+			len = blkcache_preadv(bc->rcache, bc->fd, iovecs, iovcnt, offset);
+		else
+			len = preadv(bc->fd, iovecs, iovcnt, offset);
 		if (info->need_conversion) {
 			blockif_complete_bounced_read(br);
-			blockif_deinit_bounce_iov(br);
+			blockif_deinit_bounce_iov(bc, br);
 		}
 
 		if (len < 0)
 			err = errno;
 		else
-			br->resid -= len;
+			blockif_account(be, len);
 		break;
 	case BOP_WRITE:
 		if (bc->rdonly) {
@@ -835,33 +1410,38 @@ blockif_proc(struct blockif_queue *bq, struct blockif_elem *be)
 			break;
 		}
 
-		len = pwritev(bc->fd, iovecs, iovcnt, offset);
+		if (bc->dirty)
+			blockif_mark_dirty(bc, offset, blockif_iov_len(iovecs, iovcnt));
+		if (bc->cow)
+			len = cow_pwritev(bc->cow, iovecs, iovcnt, offset);
+		else
+			len = pwritev(bc->fd, iovecs, iovcnt, offset);
 		if (info->need_conversion) {
-			blockif_deinit_bounce_iov(br);
+			blockif_deinit_bounce_iov(bc, br);
 		}
 
 		if (len < 0)
 			err = errno;
 		else {
-			br->resid -= len;
+			blockif_account(be, len);
 			err = blockif_flush_cache(bc);
 		}
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
-			err = errno;
+		err = blockif_fsync(bc);
 		break;
 	case BOP_DISCARD:
 		err = blockif_process_discard(bc, br);
 		break;
+	case BOP_WRITE_ZEROES:
+		err = blockif_process_write_zeroes(bc, br);
+		break;
 	default:
 		err = EINVAL;
 		break;
 	}
 
-	be->status = BST_DONE;
-
-	(*br->callback)(br, err);
+	blockif_done(be, err);
 }
 
 static void *
@@ -882,6 +1462,9 @@ blockif_thr(void *arg)
 			blockif_proc(bq, be);
 			pthread_mutex_lock(&bq->mtx);
 			blockif_complete(bq, be);
+			/* wake up blockif_freeze() once the queue is drained */
+			if (bq->frozen && TAILQ_EMPTY(&bq->busyq))
+				pthread_cond_broadcast(&bq->cond);
 		}
 		/* Check ctxt status here to see if exit requested */
 		if (bq->closing)
@@ -987,6 +1570,12 @@ thread_pool_init(struct blockif_queue *bq, char *tag)
 		}
 		pthread_create(&bq->btid[i], NULL, blockif_thr, bq);
 		pthread_setname_np(bq->btid[i], tname);
+
+		/* run next to the iothread that kicks this queue */
+		if (bq->ioctx && CPU_COUNT(&bq->ioctx->cpuset)) {
+			if (pthread_setaffinity_np(bq->btid[i], sizeof(cpu_set_t), &bq->ioctx->cpuset))
+				pr_err("%s: pthread_setaffinity_np fails\n", tname);
+		}
 	}
 
 	return 0;
@@ -1038,94 +1627,353 @@ is_io_uring_supported_op(enum blockop op)
 	return ((op == BOP_READ) || (op == BOP_WRITE) || (op == BOP_FLUSH));
 }
 
+/*
+ * Get a free submission queue entry.  When the queue is full of entries
+ * prepared in this round, submit them first.
+ */
+static struct io_uring_sqe *
+iou_get_sqe(struct blockif_queue *bq)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&bq->ring);
+
+	if (!sqe && io_uring_submit(&bq->ring) >= 0)
+		sqe = io_uring_get_sqe(&bq->ring);
+
+	return sqe;
+}
+
+/*
+ * Find the registered guest memory chunk holding the whole buffer, so
+ * that it can be transferred without pinning its pages again.
+ */
+static int
+iou_fixed_buf_index(struct blockif_queue *bq, const struct iovec *iov)
+{
+	uintptr_t base, start = (uintptr_t)iov->iov_base;
+	int i;
+
+	for (i = 0; i < bq->nr_fixed_bufs; i++) {
+		base = (uintptr_t)bq->fixed_bufs[i].iov_base;
+		if ((start >= base) &&
+		    (start + iov->iov_len <= base + bq->fixed_bufs[i].iov_len))
+			return i;
+	}
+
+	return -1;
+}
+
 static int
 iou_submit_sqe(struct blockif_queue *bq, struct blockif_elem *be)
 {
-	int ret;
-	struct io_uring *ring = &bq->ring;
-	struct io_uring_sqe *sqes = io_uring_get_sqe(ring);
+	struct io_uring_sqe *sqes = iou_get_sqe(bq);
 	struct blockif_req *br = be->req;
 	struct blockif_ctxt *bc = bq->bc;
 	struct br_align_info *info = &br->align_info;
 	struct iovec *iovecs;
 	size_t iovcnt;
 	off_t offset;
+	int fd, idx = -1;
 
 	if (!sqes) {
 		pr_err("%s: io_uring_get_sqe fails. NO available submission queue entry. \n", __func__);
 		return -1;
 	}
 
+	/* a registered file is referred to by its index */
+	fd = bq->fixed_file ? 0 : bc->fd;
+
 	if ((be->op == BOP_READ) || (be->op == BOP_WRITE)) {
 		if (info->need_conversion) {
 			/* bounce_iov has been initialized in blockif_request */
-			iovecs = &(info->bounce_iov);
-			iovcnt = 1;
+			iovecs = info->bounce_iov;
+			iovcnt = info->bounce_iovcnt;
 			offset = info->aligned_dn_start;
+		} else if (be->mnext) {
+			/* requests merged by blockif_merge() */
+			iovecs = be->miov;
+			iovcnt = be->miovcnt;
+			offset = br->offset + bc->sub_file_start_lba;
 		} else {
 			/* use the original iov if no conversion is required */
 			iovecs = br->iov;
 			iovcnt = br->iovcnt;
 			offset = br->offset + bc->sub_file_start_lba;
 		}
+
+		/* a single buffer in guest memory needs no vector */
+		if (iovcnt == 1)
+			idx = iou_fixed_buf_index(bq, iovecs);
 	}
 
 	switch (be->op) {
 	case BOP_READ:
-		io_uring_prep_readv(sqes, bc->fd, iovecs, iovcnt, offset);
+		if (idx >= 0)
+			io_uring_prep_read_fixed(sqes, fd, iovecs->iov_base,
+				iovecs->iov_len, offset, idx);
+		else
+			io_uring_prep_readv(sqes, fd, iovecs, iovcnt, offset);
 		break;
 	case BOP_WRITE:
-		io_uring_prep_writev(sqes, bc->fd, iovecs, iovcnt, offset);
+		if (bc->dirty)
+			blockif_mark_dirty(bc, offset, blockif_iov_len(iovecs, iovcnt));
+		if (idx >= 0)
+			io_uring_prep_write_fixed(sqes, fd, iovecs->iov_base,
+				iovecs->iov_len, offset, idx);
+		else
+			io_uring_prep_writev(sqes, fd, iovecs, iovcnt, offset);
 		break;
 	case BOP_FLUSH:
-		io_uring_prep_fsync(sqes, bc->fd, IORING_FSYNC_DATASYNC);
+		io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
 		break;
 	default:
 		/* is_io_uring_supported_op guarantees that this case will not occur */
 		break;
 	}
 
-	io_uring_sqe_set_data(sqes, be);
-	bq->in_flight++;
-	ret = io_uring_submit(ring);
-	if (ret < 0) {
-		pr_err("%s: io_uring_submit fails, error %s \n", __func__, strerror(-ret));
-	}
+	if (bq->fixed_file)
+		io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqes, be);
+	bq->in_flight++;
+
+	return 0;
+}
+
+/*
+ * Queue the discard of a file as linked fallocate() hole punches and a
+ * data sync, the way blockif_process_discard() does it inline.  Only the
+ * sync carries the request, a failed punch cancels it.  Returns false if
+ * the request has to be processed inline: block devices need BLKDISCARD,
+ * which io_uring has no operation for.
+ */
+static bool
+iou_submit_discard(struct blockif_queue *bq, struct blockif_elem *be)
+{
+	struct io_uring *ring = &bq->ring;
+	struct io_uring_sqe *sqes;
+	struct blockif_req *br = be->req;
+	struct blockif_ctxt *bc = bq->bc;
+	off_t arg[MAX_DISCARD_SEGMENT][2];
+	int fd, i, segment;
+	unsigned int flags;
+
+	if (bc->isblk || bc->rdonly ||
+	    blockif_discard_ranges(bc, br, BOP_DISCARD, arg, NULL, &segment))
+		return false;
+
+	/* the linked entries must go in one submission */
+	if (io_uring_sq_space_left(ring) < segment + 1)
+		io_uring_submit(ring);
+	if (io_uring_sq_space_left(ring) < segment + 1)
+		return false;
+
+	fd = bq->fixed_file ? 0 : bc->fd;
+	flags = IOSQE_IO_LINK | (bq->fixed_file ? IOSQE_FIXED_FILE : 0);
+	for (i = 0; i < segment; i++) {
+		blockif_mark_dirty(bc, arg[i][0], arg[i][1]);
+		sqes = io_uring_get_sqe(ring);
+		io_uring_prep_fallocate(sqes, fd,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			arg[i][0], arg[i][1]);
+		io_uring_sqe_set_flags(sqes, flags);
+		io_uring_sqe_set_data(sqes, NULL);
+	}
+
+	sqes = io_uring_get_sqe(ring);
+	io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+	if (bq->fixed_file)
+		io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqes, be);
+	bq->in_flight += segment + 1;
+
+	return true;
+}
+
+/*
+ * Discards of block devices and write zeroes need system calls io_uring
+ * has no operation for. Rather than blocking the iothread, they are handed
+ * to a helper thread of the queue, which signals an eventfd polled through
+ * the ring when done, so that they complete on the ring's thread like the
+ * rest. The helper is started on first use.
+ */
+static char iou_offload_tag;
+
+static void *
+iou_offload_thr(void *arg)
+{
+	struct blockif_queue *bq = arg;
+	struct blockif_elem *be;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&bq->offload_mtx);
+	for (;;) {
+		while ((bq->offload_head == NULL) && !bq->offload_stop)
+			pthread_cond_wait(&bq->offload_cond, &bq->offload_mtx);
+		be = bq->offload_head;
+		if (be == NULL)
+			break;
+		bq->offload_head = be->onext;
+		pthread_mutex_unlock(&bq->offload_mtx);
+
+		if (be->op == BOP_DISCARD)
+			be->oerr = blockif_process_discard(bq->bc, be->req);
+		else
+			be->oerr = blockif_process_write_zeroes(bq->bc, be->req);
+
+		pthread_mutex_lock(&bq->offload_mtx);
+		be->onext = bq->offload_done;
+		bq->offload_done = be;
+		if (write(bq->offload_efd, &one, sizeof(one)) < 0)
+			pr_err("%s: fails to signal completion\n", __func__);
+	}
+	pthread_mutex_unlock(&bq->offload_mtx);
+
+	return NULL;
+}
+
+static bool
+iou_offload_arm(struct blockif_queue *bq)
+{
+	struct io_uring_sqe *sqe = iou_get_sqe(bq);
+
+	if (!sqe)
+		return false;
+
+	io_uring_prep_poll_add(sqe, bq->offload_efd, POLLIN);
+	io_uring_sqe_set_data(sqe, &iou_offload_tag);
+	return true;
+}
+
+static int
+iou_offload_start(struct blockif_queue *bq)
+{
+	bq->offload_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bq->offload_efd < 0)
+		return -1;
+
+	if (!iou_offload_arm(bq) ||
+	    pthread_create(&bq->offload_tid, NULL, iou_offload_thr, bq)) {
+		pr_err("%s: fails to start the offload thread\n", __func__);
+		close(bq->offload_efd);
+		bq->offload_efd = -1;
+		return -1;
+	}
+	pthread_setname_np(bq->offload_tid, "blk-offload");
+
+	return 0;
+}
+
+/* Returns false if @be has to be processed inline */
+static bool
+iou_offload(struct blockif_queue *bq, struct blockif_elem *be)
+{
+	if ((bq->offload_efd < 0) && iou_offload_start(bq))
+		return false;
+
+	be->onext = NULL;
+	pthread_mutex_lock(&bq->offload_mtx);
+	if (bq->offload_head)
+		bq->offload_tail->onext = be;
+	else
+		bq->offload_head = be;
+	bq->offload_tail = be;
+	pthread_cond_signal(&bq->offload_cond);
+	pthread_mutex_unlock(&bq->offload_mtx);
+
+	return true;
+}
+
+static void
+iou_offload_reap(struct blockif_queue *bq)
+{
+	struct blockif_elem *be, *next;
+	uint64_t cnt;
+
+	if (read(bq->offload_efd, &cnt, sizeof(cnt)) < 0 && (errno != EAGAIN))
+		pr_err("%s: fails to read eventfd\n", __func__);
+
+	pthread_mutex_lock(&bq->offload_mtx);
+	be = bq->offload_done;
+	bq->offload_done = NULL;
+	pthread_mutex_unlock(&bq->offload_mtx);
+
+	for (; be != NULL; be = next) {
+		next = be->onext;
+		blockif_done(be, be->oerr);
+		blockif_complete(bq, be);
+	}
+
+	if (iou_offload_arm(bq))
+		io_uring_submit(&bq->ring);
+	else
+		pr_err("%s: fails to rearm, offloaded requests will hang\n", __func__);
+}
+
+static void
+iou_offload_stop(struct blockif_queue *bq)
+{
+	void *jval;
+
+	if (bq->offload_efd < 0)
+		return;
 
-	return ret;
+	pthread_mutex_lock(&bq->offload_mtx);
+	bq->offload_stop = true;
+	pthread_cond_signal(&bq->offload_cond);
+	pthread_mutex_unlock(&bq->offload_mtx);
+	pthread_join(bq->offload_tid, &jval);
+
+	close(bq->offload_efd);
+	bq->offload_efd = -1;
 }
 
 static void
 iou_submit(struct blockif_queue *bq)
 {
 	int err = 0;
+	int queued = 0;
 	struct blockif_elem *be;
 	struct blockif_req *br;
 	struct blockif_ctxt *bc = bq->bc;
 
+	/*
+	 * Prepare entries for all the dequeued requests and submit them
+	 * with a single system call.
+	 */
 	while (blockif_dequeue(bq, 0, &be)) {
+		br = be->req;
 		if (is_io_uring_supported_op(be->op)) {
 			err = iou_submit_sqe(bq, be);
+			if (err == 0) {
+				queued++;
+				continue;
+			}
 
-			/*
-			 * -1 means that there is NO available submission queue entry (SQE) in the submission queue.
-			 * Break the while loop here. Request can only be submitted when SQE is available.
-			 */
-			if (err == -1) {
-				break;
+			/* the submission queue is stuck: fail the request */
+			err = EIO;
+		} else if (be->op == BOP_DISCARD) {
+			if (iou_submit_discard(bq, be) || iou_offload(bq, be)) {
+				queued++;
+				continue;
 			}
-		} else {
-			br = be->req;
-			if (be->op == BOP_DISCARD) {
-				err = blockif_process_discard(bc, br);
-			} else {
-				pr_err("%s: op %d is not supported \n", __func__, be->op);
-				err = EINVAL;
+			err = blockif_process_discard(bc, br);
+		} else if (be->op == BOP_WRITE_ZEROES) {
+			if (iou_offload(bq, be)) {
+				queued++;
+				continue;
 			}
-			be->status = BST_DONE;
-			(*br->callback)(br, err);
-			blockif_complete(bq, be);
+			err = blockif_process_write_zeroes(bc, br);
+		} else {
+			pr_err("%s: op %d is not supported \n", __func__, be->op);
+			err = EINVAL;
 		}
+		blockif_done(be, err);
+		blockif_complete(bq, be);
+	}
+
+	if (queued > 0) {
+		err = io_uring_submit(&bq->ring);
+		if (err < 0)
+			pr_err("%s: io_uring_submit fails, error %s \n", __func__, strerror(-err));
 	}
 	return;
 }
@@ -1138,6 +1986,7 @@ iou_process_completions(struct blockif_queue *bq)
 	struct blockif_req *br;
 	struct io_uring *ring = &bq->ring;
 	int err = 0;
+	int res;
 
 	while (io_uring_peek_cqe(ring, &cqes) == 0) {
 		if (!cqes) {
@@ -1146,13 +1995,20 @@ iou_process_completions(struct blockif_queue *bq)
 		}
 
 		be = io_uring_cqe_get_data(cqes);
-		bq->in_flight--;
+		res = cqes->res;
 		io_uring_cqe_seen(ring, cqes);
 		cqes = NULL;
-		if (!be) {
-			pr_err("%s: be is NULL \n", __func__);
-			break;
+
+		/* the offload thread finished something, not counted in in_flight */
+		if (be == (void *)&iou_offload_tag) {
+			iou_offload_reap(bq);
+			continue;
 		}
+		bq->in_flight--;
+
+		/* the hole punches linked ahead of a discard's data sync */
+		if (!be)
+			continue;
 
 		br = be->req;
 		if (!br) {
@@ -1165,28 +2021,64 @@ iou_process_completions(struct blockif_queue *bq)
 			if (be->op == BOP_READ) {
 				blockif_complete_bounced_read(br);
 			}
-			blockif_deinit_bounce_iov(br);
+			blockif_deinit_bounce_iov(bq->bc, br);
 		}
 
-		if (be->op == BOP_WRITE) {
+		err = (res < 0) ? -res : 0;
+		if ((be->op == BOP_WRITE) && !err) {
 			err = blockif_flush_cache(bq->bc);
 		}
 
-		be->status = BST_DONE;
-		(*br->callback)(br, err);
+		if ((be->op == BOP_DISCARD) && !err) {
+			br->resid = 0;
+		}
+
+		blockif_done(be, err);
 		blockif_complete(bq, be);
 	}
 
 	return;
 }
 
+/*
+ * With SQPOLL, spin on the completion ring for a while after submitting
+ * rather than waiting for the ring fd to wake up the iothread.  The
+ * budget doubles when the requests only just completed within it, and
+ * halves when they did not; the late ones are reaped on the wakeup.
+ */
+static void
+iou_poll_completions(struct blockif_queue *bq)
+{
+	uint64_t start, now;
+
+	start = now = blockif_now_ns();
+	while (now - start < bq->poll_ns) {
+		if (io_uring_cq_ready(&bq->ring) > 0)
+			iou_process_completions(bq);
+		if (bq->in_flight == 0)
+			break;
+		asm volatile ("pause" ::: "memory");
+		now = blockif_now_ns();
+	}
+
+	if (bq->in_flight == 0) {
+		if ((now - start > bq->poll_ns / 2) && (bq->poll_ns < IOU_POLL_MAX_NS))
+			bq->poll_ns *= 2;
+	} else if (bq->poll_ns > IOU_POLL_MIN_NS) {
+		bq->poll_ns /= 2;
+	}
+}
+
 static void
 iou_submit_and_reap(struct blockif_queue *bq)
 {
 	iou_submit(bq);
 
 	if (bq->in_flight > 0) {
-		iou_process_completions(bq);
+		if (bq->poll_ns)
+			iou_poll_completions(bq);
+		else
+			iou_process_completions(bq);
 	}
 
 	return;
@@ -1199,6 +2091,8 @@ iou_reap_and_submit(struct blockif_queue *bq)
 
 	if (!TAILQ_EMPTY(&bq->pendq)) {
 		iou_submit(bq);
+		if (bq->poll_ns && (bq->in_flight > 0))
+			iou_poll_completions(bq);
 	}
 
 	return;
@@ -1241,23 +2135,109 @@ iou_del_iothread(struct blockif_queue *bq)
 	return ret;
 }
 
+/*
+ * The backing file and guest memory stay the same for the life of the
+ * ring: register them once, rather than having the kernel look up the
+ * file and pin the pages of every request.  Either is optional.
+ */
+static void
+iou_register(struct blockif_queue *bq)
+{
+	struct iovec regions[IOU_MAX_MEM_REGIONS];
+	struct io_uring *ring = &bq->ring;
+	size_t off, len;
+	int i, n, nr, ret;
+
+	ret = io_uring_register_files(ring, &bq->bc->fd, 1);
+	if (ret < 0)
+		pr_warn("%s: io_uring_register_files fails, error %d \n", __func__, ret);
+	else
+		bq->fixed_file = true;
+
+	n = hugetlb_get_mem_regions(regions, IOU_MAX_MEM_REGIONS);
+	if (n > IOU_MAX_MEM_REGIONS)
+		n = IOU_MAX_MEM_REGIONS;
+
+	nr = 0;
+	for (i = 0; i < n; i++)
+		nr += (regions[i].iov_len + IOU_FIXED_BUF_MAX_LEN - 1) / IOU_FIXED_BUF_MAX_LEN;
+	if (nr == 0)
+		return;
+
+	bq->fixed_bufs = calloc(nr, sizeof(struct iovec));
+	if (!bq->fixed_bufs)
+		return;
+
+	nr = 0;
+	for (i = 0; i < n; i++) {
+		for (off = 0; off < regions[i].iov_len; off += len) {
+			len = MIN(regions[i].iov_len - off, IOU_FIXED_BUF_MAX_LEN);
+			bq->fixed_bufs[nr].iov_base = (char *)regions[i].iov_base + off;
+			bq->fixed_bufs[nr].iov_len = len;
+			nr++;
+		}
+	}
+
+	ret = io_uring_register_buffers(ring, bq->fixed_bufs, nr);
+	if (ret < 0) {
+		pr_warn("%s: io_uring_register_buffers fails, error %d \n", __func__, ret);
+		free(bq->fixed_bufs);
+		bq->fixed_bufs = NULL;
+		return;
+	}
+	bq->nr_fixed_bufs = nr;
+}
+
 static int
 iou_init(struct blockif_queue *bq, char *tag __attribute__((unused)))
 {
 	int ret = 0;
 	struct io_uring *ring = &bq->ring;
+	struct io_uring_params params;
+	struct blockif_ctxt *bc = bq->bc;
+	int cpu;
+
+	bq->offload_efd = -1;
+	pthread_mutex_init(&bq->offload_mtx, NULL);
+	pthread_cond_init(&bq->offload_cond, NULL);
 
 	/*
 	 * - When Service VM owns more dedicated cores, IORING_SETUP_SQPOLL and IORING_SETUP_IOPOLL, along with NVMe
 	 *   polling mechanism could benefit the performance.
 	 * - When Service VM owns limited cores, the benefit of polling is also limited.
 	 * As in most of the use cases, Service VM does not own much dedicated cores, IORING_SETUP_SQPOLL and
-	 * IORING_SETUP_IOPOLL are not enabled by default.
+	 * IORING_SETUP_IOPOLL are not enabled by default, but IORING_SETUP_SQPOLL is with aio=io_uring_sqpoll.
 	 */
-	ret = io_uring_queue_init(MAX_IO_URING_ENTRIES, ring, 0);
+	memset(&params, 0, sizeof(params));
+	if (bc->aio_mode == AIO_MODE_IO_URING_SQPOLL) {
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = IOU_SQPOLL_IDLE_MS;
+		if (bc->sqpoll_cpu >= 0) {
+			params.flags |= IORING_SETUP_SQ_AFF;
+			params.sq_thread_cpu = bc->sqpoll_cpu;
+			/* the queues of a device share the submission thread */
+			if (bq != bc->bqs) {
+				params.flags |= IORING_SETUP_ATTACH_WQ;
+				params.wq_fd = bc->bqs[0].ring.ring_fd;
+			}
+		} else if (bq->ioctx && CPU_COUNT(&bq->ioctx->cpuset)) {
+			/* each queue polls on the first CPU of its iothread, keeping it CPU local */
+			for (cpu = 0; !CPU_ISSET(cpu, &bq->ioctx->cpuset); cpu++)
+				;
+			params.flags |= IORING_SETUP_SQ_AFF;
+			params.sq_thread_cpu = cpu;
+		} else if (bq != bc->bqs) {
+			params.flags |= IORING_SETUP_ATTACH_WQ;
+			params.wq_fd = bc->bqs[0].ring.ring_fd;
+		}
+		bq->poll_ns = IOU_POLL_MIN_NS;
+	}
+
+	ret = io_uring_queue_init_params(MAX_IO_URING_ENTRIES, ring, &params);
 	if (ret < 0) {
 		pr_err("%s: io_uring_queue_init fails, error %d \n", __func__, ret);
 	} else {
+		iou_register(bq);
 		ret = iou_set_iothread(bq);
 		if (ret < 0) {
 			pr_err("%s: iou_set_iothread fails \n", __func__);
@@ -1273,7 +2253,15 @@ iou_deinit(struct blockif_queue *bq)
 	struct io_uring *ring = &bq->ring;
 
 	iou_del_iothread(bq);
+	iou_offload_stop(bq);
 	io_uring_queue_exit(ring);
+	pthread_mutex_destroy(&bq->offload_mtx);
+	pthread_cond_destroy(&bq->offload_cond);
+
+	free(bq->fixed_bufs);
+	bq->fixed_bufs = NULL;
+	bq->nr_fixed_bufs = 0;
+	bq->fixed_file = false;
 }
 
 static inline void iou_mutex_lock(pthread_mutex_t *mutex __attribute__((unused))) {}
@@ -1295,7 +2283,7 @@ struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident, int queue_num, struct iothreads_info *iothrds_info)
 {
 	char tag[MAXCOMLEN + 1];
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *cow_path;
 	struct blockif_ctxt *bc = NULL;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
@@ -1309,8 +2297,9 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 	int sub_file_assign;
 	int max_discard_sectors, max_discard_seg, discard_sector_alignment;
 	off_t probe_arg[] = {0, 0};
-	int aio_mode;
-	int bypass_host_cache, open_flag, bst_block;
+	int aio_mode, sqpoll_cpu, rcache_mb, dirty_kb;
+	struct blkqos_conf qos_conf;
+	int bypass_host_cache, open_flag, bst_block, merge;
 
 	pthread_once(&blockif_once, blockif_init);
 
@@ -1328,6 +2317,7 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 
 	/* default mode is thread pool */
 	aio_mode = AIO_MODE_THREAD_POOL;
+	sqpoll_cpu = -1;
 
 	/* writethru is on by default */
 	writeback = 0;
@@ -1338,8 +2328,23 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 	/* By default, bst_block is 1, meaning that the BST_BLOCK logic in blockif_dequeue is enabled. */
 	bst_block = 1;
 
+	/* By default, adjacent requests are merged into one operation. */
+	merge = 1;
+
 	candiscard = 0;
 
+	/* By default, the image is used as is, without a copy-on-write overlay. */
+	cow_path = NULL;
+
+	/* By default, reads are not shared with other VMs using the same image. */
+	rcache_mb = 0;
+
+	/* By default, writes are not tracked for incremental backups. */
+	dirty_kb = 0;
+
+	/* By default, there are no I/O limits. */
+	blkqos_conf_init(&qos_conf);
+
 	if (queue_num <= 0)
 		queue_num = 1;
 
@@ -1366,6 +2371,8 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 			bypass_host_cache = 1;
 		else if (!strcmp(cp, "no_bst_block"))
 			bst_block = 0;
+		else if (!strcmp(cp, "no_merge"))
+			merge = 0;
 		else if (!strncmp(cp, "discard", strlen("discard"))) {
 			strsep(&cp, "=");
 			if (cp != NULL) {
@@ -1401,31 +2408,108 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 			else
 				goto err;
 		} else if (!strncmp(cp, "aio", strlen("aio"))) {
-			/* aio=threads or aio=io_uring */
+			/* aio=threads, aio=io_uring or aio=io_uring_sqpoll */
 			strsep(&cp, "=");
 			if (cp != NULL) {
 				if (!strncmp(cp, "threads", strlen("threads"))) {
 					aio_mode = AIO_MODE_THREAD_POOL;
+				} else if (!strncmp(cp, "io_uring_sqpoll", strlen("io_uring_sqpoll"))) {
+					aio_mode = AIO_MODE_IO_URING_SQPOLL;
 				} else if (!strncmp(cp, "io_uring", strlen("io_uring"))) {
 					aio_mode = AIO_MODE_IO_URING;
 				} else {
-					pr_err("Invalid aio option, only support threads or io_uring \"%s\"\n", cp);
+					pr_err("Invalid aio option, only support threads, io_uring or io_uring_sqpoll \"%s\"\n", cp);
 					goto err;
 				}
 			}
+		} else if (!strncmp(cp, "sqpoll_cpu", strlen("sqpoll_cpu"))) {
+			/* sqpoll_cpu=<cpu> pins the aio=io_uring_sqpoll submission thread */
+			strsep(&cp, "=");
+			if ((cp == NULL) || dm_strtoi(cp, &cp, 10, &sqpoll_cpu) || (sqpoll_cpu < 0)) {
+				pr_err("Invalid sqpoll_cpu option\n");
+				goto err;
+			}
+		} else if (!strncmp(cp, "cow", strlen("cow"))) {
+			/* cow=<overlay> keeps all guest writes in a sparse overlay */
+			strsep(&cp, "=");
+			if ((cp == NULL) || (*cp == '\0')) {
+				pr_err("Invalid cow option\n");
+				goto err;
+			}
+			cow_path = cp;
+		} else if (!strncmp(cp, "rcache", strlen("rcache"))) {
+			/* rcache=<MiB> shares a read cache among VMs using the same read-only image */
+			strsep(&cp, "=");
+			if ((cp == NULL) || dm_strtoi(cp, &cp, 10, &rcache_mb) || (rcache_mb <= 0)) {
+				pr_err("Invalid rcache option\n");
+				goto err;
+			}
+		} else if (!strncmp(cp, "dirty_bitmap", strlen("dirty_bitmap"))) {
+			/* dirty_bitmap[=<KiB>] tracks writes with one bit per KiB chunk */
+			strsep(&cp, "=");
+			if (cp == NULL)
+				dirty_kb = BLOCKIF_DIRTY_KB;
+			else if (dm_strtoi(cp, &cp, 10, &dirty_kb) || (dirty_kb <= 0)) {
+				pr_err("Invalid dirty_bitmap option\n");
+				goto err;
+			}
+		} else if ((err_code = blkqos_parse_opt(&qos_conf, cp)) != 0) {
+			/* iops=, bps=, burst=, qos_weight=, qos_lat= and qos_group= */
+			if (err_code < 0) {
+				pr_err("Invalid QoS option \"%s\"\n", cp);
+				goto err;
+			}
 		} else {
 			pr_err("Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
 
+	if (cow_path) {
+		if (sub_file_assign) {
+			pr_err("cow overlay can not be combined with range\n");
+			goto err;
+		}
+		/* The overlay is buffered I/O on the worker threads. */
+		if (bypass_host_cache) {
+			pr_warn("nocache is ignored for cow overlay images\n");
+			bypass_host_cache = 0;
+		}
+		if (candiscard) {
+			pr_warn("discard is not supported for cow overlay images\n");
+			candiscard = 0;
+		}
+		if (aio_mode != AIO_MODE_THREAD_POOL) {
+			pr_warn("cow overlay images use aio=threads\n");
+			aio_mode = AIO_MODE_THREAD_POOL;
+		}
+	}
+
+	if (blkqos_conf_enabled(&qos_conf) && (aio_mode != AIO_MODE_THREAD_POOL)) {
+		/* throttled requests wait in the worker threads */
+		pr_warn("I/O limits use aio=threads\n");
+		aio_mode = AIO_MODE_THREAD_POOL;
+	}
+
+	if (rcache_mb) {
+		/* the cache is only coherent if nobody writes to the image */
+		if (!ro && !cow_path) {
+			pr_err("rcache requires ro or cow\n");
+			goto err;
+		}
+		if (aio_mode != AIO_MODE_THREAD_POOL) {
+			pr_warn("rcache images use aio=threads\n");
+			aio_mode = AIO_MODE_THREAD_POOL;
+		}
+	}
+
 	/*
 	 * To support "writeback" and "writethru" mode switch during runtime,
 	 * O_SYNC is not used directly, as O_SYNC flag cannot dynamic change
 	 * after file is opened. Instead, we call fsync() after each write
 	 * operation to emulate it.
 	 */
-	open_flag = (ro ? O_RDONLY : O_RDWR);
+	open_flag = ((ro || cow_path) ? O_RDONLY : O_RDWR);
 	if (bypass_host_cache == 1) {
 		open_flag |= O_DIRECT;
 	}
@@ -1537,6 +2621,7 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 		pr_err("calloc");
 		goto err;
 	}
+	pthread_mutex_init(&bc->bounce_mtx, NULL);
 
 	if (sub_file_assign) {
 		DPRINTF(("sector size is %d\n", sectsz));
@@ -1558,6 +2643,28 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 	}
 
 	bc->fd = fd;
+	if (rcache_mb) {
+		/* not fatal, the image is just read without sharing */
+		bc->rcache = blkcache_open(fd, rcache_mb);
+		if (bc->rcache == NULL)
+			pr_warn("failed to set up the shared read cache\n");
+	}
+	if (cow_path) {
+		/* the base image is never written, all changes go to the overlay */
+		bc->cow = cow_open(cow_path, nopt, fd, size, ro);
+		if (bc->cow == NULL)
+			goto err;
+		size = cow_size(bc->cow);
+		cow_set_base_cache(bc->cow, bc->rcache);
+	}
+	if (dirty_kb) {
+		bc->dirty = blkdirty_open(ident, size, (uint32_t)dirty_kb << 10);
+		if (bc->dirty == NULL)
+			goto err;
+	}
+	bc->path = strdup(nopt);
+	if (bc->path == NULL)
+		goto err;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
 	bc->candiscard = candiscard;
 	if (candiscard) {
@@ -1577,8 +2684,15 @@ blockif_open(const char *optstr, const char *ident, int queue_num, struct iothre
 	bc->wce = writeback;
 	bc->bypass_host_cache = bypass_host_cache;
 	bc->aio_mode = aio_mode;
+	bc->sqpoll_cpu = sqpoll_cpu;
+	bc->merge = merge;
+	if (blkqos_conf_enabled(&qos_conf)) {
+		bc->qos = blkqos_create(&qos_conf);
+		if (bc->qos == NULL)
+			goto err;
+	}
 
-	if (bc->aio_mode == AIO_MODE_IO_URING) {
+	if ((bc->aio_mode == AIO_MODE_IO_URING) || (bc->aio_mode == AIO_MODE_IO_URING_SQPOLL)) {
 		bc->ops = &blockif_ops_iou;
 		bc->bst_block = 0;
 	} else {
@@ -1640,6 +2754,14 @@ err:
 	if (fd >= 0)
 		close(fd);
 	if (bc) {
+		if (bc->cow)
+			cow_close(bc->cow);
+		if (bc->rcache)
+			blkcache_close(bc->rcache);
+		blkqos_destroy(bc->qos);
+		blkdirty_close(bc->dirty);
+		free(bc->path);
+		blockif_bounce_drain(bc);
 		if (bc->bqs)
 			free(bc->bqs);
 		free(bc);
@@ -1665,14 +2787,15 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 	blockif_init_alignment_info(bc, breq);
 	/* For misaligned READ/WRITE, need a bounce_iov to convert the misaligned request to an aligned one. */
 	if (((op == BOP_READ) || (op == BOP_WRITE)) && (breq->align_info.need_conversion)) {
-		err = blockif_init_bounce_iov(breq);
-		if (err < 0) {
+		err = blockif_init_bounce_iov(bc, breq);
+		if (err) {
 			return err;
 		}
 
 		if (op == BOP_WRITE) {
 			err = blockif_init_bounced_write(bc, breq);
-			if (err < 0) {
+			if (err) {
+				blockif_deinit_bounce_iov(bc, breq);
 				return err;
 			}
 		}
@@ -1686,7 +2809,7 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bq, breq, op)) {
+		if (blockif_enqueue(bq, breq, op) && !bq->plugged) {
 			if (bc->ops->request) {
 				bc->ops->request(bq);
 			}
@@ -1703,9 +2826,55 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 	if (bc->ops->mutex_unlock) {
 		bc->ops->mutex_unlock(&bq->mtx);
 	}
+	if (err && breq->align_info.need_conversion) {
+		blockif_deinit_bounce_iov(bc, breq);
+	}
 	return err;
 }
 
+/*
+ * Hold off dispatching the requests of queue @qidx until blockif_unplug(),
+ * so that a batch of requests from the guest can be merged.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc, int qidx)
+{
+	struct blockif_queue *bq;
+
+	if (qidx >= bc->bq_num)
+		return;
+	bq = bc->bqs + qidx;
+
+	if (bc->ops->mutex_lock)
+		bc->ops->mutex_lock(&bq->mtx);
+	bq->plugged = true;
+	if (bc->ops->mutex_unlock)
+		bc->ops->mutex_unlock(&bq->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc, int qidx)
+{
+	struct blockif_queue *bq;
+
+	if (qidx >= bc->bq_num)
+		return;
+	bq = bc->bqs + qidx;
+
+	if (bc->ops->mutex_lock)
+		bc->ops->mutex_lock(&bq->mtx);
+	bq->plugged = false;
+	if (!TAILQ_EMPTY(&bq->pendq)) {
+		/* wake up all the workers, the batch may not merge into one */
+		if (bc->ops->aio_mode == AIO_MODE_THREAD_POOL)
+			pthread_cond_broadcast(&bq->cond);
+		else if (bc->ops->request)
+			bc->ops->request(bq);
+	}
+	if (bc->ops->mutex_unlock)
+		bc->ops->mutex_unlock(&bq->mtx);
+}
+
 int
 blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -1730,6 +2899,12 @@ blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DISCARD);
 }
 
+int
+blockif_write_zeroes(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	return blockif_request(bc, breq, BOP_WRITE_ZEROES);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -1833,12 +3008,25 @@ blockif_close(struct blockif_ctxt *bc)
 		if (bc->ops->deinit) {
 			bc->ops->deinit(bq);
 		}
+
+		if (bq->nr_merged)
+			pr_info("blk queue %d: %lu requests merged\n", j, bq->nr_merged);
 	}
 	/* XXX Cancel queued i/o's ??? */
 
 	/*
 	 * Release resources
 	 */
+	if (bc->snap_path)
+		pr_warn("%s: snapshot not committed, writes since then are in %s\n",
+			bc->path, bc->snap_path);
+	cow_close(bc->cow);
+	blkcache_close(bc->rcache);
+	blkqos_destroy(bc->qos);
+	blkdirty_close(bc->dirty);
+	free(bc->snap_path);
+	free(bc->path);
+	blockif_bounce_drain(bc);
 	close(bc->fd);
 	if (bc->bqs)
 		free(bc->bqs);
@@ -1952,6 +3140,26 @@ blockif_discard_sector_alignment(struct blockif_ctxt *bc)
 	return bc->discard_sector_alignment;
 }
 
+uint32_t
+blockif_max_write_zeroes_sectors(struct blockif_ctxt *bc)
+{
+	off_t sectors = bc->size / DEV_BSIZE;
+
+	return (sectors > UINT32_MAX) ? UINT32_MAX : sectors;
+}
+
+int
+blockif_max_write_zeroes_seg(struct blockif_ctxt *bc)
+{
+	return MAX_DISCARD_SEGMENT;
+}
+
+int
+blockif_write_zeroes_may_unmap(struct blockif_ctxt *bc)
+{
+	return bc->candiscard && !bc->isblk && !bc->cow;
+}
+
 uint8_t
 blockif_get_wce(struct blockif_ctxt *bc)
 {
@@ -1964,13 +3172,222 @@ blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce)
 	bc->wce = wce;
 }
 
+/*
+ * Set or change the I/O limits of a disk, @opts takes the same QoS
+ * options as blockif_open.
+ */
+int
+blockif_set_qos(struct blockif_ctxt *bc, const char *opts)
+{
+	struct blkqos_conf conf;
+	struct blkqos *qos;
+
+	if (bc->qos)
+		return blkqos_update(bc->qos, opts);
+
+	if (bc->aio_mode != AIO_MODE_THREAD_POOL) {
+		pr_err("I/O limits can only be added at runtime with aio=threads\n");
+		return -1;
+	}
+
+	blkqos_conf_init(&conf);
+	if (blkqos_parse(&conf, opts) || !blkqos_conf_enabled(&conf))
+		return -1;
+
+	qos = blkqos_create(&conf);
+	if (qos == NULL)
+		return -1;
+
+	__atomic_store_n(&bc->qos, qos, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Take a snapshot of the statistics of queue @qidx. The counters are
+ * updated without locking, so the snapshot is approximate.
+ */
+int
+blockif_get_stats(struct blockif_ctxt *bc, int qidx, struct blockif_stats *stats)
+{
+	if ((qidx < 0) || (qidx >= bc->bq_num))
+		return -1;
+
+	memcpy(stats, &bc->bqs[qidx].stats, sizeof(*stats));
+	return 0;
+}
+
 int
 blockif_flush_all(struct blockif_ctxt *bc)
 {
 	int err;
 
-	err=0;
-	if (fsync(bc->fd))
-		err = errno;
+	err = blockif_fsync(bc);
 	return err;
 }
+
+/*
+ * Stop dispatching requests and wait for those in progress, so that the
+ * image holds exactly what the guest has seen completed. New requests are
+ * still queued, they are only held back until blockif_thaw().
+ */
+static void
+blockif_freeze(struct blockif_ctxt *bc)
+{
+	struct blockif_queue *bq;
+	int j;
+
+	for (j = 0; j < bc->bq_num; j++) {
+		bq = bc->bqs + j;
+		pthread_mutex_lock(&bq->mtx);
+		bq->frozen = true;
+		while (!TAILQ_EMPTY(&bq->busyq))
+			pthread_cond_wait(&bq->cond, &bq->mtx);
+		pthread_mutex_unlock(&bq->mtx);
+	}
+}
+
+static void
+blockif_thaw(struct blockif_ctxt *bc)
+{
+	struct blockif_queue *bq;
+	int j;
+
+	for (j = 0; j < bc->bq_num; j++) {
+		bq = bc->bqs + j;
+		pthread_mutex_lock(&bq->mtx);
+		bq->frozen = false;
+		pthread_cond_broadcast(&bq->cond);
+		pthread_mutex_unlock(&bq->mtx);
+	}
+}
+
+/*
+ * Take a crash consistent snapshot of the image while the VM runs: once
+ * the requests in progress are done, further writes go to a new cow
+ * overlay at @overlay and the image itself stays frozen, for a backup
+ * tool to copy. With dirty_bitmap, the bitmap of the blocks changed since
+ * the previous snapshot is published at the same time.
+ * blockif_commit() folds the overlay back into the image.
+ */
+int
+blockif_snapshot(struct blockif_ctxt *bc, const char *overlay)
+{
+	struct cow_image *cow;
+	struct stat sbuf;
+	uint64_t gen;
+	int err;
+
+	if ((bc->aio_mode != AIO_MODE_THREAD_POOL) || bc->bypass_host_cache ||
+			bc->sub_file_assign) {
+		pr_err("%s: snapshots need aio=threads without nocache or range\n", bc->path);
+		return -1;
+	}
+	if (bc->rdonly) {
+		pr_err("%s: read-only images have no need for a snapshot\n", bc->path);
+		return -1;
+	}
+	if (bc->cow) {
+		pr_err("%s: writes already go to an overlay\n", bc->path);
+		return -1;
+	}
+	if (!stat(overlay, &sbuf) && sbuf.st_size) {
+		pr_err("%s: snapshot overlay %s already exists\n", bc->path, overlay);
+		return -1;
+	}
+
+	bc->snap_path = strdup(overlay);
+	if (bc->snap_path == NULL)
+		return -1;
+
+	blockif_freeze(bc);
+	gen = 0;
+	err = fdatasync(bc->fd);
+	if (!err) {
+		cow = cow_open(overlay, bc->path, bc->fd, bc->size, false);
+		if (cow) {
+			bc->cow = cow;
+			if (bc->dirty)
+				gen = blkdirty_snapshot(bc->dirty);
+		} else
+			err = -1;
+	}
+	blockif_thaw(bc);
+
+	if (err) {
+		pr_err("%s: failed to take a snapshot\n", bc->path);
+		free(bc->snap_path);
+		bc->snap_path = NULL;
+		return -1;
+	}
+
+	if (bc->dirty)
+		pr_info("%s: snapshot %lu taken, writes go to %s, changes are in %s\n",
+			bc->path, gen, overlay, blkdirty_name(bc->dirty));
+	else
+		pr_info("%s: snapshot taken, writes go to %s\n", bc->path, overlay);
+	return 0;
+}
+
+/*
+ * Copy the writes held by the snapshot overlay back to the image and go
+ * back to writing the image directly. The overlay is copied a chunk at a
+ * time and the guest's requests only wait while a chunk is copied. Those
+ * which write clusters already copied put them back in the overlay, so the
+ * overlay is gone over again while the last pass copied more than a chunk.
+ * The final pass copies what is left with the requests held back, and the
+ * image is written directly from then on.
+ */
+int
+blockif_commit(struct blockif_ctxt *bc)
+{
+	uint64_t copied;
+	int64_t len;
+	off_t pos;
+	int pass, err;
+
+	if (bc->snap_path == NULL) {
+		pr_err("%s: no snapshot to commit\n", bc->path);
+		return -1;
+	}
+
+	err = 0;
+	for (pass = 0; pass < BLOCKIF_COMMIT_PASSES && !err; pass++) {
+		copied = 0;
+		for (pos = 0; pos < cow_size(bc->cow) && !err; copied += len) {
+			blockif_freeze(bc);
+			len = cow_commit(bc->cow, &pos, BLOCKIF_COMMIT_CHUNK);
+			blockif_thaw(bc);
+			if (len < 0) {
+				err = -1;
+				len = 0;
+			}
+		}
+		if (copied <= BLOCKIF_COMMIT_CHUNK)
+			break;
+	}
+
+	if (!err) {
+		blockif_freeze(bc);
+		pos = 0;
+		if (cow_commit(bc->cow, &pos, UINT64_MAX) < 0)
+			err = -1;
+		else {
+			cow_close(bc->cow);
+			bc->cow = NULL;
+		}
+		blockif_thaw(bc);
+	}
+
+	if (err) {
+		pr_err("%s: failed to commit %s: %s\n", bc->path, bc->snap_path,
+			strerror(errno));
+		return -1;
+	}
+
+	if (unlink(bc->snap_path))
+		pr_warn("%s: failed to remove %s\n", bc->path, bc->snap_path);
+	pr_info("%s: snapshot overlay %s committed\n", bc->path, bc->snap_path);
+	free(bc->snap_path);
+	bc->snap_path = NULL;
+	return 0;
+}
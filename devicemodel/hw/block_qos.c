@@ -0,0 +1,593 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Per-disk I/O throttling.
+ *
+ * Each disk has two token buckets, one counting requests and one counting
+ * bytes. A request takes its tokens up front and may drive a bucket into
+ * debt; the worker thread then sleeps until the debt is paid back. Since
+ * the queue only has BLOCKIF_MAXREQ slots, a throttled disk soon stops
+ * taking requests from the guest.
+ *
+ * Disks from several DM instances can also share a host-wide limit
+ * through a small arbiter in shared memory, named after the group. Each
+ * member registers a weight there and gets a share of the group limit in
+ * proportion to its weight among the members that did I/O in the last
+ * second, so idle members do not hold bandwidth back. All the members
+ * must agree on the group limit, and the last one to leave removes the
+ * segment.
+ *
+ * A member of a group may also have a latency target. While its requests
+ * take longer than that on average, the members with no target or a
+ * looser one halve their rate every 100ms. They take a quarter more back
+ * every 100ms once the target is met again, and drop the cap once they no
+ * longer use half of it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "block_qos.h"
+#include "dm_string.h"
+#include "log.h"
+
+#define NSEC_PER_SEC		1000000000UL
+#define BLKQOS_DEFAULT_BURST_MS	100
+#define BLKQOS_DEFAULT_WEIGHT	100
+#define BLKQOS_GROUP_MEMBERS	64
+#define BLKQOS_ACTIVE_NS	NSEC_PER_SEC	/* idle members drop out after this */
+#define BLKQOS_SHARE_NS		(NSEC_PER_SEC / 10)	/* how often shares are recomputed */
+#define BLKQOS_LAT_MIN_IOPS	16	/* a latency target throttles others no lower */
+#define BLKQOS_LAT_MIN_BPS	(1024 * 1024)
+
+struct blkqos_member {
+	int32_t		pid;		/* 0 if the entry is free */
+	uint32_t	weight;
+	uint64_t	active_ns;	/* CLOCK_MONOTONIC of the last request */
+	uint32_t	lat_us;		/* latency target, 0 if none */
+	uint32_t	pad;
+	uint64_t	missed_ns;	/* CLOCK_MONOTONIC of the last missed target */
+};
+
+struct blkqos_group {
+	uint64_t		iops;
+	uint64_t		bps;
+	struct blkqos_member	members[BLKQOS_GROUP_MEMBERS];
+};
+
+struct blkqos_bucket {
+	double		rate;		/* tokens per second, 0 if unlimited */
+	double		level;		/* may go negative */
+	double		max;
+};
+
+struct blkqos {
+	pthread_mutex_t		mtx;
+	struct blkqos_conf	conf;
+	struct blkqos_bucket	ops;
+	struct blkqos_bucket	bytes;
+	uint64_t		last_ns;
+
+	struct blkqos_group	*group;
+	int			group_fd;	/* locked while joining or leaving */
+	struct blkqos_member	*member;
+	uint64_t		share_ns;	/* when shares were last computed */
+
+	/* what was issued and completed since share_ns */
+	uint64_t		win_ops;
+	uint64_t		win_bytes;
+	uint64_t		win_lat_ns;	/* atomic, added to on completion */
+	uint64_t		win_done;	/* atomic */
+	/* caps while another member misses a stricter latency target, 0 if none */
+	double			lat_iops;
+	double			lat_bps;
+
+	uint64_t		throttled_ns;
+};
+
+static uint64_t
+blkqos_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void
+blkqos_conf_init(struct blkqos_conf *conf)
+{
+	memset(conf, 0, sizeof(*conf));
+	conf->burst_ms = BLKQOS_DEFAULT_BURST_MS;
+	conf->weight = BLKQOS_DEFAULT_WEIGHT;
+}
+
+bool
+blkqos_conf_enabled(const struct blkqos_conf *conf)
+{
+	return conf->iops || conf->bps || conf->group[0] || conf->lat_us;
+}
+
+static int
+blkqos_parse_u64(const char *s, uint64_t *val)
+{
+	unsigned long v;
+	char *end;
+
+	if (dm_strtoul(s, &end, 10, &v) || *end != '\0')
+		return -1;
+	*val = v;
+	return 0;
+}
+
+/*
+ * Parse one QoS option. Returns 1 if @opt was a QoS option, 0 if it was
+ * not and -1 if it was malformed.
+ */
+int
+blkqos_parse_opt(struct blkqos_conf *conf, const char *opt)
+{
+	char *cp, *str, *name;
+	uint64_t val;
+	int ret;
+
+	if (!strncmp(opt, "iops=", strlen("iops=")))
+		return blkqos_parse_u64(opt + strlen("iops="), &conf->iops) ? -1 : 1;
+	if (!strncmp(opt, "bps=", strlen("bps=")))
+		return blkqos_parse_u64(opt + strlen("bps="), &conf->bps) ? -1 : 1;
+	if (!strncmp(opt, "burst=", strlen("burst="))) {
+		if (blkqos_parse_u64(opt + strlen("burst="), &val) || !val || val > UINT32_MAX)
+			return -1;
+		conf->burst_ms = val;
+		return 1;
+	}
+	if (!strncmp(opt, "qos_weight=", strlen("qos_weight="))) {
+		if (blkqos_parse_u64(opt + strlen("qos_weight="), &val) || !val || val > UINT32_MAX)
+			return -1;
+		conf->weight = val;
+		return 1;
+	}
+	if (!strncmp(opt, "qos_lat=", strlen("qos_lat="))) {
+		if (blkqos_parse_u64(opt + strlen("qos_lat="), &val) || val > UINT32_MAX)
+			return -1;
+		conf->lat_us = val;
+		return 1;
+	}
+	if (strncmp(opt, "qos_group=", strlen("qos_group=")))
+		return 0;
+
+	/* qos_group=<name>:<group iops>:<group bps> */
+	str = strdup(opt + strlen("qos_group="));
+	if (!str)
+		return -1;
+	cp = str;
+	name = strsep(&cp, ":");
+	ret = -1;
+	if (name && *name && strlen(name) < sizeof(conf->group) && !strchr(name, '/') &&
+			cp && !blkqos_parse_u64(strsep(&cp, ":"), &conf->group_iops) &&
+			cp && !blkqos_parse_u64(cp, &conf->group_bps)) {
+		strncpy(conf->group, name, sizeof(conf->group) - 1);
+		ret = 1;
+	}
+	free(str);
+	return ret;
+}
+
+/* Parse a comma separated list of QoS options */
+int
+blkqos_parse(struct blkqos_conf *conf, const char *opts)
+{
+	char *str, *cp, *opt;
+	int ret;
+
+	str = strdup(opts);
+	if (!str)
+		return -1;
+
+	ret = 0;
+	cp = str;
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (*opt == '\0')
+			continue;
+		if (blkqos_parse_opt(conf, opt) != 1) {
+			pr_err("blkqos: invalid option \"%s\"\n", opt);
+			ret = -1;
+			break;
+		}
+	}
+	free(str);
+	return ret;
+}
+
+static void
+blkqos_bucket_set(struct blkqos_bucket *b, double rate, uint32_t burst_ms, double min)
+{
+	b->rate = rate;
+	b->max = MAX(rate * burst_ms / 1000, min);
+	b->level = MIN(b->level, b->max);
+}
+
+/* Reserve @cost tokens, return how long the caller has to wait for them */
+static uint64_t
+blkqos_bucket_take(struct blkqos_bucket *b, uint64_t elapsed_ns, double cost)
+{
+	if (b->rate == 0)
+		return 0;
+
+	b->level = MIN(b->level + b->rate * elapsed_ns / NSEC_PER_SEC, b->max);
+	b->level -= cost;
+	if (b->level >= 0)
+		return 0;
+	return -b->level / b->rate * NSEC_PER_SEC;
+}
+
+/* Compute the effective rates, called with qos->mtx held */
+static void
+blkqos_apply(struct blkqos *qos, uint64_t now)
+{
+	struct blkqos_member *m;
+	double iops, bps, share;
+	uint64_t total, group_iops, group_bps;
+	int i;
+
+	iops = qos->conf.iops;
+	bps = qos->conf.bps;
+
+	if (qos->group) {
+		total = 0;
+		for (i = 0; i < BLKQOS_GROUP_MEMBERS; i++) {
+			m = &qos->group->members[i];
+			if (m == qos->member || (__atomic_load_n(&m->pid, __ATOMIC_RELAXED) &&
+					now - __atomic_load_n(&m->active_ns, __ATOMIC_RELAXED) < BLKQOS_ACTIVE_NS))
+				total += __atomic_load_n(&m->weight, __ATOMIC_RELAXED);
+		}
+		share = (double)qos->conf.weight / MAX(total, 1);
+
+		group_iops = __atomic_load_n(&qos->group->iops, __ATOMIC_RELAXED);
+		group_bps = __atomic_load_n(&qos->group->bps, __ATOMIC_RELAXED);
+		if (group_iops)
+			iops = iops ? MIN(iops, group_iops * share) : group_iops * share;
+		if (group_bps)
+			bps = bps ? MIN(bps, group_bps * share) : group_bps * share;
+		if (qos->lat_iops)
+			iops = iops ? MIN(iops, qos->lat_iops) : qos->lat_iops;
+		if (qos->lat_bps)
+			bps = bps ? MIN(bps, qos->lat_bps) : qos->lat_bps;
+		qos->share_ns = now;
+	}
+
+	/* a bucket must hold at least one request, whatever its rate */
+	blkqos_bucket_set(&qos->ops, iops, qos->conf.burst_ms, 1);
+	blkqos_bucket_set(&qos->bytes, bps, qos->conf.burst_ms, 128 * 1024);
+}
+
+/*
+ * Look at the latency of the requests completed since the last call, tell
+ * the other members if it missed the target and cap the rate while another
+ * member misses a stricter one. Called with qos->mtx held, before
+ * blkqos_apply().
+ */
+static void
+blkqos_lat_update(struct blkqos *qos, uint64_t now)
+{
+	struct blkqos_member *m;
+	uint64_t elapsed, done, lat_ns, missed;
+	uint32_t target, strictest;
+	double ops_rate, bytes_rate;
+	int i;
+
+	elapsed = MAX(now - qos->share_ns, 1);
+	done = __atomic_exchange_n(&qos->win_done, 0, __ATOMIC_RELAXED);
+	lat_ns = __atomic_exchange_n(&qos->win_lat_ns, 0, __ATOMIC_RELAXED);
+	ops_rate = (double)qos->win_ops * NSEC_PER_SEC / elapsed;
+	bytes_rate = (double)qos->win_bytes * NSEC_PER_SEC / elapsed;
+	qos->win_ops = 0;
+	qos->win_bytes = 0;
+
+	if (qos->conf.lat_us && done && (lat_ns / done > qos->conf.lat_us * 1000UL))
+		__atomic_store_n(&qos->member->missed_ns, now, __ATOMIC_RELAXED);
+
+	strictest = 0;
+	for (i = 0; i < BLKQOS_GROUP_MEMBERS; i++) {
+		m = &qos->group->members[i];
+		if (m == qos->member || !__atomic_load_n(&m->pid, __ATOMIC_RELAXED))
+			continue;
+		target = __atomic_load_n(&m->lat_us, __ATOMIC_RELAXED);
+		missed = __atomic_load_n(&m->missed_ns, __ATOMIC_RELAXED);
+		if (target && (now - missed < 2 * BLKQOS_SHARE_NS) &&
+				(!strictest || target < strictest))
+			strictest = target;
+	}
+
+	if (strictest && (!qos->conf.lat_us || qos->conf.lat_us > strictest)) {
+		ops_rate = qos->lat_iops ? MIN(qos->lat_iops, ops_rate) : ops_rate;
+		bytes_rate = qos->lat_bps ? MIN(qos->lat_bps, bytes_rate) : bytes_rate;
+		qos->lat_iops = MAX(ops_rate / 2, BLKQOS_LAT_MIN_IOPS);
+		qos->lat_bps = MAX(bytes_rate / 2, BLKQOS_LAT_MIN_BPS);
+	} else {
+		qos->lat_iops = (ops_rate < qos->lat_iops / 2) ? 0 : qos->lat_iops * 1.25;
+		qos->lat_bps = (bytes_rate < qos->lat_bps / 2) ? 0 : qos->lat_bps * 1.25;
+	}
+}
+
+static void
+blkqos_group_path(const char *group, char *name, size_t len)
+{
+	snprintf(name, len, "/acrn-blkqos-%s", group);
+}
+
+/*
+ * Open the segment of @group and lock it, for the caller to join or leave.
+ * The lock goes away with *@fd.
+ */
+static struct blkqos_group *
+blkqos_group_open(const char *group, int *fd)
+{
+	struct blkqos_group *grp;
+	char name[BLKQOS_GROUP_NAME_LEN + 16];
+	struct stat st;
+
+	blkqos_group_path(group, name, sizeof(name));
+
+	for (;;) {
+		/* a new segment reads as zero, that is an empty member table */
+		*fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+		if (*fd < 0) {
+			pr_warn("blkqos: failed to open %s, error %s\n", name, strerror(errno));
+			return NULL;
+		}
+		if (flock(*fd, LOCK_EX) < 0 || fstat(*fd, &st) < 0) {
+			pr_warn("blkqos: failed to lock %s\n", name);
+			close(*fd);
+			return NULL;
+		}
+		/* the last member left and removed it meanwhile */
+		if (st.st_nlink > 0)
+			break;
+		close(*fd);
+	}
+
+	if (st.st_size < sizeof(*grp) && ftruncate(*fd, sizeof(*grp)) < 0) {
+		pr_warn("blkqos: can't resize %s\n", name);
+		close(*fd);
+		return NULL;
+	}
+
+	grp = mmap(NULL, sizeof(*grp), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (grp == MAP_FAILED) {
+		pr_warn("blkqos: failed to map %s\n", name);
+		close(*fd);
+		return NULL;
+	}
+	return grp;
+}
+
+/* Count the members still running, called with the group locked */
+static int
+blkqos_group_members(struct blkqos_group *group)
+{
+	int32_t pid;
+	int i, n;
+
+	for (i = 0, n = 0; i < BLKQOS_GROUP_MEMBERS; i++) {
+		pid = __atomic_load_n(&group->members[i].pid, __ATOMIC_RELAXED);
+		if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+			n++;
+	}
+	return n;
+}
+
+/* Take a free entry, called with the group locked */
+static struct blkqos_member *
+blkqos_group_join(struct blkqos_group *group, const struct blkqos_conf *conf)
+{
+	struct blkqos_member *m;
+	int32_t pid;
+	int i;
+
+	for (i = 0; i < BLKQOS_GROUP_MEMBERS; i++) {
+		m = &group->members[i];
+		pid = __atomic_load_n(&m->pid, __ATOMIC_RELAXED);
+
+		/* reclaim entries of DM instances that died without leaving */
+		if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+			continue;
+
+		__atomic_store_n(&m->weight, conf->weight, __ATOMIC_RELAXED);
+		__atomic_store_n(&m->lat_us, conf->lat_us, __ATOMIC_RELAXED);
+		__atomic_store_n(&m->missed_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&m->active_ns, blkqos_now_ns(), __ATOMIC_RELAXED);
+		__atomic_store_n(&m->pid, getpid(), __ATOMIC_RELEASE);
+		return m;
+	}
+	return NULL;
+}
+
+static void
+blkqos_group_leave(struct blkqos *qos)
+{
+	char name[BLKQOS_GROUP_NAME_LEN + 16];
+
+	if (flock(qos->group_fd, LOCK_EX) == 0) {
+		__atomic_store_n(&qos->member->pid, 0, __ATOMIC_RELEASE);
+		if (blkqos_group_members(qos->group) == 0) {
+			blkqos_group_path(qos->conf.group, name, sizeof(name));
+			shm_unlink(name);
+		}
+	} else
+		__atomic_store_n(&qos->member->pid, 0, __ATOMIC_RELEASE);
+
+	munmap(qos->group, sizeof(*qos->group));
+	close(qos->group_fd);
+	qos->group = NULL;
+	qos->member = NULL;
+}
+
+struct blkqos *
+blkqos_create(const struct blkqos_conf *conf)
+{
+	struct blkqos *qos;
+
+	if (conf->lat_us && !conf->group[0]) {
+		pr_err("blkqos: qos_lat needs a qos_group\n");
+		return NULL;
+	}
+
+	qos = calloc(1, sizeof(*qos));
+	if (!qos)
+		return NULL;
+
+	qos->conf = *conf;
+	qos->group_fd = -1;
+	if (conf->group[0]) {
+		qos->group = blkqos_group_open(conf->group, &qos->group_fd);
+		if (qos->group && blkqos_group_members(qos->group) == 0) {
+			__atomic_store_n(&qos->group->iops, conf->group_iops, __ATOMIC_RELAXED);
+			__atomic_store_n(&qos->group->bps, conf->group_bps, __ATOMIC_RELAXED);
+		} else if (qos->group && (qos->group->iops != conf->group_iops ||
+					  qos->group->bps != conf->group_bps)) {
+			pr_err("blkqos: group %s is limited to iops %lu bps %lu already\n",
+					conf->group, qos->group->iops, qos->group->bps);
+			munmap(qos->group, sizeof(*qos->group));
+			close(qos->group_fd);
+			free(qos);
+			return NULL;
+		}
+		if (qos->group) {
+			qos->member = blkqos_group_join(qos->group, conf);
+			if (!qos->member) {
+				pr_warn("blkqos: group %s is full\n", conf->group);
+				munmap(qos->group, sizeof(*qos->group));
+				close(qos->group_fd);
+				qos->group = NULL;
+			} else
+				flock(qos->group_fd, LOCK_UN);
+		}
+		if (!qos->group)
+			pr_warn("blkqos: running without group %s\n", conf->group);
+	}
+
+	pthread_mutex_init(&qos->mtx, NULL);
+	qos->last_ns = blkqos_now_ns();
+	blkqos_apply(qos, qos->last_ns);
+	qos->ops.level = qos->ops.max;
+	qos->bytes.level = qos->bytes.max;
+
+	pr_info("blkqos: iops %lu bps %lu burst %ums%s%s\n", conf->iops, conf->bps,
+			conf->burst_ms, qos->group ? " group " : "",
+			qos->group ? conf->group : "");
+	return qos;
+}
+
+/* Change the limits at runtime, the group can not be changed */
+int
+blkqos_update(struct blkqos *qos, const char *opts)
+{
+	struct blkqos_conf conf;
+
+	pthread_mutex_lock(&qos->mtx);
+	conf = qos->conf;
+	pthread_mutex_unlock(&qos->mtx);
+
+	if (blkqos_parse(&conf, opts))
+		return -1;
+	if (strcmp(conf.group, qos->conf.group)) {
+		pr_err("blkqos: the group can not be changed at runtime\n");
+		return -1;
+	}
+	if (conf.lat_us && !qos->group) {
+		pr_err("blkqos: qos_lat needs a qos_group\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&qos->mtx);
+	qos->conf = conf;
+	if (qos->group) {
+		/* for all the members, they keep agreeing on the limit */
+		__atomic_store_n(&qos->group->iops, conf.group_iops, __ATOMIC_RELAXED);
+		__atomic_store_n(&qos->group->bps, conf.group_bps, __ATOMIC_RELAXED);
+		__atomic_store_n(&qos->member->weight, conf.weight, __ATOMIC_RELAXED);
+		__atomic_store_n(&qos->member->lat_us, conf.lat_us, __ATOMIC_RELAXED);
+	}
+	blkqos_apply(qos, blkqos_now_ns());
+	pthread_mutex_unlock(&qos->mtx);
+
+	pr_info("blkqos: updated to iops %lu bps %lu burst %ums weight %u\n",
+			conf.iops, conf.bps, conf.burst_ms, conf.weight);
+	return 0;
+}
+
+/* Charge @ops requests of @bytes in total, merged requests count one by one */
+void
+blkqos_throttle(struct blkqos *qos, uint32_t ops, size_t bytes)
+{
+	struct timespec ts;
+	uint64_t now, wait;
+
+	now = blkqos_now_ns();
+
+	pthread_mutex_lock(&qos->mtx);
+	if (qos->group) {
+		__atomic_store_n(&qos->member->active_ns, now, __ATOMIC_RELAXED);
+		qos->win_ops += ops;
+		qos->win_bytes += bytes;
+		if (now - qos->share_ns >= BLKQOS_SHARE_NS) {
+			blkqos_lat_update(qos, now);
+			blkqos_apply(qos, now);
+		}
+	}
+
+	wait = MAX(blkqos_bucket_take(&qos->ops, now - qos->last_ns, ops),
+		   blkqos_bucket_take(&qos->bytes, now - qos->last_ns, bytes));
+	qos->last_ns = now;
+	qos->throttled_ns += wait;
+	pthread_mutex_unlock(&qos->mtx);
+
+	if (wait) {
+		ts.tv_sec = wait / NSEC_PER_SEC;
+		ts.tv_nsec = wait % NSEC_PER_SEC;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+	}
+}
+
+/* Account a request which took @lat_ns from blkqos_throttle() to its completion */
+void
+blkqos_complete(struct blkqos *qos, uint64_t lat_ns)
+{
+	if (!qos->group)
+		return;
+
+	__atomic_fetch_add(&qos->win_lat_ns, lat_ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&qos->win_done, 1, __ATOMIC_RELAXED);
+}
+
+void
+blkqos_destroy(struct blkqos *qos)
+{
+	if (!qos)
+		return;
+
+	pr_info("blkqos: requests were delayed by %lu ms in total\n",
+			qos->throttled_ns / 1000000);
+
+	if (qos->group)
+		blkqos_group_leave(qos);
+	pthread_mutex_destroy(&qos->mtx);
+	free(qos);
+}
@@ -500,8 +500,9 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 	struct pci_vdev *pdi = arg;
 	struct pci_vdev_ops *ops = pdi->dev_ops;
 	uint64_t offset;
-	int i;
+	int i, ret = -1;
 
+	pthread_mutex_lock(&pdi->emul_lock);
 	for (i = 0; i <= PCI_BARMAX; i++) {
 		if (pdi->bar[i].type == PCIBAR_IO &&
 		    port >= pdi->bar[i].addr &&
@@ -514,10 +515,12 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 			} else
 				(*ops->vdev_barwrite)(ctx, vcpu, pdi, i, offset,
 				                      bytes, bar_value(bytes, *eax));
-			return 0;
+			ret = 0;
+			break;
 		}
 	}
-	return -1;
+	pthread_mutex_unlock(&pdi->emul_lock);
+	return ret;
 }
 
 static int
@@ -536,6 +539,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 
 	offset = addr - pdi->bar[bidx].addr;
 
+	pthread_mutex_lock(&pdi->emul_lock);
 	if (dir == MEM_F_WRITE) {
 		if (size == 8) {
 			(*ops->vdev_barwrite)(ctx, vcpu, pdi, bidx, offset,
@@ -564,6 +568,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 			*val = bar_value(size, *val);
 		}
 	}
+	pthread_mutex_unlock(&pdi->emul_lock);
 
 	return 0;
 }
@@ -1032,6 +1037,7 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	      int func, struct funcinfo *fi)
 {
 	struct pci_vdev *pdi;
+	pthread_mutexattr_t attr;
 	int err;
 
 	pdi = calloc(1, sizeof(struct pci_vdev));
@@ -1045,6 +1051,10 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	pdi->slot = slot;
 	pdi->func = func;
 	pthread_mutex_init(&pdi->lintr.lock, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pdi->emul_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
 	pdi->lintr.pin = 0;
 	pdi->lintr.state = IDLE;
 	pdi->lintr.pirq_pin = 0;
@@ -1066,8 +1076,10 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
 	if (err == 0)
 		fi->fi_devi = pdi;
-	else
+	else {
+		pthread_mutex_destroy(&pdi->emul_lock);
 		free(pdi);
+	}
 
 	return err;
 }
@@ -1085,6 +1097,7 @@ pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		pci_lintr_release(fi->fi_devi);
 		pci_emul_free_bars(fi->fi_devi);
 		pci_emul_free_msixcap(fi->fi_devi);
+		pthread_mutex_destroy(&fi->fi_devi->emul_lock);
 		free(fi->fi_devi);
 	}
 }
@@ -2373,36 +2386,15 @@ pci_emul_cmdsts_write(struct pci_vdev *dev, int coff, uint32_t new, int bytes)
 }
 
 static void
-pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
-	  int coff, int bytes, uint32_t *eax)
+pci_vdev_cfgrw(struct vmctx *ctx, int vcpu, int in, struct pci_vdev *dev,
+	       int coff, int bytes, uint32_t *eax)
 {
-	struct businfo *bi;
-	struct slotinfo *si;
-	struct pci_vdev *dev;
 	struct pci_vdev_ops *ops;
 	int idx, needcfg;
 	uint64_t addr, bar, mask;
 	bool decode, ignore_reg_unreg = false;
 	uint8_t mmio_bar_prop;
 
-	bi = pci_businfo[bus];
-	if (bi != NULL) {
-		si = &bi->slotinfo[slot];
-		dev = si->si_funcs[func].fi_devi;
-	} else
-		dev = NULL;
-
-	/*
-	 * Just return if there is no device at this slot:func or if the
-	 * the guest is doing an un-aligned access.
-	 */
-	if (dev == NULL || (bytes != 1 && bytes != 2 && bytes != 4) ||
-	    (coff & (bytes - 1)) != 0) {
-		if (in)
-			*eax = 0xffffffff;
-		return;
-	}
-
 	ops = dev->dev_ops;
 
 	/*
@@ -2446,7 +2438,7 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 		if (needcfg)
 			*eax = CFGREAD(dev, coff, bytes);
 
-		pci_emul_hdrtype_fixup(bus, slot, coff, bytes, eax);
+		pci_emul_hdrtype_fixup(dev->bus, dev->slot, coff, bytes, eax);
 	} else {
 		/* Let the device emulation override the default handler */
 		if (ops->vdev_cfgwrite != NULL &&
@@ -2560,6 +2552,37 @@ pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 	}
 }
 
+static void
+pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
+	  int coff, int bytes, uint32_t *eax)
+{
+	struct businfo *bi;
+	struct slotinfo *si;
+	struct pci_vdev *dev;
+
+	bi = pci_businfo[bus];
+	if (bi != NULL) {
+		si = &bi->slotinfo[slot];
+		dev = si->si_funcs[func].fi_devi;
+	} else
+		dev = NULL;
+
+	/*
+	 * Just return if there is no device at this slot:func or if the
+	 * the guest is doing an un-aligned access.
+	 */
+	if (dev == NULL || (bytes != 1 && bytes != 2 && bytes != 4) ||
+	    (coff & (bytes - 1)) != 0) {
+		if (in)
+			*eax = 0xffffffff;
+		return;
+	}
+
+	pthread_mutex_lock(&dev->emul_lock);
+	pci_vdev_cfgrw(ctx, vcpu, in, dev, coff, bytes, eax);
+	pthread_mutex_unlock(&dev->emul_lock);
+}
+
 int
 emulate_pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot,
 		  int func, int reg, int bytes, int *value)
@@ -45,6 +45,8 @@
 #include "lpc.h"
 #include "pit.h"
 #include "uart_core.h"
+#include "ns16550.h"
+#include "coalesced_io.h"
 
 #define	IO_ICU1		0x20
 #define	IO_ICU2		0xA0
@@ -66,6 +68,7 @@ static struct lpc_uart_vdev {
 	int	iobase;
 	int	irq;
 	int	enabled;	/* enabled/configured by user */
+	bool	thr_posted;	/* THR is a coalesced I/O zone */
 } lpc_uart_vdev[LPC_UART_NUM];
 #define LPC_S5_UART_NAME "COM5"
 
@@ -149,6 +152,30 @@ lpc_uart_intr_deassert(void *arg)
 	 */
 }
 
+/*
+ * Characters written to THR are only seen through LSR, which the guest
+ * reads through a request draining the posted writes first, unless the
+ * THRE interrupt or the loopback mode is on: THR is only coalesced while
+ * both are off.
+ */
+static void
+lpc_uart_update_posting(struct lpc_uart_vdev *lpc_uart)
+{
+	bool post;
+
+	post = uart_thr_write_is_silent(lpc_uart->uart);
+	if (post == lpc_uart->thr_posted)
+		return;
+
+	if (post)
+		lpc_uart->thr_posted = (register_coalesced_io(ACRN_IOREQ_TYPE_PORTIO,
+				lpc_uart->iobase + REG_DATA, 1) == 0);
+	else {
+		unregister_coalesced_io(ACRN_IOREQ_TYPE_PORTIO, lpc_uart->iobase + REG_DATA, 1);
+		lpc_uart->thr_posted = false;
+	}
+}
+
 static int
 lpc_uart_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		    uint32_t *eax, void *arg)
@@ -178,6 +205,10 @@ lpc_uart_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		return -1;
 	}
 
+	/* IER or MCR may have changed */
+	if (!in && (offset + bytes > REG_IER))
+		lpc_uart_update_posting(lpc_uart);
+
 	return 0;
 }
 
@@ -197,6 +228,12 @@ lpc_deinit(struct vmctx *ctx)
 		if (lpc_uart->enabled == 0)
 			continue;
 
+		if (lpc_uart->thr_posted) {
+			unregister_coalesced_io(ACRN_IOREQ_TYPE_PORTIO,
+					lpc_uart->iobase + REG_DATA, 1);
+			lpc_uart->thr_posted = false;
+		}
+
 		bzero(&iop, sizeof(struct inout_port));
 		iop.name = name;
 		iop.port = lpc_uart->iobase;
@@ -254,6 +291,8 @@ lpc_init(struct vmctx *ctx)
 		error = register_inout(&iop);
 		if (error)
 			goto init_failed;
+
+		lpc_uart_update_posting(lpc_uart);
 	}
 
 	return 0;
@@ -170,7 +170,7 @@ virtio_poll_timer(void *arg, uint64_t nexp)
 		vq = &base->queues[i];
 		if(!vq_ring_ready(vq))
 			continue;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(base, vq);
 		/* TODO: call notify when necessary */
 		if (vq->viothrd.ioevent_started){
 			if (eventfd_write(vq->viothrd.iomvt.fd, val) == -1){
@@ -287,6 +287,11 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		vq->packed = false;
+		vq->used_idx = 0;
+		vq->last_chain_ndesc = 0;
+		free(vq->packed_ndesc);
+		vq->packed_ndesc = NULL;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -428,6 +433,71 @@ error:
 	pr_err("%s: vq enable failed\n", __func__);
 }
 
+/*
+ * Initialize a packed virtqueue. The descriptor ring lives at the
+ * "desc" address, while the "avail" and "used" addresses carry the
+ * driver and device event suppression structures respectively.
+ */
+static void
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t qsz;
+	uint64_t phys;
+	uint16_t *ndesc;
+	char *vb;
+
+	qsz = vq->qsize;
+	if (qsz == 0 || qsz > 32768)
+		goto error;
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			qsz * sizeof(struct vring_packed_desc));
+	if (!vb)
+		goto error;
+	vq->packed_desc = (struct vring_packed_desc *)vb;
+
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		goto error;
+	vq->driver_event = (struct vring_packed_desc_event *)vb;
+
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		goto error;
+	vq->device_event = (struct vring_packed_desc_event *)vb;
+
+	ndesc = realloc(vq->packed_ndesc, qsz * sizeof(uint16_t));
+	if (!ndesc)
+		goto error;
+	memset(ndesc, 0, qsz * sizeof(uint16_t));
+	vq->packed_ndesc = ndesc;
+
+	/* Start at slot 0 with both wrap counters set. */
+	vq->last_avail = 0;
+	vq->save_used = 0;
+	vq->used_idx = 0;
+	vq->last_chain_ndesc = 0;
+	vq->avail_wrap = true;
+	vq->used_wrap = true;
+	vq->packed = true;
+
+	/* Mark queue as enabled. */
+	vq->enabled = true;
+
+	/* Mark queue as allocated after initialization is complete. */
+	mb();
+	vq->flags = VQ_ALLOC;
+	return;
+ error:
+	vq->flags = 0;
+	pr_err("%s: packed vq enable failed\n", __func__);
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -446,6 +516,11 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & (1UL << VIRTIO_F_RING_PACKED)) {
+		virtio_vq_enable_packed(base, vq);
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct vring_desc);
@@ -474,6 +549,7 @@ virtio_vq_enable(struct virtio_base *base)
 	/* Start at 0 when we use it. */
 	vq->last_avail = 0;
 	vq->save_used = 0;
+	vq->packed = false;
 
 	/* Mark queue as enabled. */
 	vq->enabled = true;
@@ -494,72 +570,47 @@ virtio_vq_enable(struct virtio_base *base)
  *        fails.
  */
 static inline int
-_vq_record(int i, volatile struct vring_desc *vd, struct vmctx *ctx,
-	   struct iovec *iov, int n_iov, uint16_t *flags) {
+_vq_record(int i, uint64_t addr, uint32_t len, uint16_t vflags,
+	   struct vmctx *ctx, struct iovec *iov, int n_iov, uint16_t *flags) {
 
 	void *host_addr;
 
 	if (i >= n_iov)
 		return -1;
-	host_addr = paddr_guest2host(ctx, vd->addr, vd->len);
+	host_addr = paddr_guest2host(ctx, addr, len);
 	if (!host_addr)
 		return -1;
 	iov[i].iov_base = host_addr;
-	iov[i].iov_len = vd->len;
+	iov[i].iov_len = len;
 	if (flags != NULL)
-		flags[i] = vd->flags;
+		flags[i] = vflags;
 	return 0;
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/* Descriptor flags reported to backends for a packed virtqueue */
+#define	VQ_PACKED_DESC_F_MASK	\
+	(VRING_DESC_F_NEXT | VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT)
+
 /*
- * Examine the chain of descriptors starting at the "next one" to
- * make sure that they describe a sensible request.  If so, return
- * the number of "real" descriptors that would be needed/used in
- * acting on this request.  This may be smaller than the number of
- * available descriptors, e.g., if there are two available but
- * they are two separate requests, this just returns 1.  Or, it
- * may be larger: if there are indirect descriptors involved,
- * there may only be one descriptor available but it may be an
- * indirect pointing to eight more.  We return 8 in this case,
- * i.e., we do not count the indirect descriptors, only the "real"
- * ones.
- *
- * Basically, this vets the flags and vd_next field of each
- * descriptor and tells you how many are involved.  Since some may
- * be indirect, this also needs the vmctx (in the pci_vdev
- * at base->dev) so that it can find indirect descriptors.
- *
- * As we process each descriptor, we copy and adjust it (guest to
- * host address wise, also using the vmtctx) into the given iov[]
- * array (of the given size).  If the array overflows, we stop
- * placing values into the array but keep processing descriptors,
- * up to VQ_MAX_DESCRIPTORS, before giving up and returning -1.
- * So you, the caller, must not assume that iov[] is as big as the
- * return value (you can process the same thing twice to allocate
- * a larger iov array if needed, or supply a zero length to find
- * out how much space is needed).
- *
- * If you want to verify the WRITE flag on each descriptor, pass a
- * non-NULL "flags" pointer to an array of "uint16_t" of the same size
- * as n_iov and we'll copy each flags field after unwinding any
- * indirects.
+ * Packed virtqueue flavour of vq_getchain().  A chain is the run of
+ * descriptor slots starting at last_avail for as long as NEXT is set,
+ * and the buffer id handed back in *pidx is taken from the last one.
+ * An indirect descriptor takes a single slot and its whole table is
+ * part of the chain; NEXT is ignored inside the table.
  *
- * If some descriptor(s) are invalid, this prints a diagnostic message
- * and returns -1.  If no descriptors are ready now it simply returns 0.
- *
- * You are assumed to have done a vq_ring_ready() if needed (note
- * that vq_has_descs() does one).
+ * last_avail and avail_wrap are advanced slot by slot, so a broken
+ * chain is skipped rather than retried forever, as for split rings.
  */
-int
-vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
-	    struct iovec *iov, int n_iov, uint16_t *flags)
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
 {
 	int i;
-	u_int ndesc, n_indir;
-	u_int idx, next;
+	u_int j, n_indir;
+	uint16_t vflags, nslots, id;
 
-	volatile struct vring_desc *vdir, *vindir, *vp;
+	volatile struct vring_packed_desc *vdir, *vindir, *vp;
 	struct vmctx *ctx;
 	struct virtio_base *base;
 	const char *name;
@@ -567,29 +618,119 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	base = vq->base;
 	name = base->vops->name;
 
+	if (!vq_has_descs(vq))
+		return 0;
+
 	/*
-	 * Note: it's the responsibility of the guest not to
-	 * update vq->avail->idx until all of the descriptors
-	 * the guest has written are valid (including all their
-	 * next fields and vd_flags).
-	 *
-	 * Compute (last_avail - idx) in integers mod 2**16.  This is
-	 * the number of descriptors the device has made available
-	 * since the last time we updated vq->last_avail.
-	 *
-	 * We just need to do the subtraction as an unsigned int,
-	 * then trim off excess bits.
+	 * The driver publishes the head flags last; don't let the rest
+	 * of the chain be read ahead of them.  Only loads are ordered
+	 * here, a full fence would cost more than the rest of the chain.
 	 */
-	idx = vq->last_avail;
-	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
-	if (ndesc == 0)
-		return 0;
-	if (ndesc > vq->qsize) {
-		/* XXX need better way to diagnose issues */
-		pr_err("%s: ndesc (%u) out of range, driver confused?\r\n",
-		    name, (u_int)ndesc);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	ctx = base->dev->vmctx;
+	i = 0;
+	for (nslots = 1; ; nslots++) {
+		if (nslots > vq->qsize) {
+			pr_err("%s: chain longer than the ring, "
+			    "driver confused?\r\n", name);
+			return -1;
+		}
+		vdir = &vq->packed_desc[vq->last_avail];
+		vflags = vdir->flags;
+		if (++vq->last_avail == vq->qsize) {
+			vq->last_avail = 0;
+			vq->avail_wrap = !vq->avail_wrap;
+		}
+
+		if ((vflags & VRING_DESC_F_INDIRECT) == 0) {
+			if (_vq_record(i, vdir->addr, vdir->len,
+					vflags & VQ_PACKED_DESC_F_MASK,
+					ctx, iov, n_iov, flags)) {
+				pr_err("%s: mapping to host failed\r\n", name);
+				return -1;
+			}
+			if (++i > VQ_MAX_DESCRIPTORS)
+				goto loopy;
+		} else if ((base->device_caps &
+		    (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0) {
+			pr_err("%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			return -1;
+		} else {
+			n_indir = vdir->len / 16;
+			if ((vdir->len & 0xf) || n_indir == 0) {
+				pr_err("%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vdir->len);
+				return -1;
+			}
+			vindir = paddr_guest2host(ctx,
+			    vdir->addr, vdir->len);
+			if (!vindir) {
+				pr_err("%s cannot get host memory\r\n", name);
+				return -1;
+			}
+			for (j = 0; j < n_indir; j++) {
+				vp = &vindir[j];
+				if (vp->flags & VRING_DESC_F_INDIRECT) {
+					pr_err("%s: indirect desc has INDIR flag,"
+					    " driver confused?\r\n",
+					    name);
+					return -1;
+				}
+				if (_vq_record(i, vp->addr, vp->len,
+						vp->flags & VQ_PACKED_DESC_F_MASK,
+						ctx, iov, n_iov, flags)) {
+					pr_err("%s: mapping to host failed\r\n", name);
+					return -1;
+				}
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+		if ((vflags & VRING_DESC_F_NEXT) == 0)
+			break;
+	}
+
+	/* read the id once, the driver may change it under us */
+	id = vdir->id;
+	if (id >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range, "
+		    "driver confused?\r\n",
+		    name, (u_int)id);
 		return -1;
 	}
+	*pidx = id;
+	vq->packed_ndesc[id] = nslots;
+	vq->last_chain_ndesc = nslots;
+	return i;
+
+loopy:
+	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+	return -1;
+}
+
+/*
+ * Helper for vq_getchain() and vq_getchains_batch() on a split
+ * virtqueue: walk the chain whose head descriptor is "next".
+ */
+static int
+_vq_walk_chain(struct virtio_vq_info *vq, u_int next,
+	       struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i;
+	u_int n_indir;
+
+	volatile struct vring_desc *vdir, *vindir, *vp;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
 
 	/*
 	 * Now count/parse "involved" descriptors starting from
@@ -600,8 +741,6 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	 * index, but we just abort if the count gets excessive.
 	 */
 	ctx = base->dev->vmctx;
-	*pidx = next = vq->avail->ring[idx & (vq->qsize - 1)];
-	vq->last_avail++;
 	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->next) {
 		if (next >= vq->qsize) {
 			pr_err("%s: descriptor index %u out of range, "
@@ -611,7 +750,8 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		}
 		vdir = &vq->desc[next];
 		if ((vdir->flags & VRING_DESC_F_INDIRECT) == 0) {
-			if (_vq_record(i, vdir, ctx, iov, n_iov, flags)) {
+			if (_vq_record(i, vdir->addr, vdir->len, vdir->flags,
+					ctx, iov, n_iov, flags)) {
 				pr_err("%s: mapping to host failed\r\n", name);
 				return -1;
 			}
@@ -653,7 +793,8 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 					    name);
 					return -1;
 				}
-				if (_vq_record(i, vp, ctx, iov, n_iov, flags)) {
+				if (_vq_record(i, vp->addr, vp->len, vp->flags,
+						ctx, iov, n_iov, flags)) {
 					pr_err("%s: mapping to host failed\r\n", name);
 					return -1;
 				}
@@ -679,6 +820,90 @@ loopy:
 	return -1;
 }
 
+/*
+ * Examine the chain of descriptors starting at the "next one" to
+ * make sure that they describe a sensible request.  If so, return
+ * the number of "real" descriptors that would be needed/used in
+ * acting on this request.  This may be smaller than the number of
+ * available descriptors, e.g., if there are two available but
+ * they are two separate requests, this just returns 1.  Or, it
+ * may be larger: if there are indirect descriptors involved,
+ * there may only be one descriptor available but it may be an
+ * indirect pointing to eight more.  We return 8 in this case,
+ * i.e., we do not count the indirect descriptors, only the "real"
+ * ones.
+ *
+ * Basically, this vets the flags and vd_next field of each
+ * descriptor and tells you how many are involved.  Since some may
+ * be indirect, this also needs the vmctx (in the pci_vdev
+ * at base->dev) so that it can find indirect descriptors.
+ *
+ * As we process each descriptor, we copy and adjust it (guest to
+ * host address wise, also using the vmtctx) into the given iov[]
+ * array (of the given size).  If the array overflows, we stop
+ * placing values into the array but keep processing descriptors,
+ * up to VQ_MAX_DESCRIPTORS, before giving up and returning -1.
+ * So you, the caller, must not assume that iov[] is as big as the
+ * return value (you can process the same thing twice to allocate
+ * a larger iov array if needed, or supply a zero length to find
+ * out how much space is needed).
+ *
+ * If you want to verify the WRITE flag on each descriptor, pass a
+ * non-NULL "flags" pointer to an array of "uint16_t" of the same size
+ * as n_iov and we'll copy each flags field after unwinding any
+ * indirects.
+ *
+ * If some descriptor(s) are invalid, this prints a diagnostic message
+ * and returns -1.  If no descriptors are ready now it simply returns 0.
+ *
+ * You are assumed to have done a vq_ring_ready() if needed (note
+ * that vq_has_descs() does one).
+ */
+int
+vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
+	    struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	u_int ndesc;
+	u_int idx, next;
+
+	struct virtio_base *base;
+	const char *name;
+
+	if (vq->packed)
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
+	base = vq->base;
+	name = base->vops->name;
+
+	/*
+	 * Note: it's the responsibility of the guest not to
+	 * update vq->avail->idx until all of the descriptors
+	 * the guest has written are valid (including all their
+	 * next fields and vd_flags).
+	 *
+	 * Compute (last_avail - idx) in integers mod 2**16.  This is
+	 * the number of descriptors the device has made available
+	 * since the last time we updated vq->last_avail.
+	 *
+	 * We just need to do the subtraction as an unsigned int,
+	 * then trim off excess bits.
+	 */
+	idx = vq->last_avail;
+	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
+	if (ndesc == 0)
+		return 0;
+	if (ndesc > vq->qsize) {
+		/* XXX need better way to diagnose issues */
+		pr_err("%s: ndesc (%u) out of range, driver confused?\r\n",
+		    name, (u_int)ndesc);
+		return -1;
+	}
+
+	*pidx = next = vq->avail->ring[idx & (vq->qsize - 1)];
+	vq->last_avail++;
+	return _vq_walk_chain(vq, next, iov, n_iov, flags);
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -688,7 +913,52 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	if (!vq->packed) {
+		vq->last_avail--;
+		return;
+	}
+
+	if (vq->last_avail < vq->last_chain_ndesc) {
+		vq->last_avail += vq->qsize;
+		vq->avail_wrap = !vq->avail_wrap;
+	}
+	vq->last_avail -= vq->last_chain_ndesc;
+	vq->last_chain_ndesc = 0;
+}
+
+/*
+ * Packed virtqueue flavour of vq_relchain().  Used buffers are written
+ * back in completion order over the slots the driver handed out, so
+ * the write position advances by the number of slots the buffer took
+ * in vq_getchain().  The flags go last: they make the slot visible.
+ */
+static void
+vq_relchain_packed(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags, nslots;
+
+	vd = &vq->packed_desc[vq->used_idx];
+	vd->id = idx;
+	vd->len = iolen;
+
+	flags = iolen ? VRING_DESC_F_WRITE : 0;
+	if (vq->used_wrap)
+		flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+			(1 << VRING_PACKED_DESC_F_USED);
+
+	/* an id vq_getchain() did not hand out takes a single slot */
+	nslots = (idx < vq->qsize) ? vq->packed_ndesc[idx] : 0;
+	if (nslots == 0 || nslots > vq->qsize)
+		nslots = 1;
+	vq->used_idx += nslots;
+	if (vq->used_idx >= vq->qsize) {
+		vq->used_idx -= vq->qsize;
+		vq->used_wrap = !vq->used_wrap;
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	vd->flags = flags;
 }
 
 /*
@@ -715,6 +985,11 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	 * (I apologize for the two fields named idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
+	if (vq->packed) {
+		vq_relchain_packed(vq, idx, iolen);
+		return;
+	}
+
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
@@ -725,6 +1000,139 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vuh->idx = uidx;
 }
 
+/*
+ * Fetch up to nchains available chains in one go.  On a split ring
+ * the avail index is read only once for the whole batch.  Chain k is
+ * walked into iov[k * n_iov] (and flags[k * n_iov] if flags is not
+ * NULL), and chains[k].n is what vq_getchain() would have returned
+ * for it.  A broken chain is consumed and ends the batch, so only the
+ * last returned chain can have a negative n.
+ *
+ * Return the number of chains filled in, or -1 if the avail index is
+ * bogus.
+ */
+int
+vq_getchains_batch(struct virtio_vq_info *vq, struct vq_chain *chains,
+		   int nchains, struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	struct vq_chain *chain;
+	u_int ndesc;
+	int i;
+
+	if (!vq->packed) {
+		ndesc = (uint16_t)((u_int)vq->avail->idx - vq->last_avail);
+		if (ndesc > vq->qsize) {
+			pr_err("%s: ndesc (%u) out of range, driver confused?\r\n",
+			    vq->base->vops->name, ndesc);
+			return -1;
+		}
+		if (ndesc < (u_int)nchains)
+			nchains = ndesc;
+	}
+
+	for (i = 0; i < nchains; i++) {
+		chain = &chains[i];
+		chain->iov = &iov[i * n_iov];
+		chain->flags = flags ? &flags[i * n_iov] : NULL;
+		chain->idx = vq->qsize;
+		chain->len = 0;
+		if (vq->packed) {
+			chain->n = vq_getchain_packed(vq, &chain->idx,
+					chain->iov, n_iov, chain->flags);
+		} else {
+			chain->idx = vq->avail->ring[vq->last_avail &
+					(vq->qsize - 1)];
+			vq->last_avail++;
+			chain->n = _vq_walk_chain(vq, chain->idx,
+					chain->iov, n_iov, chain->flags);
+		}
+		if (chain->n == 0)
+			break;
+		if (chain->n < 0)
+			return i + 1;
+	}
+	return i;
+}
+
+/*
+ * Return the last nchains chains of a vq_getchains_batch() result,
+ * which were not handled, back to the available queue.
+ */
+void
+vq_retchains_batch(struct virtio_vq_info *vq, struct vq_chain *chains,
+		   int nchains)
+{
+	uint16_t nslots;
+	int i;
+
+	if (nchains <= 0)
+		return;
+
+	if (!vq->packed) {
+		vq->last_avail -= nchains;
+		return;
+	}
+
+	for (nslots = 0, i = 0; i < nchains; i++) {
+		/* a broken chain got no id, its slots stay skipped */
+		if (chains[i].idx < vq->qsize)
+			nslots += vq->packed_ndesc[chains[i].idx];
+	}
+	if (vq->last_avail < nslots) {
+		vq->last_avail += vq->qsize;
+		vq->avail_wrap = !vq->avail_wrap;
+	}
+	vq->last_avail -= nslots;
+	vq->last_chain_ndesc = 0;
+}
+
+/*
+ * Packed virtqueue flavour of vq_endchains().  The driver event
+ * structure either enables or disables interrupts outright, or (with
+ * EVENT_IDX) asks for one once a given slot and wrap counter has been
+ * used.  The slot is placed on the same linear scale as the slots
+ * used since the last call, so that a wrap in between is handled.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq)
+{
+	struct virtio_base *base;
+	uint16_t event_flags, off_wrap;
+	int old_idx, new_idx, event_idx;
+	int intr;
+
+	atomic_thread_fence();
+
+	base = vq->base;
+	old_idx = vq->save_used;
+	new_idx = vq->used_idx;
+	vq->save_used = vq->used_idx;
+	if (new_idx == old_idx)
+		return;
+
+	/* the ring wrapped since the last call */
+	if (new_idx < old_idx)
+		new_idx += vq->qsize;
+
+	event_flags = vq->driver_event->flags;
+	if (event_flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		intr = 0;
+	else if (event_flags == VRING_PACKED_EVENT_FLAG_DESC &&
+	    (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		if (new_idx >= vq->qsize)
+			event_idx += vq->qsize;
+		if (!!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+		    vq->used_wrap)
+			event_idx -= vq->qsize;
+		intr = event_idx >= old_idx && event_idx < new_idx;
+	} else
+		intr = 1;
+	if (intr)
+		vq_interrupt(base, vq);
+}
+
 /*
  * Driver has finished processing "available" chains and calling
  * vq_relchain on each one.  If driver used all the available
@@ -747,8 +1155,13 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	uint16_t event_idx, new_idx, old_idx;
 	int intr;
 
-	if (!vq || !vq->used)
+	if (!vq || (!vq->packed && !vq->used))
+		return;
+
+	if (vq->packed) {
+		vq_endchains_packed(vq);
 		return;
+	}
 
 	/*
 	 * Interrupt generation: if we're using EVENT_IDX,
@@ -803,7 +1216,41 @@ void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *v
 	if (virtio_poll_enabled && backend_type == BACKEND_VBSU && polling_in_progress == 1)
 		return;
 
-	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq->packed)
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	else
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+}
+
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_set_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->packed) {
+		if (vq->device_event)
+			vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	} else if (vq->used)
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/*
+ * Capabilities offered to a modern driver.  Packed virtqueues are
+ * handled entirely in this file, so every user space backend gets
+ * them; vhost backends keep the split layout the kernel expects.
+ */
+static uint64_t
+virtio_device_caps(struct virtio_base *base)
+{
+	uint64_t caps = base->device_caps;
+
+	if (base->backend_type == BACKEND_VBSU &&
+	    (caps & (1UL << VIRTIO_F_VERSION_1)))
+		caps |= (1UL << VIRTIO_F_RING_PACKED);
+	return caps;
 }
 
 struct config_reg {
@@ -1412,9 +1859,9 @@ virtio_common_cfg_read(struct pci_vdev *dev, uint64_t offset, int size)
 		break;
 	case VIRTIO_PCI_COMMON_DF:
 		if (base->device_feature_select == 0)
-			value = base->device_caps & 0xffffffff;
+			value = virtio_device_caps(base) & 0xffffffff;
 		else if (base->device_feature_select == 1)
-			value = (base->device_caps >> 32) & 0xffffffff;
+			value = (virtio_device_caps(base) >> 32) & 0xffffffff;
 		else /* present 0, see 4.1.4.3.1 */
 			value = 0;
 		break;
@@ -1538,11 +1985,11 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		if (base->driver_feature_select < 2) {
 			value &= 0xffffffff;
 			if (base->driver_feature_select == 0) {
-				features = base->device_caps & value;
+				features = virtio_device_caps(base) & value;
 				base->negotiated_caps &= ~0xffffffffULL;
 			} else {
 				features = (value << 32)
-					& base->device_caps;
+					& virtio_device_caps(base);
 				base->negotiated_caps &= 0xffffffffULL;
 			}
 			base->negotiated_caps |= features;
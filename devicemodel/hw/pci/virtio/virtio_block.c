@@ -45,6 +45,7 @@
 
 #define VIRTIO_BLK_RINGSZ	64
 #define VIRTIO_BLK_MAX_OPTS_LEN	256
+#define VIRTIO_BLK_BATCH	8	/* chains handled under one plug */
 
 #define VIRTIO_BLK_S_OK	0
 #define VIRTIO_BLK_S_IOERR	1
@@ -63,6 +64,7 @@
 #define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)
 #define	VIRTIO_BLK_F_MQ		(1 << 12)	/* support more than one vq */
 #define	VIRTIO_BLK_F_DISCARD	(1 << 13)
+#define	VIRTIO_BLK_F_WRITE_ZEROES	(1 << 14)
 
 /*
  * Basic device capabilities
@@ -109,6 +111,13 @@ struct virtio_blk_config {
 	uint32_t max_discard_seg;
 	/* Discard commands must be aligned to this number of sectors. */
 	uint32_t discard_sector_alignment;
+	/* The maximum write zeroes sectors (in 512-byte sectors) for one segment */
+	uint32_t max_write_zeroes_sectors;
+	/* The maximum number of write zeroes segments */
+	uint32_t max_write_zeroes_seg;
+	/* Whether a write zeroes command may deallocate the sectors */
+	uint8_t write_zeroes_may_unmap;
+	uint8_t unused1[3];
 } __attribute__((packed));
 
 /*
@@ -121,6 +130,7 @@ struct virtio_blk_hdr {
 #define	VBH_OP_FLUSH_OUT	5
 #define	VBH_OP_IDENT		8
 #define	VBH_OP_DISCARD		11
+#define	VBH_OP_WRITE_ZEROES	13
 #define	VBH_FLAG_BARRIER	0x80000000	/* OR'ed into type */
 	uint32_t type;
 	uint32_t ioprio;
@@ -141,6 +151,9 @@ static bool register_vm_monitor_blkrescan = false;
 
 static struct monitor_vm_ops virtio_blk_rescan_ops = {
 	.rescan	= vm_monitor_blkrescan,
+	.blkqos	= vm_monitor_blkqos,
+	.blkstat = vm_monitor_blkstat,
+	.blksnap = vm_monitor_blksnap,
 };
 
 struct virtio_blk_ioreq {
@@ -223,7 +236,7 @@ virtio_blk_abort(struct virtio_vq_info *vq, uint16_t idx)
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc_chain(struct virtio_blk *blk, struct virtio_vq_info *vq)
 {
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
@@ -284,7 +297,8 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 */
 	type = vbh->type & ~VBH_FLAG_BARRIER;
 	writeop = ((type == VBH_OP_WRITE) ||
-			(type == VBH_OP_DISCARD));
+			(type == VBH_OP_DISCARD) ||
+			(type == VBH_OP_WRITE_ZEROES));
 
 	if (blk->dummy_bctxt) {
 		WPRINTF(("Block context invalid: Operation cannot be permitted!\n"));
@@ -348,6 +362,9 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	case VBH_OP_DISCARD:
 		err = blockif_discard(blk->bc, &io->req);
 		break;
+	case VBH_OP_WRITE_ZEROES:
+		err = blockif_write_zeroes(blk->bc, &io->req);
+		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
 		err = blockif_flush(blk->bc, &io->req);
@@ -368,6 +385,22 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		WPRINTF(("%s: request process failed\n", __func__));
 }
 
+static void
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+{
+	struct blockif_ctxt *bc;
+	int i;
+
+	/* let blockif merge adjacent requests of the batch */
+	bc = blk->dummy_bctxt ? NULL : blk->bc;
+	if (bc)
+		blockif_plug(bc, vq - blk->vqs);
+	for (i = 0; i < VIRTIO_BLK_BATCH && vq_has_descs(vq); i++)
+		virtio_blk_proc_chain(blk, vq);
+	if (bc)
+		blockif_unplug(bc, vq - blk->vqs);
+}
+
 static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
@@ -387,7 +420,7 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 	 * requests in virtqueue.
 	 * */
 	do {
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(&blk->base, vq);
 		mb();
 		do {
 			virtio_blk_proc(blk, vq);
@@ -412,6 +445,8 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 
 	if (blockif_is_ro(blk->bc))
 		caps |= VIRTIO_BLK_F_RO;
+	else
+		caps |= VIRTIO_BLK_F_WRITE_ZEROES;
 
 	if (blk->num_vqs > 1)
 		caps |= VIRTIO_BLK_F_MQ;
@@ -450,6 +485,11 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 		blk->cfg.max_discard_seg = blockif_max_discard_seg(blk->bc);
 		blk->cfg.discard_sector_alignment = blockif_discard_sector_alignment(blk->bc);
 	}
+	if (!blockif_is_ro(blk->bc)) {
+		blk->cfg.max_write_zeroes_sectors = blockif_max_write_zeroes_sectors(blk->bc);
+		blk->cfg.max_write_zeroes_seg = blockif_max_write_zeroes_seg(blk->bc);
+		blk->cfg.write_zeroes_may_unmap = blockif_write_zeroes_may_unmap(blk->bc);
+	}
 	blk->base.device_caps =
 		virtio_blk_get_caps(blk, !!blk->cfg.writeback);
 }
@@ -476,7 +516,9 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *opt = NULL;
 	u_char digest[16];
 	struct virtio_blk *blk;
-	bool use_iothread;
+	bool use_iothread, iothread_per_vq;
+	char *iothread_vq_cpus = NULL;
+	char iothread_str[256];
 	struct iothread_ctx *ioctx_base = NULL;
 	struct iothreads_info iothrds_info;
 	int num_vqs;
@@ -491,6 +533,7 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* Assume the bctxt is valid, until identified otherwise */
 	dummy_bctxt = false;
 	use_iothread = false;
+	iothread_per_vq = false;
 	num_vqs = 1;
 
 	if (opts == NULL) {
@@ -529,8 +572,16 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			if (!strncmp(opt, "iothread", strlen("iothread"))) {
 				use_iothread = true;
 				strsep(&opt, "=");
-
-				if (iothread_parse_options(opt, &iot_opt) < 0) {
+				if ((opt != NULL) && !strncmp(opt, "vq", strlen("vq"))) {
+					/* one iothread per virtqueue, created once mq is known */
+					iothread_per_vq = true;
+					iothread_vq_cpus = opt + strlen("vq");
+					if ((*iothread_vq_cpus != '\0') && (*iothread_vq_cpus != '@')) {
+						pr_err("%s: invalid iothread setting %s\n", __func__, opt);
+						free(opts_start);
+						return -1;
+					}
+				} else if (iothread_parse_options(opt, &iot_opt) < 0) {
 					free(opts_start);
 					return -1;
 				}
@@ -567,7 +618,16 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			 * - One or more vqs can be handled in one iothread.
 			 * - The mapping between virtqueues and iothreads is based on round robin.
 			 */
-			if (iot_opt.num > num_vqs) {
+			if (iothread_per_vq) {
+				if ((snprintf(iothread_str, sizeof(iothread_str), "%d%s",
+						num_vqs, iothread_vq_cpus) >= sizeof(iothread_str)) ||
+						(iothread_parse_options(iothread_str, &iot_opt) < 0)) {
+					pr_err("%s: invalid iothread setting vq%s\n", __func__,
+						iothread_vq_cpus);
+					free(opts_start);
+					return -1;
+				}
+			} else if (iot_opt.num > num_vqs) {
 				iot_opt.num = num_vqs;
 			}
 
@@ -922,6 +982,158 @@ end:
 	return error;
 }
 
+int
+vm_monitor_blkqos(void *arg, char *devargs)
+{
+	char *str, *cp;
+	char *str_slot, *str_opts;
+	int slot;
+	int error = -1;
+	struct pci_vdev *dev;
+	struct virtio_blk *blk;
+
+	/* Extract slot and QoS options from args */
+	str = cp = strdup(devargs);
+	if (!str)
+		return -1;
+
+	str_slot = strsep(&cp, ",");
+	str_opts = strsep(&cp, "");
+
+	if ((str_slot == NULL) || (str_opts == NULL) ||
+			dm_strtoi(str_slot, &str_slot, 10, &slot)) {
+		pr_err("Slot info or QoS options not available!\n");
+		goto end;
+	}
+
+	dev = pci_get_vdev_info(slot);
+	if (dev == NULL) {
+		pr_err("vdev info failed for Slot %d\n!", slot);
+		goto end;
+	}
+
+	if (strstr(dev->name, "virtio-blk") == NULL) {
+		pr_err("virtio-blk only supports QoS: found %s at slot %d\n", dev->name, slot);
+		goto end;
+	}
+
+	blk = dev->arg;
+	if (blk->dummy_bctxt) {
+		pr_err("virtio-blk at slot %d has no backend\n", slot);
+		goto end;
+	}
+
+	error = blockif_set_qos(blk->bc, str_opts);
+	if (error)
+		pr_err("virtio-blk QoS update failed!\n");
+end:
+	free(str);
+	return error;
+}
+
+/*
+ * Format the statistics of one queue of a virtio-blk device into @buf,
+ * @devargs is "<slot>,<queue>".
+ */
+int
+vm_monitor_blkstat(void *arg, char *devargs, char *buf, size_t len)
+{
+	char *str, *cp;
+	char *str_slot, *str_queue;
+	int slot, queue, i, n;
+	int error = -1;
+	struct pci_vdev *dev;
+	struct virtio_blk *blk;
+	struct blockif_stats st;
+
+	str = cp = strdup(devargs);
+	if (!str)
+		return -1;
+
+	str_slot = strsep(&cp, ",");
+	str_queue = strsep(&cp, ",");
+
+	if ((str_slot == NULL) || (str_queue == NULL) ||
+			dm_strtoi(str_slot, &str_slot, 10, &slot) ||
+			dm_strtoi(str_queue, &str_queue, 10, &queue)) {
+		pr_err("Slot or queue info not available!\n");
+		goto end;
+	}
+
+	dev = pci_get_vdev_info(slot);
+	if ((dev == NULL) || (strstr(dev->name, "virtio-blk") == NULL)) {
+		pr_err("No virtio-blk device at slot %d\n", slot);
+		goto end;
+	}
+
+	blk = dev->arg;
+	if (blk->dummy_bctxt || blockif_get_stats(blk->bc, queue, &st))
+		goto end;
+
+	n = snprintf(buf, len, "queue %d: inflight %d, requests %lu, depth", queue, st.inflight, st.nr_reqs);
+	for (i = 0; (i < BLOCKIF_HIST_BUCKETS) && (n < len); i++)
+		n += snprintf(buf + n, len - n, "%c%lu", i ? '/' : ' ', st.depth_hist[i]);
+	if (n < len)
+		n += snprintf(buf + n, len - n, ", latency");
+	for (i = 0; (i < BLOCKIF_HIST_BUCKETS) && (n < len); i++)
+		n += snprintf(buf + n, len - n, "%c%lu", i ? '/' : ' ', st.lat_hist[i]);
+	error = 0;
+end:
+	free(str);
+	return error;
+}
+
+/*
+ * Take or commit a live snapshot of a virtio-blk device, @devargs is
+ * "<slot>,snapshot=<overlay>" or "<slot>,commit".
+ */
+int
+vm_monitor_blksnap(void *arg, char *devargs)
+{
+	char *str, *cp;
+	char *str_slot, *str_cmd;
+	int slot;
+	int error = -1;
+	struct pci_vdev *dev;
+	struct virtio_blk *blk;
+
+	str = cp = strdup(devargs);
+	if (!str)
+		return -1;
+
+	str_slot = strsep(&cp, ",");
+	str_cmd = strsep(&cp, "");
+
+	if ((str_slot == NULL) || (str_cmd == NULL) ||
+			dm_strtoi(str_slot, &str_slot, 10, &slot)) {
+		pr_err("Slot info or snapshot command not available!\n");
+		goto end;
+	}
+
+	dev = pci_get_vdev_info(slot);
+	if ((dev == NULL) || (strstr(dev->name, "virtio-blk") == NULL)) {
+		pr_err("No virtio-blk device at slot %d\n", slot);
+		goto end;
+	}
+
+	blk = dev->arg;
+	if (blk->dummy_bctxt) {
+		pr_err("virtio-blk at slot %d has no backend\n", slot);
+		goto end;
+	}
+
+	if (!strncmp(str_cmd, "snapshot=", strlen("snapshot=")) &&
+			(str_cmd[strlen("snapshot=")] != '\0'))
+		error = blockif_snapshot(blk->bc, str_cmd + strlen("snapshot="));
+	else if (!strcmp(str_cmd, "commit"))
+		error = blockif_commit(blk->bc);
+	else
+		pr_err("Invalid snapshot command \"%s\"\n", str_cmd);
+end:
+	free(str);
+	return error;
+}
+
 struct pci_vdev_ops pci_ops_virtio_blk = {
 	.class_name	= "virtio-blk",
 	.vdev_init	= virtio_blk_init,
@@ -30,6 +30,7 @@
 #include "console.h"
 #include "vga.h"
 #include "atomic.h"
+#include "coalesced_io.h"
 
 /*
  * Queue definitions.
@@ -83,6 +84,10 @@
 #define VIRTIO_GPU_CAP_COMMON_SIZE	0x800
 #define VIRTIO_GPU_CAP_ISR_OFFSET	0x1800
 #define VIRTIO_GPU_CAP_ISR_SIZE	0x800
+/* the VGA screen is checked for changes at 30Hz, or 10Hz after 1s idle */
+#define VIRTIO_GPU_VGA_FRAME_US	33000
+#define VIRTIO_GPU_VGA_IDLE_US	100000
+#define VIRTIO_GPU_VGA_IDLE_FRAMES	30
 
 /*
  * Config space "registers"
@@ -218,6 +223,8 @@ struct virtio_gpu_resource_2d {
 	struct iovec *iov;
 	uint32_t iovcnt;
 	bool blob;
+	/* non-blob resource scanned out from its backing through dma_info */
+	bool zero_copy;
 	struct dma_buf_info *dma_info;
 	LIST_ENTRY(virtio_gpu_resource_2d) link;
 };
@@ -311,6 +318,8 @@ struct virtio_gpu_update_cursor {
  * So it is not mapped as dma-buf.
  */
 #define CURSOR_BLOB_SIZE	(16 * 1024)
+/* udmabuf only takes page aligned pieces of the memfd */
+#define UDMABUF_PAGE_SIZE	4096UL
 /* VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB */
 struct virtio_gpu_resource_create_blob {
 	struct virtio_gpu_ctrl_hdr hdr;
@@ -376,6 +385,7 @@ struct virtio_gpu {
 	int32_t vga_thread_status;
 	uint8_t edid[VIRTIO_GPU_EDID_SIZE];
 	bool is_blob_supported;
+	bool zero_copy_2d;	/* scan 2D resources out of the guest pages */
 	int scanout_num;
 	struct virtio_gpu_scanout *gpu_scanouts;
 };
@@ -396,6 +406,9 @@ static int virtio_gpu_cfgwrite(void *, int, int, uint32_t);
 static void virtio_gpu_neg_features(void *, uint64_t);
 static void virtio_gpu_set_status(void *, uint64_t);
 static void * virtio_gpu_vga_render(void *param);
+static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
+					struct virtio_gpu_mem_entry *entries,
+					int nr_entries);
 
 static struct virtio_ops virtio_gpu_ops = {
 	"virtio-gpu",			/* our name */
@@ -460,10 +473,11 @@ virtio_gpu_reset(void *vdev)
 				pixman_image_unref(r2d->image);
 				r2d->image = NULL;
 			}
-			if (r2d->blob) {
+			if (r2d->blob || r2d->zero_copy) {
 				virtio_gpu_dmabuf_unref(r2d->dma_info);
 				r2d->dma_info = NULL;
 				r2d->blob = false;
+				r2d->zero_copy = false;
 			}
 			LIST_REMOVE(r2d, link);
 			if (r2d->iov) {
@@ -670,7 +684,7 @@ virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_i
 	r2d = virtio_gpu_find_resource_2d(gpu, resource_id);
 	if (r2d) {
 		gpu_scanout->is_active = true;
-		if (r2d->blob) {
+		if (r2d->blob || r2d->zero_copy) {
 			virtio_gpu_dmabuf_ref(r2d->dma_info);
 			gpu_scanout->dma_buf = r2d->dma_info;
 		} else {
@@ -683,6 +697,139 @@ virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_i
 	memcpy(&gpu_scanout->scanout_rect, scan_rect, sizeof(*scan_rect));
 }
 
+/* The formats the display can import from a dmabuf */
+static uint32_t
+virtio_gpu_drm_fourcc(pixman_format_code_t format)
+{
+	switch (format) {
+	case PIXMAN_x8r8g8b8:
+		return DRM_FORMAT_XRGB8888;
+	case PIXMAN_a8r8g8b8:
+		return DRM_FORMAT_ARGB8888;
+	case PIXMAN_x8b8g8r8:
+		return DRM_FORMAT_XBGR8888;
+	case PIXMAN_a8b8g8r8:
+		return DRM_FORMAT_ABGR8888;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Show @r2d on the scanout, from the pixman image or, for a zero-copy
+ * resource, from its dmabuf. The stride of the guest backing is the one
+ * of the pixman image, as transfer_to_host_2d assumes.
+ */
+static void
+virtio_gpu_scanout_set_surface(struct virtio_gpu *gpu, int scanout_id,
+			       struct virtio_gpu_resource_2d *r2d,
+			       struct virtio_gpu_rect *r)
+{
+	struct surface surf;
+	int bytes_pp;
+
+	virtio_gpu_update_scanout(gpu, scanout_id, r2d->resource_id, r);
+	memset(&surf, 0, sizeof(surf));
+	bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
+	surf.x = r->x;
+	surf.y = r->y;
+	surf.width = r->width;
+	surf.height = r->height;
+	if (r2d->zero_copy) {
+		virtio_gpu_dmabuf_ref(r2d->dma_info);
+		surf.stride = r2d->width * bytes_pp;
+		surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
+		surf.dma_info.dmabuf_offset = bytes_pp * surf.x + surf.y * surf.stride;
+		surf.dma_info.surf_fourcc = virtio_gpu_drm_fourcc(r2d->format);
+		surf.surf_type = SURFACE_DMABUF;
+		vdpy_surface_set(gpu->vdpy_handle, scanout_id, &surf);
+		virtio_gpu_dmabuf_unref(r2d->dma_info);
+		return;
+	}
+
+	pixman_image_ref(r2d->image);
+	surf.pixel = pixman_image_get_data(r2d->image);
+	surf.stride = pixman_image_get_stride(r2d->image);
+	surf.surf_format = r2d->format;
+	surf.surf_type = SURFACE_PIXMAN;
+	surf.pixel += bytes_pp * surf.x + surf.y * surf.stride;
+	vdpy_surface_set(gpu->vdpy_handle, scanout_id, &surf);
+	pixman_image_unref(r2d->image);
+}
+
+/*
+ * Let the display import the backing of a 2D resource through a udmabuf,
+ * so transfers no longer copy it into the pixman image. This is enabled by
+ * the zero_copy option and needs the whole image in page aligned pieces of
+ * the hugetlb memfd and a format the display can import; otherwise the
+ * resource keeps the copy path.
+ */
+static void
+virtio_gpu_zero_copy_attach(struct virtio_gpu *gpu,
+			    struct virtio_gpu_resource_2d *r2d,
+			    struct virtio_gpu_mem_entry *entries,
+			    int nr_entries)
+{
+	uint64_t size, len;
+	int i;
+
+	if (!gpu->zero_copy_2d || !virtio_gpu_blob_supported(gpu) ||
+			!vdpy_dmabuf_supported(gpu->vdpy_handle) ||
+			!virtio_gpu_drm_fourcc(r2d->format))
+		return;
+
+	/* cursors are read from the pixman image */
+	size = (uint64_t)r2d->width * r2d->height * 4;
+	if (size <= CURSOR_BLOB_SIZE)
+		return;
+
+	len = 0;
+	for (i = 0; i < nr_entries; i++) {
+		if ((entries[i].addr | entries[i].length) & (UDMABUF_PAGE_SIZE - 1))
+			return;
+		len += entries[i].length;
+	}
+	if (len < size)
+		return;
+
+	r2d->dma_info = virtio_gpu_create_udmabuf(gpu, entries, nr_entries);
+	r2d->zero_copy = (r2d->dma_info != NULL);
+}
+
+/*
+ * Go back to the copy path. The pixman image was left alone while the
+ * display read the backing, so it gets the content of the backing, which
+ * must still be attached: a flush without a new transfer shows the image.
+ */
+static void
+virtio_gpu_zero_copy_detach(struct virtio_gpu_resource_2d *r2d)
+{
+	uint8_t *img_data;
+	size_t size, done, len;
+	int i;
+
+	if (!r2d->zero_copy)
+		return;
+
+	if (r2d->iov) {
+		/* the backing has the stride of the image, see attach */
+		img_data = (uint8_t *)pixman_image_get_data(r2d->image);
+		size = (size_t)pixman_image_get_stride(r2d->image) * r2d->height;
+		for (i = 0, done = 0; (i < r2d->iovcnt) && (done < size); i++) {
+			if (r2d->iov[i].iov_base == NULL)
+				break;
+			len = MIN(r2d->iov[i].iov_len, size - done);
+			memcpy(img_data + done, r2d->iov[i].iov_base, len);
+			done += len;
+		}
+	}
+
+	/* a scanout still showing it holds its own reference */
+	virtio_gpu_dmabuf_unref(r2d->dma_info);
+	r2d->dma_info = NULL;
+	r2d->zero_copy = false;
+}
+
 static void
 virtio_gpu_cmd_resource_create_2d(struct virtio_gpu_command *cmd)
 {
@@ -749,10 +896,11 @@ virtio_gpu_cmd_resource_unref(struct virtio_gpu_command *cmd)
 			pixman_image_unref(r2d->image);
 			r2d->image = NULL;
 		}
-		if (r2d->blob) {
+		if (r2d->blob || r2d->zero_copy) {
 			virtio_gpu_dmabuf_unref(r2d->dma_info);
 			r2d->dma_info = NULL;
 			r2d->blob = false;
+			r2d->zero_copy = false;
 		}
 		LIST_REMOVE(r2d, link);
 		if (r2d->iov) {
@@ -808,6 +956,9 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 			goto exit;
 		}
 
+		/* copies the previous backing, so before it is replaced */
+		virtio_gpu_zero_copy_detach(r2d);
+		free(r2d->iov);
 		r2d->iov = iov;
 		r2d->iovcnt = req.nr_entries;
 		entries = calloc(req.nr_entries, sizeof(struct virtio_gpu_mem_entry));
@@ -828,6 +979,7 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 					entries[i].length);
 			r2d->iov[i].iov_len = entries[i].length;
 		}
+		virtio_gpu_zero_copy_attach(cmd->gpu, r2d, entries, req.nr_entries);
 		free(entries);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
@@ -851,6 +1003,8 @@ virtio_gpu_cmd_resource_detach_backing(struct virtio_gpu_command *cmd)
 	memset(&resp, 0, sizeof(resp));
 
 	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
+	if (r2d)
+		virtio_gpu_zero_copy_detach(r2d);
 	if (r2d && r2d->iov) {
 		free(r2d->iov);
 		r2d->iov = NULL;
@@ -868,10 +1022,8 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 	struct virtio_gpu_set_scanout req;
 	struct virtio_gpu_resource_2d *r2d;
 	struct virtio_gpu_ctrl_hdr resp;
-	struct surface surf;
 	struct virtio_gpu *gpu;
 	struct virtio_gpu_scanout *gpu_scanout;
-	int bytes_pp;
 
 	gpu = cmd->gpu;
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
@@ -905,20 +1057,7 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 				__func__);
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 	} else {
-		virtio_gpu_update_scanout(gpu, req.scanout_id, req.resource_id, &req.r);
-		bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
-		pixman_image_ref(r2d->image);
-		surf.pixel = pixman_image_get_data(r2d->image);
-		surf.x = req.r.x;
-		surf.y = req.r.y;
-		surf.width = req.r.width;
-		surf.height = req.r.height;
-		surf.stride = pixman_image_get_stride(r2d->image);
-		surf.surf_format = r2d->format;
-		surf.surf_type = SURFACE_PIXMAN;
-		surf.pixel += bytes_pp * surf.x + surf.y * surf.stride;
-		vdpy_surface_set(gpu->vdpy_handle, req.scanout_id, &surf);
-		pixman_image_unref(r2d->image);
+		virtio_gpu_scanout_set_surface(gpu, req.scanout_id, r2d, &req.r);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	}
 
@@ -955,7 +1094,8 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 		return;
 	}
 
-	if (r2d->blob) {
+	/* the display reads the guest pages, there is nothing to copy */
+	if (r2d->blob || r2d->zero_copy) {
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
 		return;
@@ -1011,23 +1151,30 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 	memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
 }
 
+/*
+ * Compute in @damage the part of @flush_rect that falls in the scanout,
+ * relative to the scanout origin. Returns false if there is none. The
+ * caller has to release @damage either way.
+ */
 static bool
-virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
-			      int scanout_id,
-			      int resource_id,
-			      struct virtio_gpu_rect *flush_rect)
+virtio_gpu_scanout_damage(struct virtio_gpu *gpu,
+			  int scanout_id,
+			  int resource_id,
+			  struct virtio_gpu_rect *flush_rect,
+			  pixman_region16_t *damage)
 {
 	struct virtio_gpu_scanout *gpu_scanout;
-	pixman_region16_t flush_region, final_region, scanout_region;
+	pixman_region16_t flush_region, scanout_region;
 
 	/* the scanout_id is already checked. So it is ignored in this function */
 	gpu_scanout = gpu->gpu_scanouts + scanout_id;
 
+	pixman_region_init(damage);
+
 	/* if the different resource_id is used, flush can be skipped */
 	if (resource_id != gpu_scanout->resource_id)
 		return false;
 
-	pixman_region_init(&final_region);
 	pixman_region_init_rect(&scanout_region,
 				gpu_scanout->scanout_rect.x,
 				gpu_scanout->scanout_rect.y,
@@ -1037,18 +1184,17 @@ virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
 				flush_rect->x, flush_rect->y,
 				flush_rect->width, flush_rect->height);
 
-	/* Check intersect region to determine whether scanout_region
-	 * needs to be flushed.
+	/* Only the intersection of the scanout and the flushed region
+	 * changed on screen. If it is empty, there is nothing to update.
 	 */
-	pixman_region_intersect(&final_region, &scanout_region, &flush_region);
-
-	/* if intersection_region is empty, it means that the scanout_region is not
-	 * covered by the flushed_region. And it is unnecessary to update
-	 */
-	if (pixman_region_not_empty(&final_region))
-		return true;
-	else
-		return false;
+	pixman_region_intersect(damage, &scanout_region, &flush_region);
+	pixman_region_fini(&scanout_region);
+	pixman_region_fini(&flush_region);
+	pixman_region_translate(damage,
+				-(int)gpu_scanout->scanout_rect.x,
+				-(int)gpu_scanout->scanout_rect.y);
+
+	return pixman_region_not_empty(damage);
 }
 
 static void
@@ -1061,6 +1207,8 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	struct virtio_gpu *gpu;
 	int i;
 	struct virtio_gpu_scanout *gpu_scanout;
+	struct virtio_gpu_rect scanout_rect;
+	pixman_region16_t damage;
 	int bytes_pp;
 
 	gpu = cmd->gpu;
@@ -1079,11 +1227,16 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	if (r2d->blob) {
 		virtio_gpu_dmabuf_ref(r2d->dma_info);
 		for (i = 0; i < gpu->scanout_num; i++) {
-			if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
+			/* the dmabuf is the texture, there is nothing to upload */
+			if (!virtio_gpu_scanout_damage(gpu, i, req.resource_id, &req.r, &damage)) {
+				pixman_region_fini(&damage);
 				continue;
+			}
+			pixman_region_fini(&damage);
 
 			surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
 			surf.surf_type = SURFACE_DMABUF;
+			surf.damage = NULL;
 			vdpy_surface_update(gpu->vdpy_handle, i, &surf);
 		}
 		virtio_gpu_dmabuf_unref(r2d->dma_info);
@@ -1094,10 +1247,28 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	pixman_image_ref(r2d->image);
 	bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
 	for (i = 0; i < gpu->scanout_num; i++) {
-		if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
+		if (!virtio_gpu_scanout_damage(gpu, i, req.resource_id, &req.r, &damage)) {
+			pixman_region_fini(&damage);
 			continue;
+		}
 
 		gpu_scanout = gpu->gpu_scanouts + i;
+		if (gpu_scanout->dma_buf != r2d->dma_info) {
+			/* the backing was replaced since the scanout was set */
+			scanout_rect = gpu_scanout->scanout_rect;
+			virtio_gpu_scanout_set_surface(gpu, i, r2d, &scanout_rect);
+			pixman_region_fini(&damage);
+			continue;
+		}
+		if (r2d->zero_copy) {
+			surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
+			surf.surf_type = SURFACE_DMABUF;
+			surf.damage = NULL;
+			vdpy_surface_update(gpu->vdpy_handle, i, &surf);
+			pixman_region_fini(&damage);
+			continue;
+		}
+
 		surf.pixel = pixman_image_get_data(r2d->image);
 		surf.x = gpu_scanout->scanout_rect.x;
 		surf.y = gpu_scanout->scanout_rect.y;
@@ -1107,7 +1278,10 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 		surf.surf_format = r2d->format;
 		surf.surf_type = SURFACE_PIXMAN;
 		surf.pixel += bytes_pp * surf.x + surf.y * surf.stride;
+		/* only the flushed area is uploaded to the display */
+		surf.damage = &damage;
 		vdpy_surface_update(gpu->vdpy_handle, i, &surf);
+		pixman_region_fini(&damage);
 	}
 	pixman_image_unref(r2d->image);
 
@@ -1138,7 +1312,8 @@ static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
 					int nr_entries)
 {
 	struct udmabuf_create_list *list;
-	int udmabuf, i, dmabuf_fd;
+	struct udmabuf_create_item *item;
+	int udmabuf, i, count, dmabuf_fd;
 	struct vm_mem_region ret_region;
 	bool fail_flag;
 	struct dma_buf_info *info;
@@ -1149,6 +1324,7 @@ static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
 	}
 
 	fail_flag = false;
+	count = 0;
 	list = malloc(sizeof(*list) + sizeof(struct udmabuf_create_item) * nr_entries);
 	info = malloc(sizeof(*info));
 	if ((info == NULL) || (list == NULL)) {
@@ -1165,11 +1341,19 @@ static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
 					__func__, entries[i].addr);
 			break;
 		}
-		list->list[i].memfd  = ret_region.fd;
-		list->list[i].offset = ret_region.fd_offset;
-		list->list[i].size   = entries[i].length;
+		/* pages contiguous in the memfd take a single item */
+		item = count ? &list->list[count - 1] : NULL;
+		if (item && (item->memfd == ret_region.fd) &&
+				(item->offset + item->size == ret_region.fd_offset)) {
+			item->size += entries[i].length;
+			continue;
+		}
+		item = &list->list[count++];
+		item->memfd  = ret_region.fd;
+		item->offset = ret_region.fd_offset;
+		item->size   = entries[i].length;
 	}
-	list->count = nr_entries;
+	list->count = count;
 	list->flags = UDMABUF_FLAGS_CLOEXEC;
 	if (fail_flag) {
 		dmabuf_fd = -1;
@@ -1596,9 +1780,17 @@ static void
 virtio_gpu_vga_bh(void *param)
 {
 	struct virtio_gpu *gpu;
+	pixman_region16_t damage;
 
 	gpu = (struct virtio_gpu*)param;
 
+	pthread_mutex_lock(&gpu->vga.damage_mtx);
+	pixman_region_init(&damage);
+	pixman_region_copy(&damage, &gpu->vga.damage);
+	pixman_region_clear(&gpu->vga.damage);
+	pthread_mutex_unlock(&gpu->vga.damage_mtx);
+	gpu->vga.surf.damage = &damage;
+
 	if ((gpu->vga.surf.width != gpu->vga.gc->gc_image->width) ||
 		(gpu->vga.surf.height != gpu->vga.gc->gc_image->height)) {
 		gpu->vga.surf.width = gpu->vga.gc->gc_image->width;
@@ -1608,33 +1800,61 @@ virtio_gpu_vga_bh(void *param)
 		gpu->vga.surf.surf_format = PIXMAN_a8r8g8b8;
 		gpu->vga.surf.surf_type = SURFACE_PIXMAN;
 		vdpy_surface_set(gpu->vdpy_handle, 0, &gpu->vga.surf);
+		/* the new surface has to be displayed as a whole */
+		gpu->vga.surf.damage = NULL;
 	}
 
-	vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+	if (gpu->vga.surf.width && gpu->vga.surf.height)
+		vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+	gpu->vga.surf.damage = NULL;
+	pixman_region_fini(&damage);
 }
 
+/*
+ * Only the scanlines the guest changed are rendered and displayed, an
+ * unchanged screen costs one comparison per frame and nothing else.
+ */
 static void *
 virtio_gpu_vga_render(void *param)
 {
 	struct virtio_gpu *gpu;
+	pixman_region16_t damage;
+	int idle;
 
 	gpu = (struct virtio_gpu*)param;
 	gpu->vga.surf.width = 0;
 	gpu->vga.surf.stride = 0;
-	/* The below logic needs to be refined */
+	/* the display may show something else since the last run */
+	vga_invalidate(&gpu->vga);
+	pixman_region_init(&damage);
+	idle = 0;
 	while(gpu->vga.enable) {
+		/* writes to the VGA planes may still be in the coalesced I/O ring */
+		coalesced_io_drain(gpu->base.dev->vmctx);
 		if ((gpu->vga.gc->gc_image->vgamode) && (gpu->vga.dev != NULL)) {
-			vga_render(gpu->vga.gc, gpu->vga.dev);
-			break;
+			vga_render(gpu->vga.gc, gpu->vga.dev, &damage);
+		} else {
+			if(gpu->vga.gc->gc_image->width != gpu->vga.vberegs.xres ||
+			   gpu->vga.gc->gc_image->height != gpu->vga.vberegs.yres) {
+				gc_resize(gpu->vga.gc, gpu->vga.vberegs.xres, gpu->vga.vberegs.yres);
+			}
+			vga_vbe_damage(&gpu->vga, &damage);
 		}
 
-		if(gpu->vga.gc->gc_image->width != gpu->vga.vberegs.xres ||
-		   gpu->vga.gc->gc_image->height != gpu->vga.vberegs.yres) {
-			gc_resize(gpu->vga.gc, gpu->vga.vberegs.xres, gpu->vga.vberegs.yres);
+		if (pixman_region_not_empty(&damage)) {
+			pthread_mutex_lock(&gpu->vga.damage_mtx);
+			pixman_region_union(&gpu->vga.damage, &gpu->vga.damage, &damage);
+			pthread_mutex_unlock(&gpu->vga.damage_mtx);
+			pixman_region_clear(&damage);
+			vdpy_submit_bh(gpu->vdpy_handle, &gpu->vga_bh);
+			idle = 0;
+		} else if (idle < VIRTIO_GPU_VGA_IDLE_FRAMES) {
+			idle++;
 		}
-		vdpy_submit_bh(gpu->vdpy_handle, &gpu->vga_bh);
-		usleep(33000);
+		usleep((idle < VIRTIO_GPU_VGA_IDLE_FRAMES) ?
+				VIRTIO_GPU_VGA_FRAME_US : VIRTIO_GPU_VGA_IDLE_US);
 	}
+	pixman_region_fini(&damage);
 
 	pthread_mutex_lock(&gpu->vga_thread_mtx);
 	atomic_store(&gpu->vga_thread_status, VGA_THREAD_EOL);
@@ -1653,6 +1873,7 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	struct virtio_pci_cap cap;
 	struct virtio_pci_notify_cap notify;
 	struct virtio_pci_cfg_cap cfg;
+	char *str, *stropts, *cp;
 
 	if (virtio_gpu_device_cnt) {
 		pr_err("%s: only 1 virtio-gpu device can be created.\n", __func__);
@@ -1745,6 +1966,17 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			gpu->base.device_caps |= (1UL << VIRTIO_GPU_F_RESOURCE_BLOB);
 	}
 
+	/* the display options are parsed by vdpy_parse_cmd_option() */
+	cp = stropts = opts ? strdup(opts) : NULL;
+	while ((str = strsep(&cp, ",")) != NULL) {
+		if (!strcasecmp(str, "zero_copy"))
+			gpu->zero_copy_2d = true;
+	}
+	free(stropts);
+	if (gpu->zero_copy_2d && !gpu->is_blob_supported)
+		pr_info("%s: zero_copy needs udmabuf, 2D resources are copied.\n",
+			__func__);
+
 	/* set queue size */
 	gpu->vq[VIRTIO_GPU_CONTROLQ].qsize = VIRTIO_GPU_RINGSZ;
 	gpu->vq[VIRTIO_GPU_CONTROLQ].notify = virtio_gpu_notify_controlq;
@@ -1852,6 +2084,8 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 
 	pthread_mutex_init(&gpu->vga_thread_mtx, NULL);
+	pthread_mutex_init(&gpu->vga.damage_mtx, NULL);
+	pixman_region_init(&gpu->vga.damage);
 	/* VGA Compablility */
 	gpu->vga.enable = true;
 	gpu->vga.surf.width = 0;
@@ -1911,6 +2145,10 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	gpu->gpu_scanouts = NULL;
 
 	pthread_mutex_destroy(&gpu->vga_thread_mtx);
+	pthread_mutex_destroy(&gpu->vga.damage_mtx);
+	pixman_region_fini(&gpu->vga.damage);
+	free(gpu->vga.shadow);
+	gpu->vga.shadow = NULL;
 	while (LIST_FIRST(&gpu->r2d_list)) {
 		r2d = LIST_FIRST(&gpu->r2d_list);
 		if (r2d) {
@@ -1918,10 +2156,11 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				pixman_image_unref(r2d->image);
 				r2d->image = NULL;
 			}
-			if (r2d->blob) {
+			if (r2d->blob || r2d->zero_copy) {
 				virtio_gpu_dmabuf_unref(r2d->dma_info);
 				r2d->dma_info = NULL;
 				r2d->blob = false;
+				r2d->zero_copy = false;
 			}
 			LIST_REMOVE(r2d, link);
 			if (r2d->iov) {
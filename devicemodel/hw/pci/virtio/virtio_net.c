@@ -44,6 +44,7 @@
 #include <linux/if_tun.h>
 #include <sys/socket.h>
 #include <linux/vhost.h>
+#include <liburing.h>
 
 #include "dm.h"
 #include "pci_core.h"
@@ -51,9 +52,21 @@
 #include "virtio.h"
 #include "vhost.h"
 #include "dm_string.h"
+#include "iothread.h"
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_BATCH	16	/* chains fetched/released at once */
+#define VIRTIO_NET_RX_CHAINS	64	/* chains gathered for merged rx bufs */
+#define VIRTIO_NET_MRG_SEGS	64	/* segs per merged rx buffer */
+#define VIRTIO_NET_RX_IOV	1024	/* segs per tap read, UIO_MAXIOV */
+
+/*
+ * Largest packets the tap device hands over: a jumbo frame with a VLAN
+ * tag, or a GSO packet when the guest takes those.
+ */
+#define VIRTIO_NET_MAX_FRAME	(9000 + 14 + 4)
+#define VIRTIO_NET_MAX_GSO	(65535 + 14 + 4)
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -77,11 +90,31 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple rx/tx queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
 	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC))
 
+/*
+ * Offloads offered when the tap device passes the virtio-net header
+ * through (IFF_VNET_HDR); UFO only if the tap device still supports it.
+ */
+#define VIRTIO_NET_S_OFFLOADCAPS   \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_HOST_ECN)
+
+#define VIRTIO_NET_S_GUEST_OFFLOADCAPS \
+	(VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_TSO4 | \
+	VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN)
+
+#define VIRTIO_NET_S_UFOCAPS       \
+	(VIRTIO_NET_F_HOST_UFO | VIRTIO_NET_F_GUEST_UFO)
+
+#define VIRTIO_NET_F_GUEST_GSO     \
+	(VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+	VIRTIO_NET_F_GUEST_UFO)
+
 #define VIRTIO_NET_S_VHOSTCAPS      \
 	((1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
 	(1 << VIRTIO_RING_F_EVENT_IDX) | VIRTIO_NET_F_MRG_RXBUF | \
@@ -96,16 +129,35 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions.  Queues 2*N and 2*N+1 are the rx and tx queues of
+ * queue pair N.  With multiqueue, the control queue follows the last
+ * pair.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_PAIR_VQS	2
+
+#define VIRTIO_NET_MAX_PAIRS	16
+
+/*
+ * Control queue commands
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+
+#define VIRTIO_NET_CTRL_MAXSEGS	4
 
 /*
  * Fixed network header size
@@ -132,50 +184,82 @@ static int virtio_net_debug;
  */
 struct vhost_net {
 	struct vhost_dev vdev;
-	struct vhost_vq vqs[VIRTIO_NET_MAXQ - 1];
+	struct vhost_vq vqs[VIRTIO_NET_PAIR_VQS];
 	int tapfd;
 	bool vhost_started;
 };
 
+struct virtio_net;
+
+/*
+ * Per-queue-pair struct: one tap queue and the rx/tx virtqueues
+ * serving it.
+ */
+struct virtio_net_pair {
+	struct virtio_net *net;
+	int		idx;
+
+	int		tapfd;
+	struct mevent	*mevp;
+	struct iothread_mevent iomvt;	/* tapfd on an iothread */
+	struct iothread_ctx *ioctx;
+
+	int		rx_ready;
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+
+	struct io_uring	tx_ring;	/* batched tap writes */
+	bool		tx_uring;
+	int		tx_queued;	/* writes not submitted yet */
+	struct io_uring_sqe *tx_last;	/* last write queued, not linked yet */
+	uint64_t	tx_packets;	/* dropped by the null backend */
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_vq_info *queues;
+	struct virtio_ops ops;
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
-
-	int		tapfd;
 
-	int		rx_ready;
+	struct virtio_net_pair *pairs;
+	int		max_pairs;	/* pairs offered to the guest */
+	int		curr_pairs;	/* pairs enabled by the guest */
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	closing;	/* stop the tx i/o threads */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	bool		tap_vnet_hdr;	/* tap passes the header through */
+	uint64_t	tap_caps;	/* offloads the tap device supports */
+
+	void (*virtio_net_rx)(struct virtio_net_pair *pair);
+	void (*virtio_net_tx)(struct virtio_net_pair *pair, struct iovec *iov,
 			     int iovcnt, int len);
+	/* optional: complete the packets queued by virtio_net_tx */
+	void (*virtio_net_tx_flush)(struct virtio_net_pair *pair);
 
 	struct vhost_net *vhost_net;
 	bool		use_vhost;
 };
 
+#define VIRTIO_NET_PAIR(net, vq)	(&(net)->pairs[(vq)->num / VIRTIO_NET_PAIR_VQS])
+
 static void virtio_net_reset(void *vdev);
-static void virtio_net_tx_stop(struct virtio_net *net);
+static void virtio_net_tx_stop(struct virtio_net_pair *pair);
 static int virtio_net_cfgread(void *vdev, int offset, int size,
 	uint32_t *retval);
 static int virtio_net_cfgwrite(void *vdev, int offset, int size,
@@ -191,7 +275,7 @@ static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	VIRTIO_NET_PAIR_VQS,		/* one pair; adjusted per device */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -268,36 +352,97 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_pair *pair)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	while (pair->tx_in_progress) {
+		pthread_mutex_unlock(&pair->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&pair->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_pair *pair)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&pair->rx_mtx);
+	while (pair->rx_in_progress) {
+		pthread_mutex_unlock(&pair->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&pair->rx_mtx);
+	}
+	pthread_mutex_unlock(&pair->rx_mtx);
+}
+
+/*
+ * Attach the tap queues of the first "pairs" queue pairs and detach the
+ * others, so that the host only steers packets to queues the guest is
+ * using.
+ */
+static void
+virtio_net_set_pairs(struct virtio_net *net, int pairs)
+{
+	struct ifreq ifr;
+	int i;
+
+	for (i = 1; i < net->max_pairs; i++) {
+		if (net->pairs[i].tapfd < 0)
+			continue;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = (i < pairs) ? IFF_ATTACH_QUEUE :
+			IFF_DETACH_QUEUE;
+		if (ioctl(net->pairs[i].tapfd, TUNSETQUEUE, &ifr) < 0)
+			WPRINTF(("vtnet: %s tap queue %d failed: %d\n",
+				(i < pairs) ? "attach" : "detach", i, errno));
+	}
+	net->curr_pairs = pairs;
+}
+
+/*
+ * Make the tap device use the header size in effect and hand over only
+ * the offloaded packets the guest has accepted.
+ */
+static void
+virtio_net_tap_set_offload(struct virtio_net *net)
+{
+	unsigned int offload = 0;
+	int i;
+
+	if (!net->tap_vnet_hdr)
+		return;
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
+		if (net->features & VIRTIO_NET_F_GUEST_ECN)
+			offload |= TUN_F_TSO_ECN;
+		if (net->features & VIRTIO_NET_F_GUEST_UFO)
+			offload |= TUN_F_UFO;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		if (net->pairs[i].tapfd < 0)
+			continue;
+		if (ioctl(net->pairs[i].tapfd, TUNSETVNETHDRSZ,
+				&net->rx_vhdrlen) < 0 ||
+		    ioctl(net->pairs[i].tapfd, TUNSETOFFLOAD, offload) < 0)
+			WPRINTF(("vtnet: tap queue %d offload setup failed: %d\n",
+				i, errno));
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -307,12 +452,20 @@ virtio_net_reset(void *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_pairs; i++) {
+		virtio_net_txwait(&net->pairs[i]);
+		virtio_net_rxwait(&net->pairs[i]);
+		net->pairs[i].rx_ready = 0;
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->features = 0;
+	virtio_net_tap_set_offload(net);
+
+	/* only the first pair is in use until the guest asks for more */
+	if (net->curr_pairs != 1)
+		virtio_net_set_pairs(net, 1);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
@@ -325,31 +478,118 @@ virtio_net_reset(void *vdev)
  * Send signal to tx I/O thread and wait till it exits
  */
 static void
-virtio_net_tx_stop(struct virtio_net *net)
+virtio_net_tx_stop(struct virtio_net_pair *pair)
 {
 	void *jval;
 
-	pthread_mutex_lock(&net->tx_mtx);
-	net->closing = 1;
-	pthread_cond_broadcast(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	/* tx is handled on an iothread, no thread of our own */
+	if (!pair->tx_tid)
+		return;
 
-	pthread_join(net->tx_tid, &jval);
+	pthread_mutex_lock(&pair->tx_mtx);
+	pair->net->closing = 1;
+	pthread_cond_broadcast(&pair->tx_cond);
+	pthread_mutex_unlock(&pair->tx_mtx);
+
+	pthread_join(pair->tx_tid, &jval);
+	pair->tx_tid = 0;
+}
+
+/*
+ * Skip the virtio-net header at the start of a chain
+ */
+static inline struct iovec *
+iov_trim_hdr(struct iovec *iov, int *niov, int tlen)
+{
+	struct iovec *riov;
+
+	/* XXX short-cut: assume first segment is >= tlen */
+	if (iov[0].iov_len < tlen) {
+		WPRINTF(("vtnet: iov_trim_hdr: iov_len=%lu, tlen=%d\n", iov[0].iov_len, tlen));
+		return NULL;
+	}
+
+	iov[0].iov_len -= tlen;
+	if (iov[0].iov_len == 0) {
+		if (*niov <= 1) {
+			WPRINTF(("vtnet: iov_trim_hdr: *niov=%d\n", *niov));
+			return NULL;
+		}
+		*niov -= 1;
+		riov = &iov[1];
+	} else {
+		iov[0].iov_base = (void *)((uintptr_t)iov[0].iov_base + tlen);
+		riov = &iov[0];
+	}
+
+	return riov;
+}
+
+/*
+ * Submit the tap writes queued for a batch of chains with one system
+ * call and wait for them, as the chains are released afterwards.  The
+ * writes are hard-linked by virtio_net_tap_tx(), so that the packets
+ * reach the tap device in order even if the kernel punts one of them to
+ * a worker, and a failed write does not cancel the following ones.
+ */
+static void
+virtio_net_tap_tx_flush(struct virtio_net_pair *pair)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	if (!pair->tx_queued)
+		return;
+
+	pair->tx_last = NULL;
+	ret = io_uring_submit_and_wait(&pair->tx_ring, pair->tx_queued);
+	if (ret < 0) {
+		/*
+		 * The writes were not submitted: drop them along with the
+		 * ring and go on with writev().
+		 */
+		WPRINTF(("vtnet: tap queue %d submit failed: %d\n",
+			pair->idx, ret));
+		io_uring_queue_exit(&pair->tx_ring);
+		pair->tx_uring = false;
+		pair->tx_queued = 0;
+		return;
+	}
+
+	while (pair->tx_queued > 0) {
+		if (io_uring_wait_cqe(&pair->tx_ring, &cqe) < 0)
+			break;
+		if (cqe->res < 0)
+			DPRINTF(("vtnet: tap write failed: %d\n", cqe->res));
+		io_uring_cqe_seen(&pair->tx_ring, cqe);
+		pair->tx_queued--;
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_pair *pair, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
+	struct io_uring_sqe *sqe;
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (pair->tapfd == -1)
 		return;
 
+	/*
+	 * The header goes to the tap device as is with IFF_VNET_HDR,
+	 * otherwise it is stripped.
+	 */
+	if (!pair->net->tap_vnet_hdr) {
+		iov = iov_trim_hdr(iov, &iovcnt, pair->net->rx_vhdrlen);
+		if (iov == NULL)
+			return;
+	}
+
 	/*
 	 * If the length is < 60, pad out to that and add the
 	 * extra zero'd segment to the iov. It is guaranteed that
@@ -360,60 +600,80 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+
+	/* queue the write for virtio_net_tap_tx_flush() */
+	if (pair->tx_uring) {
+		sqe = io_uring_get_sqe(&pair->tx_ring);
+		if (sqe == NULL) {
+			virtio_net_tap_tx_flush(pair);
+			if (pair->tx_uring)
+				sqe = io_uring_get_sqe(&pair->tx_ring);
+		}
+		if (sqe) {
+			io_uring_prep_writev(sqe, pair->tapfd, iov, iovcnt, 0);
+			/* chain it after the previous write of the batch */
+			if (pair->tx_last)
+				io_uring_sqe_set_flags(pair->tx_last, IOSQE_IO_HARDLINK);
+			pair->tx_last = sqe;
+			pair->tx_queued++;
+			return;
+		}
+	}
+
+	ret = writev(pair->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
+/*
+ * The null backend drops whatever the guest sends and never receives,
+ * so the transmit path can be measured without a NIC.
+ */
+static void
+virtio_net_null_tx(struct virtio_net_pair *pair, struct iovec *iov,
+		   int iovcnt, int len)
+{
+	pair->tx_packets++;
+}
+
 /*
  *  Called when there is read activity on the tap file descriptor.
- * Each buffer posted by the guest is assumed to be able to contain
- * an entire ethernet frame + rx header.
+ * Without merged rx bufs, each buffer posted by the guest is assumed to
+ * be able to contain an entire ethernet frame + rx header; with them a
+ * packet is spread over as many buffers as it needs.
  *  MP note: the dummybuf is only used for discarding frames, so there
  * is no need for it to be per-vtnet or locked.
  */
 static uint8_t dummybuf[2048];
 
-static inline struct iovec *
-rx_iov_trim(struct iovec *iov, int *niov, int tlen)
+/* Release the first nchains chains of a batch, in order */
+static void
+virtio_net_relchains(struct virtio_vq_info *vq, struct vq_chain *chains,
+		     int nchains)
 {
-	struct iovec *riov;
-
-	/* XXX short-cut: assume first segment is >= tlen */
-	if (iov[0].iov_len < tlen) {
-		WPRINTF(("vtnet: rx_iov_trim: iov_len=%lu, tlen=%d\n", iov[0].iov_len, tlen));
-		return NULL;
-	}
-
-	iov[0].iov_len -= tlen;
-	if (iov[0].iov_len == 0) {
-		if (*niov <= 1) {
-			WPRINTF(("vtnet: rx_iov_trim: *niov=%d\n", *niov));
-			return NULL;
-		}
-		*niov -= 1;
-		riov = &iov[1];
-	} else {
-		iov[0].iov_base = (void *)((uintptr_t)iov[0].iov_base + tlen);
-		riov = &iov[0];
-	}
+	int i;
 
-	return riov;
+	for (i = 0; i < nchains; i++)
+		vq_relchain(vq, chains[i].idx, chains[i].len);
 }
 
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_pair *pair)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct iovec iov[VIRTIO_NET_BATCH * VIRTIO_NET_MAXSEGS];
+	struct iovec riov[VIRTIO_NET_RX_IOV], *tiov;
+	struct vq_chain chains[VIRTIO_NET_RX_CHAINS];
+	size_t clen[VIRTIO_NET_RX_CHAINS];
+	struct virtio_net *net = pair->net;
+	struct virtio_net_rxhdr *vrxh;
 	struct virtio_vq_info *vq;
-	void *vrx;
-	int len, n;
-	uint16_t idx;
-	ssize_t ret;
+	int n, i, j, k, nbufs, nchains, max_chains, segs;
+	size_t need, avail, rem;
+	ssize_t len, ret;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	if (net->tapfd == -1) {
+	if (pair->tapfd == -1) {
 		WPRINTF(("vtnet: tapfd == -1\n"));
 		return;
 	}
@@ -422,11 +682,11 @@ virtio_net_tap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!pair->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(pair->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		return;
@@ -435,137 +695,287 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = &net->queues[pair->idx * VIRTIO_NET_PAIR_VQS + VIRTIO_NET_RXQ];
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(pair->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		vq_endchains(vq, 1);
 		return;
 	}
 
+	if (net->rx_merge) {
+		max_chains = VIRTIO_NET_RX_CHAINS;
+		segs = VIRTIO_NET_MRG_SEGS;
+		need = net->rx_vhdrlen + ((net->features & VIRTIO_NET_F_GUEST_GSO) ?
+			VIRTIO_NET_MAX_GSO : VIRTIO_NET_MAX_FRAME);
+	} else {
+		max_chains = VIRTIO_NET_BATCH;
+		segs = VIRTIO_NET_MAXSEGS;
+		need = 0;	/* one chain per packet */
+	}
+
 	do {
 		/*
-		 * Get descriptor chain.
+		 * Get a batch of descriptor chains.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-			WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
+		nchains = vq_getchains_batch(vq, chains, max_chains, iov, segs,
+				NULL);
+		if (nchains < 1) {
+			WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchains_batch = %d\n",
+				nchains));
 			return;
 		}
-		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
-		 */
-		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-		if (riov == NULL)
-			return;
 
-		len = readv(net->tapfd, riov, n);
+		for (i = 0; i < nchains; i += nbufs) {
+			/*
+			 * Gather the chains the next packet may land in,
+			 * enough for the largest one the guest takes.
+			 */
+			n = 0;
+			avail = 0;
+			k = i;
+			do {
+				if (chains[k].n < 1 || chains[k].n > segs ||
+				    n + chains[k].n > VIRTIO_NET_RX_IOV)
+					break;
+				memcpy(&riov[n], chains[k].iov,
+				       chains[k].n * sizeof(struct iovec));
+				clen[k] = 0;
+				for (j = 0; j < chains[k].n; j++)
+					clen[k] += chains[k].iov[j].iov_len;
+				n += chains[k].n;
+				avail += clen[k];
+				k++;
+			} while (k < nchains && avail < need);
+
+			if (k == i || chains[i].iov[0].iov_len < net->rx_vhdrlen) {
+				WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n",
+					chains[i].n));
+				goto out;
+			}
 
-		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
-			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
+			 * The batch ran out for a large packet but the ring
+			 * may hold more: start the next batch with these.
 			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-			return;
-		}
+			if (avail < need && k == nchains && i > 0 &&
+			    nchains == max_chains) {
+				vq_retchains_batch(vq, &chains[i], nchains - i);
+				nchains = i;
+				break;
+			}
 
-		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+			/*
+			 * With IFF_VNET_HDR the tap device fills in the header,
+			 * otherwise the packet goes right after it.
+			 */
+			tiov = riov;
+			if (!net->tap_vnet_hdr) {
+				tiov = iov_trim_hdr(riov, &n, net->rx_vhdrlen);
+				if (tiov == NULL)
+					goto out;
+			}
+
+			len = readv(pair->tapfd, tiov, n);
+
+			if (len < 0 && errno == EWOULDBLOCK) {
+				/*
+				 * No more packets, but still some avail ring
+				 * entries.  Hand back the unused chains and
+				 * interrupt if needed/appropriate.
+				 */
+				vq_retchains_batch(vq, &chains[i], nchains - i);
+				virtio_net_relchains(vq, chains, i);
+				vq_endchains(vq, 0);
+				return;
+			}
 
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+			if (len < 0) {
+				/* hand the chain back empty and stop */
+				WPRINTF(("vtnet: tap read failed: %d\n", errno));
+				chains[i].len = 0;
+				vq_retchains_batch(vq, &chains[i + 1],
+						   nchains - i - 1);
+				virtio_net_relchains(vq, chains, i + 1);
+				vq_endchains(vq, 0);
+				return;
+			}
 
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+			if (!net->tap_vnet_hdr) {
+				/*
+				 * The only valid field in the rx packet header
+				 * is the number of buffers if merged rx bufs
+				 * were negotiated.
+				 */
+				memset(chains[i].iov[0].iov_base, 0,
+				       net->rx_vhdrlen);
+				len += net->rx_vhdrlen;
+			}
+
+			/*
+			 * Fill the gathered chains in order; the ones left
+			 * over take the next packet.
+			 */
+			rem = len;
+			nbufs = 0;
+			do {
+				chains[i + nbufs].len = (rem < clen[i + nbufs]) ?
+					rem : clen[i + nbufs];
+				rem -= chains[i + nbufs].len;
+				nbufs++;
+			} while (rem > 0 && i + nbufs < k);
+
+			if (net->rx_merge) {
+				vrxh = chains[i].iov[0].iov_base;
+				vrxh->vrh_bufs = nbufs;
+			}
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release this batch and handle more chains.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		virtio_net_relchains(vq, chains, nchains);
 	} while (vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
+	return;
+
+out:
+	/*
+	 * The bad chain stays consumed, as with vq_getchain(); the ones
+	 * fetched after it go back to the ring.
+	 */
+	vq_retchains_batch(vq, &chains[i + 1], nchains - i - 1);
+	virtio_net_relchains(vq, chains, i);
+	vq_endchains(vq, 0);
 }
 
 static void
-virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+virtio_net_rx_run(void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_pair *pair = param;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&pair->rx_mtx);
+	pair->rx_in_progress = 1;
+	pair->net->virtio_net_rx(pair);
+	pair->rx_in_progress = 0;
+	pthread_mutex_unlock(&pair->rx_mtx);
+}
 
+static void
+virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+{
+	virtio_net_rx_run(param);
 }
 
 static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_pair *pair = VIRTIO_NET_PAIR(net, vq);
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		if (vq->used != NULL) {
-			vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		}
+	if (pair->rx_ready == 0) {
+		pair->rx_ready = 1;
+		vq_set_used_ring_flags(&net->base, vq);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_proctx(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
+	struct virtio_net *net = pair->net;
+	/* one spare iov per chain for virtio_net_tap_tx() padding */
+	struct iovec iov[VIRTIO_NET_BATCH][VIRTIO_NET_MAXSEGS + 1], *ciov;
+	struct vq_chain chains[VIRTIO_NET_BATCH];
+	int i, j, n, nchains;
 	int plen, tlen;
-	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain a batch of descriptor chains.  Each starts with the
+	 * header, so we need two lengths: packet length and transfer
+	 * length.
 	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-		WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", n));
+	nchains = vq_getchains_batch(vq, chains, VIRTIO_NET_BATCH,
+			&iov[0][0], VIRTIO_NET_MAXSEGS + 1, NULL);
+	if (nchains < 1) {
+		WPRINTF(("vtnet: virtio_net_proctx: vq_getchains_batch = %d\n",
+			nchains));
 		return;
 	}
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
+
+	for (i = 0; i < nchains; i++) {
+		n = chains[i].n;
+		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", n));
+			vq_retchains_batch(vq, &chains[i + 1], nchains - i - 1);
+			break;
+		}
+		ciov = chains[i].iov;
+		tlen = 0;
+		for (j = 0; j < n; j++)
+			tlen += ciov[j].iov_len;
+		plen = tlen - net->rx_vhdrlen;
+
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
+		net->virtio_net_tx(pair, ciov, n, plen);
+		chains[i].len = tlen;
 	}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	/* the packets must be out before their chains are released */
+	if (net->virtio_net_tx_flush)
+		net->virtio_net_tx_flush(pair);
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	/* chains are processed, release them with their tlen */
+	virtio_net_relchains(vq, chains, i);
+}
+
+/*
+ * Process the tx queue of a pair in the calling iothread, which owns
+ * the queue's kick fd.
+ */
+static void
+virtio_net_tx_iothread(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = pair->net;
+
+	pthread_mutex_lock(&pair->tx_mtx);
+	pair->tx_in_progress = 1;
+	pthread_mutex_unlock(&pair->tx_mtx);
+
+	/*
+	 * As in virtio-blk, check the ring again after notifications
+	 * are re-enabled so a request posted in between is not lost.
+	 */
+	do {
+		vq_set_used_ring_flags(&net->base, vq);
+		mb();
+		while (!net->resetting && vq_has_descs(vq))
+			virtio_net_proctx(pair, vq);
+		vq_endchains(vq, 1);
+
+		vq_clear_used_ring_flags(&net->base, vq);
+		mb();
+	} while (!net->resetting && vq_has_descs(vq));
+
+	pthread_mutex_lock(&pair->tx_mtx);
+	pair->tx_in_progress = 0;
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_pair *pair = VIRTIO_NET_PAIR(net, vq);
 
 	/*
 	 * Any ring entries to process?
@@ -573,12 +983,17 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 	if (!vq_has_descs(vq))
 		return;
 
+	if (!pair->tx_tid) {
+		virtio_net_tx_iothread(pair, vq);
+		return;
+	}
+
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	vq_set_used_ring_flags(&net->base, vq);
+	if (pair->tx_in_progress == 0)
+		pthread_cond_signal(&pair->tx_cond);
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 /*
@@ -587,27 +1002,30 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
+	struct virtio_net_pair *pair = param;
+	struct virtio_net *net = pair->net;
+	struct virtio_vq_info *vq;
+
+	vq = &net->queues[pair->idx * VIRTIO_NET_PAIR_VQS + VIRTIO_NET_TXQ];
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
 
 	while (!net->closing && !vq_ring_ready(vq))
-		pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		pthread_cond_wait(&pair->tx_cond, &pair->tx_mtx);
 
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&pair->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
-		net->tx_in_progress = 0;
+		pair->tx_in_progress = 0;
 
 		/*
 		 * Checking the avail ring here serves two purposes:
@@ -621,18 +1039,18 @@ virtio_net_tx_thread(void *param)
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			pthread_cond_wait(&pair->tx_cond, &pair->tx_mtx);
 
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&pair->tx_mtx);
 				return NULL;
 			}
 		}
 
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_set_used_ring_flags(&net->base, vq);
+		pair->tx_in_progress = 1;
+		pthread_mutex_unlock(&pair->tx_mtx);
 
 		do {
 			/*
@@ -640,7 +1058,7 @@ virtio_net_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
-			virtio_net_proctx(net, vq);
+			virtio_net_proctx(pair, vq);
 		} while (vq_has_descs(vq));
 
 		/*
@@ -648,17 +1066,78 @@ virtio_net_tx_thread(void *param)
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&pair->tx_mtx);
 	}
 }
 
-#ifdef notyet
+static uint8_t
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd,
+		   struct iovec *iov, int n)
+{
+	uint16_t pairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+	    (net->features & VIRTIO_NET_F_MQ) == 0 ||
+	    n < 1 || iov[0].iov_len < sizeof(pairs))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&pairs, iov[0].iov_base, sizeof(pairs));
+	if (pairs < 1 || pairs > net->max_pairs) {
+		WPRINTF(("vtnet: invalid queue pairs %u\n", pairs));
+		return VIRTIO_NET_ERR;
+	}
+
+	DPRINTF(("vtnet: %u queue pairs enabled\n", pairs));
+	virtio_net_set_pairs(net, pairs);
+	return VIRTIO_NET_OK;
+}
+
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct iovec iov[VIRTIO_NET_CTRL_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_CTRL_MAXSEGS];
+	struct virtio_net_ctrl_hdr *hdr;
+	uint8_t *ack, status;
+	uint16_t idx;
+	int n;
+
+	while (vq_has_descs(vq)) {
+		/*
+		 * A command is a read-only class/cmd header, optional
+		 * read-only data and a writable ack byte.
+		 */
+		idx = vq->qsize;
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_CTRL_MAXSEGS, flags);
+		if (n < 2 || iov[0].iov_len < sizeof(*hdr) ||
+		    iov[n - 1].iov_len < 1 ||
+		    (flags[n - 1] & VRING_DESC_F_WRITE) == 0) {
+			WPRINTF(("vtnet: invalid control command, n = %d\n", n));
+			if (idx < vq->qsize)
+				vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		hdr = iov[0].iov_base;
+		ack = iov[n - 1].iov_base;
+		switch (hdr->class) {
+		case VIRTIO_NET_CTRL_MQ:
+			status = virtio_net_ctrl_mq(net, hdr->cmd,
+					&iov[1], n - 2);
+			break;
+		default:
+			DPRINTF(("vtnet: unsupported control class %u\n",
+				hdr->class));
+			status = VIRTIO_NET_ERR;
+			break;
+		}
+
+		*ack = status;
+		vq_relchain(vq, idx, sizeof(*ack));
+	}
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -738,10 +1217,11 @@ virtio_net_is_macvtap(char *devname, int *ifindex)
 }
 
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, bool mq, bool *vnet_hdr)
 {
 	char tbuf[IFNAMSIZ];
 	int tunfd, rc, macvtap_index;
+	unsigned int features;
 	struct ifreq ifr;
 
 	/*Check if tun/tap or macvtap interface is used */
@@ -764,6 +1244,17 @@ virtio_net_tap_open(char *devname)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if (mq)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
+	/* have the virtio-net header passed through, if supported */
+	if (*vnet_hdr) {
+		if (ioctl(tunfd, TUNGETFEATURES, &features) == 0 &&
+		    (features & IFF_VNET_HDR))
+			ifr.ifr_flags |= IFF_VNET_HDR;
+		else
+			*vnet_hdr = false;
+	}
 
 	if (*devname) {
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -782,12 +1273,98 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Open the tap queue of one queue pair
+ */
+static int
+virtio_net_tap_queue_open(struct virtio_net_pair *pair, char *devname)
+{
+	int opt = 1;
+
+	pair->tapfd = virtio_net_tap_open(devname, pair->net->max_pairs > 1,
+			&pair->net->tap_vnet_hdr);
+	if (pair->tapfd == -1) {
+		WPRINTF(("open of tap device %s queue %d failed\n",
+			devname, pair->idx));
+		return -1;
+	}
+	DPRINTF(("open of tap device %s queue %d success!\n",
+		devname, pair->idx));
+
+	/*
+	 * Set non-blocking for the read notifications
+	 */
+	if (ioctl(pair->tapfd, FIONBIO, &opt) < 0) {
+		WPRINTF(("tap device O_NONBLOCK failed\n"));
+		close(pair->tapfd);
+		pair->tapfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Register the tap queue of one queue pair for read notifications,
+ * with the pair's iothread if it has one or else with the event loop.
+ */
+static void
+virtio_net_tap_queue_register(struct virtio_net_pair *pair)
+{
+	if (pair->ioctx) {
+		pair->iomvt.run = virtio_net_rx_run;
+		pair->iomvt.arg = pair;
+		pair->iomvt.fd = pair->tapfd;
+		if (iothread_add(pair->ioctx, pair->tapfd, &pair->iomvt) == 0)
+			return;
+		WPRINTF(("Could not add tap queue %d to iothread\n",
+			pair->idx));
+	} else {
+		/* the first pair's event tears the whole device down */
+		pair->mevp = mevent_add(pair->tapfd, EVF_READ,
+				       virtio_net_rx_callback, pair,
+				       pair->idx ? NULL : virtio_net_teardown,
+				       pair->idx ? NULL : pair->net);
+		if (pair->mevp)
+			return;
+		WPRINTF(("Could not register event\n"));
+	}
+	close(pair->tapfd);
+	pair->tapfd = -1;
+}
+
+/*
+ * Find the offloads the tap device can take from and hand over to the
+ * guest.  Sending offloaded packets only needs IFF_VNET_HDR; UFO went
+ * away from some kernels and is probed for.
+ */
+static void
+virtio_net_tap_probe_offload(struct virtio_net *net)
+{
+	unsigned int offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+		TUN_F_TSO_ECN;
+	int fd = net->pairs[0].tapfd;
+
+	if (!net->tap_vnet_hdr)
+		return;
+
+	net->tap_caps = VIRTIO_NET_S_OFFLOADCAPS;
+	if (ioctl(fd, TUNSETOFFLOAD, offload | TUN_F_UFO) == 0)
+		net->tap_caps |= VIRTIO_NET_S_GUEST_OFFLOADCAPS |
+			VIRTIO_NET_S_UFOCAPS;
+	else if (ioctl(fd, TUNSETOFFLOAD, offload) == 0)
+		net->tap_caps |= VIRTIO_NET_S_GUEST_OFFLOADCAPS;
+
+	/* nothing is handed over until the guest accepts it */
+	if (ioctl(fd, TUNSETOFFLOAD, 0) < 0)
+		WPRINTF(("vtnet: tap offload reset failed: %d\n", errno));
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
 	char tbuf[IFNAMSIZ];
 	int vhost_fd = -1;
-	int rc;
+	int rc, i;
 
 	rc = snprintf(tbuf, IFNAMSIZ, "%s", devname);
 	if (rc < 0 || rc >= IFNAMSIZ) /* give warning if error or truncation happens */
@@ -796,32 +1373,34 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
-	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
+	/* vhost-net adds and strips the header itself */
+	net->tap_vnet_hdr = !net->use_vhost;
 
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * The first open resolves the tap name, the queues of the other
+	 * pairs attach to the same device.
 	 */
-	int opt = 1;
-
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	for (i = 0; i < net->max_pairs; i++) {
+		if (virtio_net_tap_queue_open(&net->pairs[i], tbuf) < 0)
+			break;
+	}
+	if (i == 0)
+		return;
+	if (i < net->max_pairs) {
+		WPRINTF(("vtnet: only %d of %d queue pairs available\n",
+			i, net->max_pairs));
+		net->max_pairs = i;
 	}
 
+	virtio_net_tap_probe_offload(net);
+
 	if (net->use_vhost) {
 		vhost_fd = open("/dev/vhost-net", O_RDWR);
 		if (vhost_fd < 0)
 			WPRINTF(("open of vhost-net failed\n"));
 		else {
 			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
+				net->pairs[0].tapfd, 0);
 			if (!net->vhost_net) {
 				WPRINTF(("vhost_net_init failed, fallback "
 					"to userspace virtio\n"));
@@ -832,17 +1411,27 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	}
 
 	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net,
-				       virtio_net_teardown, net);
-		if (net->mevp == NULL) {
-			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+		net->virtio_net_tx_flush = virtio_net_tap_tx_flush;
+		for (i = 0; i < net->max_pairs; i++) {
+			virtio_net_tap_queue_register(&net->pairs[i]);
+
+			/* batch the tap writes, or fall back to writev() */
+			if (io_uring_queue_init(VIRTIO_NET_BATCH,
+					&net->pairs[i].tx_ring, 0) == 0)
+				net->pairs[i].tx_uring = true;
+			else
+				WPRINTF(("vtnet: no io_uring for tap queue %d\n",
+					i));
 		}
 	}
 }
 
+static void
+virtio_net_null_setup(struct virtio_net *net)
+{
+	net->virtio_net_tx = virtio_net_null_tx;
+}
+
 static int
 virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -860,7 +1449,14 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *opt = NULL;
 	int mac_provided;
 	pthread_mutexattr_t attr;
-	int rc;
+	struct iothreads_option iot_opt;
+	struct iothread_ctx *ioctx_base = NULL;
+	struct virtio_net_pair *pair;
+	bool use_iothread = false;
+	int num_pairs = 1;
+	int rc, i, nvq;
+
+	memset(&iot_opt, 0, sizeof(iot_opt));
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -911,33 +1507,91 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					return err;
 				}
 				mac_provided = 1;
+			} else if (!strncmp(opt, "mq=", 3)) {
+				if (dm_strtoi(opt + 3, &opt, 10, &num_pairs) ||
+				    num_pairs <= 0) {
+					WPRINTF(("virtio_net: incorrect queue pairs %s\n",
+						opt));
+					free(devopts);
+					free(net);
+					return -1;
+				}
+				/* the max pairs used by FE is guest cpu num */
+				if (num_pairs > guest_cpu_num())
+					num_pairs = guest_cpu_num();
+				if (num_pairs > VIRTIO_NET_MAX_PAIRS)
+					num_pairs = VIRTIO_NET_MAX_PAIRS;
+			} else if (!strncmp(opt, "iothread", strlen("iothread"))) {
+				use_iothread = true;
+				strsep(&opt, "=");
+				if (iothread_parse_options(opt, &iot_opt) < 0) {
+					free(devopts);
+					free(net);
+					return -1;
+				}
 			}
 		}
 	}
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues,
+	/* vhost-net owns the rings in the kernel, for a single pair */
+	if (net->use_vhost && (num_pairs > 1 || use_iothread)) {
+		WPRINTF(("virtio_net: mq and iothread are ignored with vhost\n"));
+		num_pairs = 1;
+		use_iothread = false;
+		iothread_free_options(&iot_opt);
+	}
+
+	net->max_pairs = num_pairs;
+	net->pairs = calloc(num_pairs, sizeof(struct virtio_net_pair));
+	nvq = num_pairs * VIRTIO_NET_PAIR_VQS + (num_pairs > 1 ? 1 : 0);
+	net->queues = calloc(nvq, sizeof(struct virtio_vq_info));
+	if (!net->pairs || !net->queues) {
+		WPRINTF(("virtio_net: calloc returns NULL\n"));
+		goto fail;
+	}
+
+	if (use_iothread) {
+		/* one or more pairs per iothread, mapped round robin */
+		if (iot_opt.num > num_pairs)
+			iot_opt.num = num_pairs;
+
+		if (snprintf(iot_opt.tag, sizeof(iot_opt.tag), "net%d:%d",
+				dev->slot, dev->func) >= sizeof(iot_opt.tag))
+			pr_err("%s: virtio-net ioctx_tag too long \n", __func__);
+
+		ioctx_base = iothread_create(&iot_opt);
+		iothread_free_options(&iot_opt);
+		if (ioctx_base == NULL) {
+			pr_err("%s: Fails to create iothread context instance \n",
+				__func__);
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < num_pairs; i++) {
+		pair = &net->pairs[i];
+		pair->net = net;
+		pair->idx = i;
+		pair->tapfd = -1;
+		if (ioctx_base)
+			pair->ioctx = ioctx_base + i % iot_opt.num;
+		pthread_mutex_init(&pair->rx_mtx, NULL);
+		pthread_mutex_init(&pair->tx_mtx, NULL);
+		pthread_cond_init(&pair->tx_cond, NULL);
+	}
+
+	net->ops = virtio_net_ops;
+	net->ops.nvq = nvq;
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues,
 		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
 	net->base.mtx = &net->mtx;
-	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
 
 	/*
 	 * Attempt to open the tap device
 	 */
-	net->tapfd = -1;
-
 	if (!devopts) {
 		WPRINTF(("virtio_net: invalid optional argument\n"));
-		free(net);
-		return -1;
+		goto fail;
 	}
 
 	if (opts != NULL) {
@@ -947,6 +1601,8 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if ((tmp != NULL) && (strncmp(tmp, "tap", 3) == 0)) {
 		type = strsep(&tmp, "=");
 		name = strsep(&tmp, ",");
+	} else if ((tmp != NULL) && (strncmp(tmp, "null", 4) == 0)) {
+		type = strsep(&tmp, ",");
 	}
 
 	if ((tmp != NULL) && (strncmp(tmp, "mac_seed", 8) == 0)) {
@@ -959,7 +1615,40 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		if (strcmp(type, "tap") == 0) {
 			virtio_net_tap_setup(net, name);
 		}
+	} else if ((type != NULL) && (strcmp(type, "null") == 0)) {
+		virtio_net_null_setup(net);
+	}
+
+	/*
+	 * Set up the queues for the pairs the tap device could provide;
+	 * with multiqueue, the control queue follows the last pair.
+	 */
+	net->ops.nvq = net->max_pairs * VIRTIO_NET_PAIR_VQS;
+	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS | net->tap_caps;
+	if (net->max_pairs > 1) {
+		net->ops.nvq++;
+		net->base.device_caps |= VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+	}
+	net->config.max_virtqueue_pairs = net->max_pairs;
+
+	for (i = 0; i < net->ops.nvq; i++) {
+		net->queues[i].qsize = VIRTIO_NET_RINGSZ;
+		if (i == net->max_pairs * VIRTIO_NET_PAIR_VQS)
+			net->queues[i].notify = virtio_net_ping_ctlq;
+		else if (i % VIRTIO_NET_PAIR_VQS == VIRTIO_NET_RXQ)
+			net->queues[i].notify = virtio_net_ping_rxq;
+		else
+			net->queues[i].notify = virtio_net_ping_txq;
+		if (ioctx_base)
+			net->queues[i].viothrd.ioctx =
+				net->pairs[(i / VIRTIO_NET_PAIR_VQS) %
+					net->max_pairs].ioctx;
 	}
+	net->base.iothread = (ioctx_base != NULL);
+
+	/* only the first pair is in use until the guest asks for more */
+	net->curr_pairs = net->max_pairs;
+	virtio_net_set_pairs(net, 1);
 
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
@@ -1008,12 +1697,14 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	net->config.status = (opts == NULL || net->pairs[0].tapfd >= 0 ||
+			      net->virtio_net_tx == virtio_net_null_tx);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
-		if (net)
-			free(net);
+		free(net->queues);
+		free(net->pairs);
+		free(net);
 		return -1;
 	}
 
@@ -1025,24 +1716,35 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
+	virtio_net_tap_set_offload(net);
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Spawn one TX processing thread per queue pair, unless the
+	 * pair's tx queue is handled on an iothread.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		if (pair->ioctx)
+			continue;
+		pthread_create(&pair->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)pair);
+		if (net->max_pairs > 1)
+			snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d",
+				 dev->slot, dev->func, (uint8_t)i);
+		else
+			snprintf(tname, sizeof(tname), "vtnet-%d:%d tx",
+				 dev->slot, dev->func);
+		pthread_setname_np(pair->tx_tid, tname);
+	}
 
 	return 0;
+
+fail:
+	free(devopts);
+	free(net->queues);
+	free(net->pairs);
+	free(net);
+	return -1;
 }
 
 static int
@@ -1092,6 +1794,8 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 		/* non-merge rx header is 2 bytes shorter */
 		net->rx_vhdrlen -= 2;
 	}
+
+	virtio_net_tap_set_offload(net);
 }
 
 static void
@@ -1105,8 +1809,8 @@ virtio_net_set_status(void *vdev, uint64_t status)
 
 	if (!net->vhost_net->vhost_started &&
 		(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		if (net->mevp)
-			mevent_disable(net->mevp);
+		if (net->pairs[0].mevp)
+			mevent_disable(net->pairs[0].mevp);
 
 		rc = vhost_net_start(net->vhost_net);
 		if (rc < 0) {
@@ -1125,18 +1829,28 @@ static void
 virtio_net_teardown(void *param)
 {
 	struct virtio_net *net;
+	int i;
 
 	net = (struct virtio_net *)param;
 	if (!net)
 		return;
 
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
-	} else
+	if (net->pairs[0].tapfd < 0 && net->virtio_net_tx != virtio_net_null_tx)
 		pr_err("net->tapfd is -1!\n");
+	for (i = 0; i < net->max_pairs; i++) {
+		if (net->pairs[i].tx_uring) {
+			io_uring_queue_exit(&net->pairs[i].tx_ring);
+			net->pairs[i].tx_uring = false;
+		}
+		if (net->pairs[i].tapfd >= 0) {
+			close(net->pairs[i].tapfd);
+			net->pairs[i].tapfd = -1;
+		}
+	}
 
 	virtio_reset_dev(&net->base);
+	free(net->queues);
+	free(net->pairs);
 	free(net);
 }
 
@@ -1144,11 +1858,22 @@ static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct virtio_net_pair *pair;
+	uint64_t tx_packets = 0;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
-		virtio_net_tx_stop(net);
+		for (i = 0; i < net->max_pairs; i++)
+			virtio_net_tx_stop(&net->pairs[i]);
+
+		if (net->virtio_net_tx == virtio_net_null_tx) {
+			for (i = 0; i < net->max_pairs; i++)
+				tx_packets += net->pairs[i].tx_packets;
+			pr_info("vtnet: null backend dropped %lu tx packets\n",
+				tx_packets);
+		}
 
 		if (net->vhost_net) {
 			vhost_net_stop(net->vhost_net);
@@ -1157,8 +1882,20 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			net->vhost_net = NULL;
 		}
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
+		/*
+		 * Only the first pair's event carries the teardown, so it
+		 * goes last.
+		 */
+		for (i = net->max_pairs - 1; i >= 0; i--) {
+			pair = &net->pairs[i];
+			if (pair->ioctx && pair->tapfd >= 0)
+				iothread_del(pair->ioctx, pair->tapfd);
+			if (i > 0 && pair->mevp != NULL)
+				mevent_delete(pair->mevp);
+		}
+
+		if (net->pairs[0].mevp != NULL)
+			mevent_delete(net->pairs[0].mevp);
 		else
 			virtio_net_teardown(net);
 
@@ -530,6 +530,21 @@ done:
 	pthread_mutex_unlock(&uart->mtx);
 }
 
+/*
+ * Whether a write to THR has no effect the guest can see before its next
+ * read of the UART: neither the THRE interrupt nor the loopback mode is on.
+ */
+bool
+uart_thr_write_is_silent(struct uart_vdev *uart)
+{
+	bool silent;
+
+	pthread_mutex_lock(&uart->mtx);
+	silent = ((uart->ier & IER_ETXRDY) == 0) && ((uart->mcr & MCR_LOOPBACK) == 0);
+	pthread_mutex_unlock(&uart->mtx);
+	return silent;
+}
+
 uint8_t
 uart_read(struct uart_vdev *uart, int offset)
 {
@@ -16,8 +16,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <libdrm/drm_fourcc.h>
 #include "log.h"
 #include "vdisplay.h"
+#include "vdisplay_shm.h"
 #include "atomic.h"
 #include "timer.h"
 #include <egl.h>
@@ -33,6 +36,14 @@
 #define VDPY_MIN_HEIGHT 480
 #define transto_10bits(color) (uint16_t)(color * 1024 + 0.5)
 #define VSCREEN_MAX_NUM 2
+/* updates are presented at most once per 60Hz frame */
+#define VDPY_FRAME_NS 16666667
+/* the refresh timer redraws the screens at least this often */
+#define VDPY_REFRESH_NS 33000000
+/* beyond this many damaged rectangles, their bounding box is uploaded */
+#define VDPY_MAX_DAMAGE_RECTS 16
+/* period of the benchmark statistics */
+#define VDPY_STATS_NS 1000000000UL
 
 static unsigned char default_raw_argb[VDPY_DEFAULT_WIDTH * VDPY_DEFAULT_HEIGHT * 4];
 
@@ -76,6 +87,25 @@ struct vscreen {
 	EGLImage egl_img;
 	/* Record the update_time that is activated from guest_vm */
 	struct timespec last_time;
+	/* area of surf not uploaded to surf_tex, or copied to shm, yet */
+	pixman_region16_t damage;
+	/* an update is waiting for the next frame */
+	bool present_pending;
+	/* bytes uploaded for it */
+	size_t pending_bytes;
+	/* when the oldest update not presented yet arrived */
+	struct timespec first_update;
+	/* frames of the headless display */
+	struct vdpy_shm *shm;
+	void *dmabuf_map;
+	size_t dmabuf_map_size;
+	/* presented frames, and the benchmark statistics of this period */
+	uint64_t frames;
+	struct timespec stat_start;
+	uint64_t stat_frames;
+	uint64_t stat_bytes;
+	uint64_t stat_latency_sum;
+	uint64_t stat_latency_max;
 };
 
 static struct display {
@@ -83,7 +113,7 @@ static struct display {
 	struct vscreen *vscrs;
 	int vscrs_num;
 	pthread_t tid;
-	/* Add one UI_timer(33ms) to render the buffers from guest_vm */
+	/* Add one UI_timer(16ms) to render the buffers from guest_vm */
 	struct acrn_timer ui_timer;
 	struct vdpy_display_bh ui_timer_bh;
 	// protect the request_list
@@ -96,6 +126,13 @@ static struct display {
 	SDL_GLContext eglContext;
 	EGLDisplay eglDisplay;
 	struct egl_display_ops gl_ops;
+	/* present the frames in shared memory instead of SDL windows */
+	bool headless;
+	/* present every update at once and log the statistics */
+	bool benchmark;
+	/* dump every capture_every-th frame of the headless display */
+	char *capture_dir;
+	int capture_every;
 } vdpy = {
 	.s.is_ui_realized = false,
 	.s.is_active = false,
@@ -521,6 +558,19 @@ vdpy_edid_generate(uint8_t *edid, size_t size, struct edid_info *info)
 	edid[127] = vdpy_edid_get_checksum(edid);
 }
 
+/*
+ * Whether surfaces can be given as DMABUF. The headless display maps
+ * them, SDL needs EGL to import them as textures.
+ */
+bool
+vdpy_dmabuf_supported(int handle)
+{
+	if (handle != vdpy.s.n_connect)
+		return false;
+
+	return vdpy.headless || vdpy.egl_dmabuf_supported;
+}
+
 void
 vdpy_get_edid(int handle, int scanout_id, uint8_t *edid, size_t size)
 {
@@ -636,6 +686,96 @@ static void sdl_gl_prepare_draw(struct vscreen *vscr)
 	return;
 }
 
+/* Copy the damaged area of the surface into the frame being written */
+static size_t
+vdpy_shm_copy_damage(struct vscreen *vscr)
+{
+	size_t bytes;
+
+	if (!vscr->shm || !vscr->surf.pixel)
+		return 0;
+
+	bytes = vdpy_shm_update(vscr->shm, vscr->surf.pixel, vscr->surf.stride,
+			vscr->surf.surf_format, vscr->guest_width, vscr->guest_height,
+			&vscr->damage);
+	pixman_region_fini(&vscr->damage);
+	pixman_region_init(&vscr->damage);
+	return bytes;
+}
+
+/*
+ * The headless display reads the pixels of the surface itself, a DMABUF
+ * surface is mapped for that.
+ */
+static void
+vdpy_shm_surface_set(struct vscreen *vscr, struct surface *surf)
+{
+	uint8_t *addr;
+
+	if (vscr->dmabuf_map) {
+		munmap(vscr->dmabuf_map, vscr->dmabuf_map_size);
+		vscr->dmabuf_map = NULL;
+	}
+
+	if (surf == NULL) {
+		memset(&vscr->surf, 0, sizeof(vscr->surf));
+		vscr->surf.surf_type = SURFACE_PIXMAN;
+		vscr->surf.surf_format = PIXMAN_a8r8g8b8;
+		vscr->surf.stride = VDPY_MIN_WIDTH * 4;
+		vscr->surf.pixel = default_raw_argb;
+		vscr->guest_width = VDPY_MIN_WIDTH;
+		vscr->guest_height = VDPY_MIN_HEIGHT;
+	} else if ((surf->surf_type == SURFACE_PIXMAN) ||
+			(surf->surf_type == SURFACE_DMABUF)) {
+		vscr->surf = *surf;
+		vscr->surf.damage = NULL;
+		vscr->guest_width = surf->width;
+		vscr->guest_height = surf->height;
+	} else {
+		/* Unsupported type */
+		return;
+	}
+
+	if (surf && (surf->surf_type == SURFACE_DMABUF)) {
+		switch (surf->dma_info.surf_fourcc) {
+		case DRM_FORMAT_XRGB8888:
+			vscr->surf.surf_format = PIXMAN_x8r8g8b8;
+			break;
+		case DRM_FORMAT_ARGB8888:
+			vscr->surf.surf_format = PIXMAN_a8r8g8b8;
+			break;
+		case DRM_FORMAT_XBGR8888:
+			vscr->surf.surf_format = PIXMAN_x8b8g8r8;
+			break;
+		case DRM_FORMAT_ABGR8888:
+			vscr->surf.surf_format = PIXMAN_a8b8g8r8;
+			break;
+		default:
+			pr_err("Unsupported fourcc %x\n", surf->dma_info.surf_fourcc);
+			vscr->surf.pixel = NULL;
+			return;
+		}
+		vscr->dmabuf_map_size = surf->dma_info.dmabuf_offset +
+				(size_t)surf->stride * surf->height;
+		addr = mmap(NULL, vscr->dmabuf_map_size, PROT_READ, MAP_SHARED,
+				surf->dma_info.dmabuf_fd, 0);
+		if (addr == MAP_FAILED) {
+			pr_err("failed to map the dmabuf of the surface\n");
+			vscr->surf.pixel = NULL;
+			return;
+		}
+		vscr->dmabuf_map = addr;
+		vscr->surf.pixel = addr + surf->dma_info.dmabuf_offset;
+	}
+
+	/* a new surface is presented as a whole */
+	pixman_region_union_rect(&vscr->damage, &vscr->damage,
+			0, 0, vscr->guest_width, vscr->guest_height);
+	clock_gettime(CLOCK_MONOTONIC, &vscr->first_update);
+	vscr->pending_bytes = vdpy_shm_copy_damage(vscr);
+	vscr->present_pending = true;
+}
+
 void
 vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 {
@@ -660,6 +800,17 @@ vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 
 	vscr = vdpy.vscrs + scanout_id;
 
+	/* what was damaged belongs to the old surface */
+	pixman_region_fini(&vscr->damage);
+	pixman_region_init(&vscr->damage);
+	vscr->present_pending = false;
+	vscr->pending_bytes = 0;
+
+	if (vdpy.headless) {
+		vdpy_shm_surface_set(vscr, surf);
+		return;
+	}
+
 	if (surf == NULL ) {
 		vscr->surf.width = 0;
 		vscr->surf.height = 0;
@@ -683,11 +834,13 @@ vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 			return;
 		}
 		vscr->surf = *surf;
+		vscr->surf.damage = NULL;
 		vscr->guest_width = surf->width;
 		vscr->guest_height = surf->height;
 	} else if (surf->surf_type == SURFACE_DMABUF) {
 		src_img = NULL;
 		vscr->surf = *surf;
+		vscr->surf.damage = NULL;
 		vscr->guest_width = surf->width;
 		vscr->guest_height = surf->height;
 	} else {
@@ -816,10 +969,169 @@ vdpy_cursor_position_transformation(struct display *vdpy, int scanout_id, SDL_Re
 	rect->h = (vscr->cur.height * vscr->height) / vscr->guest_height;
 }
 
+static uint64_t
+vdpy_ns_since(struct timespec *ts)
+{
+	struct timespec cur_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &cur_time);
+	return (cur_time.tv_sec - ts->tv_sec) * 1000000000 +
+			cur_time.tv_nsec - ts->tv_nsec;
+}
+
+static uint64_t
+vdpy_elapsed_ns(struct vscreen *vscr)
+{
+	return vdpy_ns_since(&vscr->last_time);
+}
+
+/* Upload the damaged area of the surface to its texture */
+static size_t
+vdpy_upload_damage(struct vscreen *vscr)
+{
+	pixman_box16_t *boxes;
+	SDL_Rect rect;
+	int i, n, bytes_pp;
+	size_t bytes;
+
+	if (!pixman_region_not_empty(&vscr->damage))
+		return 0;
+
+	boxes = pixman_region_rectangles(&vscr->damage, &n);
+	if (n > VDPY_MAX_DAMAGE_RECTS) {
+		/* one large upload beats many small ones */
+		boxes = pixman_region_extents(&vscr->damage);
+		n = 1;
+	}
+
+	bytes_pp = PIXMAN_FORMAT_BPP(vscr->surf.surf_format) / 8;
+	bytes = 0;
+	for (i = 0; i < n; i++) {
+		rect.x = boxes[i].x1;
+		rect.y = boxes[i].y1;
+		rect.w = boxes[i].x2 - boxes[i].x1;
+		rect.h = boxes[i].y2 - boxes[i].y1;
+		SDL_UpdateTexture(vscr->surf_tex, &rect,
+				(uint8_t *)vscr->surf.pixel +
+					rect.y * vscr->surf.stride + rect.x * bytes_pp,
+				vscr->surf.stride);
+		bytes += rect.w * rect.h * bytes_pp;
+	}
+
+	pixman_region_fini(&vscr->damage);
+	pixman_region_init(&vscr->damage);
+	return bytes;
+}
+
+static void
+vdpy_sdl_present(struct display *ui_vdpy, int scanout_id)
+{
+	SDL_Rect cursor_rect;
+	struct vscreen *vscr;
+
+	vscr = ui_vdpy->vscrs + scanout_id;
+
+	sdl_gl_prepare_draw(vscr);
+	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
+
+	/* This should be handled after rendering the surface_texture.
+	 * Otherwise it will be hidden
+	 */
+	if (vscr->cur_tex) {
+		vdpy_cursor_position_transformation(ui_vdpy, scanout_id, &cursor_rect);
+		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
+				NULL, &cursor_rect);
+	}
+
+	SDL_RenderPresent(vscr->renderer);
+}
+
+static void
+vdpy_shm_present_frame(struct display *ui_vdpy, int scanout_id, uint64_t latency)
+{
+	struct vscreen *vscr;
+
+	vscr = ui_vdpy->vscrs + scanout_id;
+	if (!vscr->shm)
+		return;
+
+	vdpy_shm_publish(vscr->shm, latency);
+
+	if (ui_vdpy->capture_dir && (vscr->frames % ui_vdpy->capture_every == 0))
+		vdpy_shm_capture(vscr->shm, ui_vdpy->capture_dir);
+}
+
+/* Account a presented frame, and log the statistics once per period */
+static void
+vdpy_frame_stats(struct display *ui_vdpy, int scanout_id, size_t bytes, uint64_t latency)
+{
+	struct vscreen *vscr;
+	uint64_t period;
+
+	vscr = ui_vdpy->vscrs + scanout_id;
+	vscr->stat_frames++;
+	vscr->stat_bytes += bytes;
+	vscr->stat_latency_sum += latency;
+	if (latency > vscr->stat_latency_max)
+		vscr->stat_latency_max = latency;
+
+	if (!ui_vdpy->benchmark)
+		return;
+
+	period = vdpy_ns_since(&vscr->stat_start);
+	if (period < VDPY_STATS_NS)
+		return;
+
+	pr_info("vdpy: scanout %d: %lu fps, %lu KiB/s uploaded, latency %lu us avg %lu us max\n",
+			scanout_id, vscr->stat_frames * 1000000000 / period,
+			vscr->stat_bytes * 1000000000 / period / 1024,
+			vscr->stat_latency_sum / vscr->stat_frames / 1000,
+			vscr->stat_latency_max / 1000);
+	vscr->stat_frames = 0;
+	vscr->stat_bytes = 0;
+	vscr->stat_latency_sum = 0;
+	vscr->stat_latency_max = 0;
+	clock_gettime(CLOCK_MONOTONIC, &vscr->stat_start);
+}
+
+static void
+vdpy_present(struct display *ui_vdpy, int scanout_id)
+{
+	struct vscreen *vscr;
+	uint64_t latency;
+	bool update;
+
+	vscr = ui_vdpy->vscrs + scanout_id;
+	update = vscr->present_pending;
+	latency = update ? vdpy_ns_since(&vscr->first_update) : 0;
+	if (update)
+		vscr->frames++;
+
+	if (ui_vdpy->headless)
+		vdpy_shm_present_frame(ui_vdpy, scanout_id, latency);
+	else
+		vdpy_sdl_present(ui_vdpy, scanout_id);
+
+	/* update the rendering time */
+	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+	vscr->present_pending = false;
+
+	/* redraws of an unchanged surface are not frames */
+	if (update)
+		vdpy_frame_stats(ui_vdpy, scanout_id, vscr->pending_bytes, latency);
+	vscr->pending_bytes = 0;
+}
+
+/*
+ * Upload what changed on the surface, only the damaged rectangles. This
+ * can't wait for the next frame: the pixels belong to the guest resource
+ * or the VGA framebuffer, which may be freed or moved by then. Only the
+ * present is deferred, so a guest flushing faster than the display
+ * refreshes costs one present per frame.
+ */
 void
 vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 {
-	SDL_Rect cursor_rect;
 	struct vscreen *vscr;
 
 	if (handle != vdpy.s.n_connect) {
@@ -842,27 +1154,38 @@ vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 	}
 
 	vscr = vdpy.vscrs + scanout_id;
-	if (surf->surf_type == SURFACE_PIXMAN)
-		SDL_UpdateTexture(vscr->surf_tex, NULL,
-			  surf->pixel,
-			  surf->stride);
-
-	sdl_gl_prepare_draw(vscr);
-	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
-
-	/* This should be handled after rendering the surface_texture.
-	 * Otherwise it will be hidden
-	 */
-	if (vscr->cur_tex) {
-		vdpy_cursor_position_transformation(&vdpy, scanout_id, &cursor_rect);
-		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-				NULL, &cursor_rect);
+	if (!vscr->present_pending)
+		clock_gettime(CLOCK_MONOTONIC, &vscr->first_update);
+
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		/* the pixels may have moved, e.g. after a VGA mode change */
+		vscr->surf.pixel = surf->pixel;
+		vscr->surf.stride = surf->stride;
+		if (surf->damage)
+			pixman_region_union(&vscr->damage, &vscr->damage, surf->damage);
+		else
+			pixman_region_union_rect(&vscr->damage, &vscr->damage,
+					0, 0, surf->width, surf->height);
+		/* never upload outside of the texture */
+		pixman_region_intersect_rect(&vscr->damage, &vscr->damage,
+				0, 0, vscr->guest_width, vscr->guest_height);
+	} else if (vdpy.headless) {
+		/* the GPU gives no damage for DMABUF, copy all of it */
+		pixman_region_union_rect(&vscr->damage, &vscr->damage,
+				0, 0, vscr->guest_width, vscr->guest_height);
 	}
 
-	SDL_RenderPresent(vscr->renderer);
+	if (vdpy.headless)
+		vscr->pending_bytes += vdpy_shm_copy_damage(vscr);
+	else if (vscr->surf_tex)
+		vscr->pending_bytes += vdpy_upload_damage(vscr);
 
-	/* update the rendering time */
-	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+	/* too early for a new frame, the refresh timer will present it */
+	vscr->present_pending = true;
+	if (!vdpy.benchmark && (vdpy_elapsed_ns(vscr) < VDPY_FRAME_NS))
+		return;
+
+	vdpy_present(&vdpy, scanout_id);
 }
 
 void
@@ -889,6 +1212,15 @@ vdpy_cursor_define(int handle, int scanout_id, struct cursor *cur)
 
 	vscr = vdpy.vscrs + scanout_id;
 
+	if (vdpy.headless) {
+		/* only the position is published */
+		vscr->cur = *cur;
+		vscr->cur.data = NULL;
+		if (vscr->shm)
+			vdpy_shm_set_cursor(vscr->shm, cur->x, cur->y);
+		return;
+	}
+
 	if (vscr->cur_tex)
 		SDL_DestroyTexture(vscr->cur_tex);
 
@@ -926,15 +1258,15 @@ vdpy_cursor_move(int handle, int scanout_id, uint32_t x, uint32_t y)
 	 */
 	vscr->cur.x = x;
 	vscr->cur.y = y;
+	if (vscr->shm)
+		vdpy_shm_set_cursor(vscr->shm, x, y);
 }
 
 static void
 vdpy_sdl_ui_refresh(void *data)
 {
 	struct display *ui_vdpy;
-	struct timespec cur_time;
 	uint64_t elapsed_time;
-	SDL_Rect cursor_rect;
 	struct vscreen *vscr;
 	int i;
 
@@ -943,32 +1275,21 @@ vdpy_sdl_ui_refresh(void *data)
 	for (i = 0; i < vdpy.vscrs_num; i++) {
 		vscr = ui_vdpy->vscrs + i;
 
-		/* Skip it if no surface needs to be rendered */
-		if (vscr->surf_tex == NULL)
+		/* Skip it if no surface needs to be rendered. Shared memory
+		 * keeps the last frame, only updates are presented there.
+		 */
+		if (ui_vdpy->headless ? !vscr->present_pending : (vscr->surf_tex == NULL))
 			continue;
 
-		clock_gettime(CLOCK_MONOTONIC, &cur_time);
+		elapsed_time = vdpy_elapsed_ns(vscr);
 
-		elapsed_time = (cur_time.tv_sec - vscr->last_time.tv_sec) * 1000000000 +
-				cur_time.tv_nsec - vscr->last_time.tv_nsec;
-
-		/* the time interval is less than 10ms. Skip it */
-		if (elapsed_time < 10000000)
-			return;
-
-		sdl_gl_prepare_draw(vscr);
-		SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
-
-		/* This should be handled after rendering the surface_texture.
-		 * Otherwise it will be hidden
+		/* present deferred updates once the frame is over, and
+		 * redraw the others now and then for the cursor
 		 */
-		if (vscr->cur_tex) {
-			vdpy_cursor_position_transformation(ui_vdpy, i, &cursor_rect);
-			SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-					NULL, &cursor_rect);
-		}
+		if (elapsed_time < (vscr->present_pending ? VDPY_FRAME_NS : VDPY_REFRESH_NS))
+			continue;
 
-		SDL_RenderPresent(vscr->renderer);
+		vdpy_present(ui_vdpy, i);
 	}
 }
 
@@ -1091,12 +1412,19 @@ vdpy_sdl_display_thread(void *data)
 		vscr->info.width = vscr->guest_width;
 		vscr->info.height = vscr->guest_height;
 
-		if (vdpy_create_vscreen_window(vscr)) {
+		pixman_region_init(&vscr->damage);
+		if (vdpy.headless) {
+			vscr->shm = vdpy_shm_open(i, vscr->guest_width, vscr->guest_height);
+			if (!vscr->shm)
+				goto sdl_fail;
+		} else if (vdpy_create_vscreen_window(vscr)) {
 			goto sdl_fail;
 		}
 		clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+		vscr->stat_start = vscr->last_time;
 	}
-	sdl_gl_display_init();
+	if (!vdpy.headless)
+		sdl_gl_display_init();
 	pthread_mutex_init(&vdpy.vdisplay_mutex, NULL);
 	pthread_cond_init(&vdpy.vdisplay_signal, NULL);
 	TAILQ_INIT(&vdpy.request_list);
@@ -1107,14 +1435,14 @@ vdpy_sdl_display_thread(void *data)
 	vdpy.ui_timer.clockid = CLOCK_MONOTONIC;
 	acrn_timer_init(&vdpy.ui_timer, vdpy_sdl_ui_timer, &vdpy);
 	ui_timer_spec.it_interval.tv_sec = 0;
-	ui_timer_spec.it_interval.tv_nsec = 33000000;
+	ui_timer_spec.it_interval.tv_nsec = VDPY_FRAME_NS;
 	/* Wait for 5s to start the timer */
 	ui_timer_spec.it_value.tv_sec = 5;
 	ui_timer_spec.it_value.tv_nsec = 0;
-	/* Start one periodic timer to refresh UI based on 30fps */
+	/* Start one periodic timer to present deferred updates at 60fps */
 	acrn_timer_settime(&vdpy.ui_timer, &ui_timer_spec);
 
-	pr_info("SDL display thread is created\n");
+	pr_info("%s display thread is created\n", vdpy.headless ? "Headless" : "SDL");
 	/* Begin to process the display_cmd after initialization */
 	do {
 		if (!vdpy.s.is_active) {
@@ -1176,6 +1504,13 @@ vdpy_sdl_display_thread(void *data)
 sdl_fail:
 	for (i = 0; i < vdpy.vscrs_num; i++) {
 		vscr = vdpy.vscrs + i;
+		pixman_region_fini(&vscr->damage);
+		vdpy_shm_close(vscr->shm);
+		vscr->shm = NULL;
+		if (vscr->dmabuf_map) {
+			munmap(vscr->dmabuf_map, vscr->dmabuf_map_size);
+			vscr->dmabuf_map = NULL;
+		}
 		if (vscr->bogus_tex) {
 			SDL_DestroyTexture(vscr->bogus_tex);
 			vscr->bogus_tex = NULL;
@@ -1193,7 +1528,8 @@ sdl_fail:
 	/* This is used to workaround the TLS issue of libEGL + libGLdispatch
 	 * after unloading library.
 	 */
-	eglReleaseThread();
+	if (!vdpy.headless)
+		eglReleaseThread();
 	return NULL;
 }
 
@@ -1291,6 +1627,17 @@ gfx_ui_init()
 	struct vscreen *vscr;
 	int i;
 
+	if (vdpy.headless) {
+		/* one screen of the default size unless told otherwise */
+		if (vdpy.vscrs_num <= 0)
+			vdpy.vscrs_num = 1;
+		if (vdpy.capture_dir)
+			pr_info("virtual display: capturing every %d frames to %s\n",
+					vdpy.capture_every, vdpy.capture_dir);
+		vdpy.s.is_ui_realized = true;
+		return 0;
+	}
+
 	setenv("SDL_VIDEO_X11_FORCE_EGL", "1", 1);
 	setenv("SDL_OPENGL_ES_DRIVER", "1", 1);
 	setenv("SDL_RENDER_DRIVER", "opengles2", 1);
@@ -1357,6 +1704,10 @@ gfx_ui_deinit()
 	}
 
 	free(vdpy.vscrs);
+	free(vdpy.capture_dir);
+	if (vdpy.headless)
+		return;
+
 	SDL_Quit();
 	pr_info("SDL_Quit\r\n");
 }
@@ -1378,7 +1729,28 @@ int vdpy_parse_cmd_option(const char *opts)
 	stropts = strdup(opts);
 	while ((str = strsep(&stropts, ",")) != NULL) {
 		vscr = vdpy.vscrs + vdpy.vscrs_num;
-		if ((tmp = strcasestr(str, "geometry=fullscreen")) != NULL) {
+		if (!strcasecmp(str, "headless")) {
+			vdpy.headless = true;
+			pr_info("virtual display: headless, frames in shared memory.\n");
+		} else if (!strcasecmp(str, "benchmark")) {
+			vdpy.benchmark = true;
+			pr_info("virtual display: benchmark mode.\n");
+		} else if (!strncasecmp(str, "capture=", 8)) {
+			free(vdpy.capture_dir);
+			vdpy.capture_dir = strdup(str + 8);
+			vdpy.capture_every = 1;
+			tmp = strchr(vdpy.capture_dir, ':');
+			if (tmp) {
+				*tmp = '\0';
+				vdpy.capture_every = atoi(tmp + 1);
+				if (vdpy.capture_every <= 0) {
+					pr_err("incorrect capture option. Should be"
+							" capture=<dir>[:<every>]\n");
+					error = -1;
+					vdpy.capture_every = 1;
+				}
+			}
+		} else if ((tmp = strcasestr(str, "geometry=fullscreen")) != NULL) {
 			snum = sscanf(tmp, "geometry=fullscreen:%d", &vscr->pscreen_id);
 			if (snum != 1) {
 				vscr->pscreen_id = 0;
@@ -1414,5 +1786,10 @@ int vdpy_parse_cmd_option(const char *opts)
 	}
 	free(stropts);
 
+	if (vdpy.capture_dir && !vdpy.headless) {
+		pr_err("frame capture needs the headless display\n");
+		error = -1;
+	}
+
 	return error;
 }
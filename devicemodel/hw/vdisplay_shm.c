@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Shared memory frame ring of the headless virtual display
+ *
+ */
+
+/*
+ * Each presented frame goes to the oldest of VDPY_SHM_SLOTS full frame
+ * buffers, so readers can copy the newest one while the next is written.
+ * Only the part of a slot that changed since the slot was last written
+ * is copied: every update adds its damage to the stale region of all
+ * slots, and writing a slot refreshes and clears its own.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include "vdisplay_shm.h"
+#include "log.h"
+
+#define VDPY_SHM_PAGE	4096UL
+
+struct vdpy_shm {
+	char			name[64];
+	int			scanout_id;
+	struct vdpy_shm_hdr	*hdr;
+	size_t			map_size;
+	/* area of each slot that is older than the newest frame */
+	pixman_region16_t	stale[VDPY_SHM_SLOTS];
+	/* the next slot is being written, with this damage and bytes so far */
+	bool			writing;
+	pixman_region16_t	damage;
+	size_t			bytes;
+};
+
+static int
+vdpy_shm_map(struct vdpy_shm *shm, uint64_t slot_size)
+{
+	struct vdpy_shm_hdr *hdr;
+	size_t hdr_size, map_size;
+	void *addr;
+	int i, fd;
+
+	slot_size = roundup(slot_size, VDPY_SHM_PAGE);
+	hdr_size = roundup(sizeof(struct vdpy_shm_hdr), VDPY_SHM_PAGE);
+	map_size = hdr_size + VDPY_SHM_SLOTS * slot_size;
+
+	fd = shm_open(shm->name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0) {
+		pr_err("vdpy: failed to open %s, error %s\n", shm->name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, map_size) < 0) {
+		pr_err("vdpy: can't resize %s to %lu\n", shm->name, map_size);
+		close(fd);
+		shm_unlink(shm->name);
+		return -1;
+	}
+	addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("vdpy: failed to map %s\n", shm->name);
+		shm_unlink(shm->name);
+		return -1;
+	}
+
+	hdr = addr;
+	hdr->version = VDPY_SHM_VERSION;
+	hdr->nr_slots = VDPY_SHM_SLOTS;
+	hdr->slot_size = slot_size;
+	for (i = 0; i < VDPY_SHM_SLOTS; i++)
+		hdr->slots[i].data_offset = hdr_size + i * slot_size;
+	__atomic_store_n(&hdr->magic, VDPY_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm->hdr = hdr;
+	shm->map_size = map_size;
+	return 0;
+}
+
+/* Replace the segment by a larger one, the frames start over */
+static int
+vdpy_shm_grow(struct vdpy_shm *shm, uint64_t slot_size)
+{
+	struct vdpy_shm_hdr *old;
+	size_t old_size;
+
+	old = shm->hdr;
+	old_size = shm->map_size;
+	shm_unlink(shm->name);
+	if (vdpy_shm_map(shm, slot_size)) {
+		shm->hdr = old;
+		shm->map_size = old_size;
+		return -1;
+	}
+
+	/* the stats carry over, readers of the old segment move on */
+	shm->hdr->frames = old->frames;
+	shm->hdr->bytes = old->bytes;
+	shm->hdr->latency_sum_ns = old->latency_sum_ns;
+	shm->hdr->latency_max_ns = old->latency_max_ns;
+	__atomic_store_n(&old->stale, 1, __ATOMIC_RELEASE);
+	munmap(old, old_size);
+	return 0;
+}
+
+struct vdpy_shm *
+vdpy_shm_open(int scanout_id, uint32_t width, uint32_t height)
+{
+	struct vdpy_shm *shm;
+	int i;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+
+	shm->scanout_id = scanout_id;
+	snprintf(shm->name, sizeof(shm->name), "/acrn-vdpy-%d-%d", getpid(), scanout_id);
+	for (i = 0; i < VDPY_SHM_SLOTS; i++)
+		pixman_region_init(&shm->stale[i]);
+	pixman_region_init(&shm->damage);
+
+	if (vdpy_shm_map(shm, (uint64_t)width * height * 4)) {
+		for (i = 0; i < VDPY_SHM_SLOTS; i++)
+			pixman_region_fini(&shm->stale[i]);
+		pixman_region_fini(&shm->damage);
+		free(shm);
+		return NULL;
+	}
+
+	pr_info("vdpy: scanout %d frames are in %s\n", scanout_id, shm->name);
+	return shm;
+}
+
+void
+vdpy_shm_close(struct vdpy_shm *shm)
+{
+	int i;
+
+	if (!shm)
+		return;
+
+	munmap(shm->hdr, shm->map_size);
+	shm_unlink(shm->name);
+	for (i = 0; i < VDPY_SHM_SLOTS; i++)
+		pixman_region_fini(&shm->stale[i]);
+	pixman_region_fini(&shm->damage);
+	free(shm);
+}
+
+/*
+ * Copy what @damage covers of the @width x @height pixels at @pixel into
+ * the frame being written, which vdpy_shm_publish() makes the newest one.
+ * The pixels are copied right away, they may be gone by the time the
+ * frame is published. Returns the number of bytes copied into the ring.
+ */
+size_t
+vdpy_shm_update(struct vdpy_shm *shm, const void *pixel, uint32_t stride,
+		pixman_format_code_t format, uint32_t width, uint32_t height,
+		pixman_region16_t *damage)
+{
+	struct vdpy_shm_hdr *hdr;
+	struct vdpy_shm_frame *slot;
+	pixman_region16_t *stale;
+	pixman_box16_t *boxes;
+	uint8_t *data;
+	size_t bytes, len;
+	int i, n, y;
+
+	if ((PIXMAN_FORMAT_BPP(format) != 32) || !width || !height)
+		return 0;
+
+	if ((uint64_t)width * height * 4 > shm->hdr->slot_size) {
+		if (vdpy_shm_grow(shm, (uint64_t)width * height * 4))
+			return 0;
+		for (i = 0; i < VDPY_SHM_SLOTS; i++) {
+			pixman_region_fini(&shm->stale[i]);
+			pixman_region_init(&shm->stale[i]);
+		}
+		/* the frame being written went away with the old segment */
+		shm->writing = false;
+	}
+	hdr = shm->hdr;
+
+	for (i = 0; i < VDPY_SHM_SLOTS; i++)
+		pixman_region_union(&shm->stale[i], &shm->stale[i], damage);
+
+	slot = &hdr->slots[(hdr->last_frame + 1) % VDPY_SHM_SLOTS];
+	stale = &shm->stale[(hdr->last_frame + 1) % VDPY_SHM_SLOTS];
+	if (!shm->writing) {
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		shm->writing = true;
+	}
+	if ((slot->width != width) || (slot->height != height) || (slot->format != format)) {
+		/* nothing in the slot can be reused */
+		pixman_region_fini(stale);
+		pixman_region_init_rect(stale, 0, 0, width, height);
+		slot->width = width;
+		slot->height = height;
+		slot->stride = width * 4;
+		slot->format = format;
+	}
+	pixman_region_intersect_rect(stale, stale, 0, 0, width, height);
+
+	data = (uint8_t *)hdr + slot->data_offset;
+	bytes = 0;
+	boxes = pixman_region_rectangles(stale, &n);
+	for (i = 0; i < n; i++) {
+		len = (boxes[i].x2 - boxes[i].x1) * 4;
+		for (y = boxes[i].y1; y < boxes[i].y2; y++)
+			memcpy(data + y * slot->stride + boxes[i].x1 * 4,
+				(const uint8_t *)pixel + y * stride + boxes[i].x1 * 4, len);
+		bytes += len * (boxes[i].y2 - boxes[i].y1);
+	}
+	pixman_region_fini(stale);
+	pixman_region_init(stale);
+
+	pixman_region_union(&shm->damage, &shm->damage, damage);
+	shm->bytes += bytes;
+	return bytes;
+}
+
+/*
+ * Make the frame written by vdpy_shm_update() the newest one, @latency_ns
+ * after its first update.
+ */
+void
+vdpy_shm_publish(struct vdpy_shm *shm, uint64_t latency_ns)
+{
+	struct vdpy_shm_hdr *hdr;
+	struct vdpy_shm_frame *slot;
+	pixman_box16_t *boxes;
+	struct timespec now;
+	uint64_t frame_nr;
+	int i, n;
+
+	if (!shm->writing)
+		return;
+
+	hdr = shm->hdr;
+	frame_nr = hdr->last_frame + 1;
+	slot = &hdr->slots[frame_nr % VDPY_SHM_SLOTS];
+
+	boxes = pixman_region_rectangles(&shm->damage, &n);
+	slot->nr_rects = (n <= VDPY_SHM_MAX_RECTS) ? n : 0;
+	for (i = 0; i < slot->nr_rects; i++) {
+		slot->rects[i].x = boxes[i].x1;
+		slot->rects[i].y = boxes[i].y1;
+		slot->rects[i].w = boxes[i].x2 - boxes[i].x1;
+		slot->rects[i].h = boxes[i].y2 - boxes[i].y1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	slot->frame_nr = frame_nr;
+	slot->present_ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+	slot->latency_ns = latency_ns;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->last_frame, frame_nr, __ATOMIC_RELEASE);
+
+	hdr->frames++;
+	hdr->bytes += shm->bytes;
+	hdr->latency_sum_ns += latency_ns;
+	hdr->latency_max_ns = MAX(hdr->latency_max_ns, latency_ns);
+
+	pixman_region_fini(&shm->damage);
+	pixman_region_init(&shm->damage);
+	shm->bytes = 0;
+	shm->writing = false;
+}
+
+void
+vdpy_shm_set_cursor(struct vdpy_shm *shm, int x, int y)
+{
+	shm->hdr->cursor_x = x;
+	shm->hdr->cursor_y = y;
+}
+
+/* Write the newest frame to @dir as a binary PPM file */
+int
+vdpy_shm_capture(struct vdpy_shm *shm, const char *dir)
+{
+	struct vdpy_shm_frame *slot;
+	const uint8_t *src;
+	uint8_t *row;
+	char path[256];
+	int r, g, b;
+	uint32_t x, y;
+	FILE *f;
+
+	if (!shm->hdr->last_frame)
+		return -1;
+	slot = &shm->hdr->slots[shm->hdr->last_frame % VDPY_SHM_SLOTS];
+
+	/* byte offsets of the channels in a little endian pixel */
+	switch (slot->format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+		r = 2; g = 1; b = 0;
+		break;
+	case PIXMAN_a8b8g8r8:
+	case PIXMAN_x8b8g8r8:
+		r = 0; g = 1; b = 2;
+		break;
+	case PIXMAN_b8g8r8a8:
+	case PIXMAN_b8g8r8x8:
+		r = 1; g = 2; b = 3;
+		break;
+	case PIXMAN_r8g8b8a8:
+	case PIXMAN_r8g8b8x8:
+		r = 3; g = 2; b = 1;
+		break;
+	default:
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/scanout%d-%06lu.ppm", dir,
+			shm->scanout_id, slot->frame_nr);
+	f = fopen(path, "w");
+	if (!f) {
+		pr_err("vdpy: failed to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	row = malloc(slot->width * 3);
+	if (!row) {
+		fclose(f);
+		return -1;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", slot->width, slot->height);
+	for (y = 0; y < slot->height; y++) {
+		src = (uint8_t *)shm->hdr + slot->data_offset + y * slot->stride;
+		for (x = 0; x < slot->width; x++, src += 4) {
+			row[x * 3] = src[r];
+			row[x * 3 + 1] = src[g];
+			row[x * 3 + 2] = src[b];
+		}
+		fwrite(row, 3, slot->width, f);
+	}
+
+	free(row);
+	return fclose(f) ? -1 : 0;
+}
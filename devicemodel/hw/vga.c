@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <immintrin.h>
 
 #include "console.h"
 #include "inout.h"
@@ -20,10 +21,20 @@
 #include "vga.h"
 #include "gc.h"
 #include "log.h"
+#include "coalesced_io.h"
 
 #define	KB	(1024UL)
 #define	MB	(1024 * 1024UL)
 
+/* guest writes are tracked per 32 bytes of plane offset */
+#define	VGA_DIRTY_SHIFT		5
+#define	VGA_DIRTY_WORDS		((128 * KB >> VGA_DIRTY_SHIFT) / 64)
+/* character cells are always 16 scanlines high */
+#define	VGA_CHAR_HEIGHT		16
+
+/* bit 7 - i of a plane byte, i.e. pixel i, spread to bit 0 of byte i */
+static uint64_t vga_plane_expand[256];
+
 struct vga_vdev {
 	struct mem_range	mr;
 
@@ -34,6 +45,15 @@ struct vga_vdev {
 
 	uint8_t			*vga_ram;
 
+	/*
+	 * Written by the vCPUs, taken by the renderer: the plane offsets
+	 * written since the last render, and whether the font plane or any
+	 * register changed, which invalidates the whole screen.
+	 */
+	uint64_t		vga_dirty[VGA_DIRTY_WORDS];
+	bool			vga_font_dirty;
+	bool			vga_regs_dirty;
+
 	/*
 	 * General registers
 	 */
@@ -156,13 +176,14 @@ vga_in_reset(struct vga_vdev *vd)
 	    ((vd->vga_crtc.crtc_mode_ctrl & CRTC_MC_TE) == 0));
 }
 
-static void
+/* Returns whether the screen was resized */
+static bool
 vga_check_size(struct gfx_ctx *gc, struct vga_vdev *vd)
 {
 	int old_width, old_height;
 
 	if (vga_in_reset(vd))
-		return;
+		return false;
 
 	old_width = vd->gc_image->width;
 	old_height = vd->gc_image->height;
@@ -180,135 +201,370 @@ vga_check_size(struct gfx_ctx *gc, struct vga_vdev *vd)
 	    (((vd->vga_crtc.crtc_overflow & CRTC_OF_VDE8) >> CRTC_OF_VDE8_SHIFT) << 8) |
 	    (((vd->vga_crtc.crtc_overflow & CRTC_OF_VDE9) >> CRTC_OF_VDE9_SHIFT) << 9)) + 1;
 
-	if (old_width != vd->gc_width || old_height != vd->gc_height)
-		gc_resize(gc, vd->gc_width, vd->gc_height);
+	if (old_width == vd->gc_width && old_height == vd->gc_height)
+		return false;
+
+	gc_resize(gc, vd->gc_width, vd->gc_height);
+	return true;
 }
 
-static uint32_t
-vga_get_pixel(struct vga_vdev *vd, int x, int y)
+static void
+vga_mark_dirty(struct vga_vdev *vd, int offset)
 {
-	int offset;
-	int bit;
-	uint8_t data;
-	uint8_t idx;
-
-	offset = (y * vd->gc_width / 8) + (x / 8);
-	bit = 7 - (x % 8);
+	uint64_t bit;
 
-	data = (((vd->vga_ram[offset + 0 * 64*KB] >> bit) & 0x1) << 0) |
-		(((vd->vga_ram[offset + 1 * 64*KB] >> bit) & 0x1) << 1) |
-		(((vd->vga_ram[offset + 2 * 64*KB] >> bit) & 0x1) << 2) |
-		(((vd->vga_ram[offset + 3 * 64*KB] >> bit) & 0x1) << 3);
+	bit = (offset & (128 * KB - 1)) >> VGA_DIRTY_SHIFT;
+	if (!(__atomic_load_n(&vd->vga_dirty[bit / 64], __ATOMIC_RELAXED) & (1UL << (bit % 64))))
+		__atomic_fetch_or(&vd->vga_dirty[bit / 64], 1UL << (bit % 64), __ATOMIC_RELAXED);
+}
 
-	data &= vd->vga_atc.atc_color_plane_enb;
+/* Whether any of @len bytes of plane offset @offset was written */
+static bool
+vga_range_dirty(const uint64_t *dirty, int offset, int len)
+{
+	uint64_t bit, last;
 
-	if (vd->vga_atc.atc_mode & ATC_MC_IPS) {
-		idx = vd->vga_atc.atc_palette[data] & 0x0f;
-		idx |= vd->vga_atc.atc_color_select_45;
-	} else {
-		idx = vd->vga_atc.atc_palette[data];
-	}
-	idx |= vd->vga_atc.atc_color_select_67;
+	if (offset + len > 128 * KB)
+		return true;
 
-	return (vd->vga_dac.dac_palette_rgb[idx]);
+	last = (offset + len - 1) >> VGA_DIRTY_SHIFT;
+	for (bit = offset >> VGA_DIRTY_SHIFT; bit <= last; bit++)
+		if (dirty[bit / 64] & (1UL << (bit % 64)))
+			return true;
+	return false;
 }
 
+/* The colors of the 16 values the four planes can hold for a pixel */
 static void
-vga_render_graphics(struct vga_vdev *vd)
+vga_graphics_palette(struct vga_vdev *vd, uint32_t *rgb)
 {
-	int x, y;
+	uint8_t data, idx;
 
-	for (y = 0; y < vd->gc_height; y++) {
-		for (x = 0; x < vd->gc_width; x++) {
-			int offset;
-
-			offset = y * vd->gc_width + x;
-			vd->gc_image->data[offset] = vga_get_pixel(vd, x, y);
+	for (data = 0; data < 16; data++) {
+		if (vd->vga_atc.atc_mode & ATC_MC_IPS) {
+			idx = vd->vga_atc.atc_palette[data & vd->vga_atc.atc_color_plane_enb] & 0x0f;
+			idx |= vd->vga_atc.atc_color_select_45;
+		} else {
+			idx = vd->vga_atc.atc_palette[data & vd->vga_atc.atc_color_plane_enb];
 		}
+		idx |= vd->vga_atc.atc_color_select_67;
+		rgb[data] = vd->vga_dac.dac_palette_rgb[idx];
 	}
 }
 
-static uint32_t
-vga_get_text_pixel(struct vga_vdev *vd, int x, int y)
+/*
+ * The vector converters below work like the table: each plane byte is
+ * spread to one byte per pixel, the four planes are OR-ed into the 4-bit
+ * color value, and the 16 colors are looked up with a byte shuffle per
+ * color channel. They return how many pixels they converted, a multiple
+ * of 8 the scalar code continues from.
+ */
+__attribute__((target("avx2")))
+static int
+vga_planar_avx2(const uint8_t *plane, uint32_t *dst, const uint32_t *rgb, int width)
 {
-	int dots, offset, bit, font_offset;
-	uint8_t ch, attr, font;
-	uint8_t idx;
-
-	dots = vd->vga_seq.seq_cm_dots;
-
-	offset = 2 * vd->vga_crtc.crtc_start_addr;
-	offset += (y / 16 * vd->gc_width / dots) * 2 + (x / dots) * 2;
+	const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+			1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+			3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i bits = _mm256_set1_epi64x(0x0102040810204080L);
+	__m256i tbl[4], c[4], idx, m, lo01, hi01, lo23, hi23, p0, p1, p2, p3;
+	uint8_t channel[4][16];
+	uint32_t v;
+	int x, i, k;
+
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < 16; i++)
+			channel[k][i] = rgb[i] >> (k * 8);
+		tbl[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)channel[k]));
+	}
 
-	bit = 7 - (x % dots > 7 ? 7 : x % dots);
+	for (x = 0; x + 32 <= width; x += 32, plane += 4, dst += 32) {
+		idx = _mm256_setzero_si256();
+		for (k = 0; k < 4; k++) {
+			memcpy(&v, plane + k * 64*KB, sizeof(v));
+			m = _mm256_shuffle_epi8(_mm256_set1_epi32(v), spread);
+			m = _mm256_cmpeq_epi8(_mm256_and_si256(m, bits), bits);
+			idx = _mm256_or_si256(idx, _mm256_and_si256(m, _mm256_set1_epi8(1 << k)));
+		}
+		for (k = 0; k < 4; k++)
+			c[k] = _mm256_shuffle_epi8(tbl[k], idx);
+
+		/* each 128-bit lane holds 16 pixels, lane 1 the upper ones */
+		lo01 = _mm256_unpacklo_epi8(c[0], c[1]);
+		hi01 = _mm256_unpackhi_epi8(c[0], c[1]);
+		lo23 = _mm256_unpacklo_epi8(c[2], c[3]);
+		hi23 = _mm256_unpackhi_epi8(c[2], c[3]);
+		p0 = _mm256_unpacklo_epi16(lo01, lo23);
+		p1 = _mm256_unpackhi_epi16(lo01, lo23);
+		p2 = _mm256_unpacklo_epi16(hi01, hi23);
+		p3 = _mm256_unpackhi_epi16(hi01, hi23);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 8), _mm256_permute2x128_si256(p2, p3, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256((__m256i *)(dst + 24), _mm256_permute2x128_si256(p2, p3, 0x31));
+	}
 
-	ch = vd->vga_ram[offset + 0 * 64*KB];
-	attr = vd->vga_ram[offset + 1 * 64*KB];
+	return x;
+}
 
-	if (vd->vga_crtc.crtc_cursor_on &&
-	    (offset == (vd->vga_crtc.crtc_cursor_loc * 2)) &&
-	    ((y % 16) >= (vd->vga_crtc.crtc_cursor_start & CRTC_CS_CS)) &&
-	    ((y % 16) <= (vd->vga_crtc.crtc_cursor_end & CRTC_CE_CE))) {
-		idx = vd->vga_atc.atc_palette[attr & 0xf];
-		return (vd->vga_dac.dac_palette_rgb[idx]);
+__attribute__((target("ssse3")))
+static int
+vga_planar_ssse3(const uint8_t *plane, uint32_t *dst, const uint32_t *rgb, int width)
+{
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+			1, 1, 1, 1, 1, 1, 1, 1);
+	const __m128i bits = _mm_set1_epi64x(0x0102040810204080L);
+	__m128i tbl[4], c[4], idx, m, lo01, hi01, lo23, hi23;
+	uint8_t channel[4][16];
+	uint16_t v;
+	int x, i, k;
+
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < 16; i++)
+			channel[k][i] = rgb[i] >> (k * 8);
+		tbl[k] = _mm_loadu_si128((__m128i *)channel[k]);
 	}
 
-	if ((vd->vga_seq.seq_mm & SEQ_MM_EM) &&
-	    vd->vga_seq.seq_cmap_pri_off != vd->vga_seq.seq_cmap_sec_off) {
-		if (attr & 0x8)
-			font_offset = vd->vga_seq.seq_cmap_pri_off +
-				(ch << 5) + y % 16;
-		else
-			font_offset = vd->vga_seq.seq_cmap_sec_off +
-				(ch << 5) + y % 16;
-		attr &= ~0x8;
-	} else {
-		font_offset = (ch << 5) + y % 16;
+	for (x = 0; x + 16 <= width; x += 16, plane += 2, dst += 16) {
+		idx = _mm_setzero_si128();
+		for (k = 0; k < 4; k++) {
+			memcpy(&v, plane + k * 64*KB, sizeof(v));
+			m = _mm_shuffle_epi8(_mm_cvtsi32_si128(v), spread);
+			m = _mm_cmpeq_epi8(_mm_and_si128(m, bits), bits);
+			idx = _mm_or_si128(idx, _mm_and_si128(m, _mm_set1_epi8(1 << k)));
+		}
+		for (k = 0; k < 4; k++)
+			c[k] = _mm_shuffle_epi8(tbl[k], idx);
+
+		lo01 = _mm_unpacklo_epi8(c[0], c[1]);
+		hi01 = _mm_unpackhi_epi8(c[0], c[1]);
+		lo23 = _mm_unpacklo_epi8(c[2], c[3]);
+		hi23 = _mm_unpackhi_epi8(c[2], c[3]);
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i *)(dst + 8), _mm_unpacklo_epi16(hi01, hi23));
+		_mm_storeu_si128((__m128i *)(dst + 12), _mm_unpackhi_epi16(hi01, hi23));
 	}
 
-	font = vd->vga_ram[font_offset + 2 * 64*KB];
+	return x;
+}
 
-	if (font & (1 << bit))
-		idx = vd->vga_atc.atc_palette[attr & 0xf];
-	else
-		idx = vd->vga_atc.atc_palette[attr >> 4];
+/*
+ * Draw one scanline of a glyph: the bits of @font select @fg or @bg, the
+ * 9th dot repeats the 8th.
+ */
+__attribute__((target("avx2")))
+static void
+vga_glyph_row_avx2(uint32_t *dst, uint8_t font, uint32_t fg, uint32_t bg, int dots)
+{
+	const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x8, 0x4, 0x2, 0x1);
+	__m256i m;
+
+	m = _mm256_and_si256(_mm256_set1_epi32(font), bits);
+	m = _mm256_cmpeq_epi32(m, bits);
+	_mm256_storeu_si256((__m256i *)dst, _mm256_blendv_epi8(_mm256_set1_epi32(bg),
+			_mm256_set1_epi32(fg), m));
+	if (dots > 8)
+		dst[8] = (font & 1) ? fg : bg;
+}
 
-	return (vd->vga_dac.dac_palette_rgb[idx]);
+/* SSE2 is part of x86-64, this is the baseline */
+static void
+vga_glyph_row_sse2(uint32_t *dst, uint8_t font, uint32_t fg, uint32_t bg, int dots)
+{
+	const __m128i bits_lo = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+	const __m128i bits_hi = _mm_setr_epi32(0x8, 0x4, 0x2, 0x1);
+	__m128i f, vfg, vbg, m;
+
+	f = _mm_set1_epi32(font);
+	vfg = _mm_set1_epi32(fg);
+	vbg = _mm_set1_epi32(bg);
+
+	m = _mm_cmpeq_epi32(_mm_and_si128(f, bits_lo), bits_lo);
+	_mm_storeu_si128((__m128i *)dst,
+			_mm_or_si128(_mm_and_si128(m, vfg), _mm_andnot_si128(m, vbg)));
+	m = _mm_cmpeq_epi32(_mm_and_si128(f, bits_hi), bits_hi);
+	_mm_storeu_si128((__m128i *)(dst + 4),
+			_mm_or_si128(_mm_and_si128(m, vfg), _mm_andnot_si128(m, vbg)));
+	if (dots > 8)
+		dst[8] = (font & 1) ? fg : bg;
 }
 
+/* picked by vga_init() for the CPU, no vector planar converter by default */
+static int (*vga_planar_fast)(const uint8_t *plane, uint32_t *dst,
+		const uint32_t *rgb, int width);
+static void (*vga_glyph_row)(uint32_t *dst, uint8_t font, uint32_t fg,
+		uint32_t bg, int dots) = vga_glyph_row_sse2;
+
+/*
+ * Convert scanline @y from the four planes. What the vector converter
+ * leaves is done 8 pixels at a time: the expanded plane bytes stack up to
+ * one 4-bit color value per byte.
+ */
 static void
-vga_render_text(struct vga_vdev *vd)
+vga_render_graphics_line(struct vga_vdev *vd, const uint32_t *rgb, int y)
 {
-	int x, y;
+	const uint8_t *plane;
+	uint32_t *dst;
+	uint64_t v;
+	int x, i, n;
+
+	plane = vd->vga_ram + y * (vd->gc_width / 8);
+	dst = vd->gc_image->data + y * vd->gc_width;
+
+	x = vga_planar_fast ? vga_planar_fast(plane, dst, rgb, vd->gc_width) : 0;
+	plane += x / 8;
+	dst += x;
+	for (; x < vd->gc_width; x += 8, plane++, dst += 8) {
+		v = vga_plane_expand[plane[0 * 64*KB]] |
+			(vga_plane_expand[plane[1 * 64*KB]] << 1) |
+			(vga_plane_expand[plane[2 * 64*KB]] << 2) |
+			(vga_plane_expand[plane[3 * 64*KB]] << 3);
+		n = MIN(8, vd->gc_width - x);
+		for (i = 0; i < n; i++)
+			dst[i] = rgb[(v >> (i * 8)) & 0xf];
+	}
+}
 
-	for (y = 0; y < vd->gc_height; y++) {
-		for (x = 0; x < vd->gc_width; x++) {
-			int offset;
+static void
+vga_render_graphics(struct vga_vdev *vd, const uint64_t *dirty, bool full,
+		pixman_region16_t *damage)
+{
+	uint32_t rgb[16];
+	int y, first, line_bytes;
+
+	vga_graphics_palette(vd, rgb);
+	line_bytes = vd->gc_width / 8;
+
+	first = -1;
+	for (y = 0; y <= vd->gc_height; y++) {
+		if ((y < vd->gc_height) &&
+		    (full || vga_range_dirty(dirty, y * line_bytes, line_bytes))) {
+			vga_render_graphics_line(vd, rgb, y);
+			if (first < 0)
+				first = y;
+		} else if (first >= 0) {
+			pixman_region_union_rect(damage, damage, 0, first,
+					vd->gc_width, y - first);
+			first = -1;
+		}
+	}
+}
+
+/* Draw the @row-th line of character cells */
+static void
+vga_render_text_row(struct vga_vdev *vd, const uint32_t *rgb, int row)
+{
+	int dots, cols, col, offset, font_offset, line, y, i;
+	uint32_t fg, bg, cursor;
+	uint8_t ch, attr;
+	uint32_t *dst;
+	bool has_cursor;
 
-			offset = y * vd->gc_width + x;
-			vd->gc_image->data[offset] = vga_get_text_pixel(vd, x, y);
+	dots = vd->vga_seq.seq_cm_dots;
+	cols = vd->gc_width / dots;
+	offset = 2 * vd->vga_crtc.crtc_start_addr + row * cols * 2;
+
+	for (col = 0; col < cols; col++, offset += 2) {
+		ch = vd->vga_ram[offset + 0 * 64*KB];
+		attr = vd->vga_ram[offset + 1 * 64*KB];
+
+		has_cursor = vd->vga_crtc.crtc_cursor_on &&
+			(offset == (vd->vga_crtc.crtc_cursor_loc * 2));
+		cursor = rgb[attr & 0xf];
+
+		if ((vd->vga_seq.seq_mm & SEQ_MM_EM) &&
+		    vd->vga_seq.seq_cmap_pri_off != vd->vga_seq.seq_cmap_sec_off) {
+			if (attr & 0x8)
+				font_offset = vd->vga_seq.seq_cmap_pri_off + (ch << 5);
+			else
+				font_offset = vd->vga_seq.seq_cmap_sec_off + (ch << 5);
+			attr &= ~0x8;
+		} else {
+			font_offset = ch << 5;
+		}
+		fg = rgb[attr & 0xf];
+		bg = rgb[attr >> 4];
+
+		for (line = 0; line < VGA_CHAR_HEIGHT; line++) {
+			y = row * VGA_CHAR_HEIGHT + line;
+			if (y >= vd->gc_height)
+				break;
+			dst = vd->gc_image->data + y * vd->gc_width + col * dots;
+
+			if (has_cursor &&
+			    (line >= (vd->vga_crtc.crtc_cursor_start & CRTC_CS_CS)) &&
+			    (line <= (vd->vga_crtc.crtc_cursor_end & CRTC_CE_CE))) {
+				for (i = 0; i < dots; i++)
+					dst[i] = cursor;
+				continue;
+			}
+
+			vga_glyph_row(dst, vd->vga_ram[font_offset + line + 2 * 64*KB],
+					fg, bg, dots);
 		}
 	}
 }
 
+static void
+vga_render_text(struct vga_vdev *vd, const uint64_t *dirty, bool full,
+		pixman_region16_t *damage)
+{
+	uint32_t rgb[16];
+	int row, rows, cols, i;
+
+	for (i = 0; i < 16; i++)
+		rgb[i] = vd->vga_dac.dac_palette_rgb[vd->vga_atc.atc_palette[i]];
+
+	cols = vd->gc_width / vd->vga_seq.seq_cm_dots;
+	rows = howmany(vd->gc_height, VGA_CHAR_HEIGHT);
+	for (row = 0; row < rows; row++) {
+		if (!full && !vga_range_dirty(dirty,
+				2 * vd->vga_crtc.crtc_start_addr + row * cols * 2,
+				cols * 2))
+			continue;
+
+		vga_render_text_row(vd, rgb, row);
+		pixman_region_union_rect(damage, damage, 0, row * VGA_CHAR_HEIGHT,
+				vd->gc_width, VGA_CHAR_HEIGHT);
+	}
+}
+
+/*
+ * Redraw what the guest changed since the last call and add the redrawn
+ * scanlines to @damage, which stays empty when nothing changed.
+ */
 void
-vga_render(struct gfx_ctx *gc, void *arg)
+vga_render(struct gfx_ctx *gc, void *arg, pixman_region16_t *damage)
 {
 	struct vga_vdev *vd = arg;
+	uint64_t dirty[VGA_DIRTY_WORDS];
+	bool full, font;
+	int i;
+
+	for (i = 0; i < VGA_DIRTY_WORDS; i++)
+		dirty[i] = __atomic_exchange_n(&vd->vga_dirty[i], 0, __ATOMIC_RELAXED);
+	full = __atomic_exchange_n(&vd->vga_regs_dirty, false, __ATOMIC_RELAXED);
+	font = __atomic_exchange_n(&vd->vga_font_dirty, false, __ATOMIC_RELAXED);
 
-	vga_check_size(gc, vd);
+	if (vga_check_size(gc, vd))
+		full = true;
 
 	if (vga_in_reset(vd)) {
-		memset(vd->gc_image->data, 0,
-		    vd->gc_image->width * vd->gc_image->height *
-		     sizeof (uint32_t));
+		if (full) {
+			memset(vd->gc_image->data, 0,
+			    vd->gc_image->width * vd->gc_image->height *
+			     sizeof (uint32_t));
+			pixman_region_union_rect(damage, damage, 0, 0,
+					vd->gc_image->width, vd->gc_image->height);
+		}
 		return;
 	}
 
 	if (vd->vga_gc.gc_misc_gm && (vd->vga_atc.atc_mode & ATC_MC_GA))
-		vga_render_graphics(vd);
+		vga_render_graphics(vd, dirty, full, damage);
 	else
-		vga_render_text(vd);
+		vga_render_text(vd, dirty, full || font, damage);
 }
 
 static uint64_t
@@ -655,19 +911,25 @@ vga_mem_wr_handler(struct vmctx *ctx, uint64_t addr, uint8_t val, void *arg1)
 		} else {
 			if (vd->vga_seq.seq_map_mask & 1)
 				vd->vga_ram[offset + 0*64*KB] = c0;
-			if (vd->vga_seq.seq_map_mask & 4)
+			if (vd->vga_seq.seq_map_mask & 4) {
 				vd->vga_ram[offset + 2*64*KB] = c2;
+				vd->vga_font_dirty = true;
+			}
 		}
 	} else {
 		if (vd->vga_seq.seq_map_mask & 1)
 			vd->vga_ram[offset + 0*64*KB] = c0;
 		if (vd->vga_seq.seq_map_mask & 2)
 			vd->vga_ram[offset + 1*64*KB] = c1;
-		if (vd->vga_seq.seq_map_mask & 4)
+		if (vd->vga_seq.seq_map_mask & 4) {
 			vd->vga_ram[offset + 2*64*KB] = c2;
+			vd->vga_font_dirty = true;
+		}
 		if (vd->vga_seq.seq_map_mask & 8)
 			vd->vga_ram[offset + 3*64*KB] = c3;
 	}
+
+	vga_mark_dirty(vd, offset);
 }
 
 static int
@@ -963,6 +1225,9 @@ vga_port_out_handler(struct vmctx *ctx, int in, int port, int bytes,
 {
 	struct vga_vdev *vd = arg;
 
+	/* the palettes, the mode, the cursor: redraw everything */
+	vd->vga_regs_dirty = true;
+
 	switch (port) {
 	case CRTC_IDX_MONO_PORT:
 	case CRTC_IDX_COLOR_PORT:
@@ -1288,7 +1553,7 @@ vga_init(struct gfx_ctx *gc, int io_only)
 {
 	struct inout_port iop;
 	struct vga_vdev *vd;
-	int port, error;
+	int port, error, val, bit;
 
 	vd = calloc(1, sizeof(struct vga_vdev));
 	if (!vd) {
@@ -1313,6 +1578,21 @@ vga_init(struct gfx_ctx *gc, int io_only)
 	}
 
 	vd->gc_image = gc->gc_image;
+	vd->vga_regs_dirty = true;
+
+	for (val = 0; val < 256; val++) {
+		vga_plane_expand[val] = 0;
+		for (bit = 0; bit < 8; bit++)
+			if (val & (0x80 >> bit))
+				vga_plane_expand[val] |= 1UL << (bit * 8);
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		vga_planar_fast = vga_planar_avx2;
+		vga_glyph_row = vga_glyph_row_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		vga_planar_fast = vga_planar_ssse3;
+	}
 
 	/* only handle io ports; vga graphics is disabled */
 	if (io_only)
@@ -1361,6 +1641,13 @@ vga_init(struct gfx_ctx *gc, int io_only)
 		}
 	}
 
+	/*
+	 * Writes to the VGA planes have no side effect until they are read
+	 * back or displayed, let them be posted. Done last, as the zone must
+	 * not outlive vd on an error.
+	 */
+	register_coalesced_io(ACRN_IOREQ_TYPE_MMIO, vd->mr.base, vd->mr.size);
+
 	return (vd);
 }
 
@@ -1485,6 +1772,65 @@ vga_vbe_read(struct vmctx *ctx, int vcpu, struct vga *vga,
 	return (value);
 }
 
+/* Make the next render and damage scan cover the whole screen */
+void
+vga_invalidate(struct vga *vga)
+{
+	struct vga_vdev *vd = vga->dev;
+
+	free(vga->shadow);
+	vga->shadow = NULL;
+	vga->shadow_size = 0;
+	if (vd)
+		vd->vga_regs_dirty = true;
+}
+
+/*
+ * The guest draws into the linear framebuffer directly. Find the scanlines
+ * it changed since the last call by comparing them with a shadow copy, and
+ * add them to @damage.
+ */
+void
+vga_vbe_damage(struct vga *vga, pixman_region16_t *damage)
+{
+	struct gfx_ctx_image *image;
+	size_t line, size;
+	uint8_t *fb;
+	int y, first;
+
+	image = vga->gc->gc_image;
+	line = image->width * sizeof(uint32_t);
+	size = line * image->height;
+	fb = (uint8_t *)image->data;
+	if (!size || !fb)
+		return;
+
+	if (size != vga->shadow_size) {
+		free(vga->shadow);
+		vga->shadow = malloc(size);
+		vga->shadow_size = vga->shadow ? size : 0;
+		if (vga->shadow)
+			memcpy(vga->shadow, fb, size);
+		pixman_region_union_rect(damage, damage, 0, 0,
+				image->width, image->height);
+		return;
+	}
+
+	first = -1;
+	for (y = 0; y <= image->height; y++) {
+		if ((y < image->height) &&
+		    memcmp(vga->shadow + y * line, fb + y * line, line)) {
+			memcpy(vga->shadow + y * line, fb + y * line, line);
+			if (first < 0)
+				first = y;
+		} else if (first >= 0) {
+			pixman_region_union_rect(damage, damage, 0, first,
+					image->width, y - first);
+			first = -1;
+		}
+	}
+}
+
 void vga_deinit(struct vga *vga)
 {
 	struct vga_vdev *vd;
@@ -1506,6 +1852,9 @@ void vga_deinit(struct vga *vga)
 		}
 	}
 
+	if (vd->mr.size != 0)
+		unregister_coalesced_io(ACRN_IOREQ_TYPE_MMIO, vd->mr.base, vd->mr.size);
+
 	rc = unregister_mem_fallback(&vd->mr);
 	if (rc == -1) {
 		pr_err("%s: fail to unregister mem fallback.\n", __func__);
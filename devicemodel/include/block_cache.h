@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Read cache for images that are never written, shared through a named
+ * shared memory segment by every DM instance using the same image.
+ */
+struct blkcache;
+
+struct blkcache *blkcache_open(int fd, uint32_t size_mb);
+void blkcache_close(struct blkcache *cache);
+ssize_t blkcache_preadv(struct blkcache *cache, int fd,
+		const struct iovec *iov, int iovcnt, off_t offset);
+
+#endif
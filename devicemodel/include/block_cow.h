@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BLOCK_COW_H_
+#define _BLOCK_COW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Sparse copy-on-write overlay on top of a raw base image. The overlay
+ * only holds the clusters written by the guest; everything else is read
+ * from the base, which is never written and can be shared by many VMs.
+ */
+struct cow_image;
+struct blkcache;
+
+struct cow_image *cow_open(const char *path, const char *base_path,
+		int base_fd, off_t base_size, bool ro);
+void cow_close(struct cow_image *img);
+void cow_set_base_cache(struct cow_image *img, struct blkcache *cache);
+off_t cow_size(struct cow_image *img);
+ssize_t cow_preadv(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		off_t offset);
+ssize_t cow_pwritev(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		off_t offset);
+int cow_flush(struct cow_image *img);
+int64_t cow_commit(struct cow_image *img, off_t *pos, uint64_t max_bytes);
+
+#endif
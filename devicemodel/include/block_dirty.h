@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BLOCK_DIRTY_H_
+#define _BLOCK_DIRTY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BLKDIRTY_MAGIC		0x54524442U	/* "BDRT" */
+#define BLKDIRTY_VERSION	1
+
+/*
+ * Layout of the shared memory segment, for backup tools mapping it
+ * read-only. Both bitmaps are arrays of 64-bit words, bit N of word W
+ * covering bytes [(W * 64 + N) * granularity, +granularity) of the disk.
+ */
+struct blkdirty_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;		/* of the disk, in bytes */
+	uint32_t	granularity;	/* bytes covered by one bit */
+	uint32_t	pad;
+	uint64_t	nr_words;	/* of each bitmap */
+	uint64_t	generation;	/* snapshots taken so far */
+	uint64_t	live_offset;	/* written since the last snapshot */
+	uint64_t	snap_offset;	/* written between the last two snapshots */
+};
+
+struct blkdirty;
+
+struct blkdirty *blkdirty_open(const char *ident, off_t size, uint32_t granularity);
+void blkdirty_close(struct blkdirty *dirty);
+void blkdirty_mark(struct blkdirty *dirty, off_t offset, off_t len);
+uint64_t blkdirty_snapshot(struct blkdirty *dirty);
+const char *blkdirty_name(struct blkdirty *dirty);
+
+#endif
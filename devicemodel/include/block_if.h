@@ -42,6 +42,18 @@
 #include "iothread.h"
 
 #define BLOCKIF_IOV_MAX		256	/* not practical to be IOV_MAX */
+#define BLOCKIF_BOUNCE_IOV_MAX	8	/* pieces of a misaligned request, see br_align_info */
+#define BLOCKIF_HIST_BUCKETS	8
+
+/* per queue statistics, see blockif_get_stats() */
+struct blockif_stats {
+	int		inflight;
+	uint64_t	nr_reqs;
+	/* queue depth seen by new requests: 1, 2, <=4, <=8, ..., <=64, more */
+	uint64_t	depth_hist[BLOCKIF_HIST_BUCKETS];
+	/* completion latency: <=16us, <=64us, <=256us, ..., <=64ms, more */
+	uint64_t	lat_hist[BLOCKIF_HIST_BUCKETS];
+};
 
 /*
  *  |<------------------------------------- bounced_size --------------------------------->|
@@ -79,11 +91,16 @@ struct br_align_info {
 	off_t		aligned_dn_end;
 
 	/*
-	 * A bounce_iov for aligned read/write access.
-	 * bounce_iov.iov_base is aligned to @alignment
-	 * bounce_iov.iov_len is @bounced_size (@head + @org_size + @tail)
+	 * The aligned request, covering @bounced_size (@head + @org_size + @tail)
+	 * from @aligned_dn_start. Each entry is either a piece of the guest buffers
+	 * that is already aligned, or a piece of @bounce_buf.
 	 */
-	struct iovec	bounce_iov;
+	struct iovec	bounce_iov[BLOCKIF_BOUNCE_IOV_MAX];
+	int		bounce_iovcnt;
+
+	/* buffer from the bounce pool backing the misaligned pieces, or NULL */
+	void		*bounce_buf;
+	size_t		bounce_len;
 };
 
 struct blockif_req {
@@ -109,17 +126,27 @@ void	blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off);
 int	blockif_queuesz(struct blockif_ctxt *bc);
 int	blockif_is_ro(struct blockif_ctxt *bc);
 int	blockif_candiscard(struct blockif_ctxt *bc);
+void	blockif_plug(struct blockif_ctxt *bc, int qidx);
+void	blockif_unplug(struct blockif_ctxt *bc, int qidx);
 int	blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq);
+int	blockif_write_zeroes(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_close(struct blockif_ctxt *bc);
 uint8_t	blockif_get_wce(struct blockif_ctxt *bc);
 void	blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce);
 int	blockif_flush_all(struct blockif_ctxt *bc);
+int	blockif_set_qos(struct blockif_ctxt *bc, const char *opts);
+int	blockif_get_stats(struct blockif_ctxt *bc, int qidx, struct blockif_stats *stats);
+int	blockif_snapshot(struct blockif_ctxt *bc, const char *overlay);
+int	blockif_commit(struct blockif_ctxt *bc);
 int	blockif_max_discard_sectors(struct blockif_ctxt *bc);
 int	blockif_max_discard_seg(struct blockif_ctxt *bc);
 int	blockif_discard_sector_alignment(struct blockif_ctxt *bc);
+uint32_t	blockif_max_write_zeroes_sectors(struct blockif_ctxt *bc);
+int	blockif_max_write_zeroes_seg(struct blockif_ctxt *bc);
+int	blockif_write_zeroes_may_unmap(struct blockif_ctxt *bc);
 
 #endif /* _BLOCK_IF_H_ */
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BLOCK_QOS_H_
+#define _BLOCK_QOS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLKQOS_GROUP_NAME_LEN	32
+
+struct blkqos_conf {
+	uint64_t	iops;		/* 0 means unlimited */
+	uint64_t	bps;		/* 0 means unlimited */
+	uint32_t	burst_ms;	/* how long a bucket may save up for */
+	uint32_t	weight;		/* share within the group */
+	uint32_t	lat_us;		/* latency target within the group, 0 if none */
+	char		group[BLKQOS_GROUP_NAME_LEN];	/* empty if not grouped */
+	uint64_t	group_iops;	/* limits shared by the whole group */
+	uint64_t	group_bps;
+};
+
+struct blkqos;
+
+void blkqos_conf_init(struct blkqos_conf *conf);
+int blkqos_parse_opt(struct blkqos_conf *conf, const char *opt);
+int blkqos_parse(struct blkqos_conf *conf, const char *opts);
+bool blkqos_conf_enabled(const struct blkqos_conf *conf);
+
+struct blkqos *blkqos_create(const struct blkqos_conf *conf);
+int blkqos_update(struct blkqos *qos, const char *opts);
+void blkqos_throttle(struct blkqos *qos, uint32_t ops, size_t bytes);
+void blkqos_complete(struct blkqos *qos, uint64_t lat_ns);
+void blkqos_destroy(struct blkqos *qos);
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef COALESCED_IO_H
+#define COALESCED_IO_H
+
+#include <types.h>
+#include "vmmapi.h"
+
+/*
+ * Writes to a coalesced I/O zone are posted by the hypervisor to a ring
+ * instead of being sent to the device model one by one. They are only
+ * emulated when the ring is drained, before the next request or shortly
+ * after the last one, so a zone must only cover registers whose writes
+ * have no side effect visible to the guest until its next access to the
+ * device. Device state read outside of a request must be drained first.
+ */
+int coalesced_io_init(struct vmctx *ctx);
+void coalesced_io_deinit(void);
+void coalesced_io_enter(struct vmctx *ctx);
+void coalesced_io_exit(void);
+void coalesced_io_drain(struct vmctx *ctx);
+int register_coalesced_io(uint32_t type, uint64_t addr, uint64_t size);
+int unregister_coalesced_io(uint32_t type, uint64_t addr, uint64_t size);
+
+#endif /* COALESCED_IO_H */
@@ -26,6 +26,9 @@ struct monitor_vm_ops {
 	int (*unpause) (void *arg);
 	int (*query) (void *arg);
 	int (*rescan)(void *arg, char *devargs);
+	int (*blkqos)(void *arg, char *devargs);
+	int (*blkstat)(void *arg, char *devargs, char *buf, size_t len);
+	int (*blksnap)(void *arg, char *devargs);
 };
 
 int monitor_register_vm_ops(struct monitor_vm_ops *ops, void *arg,
@@ -36,6 +39,9 @@ unsigned get_wakeup_reason(void);
 int set_wakeup_timer(time_t t);
 int acrn_parse_intr_monitor(const char *opt);
 int vm_monitor_blkrescan(void *arg, char *devargs);
+int vm_monitor_blkqos(void *arg, char *devargs);
+int vm_monitor_blkstat(void *arg, char *devargs, char *buf, size_t len);
+int vm_monitor_blksnap(void *arg, char *devargs);
 
 int vm_monitor_send_vm_event(const char *msg);
 
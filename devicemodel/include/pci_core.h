@@ -178,6 +178,12 @@ struct pci_vdev {
 
 	void	*arg;		/* devemu-private data */
 
+	/*
+	 * Serializes the config space and BAR emulation of this device, so
+	 * that ioreqs of different vCPUs can be dispatched concurrently.
+	 */
+	pthread_mutex_t	emul_lock;
+
 	uint8_t	cfgdata[PCI_REGMAX + 1];
 	/* 0..5 is used for PCI MMIO/IO bar. 6 is used for PCI ROMbar */
 	struct pcibar bar[PCI_BARMAX + 2];
@@ -146,6 +146,14 @@
 #define ACRN_IOCTL_SETUP_VM_EVENT_FD	\
 	_IOW(ACRN_IOCTL_TYPE, 0xa1, int)
 
+/* Coalesced IO */
+#define ACRN_IOCTL_SETUP_COALESCED_IO	\
+	_IOW(ACRN_IOCTL_TYPE, 0xb0, __u64)
+#define ACRN_IOCTL_ASSIGN_COALESCED_IO	\
+	_IOW(ACRN_IOCTL_TYPE, 0xb1, struct acrn_coalesced_io_zone)
+#define ACRN_IOCTL_DEASSIGN_COALESCED_IO	\
+	_IOW(ACRN_IOCTL_TYPE, 0xb2, struct acrn_coalesced_io_zone)
+
 #define	ACRN_MEM_ACCESS_RIGHT_MASK	0x00000007U
 #define	ACRN_MEM_ACCESS_READ		0x00000001U
 #define	ACRN_MEM_ACCESS_WRITE		0x00000002U
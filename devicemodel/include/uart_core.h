@@ -29,6 +29,7 @@
 #ifndef _UART_CORE_H_
 #define	_UART_CORE_H_
 
+#include <stdbool.h>
 
 #define	UART_IO_BAR_SIZE	8
 
@@ -40,6 +41,7 @@ int     uart_legacy_reinit_res(int which, int baseaddr, int irq);
 void	uart_legacy_dealloc(int which);
 uint8_t	uart_read(struct uart_vdev *uart, int offset);
 void	uart_write(struct uart_vdev *uart, int offset, uint8_t value);
+bool	uart_thr_write_is_silent(struct uart_vdev *uart);
 struct	uart_vdev*
 	uart_set_backend(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 		void *arg, const char *opts);
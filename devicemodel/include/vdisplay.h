@@ -64,6 +64,11 @@ struct surface {
 	uint32_t bpp;
 	uint32_t stride;
 	void *pixel;
+	/*
+	 * Area changed since the last vdpy_surface_update(), relative to
+	 * (x, y). NULL means the whole surface. Only read during the call.
+	 */
+	pixman_region16_t *damage;
 	struct  {
 		int dmabuf_fd;
 		uint32_t surf_fourcc;
@@ -92,6 +97,7 @@ void vdpy_surface_set(int handle, int scanout_id, struct surface *surf);
 void vdpy_surface_update(int handle, int scanout_id, struct surface *surf);
 bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh);
 void vdpy_get_edid(int handle, int scanout_id, uint8_t *edid, size_t size);
+bool vdpy_dmabuf_supported(int handle);
 void vdpy_cursor_define(int handle, int scanout_id, struct cursor *cur);
 void vdpy_cursor_move(int handle, int scanout_id, uint32_t x, uint32_t y);
 int vdpy_deinit(int handle);
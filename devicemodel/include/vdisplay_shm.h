@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Shared memory frame ring of the headless virtual display
+ *
+ */
+#ifndef _VDISPLAY_SHM_H_
+#define _VDISPLAY_SHM_H_
+
+#include <stdint.h>
+#include <pixman.h>
+
+#define VDPY_SHM_MAGIC		0x59504456U	/* "VDPY" */
+#define VDPY_SHM_VERSION	1
+#define VDPY_SHM_SLOTS		3
+#define VDPY_SHM_MAX_RECTS	16
+
+/*
+ * Layout of /dev/shm/acrn-vdpy-<dm pid>-<scanout>, for viewers mapping it
+ * read-only. The newest frame is in slots[last_frame % VDPY_SHM_SLOTS]; a
+ * reader copies it out and checks that the seq of the slot was even and
+ * did not change meanwhile, as the writer only touches the oldest slot.
+ * When a larger frame no longer fits, the segment is replaced by a new
+ * one of the same name and stale is set in the old one.
+ */
+struct vdpy_shm_rect {
+	uint32_t	x;
+	uint32_t	y;
+	uint32_t	w;
+	uint32_t	h;
+};
+
+struct vdpy_shm_frame {
+	uint32_t	seq;		/* odd while the slot is being written */
+	uint32_t	format;		/* pixman format code, 32 bits per pixel */
+	uint64_t	frame_nr;
+	uint64_t	present_ns;	/* CLOCK_MONOTONIC */
+	uint64_t	latency_ns;	/* from the first update to the present */
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	stride;
+	uint32_t	nr_rects;	/* damage since the previous frame, 0 if all of it */
+	struct vdpy_shm_rect	rects[VDPY_SHM_MAX_RECTS];
+	uint64_t	data_offset;	/* of the pixels, from the start of the segment */
+};
+
+struct vdpy_shm_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nr_slots;
+	uint32_t	stale;
+	uint64_t	slot_size;	/* bytes of pixels each slot can hold */
+	uint64_t	last_frame;	/* 0 until the first frame */
+	int32_t		cursor_x;
+	int32_t		cursor_y;
+	/* totals since the display started */
+	uint64_t	frames;
+	uint64_t	bytes;		/* copied into the slots */
+	uint64_t	latency_sum_ns;
+	uint64_t	latency_max_ns;
+	struct vdpy_shm_frame	slots[VDPY_SHM_SLOTS];
+};
+
+struct vdpy_shm;
+
+struct vdpy_shm *vdpy_shm_open(int scanout_id, uint32_t width, uint32_t height);
+void vdpy_shm_close(struct vdpy_shm *shm);
+size_t vdpy_shm_update(struct vdpy_shm *shm, const void *pixel, uint32_t stride,
+		pixman_format_code_t format, uint32_t width, uint32_t height,
+		pixman_region16_t *damage);
+void vdpy_shm_publish(struct vdpy_shm *shm, uint64_t latency_ns);
+void vdpy_shm_set_cursor(struct vdpy_shm *shm, int x, int y);
+int vdpy_shm_capture(struct vdpy_shm *shm, const char *dir);
+
+#endif /* _VDISPLAY_SHM_H_ */
@@ -169,6 +169,12 @@ struct vga {
 	struct gfx_ctx *gc;
 	struct surface surf;
 	pthread_t tid;
+	/* scanlines changed and not displayed yet */
+	pixman_region16_t damage;
+	pthread_mutex_t damage_mtx;
+	/* last seen content of the linear framebuffer */
+	uint8_t *shadow;
+	size_t shadow_size;
 	struct {
 		uint16_t  id;
 		uint16_t  xres;
@@ -185,7 +191,9 @@ struct vga {
 };
 
 void *vga_init(struct gfx_ctx *gc, int io_only);
-void vga_render(struct gfx_ctx *gc, void *arg);
+void vga_render(struct gfx_ctx *gc, void *arg, pixman_region16_t *damage);
+void vga_vbe_damage(struct vga *vga, pixman_region16_t *damage);
+void vga_invalidate(struct vga *vga);
 int vga_port_in_handler(struct vmctx *ctx, int in, int port, int bytes,
 		     uint8_t *val, void *arg);
 int vga_port_out_handler(struct vmctx *ctx, int in, int port, int bytes,
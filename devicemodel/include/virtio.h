@@ -124,6 +124,23 @@
  * notify, when descriptors are added to the corresponding ring.
  * (These are provided only for interrupt optimization and need
  * not be implemented.)
+ *
+ * If VIRTIO_F_RING_PACKED is negotiated (virtio 1.1), the three
+ * areas are replaced by a single ring of <N> 16-byte descriptors
+ * (a 64-bit <addr>, 32-bit <len>, 16-bit buffer <id> and 16-bit
+ * <flags>) plus two 4-byte event suppression structures, one
+ * written by the driver and one by the device.  The guest hands
+ * the driver event structure over in the "avail" address and the
+ * device event structure in the "used" address.  The driver makes
+ * a descriptor available by setting its AVAIL flag bit to its wrap
+ * counter and its USED flag bit to the inverse; the device returns
+ * a buffer by overwriting the next descriptor slot in ring order
+ * with the buffer <id> and <len>, and setting both AVAIL and USED
+ * to its own wrap counter.  Both wrap counters start at 1 and are
+ * flipped each time the respective index wraps around the ring.
+ * A chain is a run of consecutive descriptors linked by NEXT, and
+ * an INDIRECT descriptor points to a table of packed descriptors
+ * that are all part of the same chain.
  */
 
 #include <linux/virtio_ring.h>
@@ -461,6 +478,20 @@ struct virtio_vq_info {
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	bool packed;		/**< VIRTIO_F_RING_PACKED layout in use */
+	bool avail_wrap;	/**< driver ring wrap counter (packed) */
+	bool used_wrap;		/**< device ring wrap counter (packed) */
+	uint16_t used_idx;	/**< next slot to write back (packed) */
+	uint16_t last_chain_ndesc;
+				/**< slots taken by last chain (packed) */
+	uint16_t *packed_ndesc;	/**< slots taken per buffer id (packed) */
+	volatile struct vring_packed_desc *packed_desc;
+				/**< packed descriptor ring */
+	volatile struct vring_packed_desc_event *driver_event;
+				/**< driver event suppression (packed) */
+	volatile struct vring_packed_desc_event *device_event;
+				/**< device event suppression (packed) */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -495,6 +526,15 @@ static inline bool
 vq_has_descs(struct virtio_vq_info *vq)
 {
 	bool ret = false;
+	uint16_t flags;
+
+	if (vq_ring_ready(vq) && vq->packed) {
+		flags = vq->packed_desc[vq->last_avail].flags;
+		return !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) ==
+			vq->avail_wrap &&
+		       !!(flags & (1 << VRING_PACKED_DESC_F_USED)) !=
+			vq->avail_wrap;
+	}
 	if (vq_ring_ready(vq) && vq->last_avail != vq->avail->idx) {
 		if ((uint16_t)((u_int)vq->avail->idx - vq->last_avail) > vq->qsize)
 			pr_err ("%s: no valid descriptor\n", vq->base->vops->name);
@@ -665,6 +705,47 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief A descriptor chain handled as part of a batch.
+ */
+struct vq_chain {
+	uint16_t idx;		/**< head index, as returned by vq_getchain() */
+	int n;			/**< number of descriptors, or -1 if invalid */
+	uint32_t len;		/**< bytes written, for vq_relchain() */
+	struct iovec *iov;	/**< iov[] of this chain */
+	uint16_t *flags;	/**< flags of each descriptor, or NULL */
+};
+
+/**
+ * @brief Walk through up to nchains available chains at once.
+ *
+ * Chain k is put into iov[k * n_iov] (and flags[k * n_iov] if flags is
+ * not NULL), so both arrays must hold nchains * n_iov entries.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to an array of nchains struct vq_chain.
+ * @param nchains Maximum number of chains to fetch.
+ * @param iov Pointer to iov[] array prepared by caller.
+ * @param n_iov Number of iov[] entries per chain.
+ * @param flags Pointer to a uint16_t array, or NULL.
+ *
+ * @return number of chains fetched, or -1 on a confused ring. Only the
+ * last fetched chain may be invalid (n < 0).
+ */
+int vq_getchains_batch(struct virtio_vq_info *vq, struct vq_chain *chains,
+		       int nchains, struct iovec *iov, int n_iov,
+		       uint16_t *flags);
+
+/**
+ * @brief Return the trailing chains of a batch back to the available ring.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to the first chain to return.
+ * @param nchains Number of chains to return, up to the end of the batch.
+ */
+void vq_retchains_batch(struct virtio_vq_info *vq, struct vq_chain *chains,
+			int nchains);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -688,6 +769,18 @@ void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
 
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * Ask the guest not to kick the given virtqueue. Drivers should use this
+ * instead of touching the used ring, since a packed virtqueue carries
+ * the flag in its device event suppression structure instead.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_set_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
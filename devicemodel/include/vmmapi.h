@@ -30,6 +30,7 @@
 #define	_VMMAPI_H_
 
 #include <sys/param.h>
+#include <sys/uio.h>
 #include "types.h"
 #include "macros.h"
 #include "pm.h"
@@ -108,6 +109,9 @@ int	vm_destroy_ioreq_client(struct vmctx *ctx);
 int	vm_attach_ioreq_client(struct vmctx *ctx);
 int	vm_notify_request_done(struct vmctx *ctx, int vcpu);
 int	vm_setup_asyncio(struct vmctx *ctx, uint64_t base);
+int	vm_setup_coalesced_io(struct vmctx *ctx, uint64_t base);
+int	vm_assign_coalesced_io(struct vmctx *ctx, struct acrn_coalesced_io_zone *zone);
+int	vm_deassign_coalesced_io(struct vmctx *ctx, struct acrn_coalesced_io_zone *zone);
 void	vm_clear_ioreq(struct vmctx *ctx);
 const char *vm_state_to_str(enum vm_suspend_how idx);
 void	vm_set_suspend_mode(enum vm_suspend_how how);
@@ -125,6 +129,7 @@ bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+int	hugetlb_get_mem_regions(struct iovec *iov, int max);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 size_t	vm_get_lowmem_size(struct vmctx *ctx);
@@ -751,11 +751,13 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 		spinlock_init(&vm->vlapic_mode_lock);
 		spinlock_init(&vm->ept_lock);
 		spinlock_init(&vm->emul_mmio_lock);
+		spinlock_init(&vm->coalesced_io_lock);
 		spinlock_init(&vm->arch_vm.iwkey_backup_lock);
 
 		vm->arch_vm.vlapic_mode = VM_VLAPIC_XAPIC;
 		vm->intr_inject_delay_delta = 0UL;
-		vm->nr_emul_mmio_regions = 0U;
+		vm->emul_mmio_index.nr = 0U;
+		vm->emul_mmio_index.nr_overlap = 0U;
 		vm->vcpuid_entry_nr = 0U;
 
 		/* Set up IO bit-mask such that VM exit occurs on
@@ -810,6 +812,7 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 			*rtn_vm = vm;
 			vm->sw.io_shared_page = NULL;
 			vm->sw.asyncio_sbuf = NULL;
+			vm->sw.coalesced_io_sbuf = NULL;
 			if ((vm_config->load_order == POST_LAUNCHED_VM)
 				&& ((vm_config->guest_flags & GUEST_FLAG_IO_COMPLETION_POLLING) != 0U)) {
 				/* enable IO completion polling mode per its guest flags in vm_config. */
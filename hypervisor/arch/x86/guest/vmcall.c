@@ -62,6 +62,10 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_asyncio_assign},
 	[HC_IDX(HC_ASYNCIO_DEASSIGN)] = {
 		.handler = hcall_asyncio_deassign},
+	[HC_IDX(HC_COALESCED_IO_ASSIGN)] = {
+		.handler = hcall_coalesced_io_assign},
+	[HC_IDX(HC_COALESCED_IO_DEASSIGN)] = {
+		.handler = hcall_coalesced_io_deassign},
 	[HC_IDX(HC_NOTIFY_REQUEST_FINISH)] = {
 		.handler = hcall_notify_ioreq_finish},
 	[HC_IDX(HC_VM_SET_MEMORY_REGIONS)] = {
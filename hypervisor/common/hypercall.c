@@ -569,6 +569,32 @@ int32_t hcall_asyncio_deassign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *
 	return ret;
 }
 
+int32_t hcall_coalesced_io_assign(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		 __unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_coalesced_io_zone zone;
+	struct acrn_vm *vm = vcpu->vm;
+	int32_t ret = -1;
+
+	if (copy_from_gpa(vm, &zone, param2, sizeof(zone)) == 0) {
+		ret = add_coalesced_io(target_vm, &zone);
+	}
+	return ret;
+}
+
+int32_t hcall_coalesced_io_deassign(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		 __unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_coalesced_io_zone zone;
+	struct acrn_vm *vm = vcpu->vm;
+	int32_t ret = -1;
+
+	if (copy_from_gpa(vm, &zone, param2, sizeof(zone)) == 0) {
+		ret = remove_coalesced_io(target_vm, &zone);
+	}
+	return ret;
+}
+
 /**
  * @brief notify request done
  *
@@ -106,6 +106,9 @@ int32_t sbuf_setup_common(struct acrn_vm *vm, uint16_t cpu_id, uint32_t sbuf_id,
 		case ACRN_VM_EVENT:
 			ret = init_vm_event(vm, hva);
 			break;
+		case ACRN_COALESCED_IO:
+			ret = init_coalesced_io(vm, hva);
+			break;
 		default:
 			pr_err("%s not support sbuf_id %d", __func__, sbuf_id);
 			ret = -1;
@@ -46,6 +46,7 @@ static int32_t shell_show_cpu_int(__unused int32_t argc, __unused char **argv);
 static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv);
 static int32_t shell_show_vioapic_info(int32_t argc, char **argv);
 static int32_t shell_show_ioapic_info(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_pio_stat(int32_t argc, char **argv);
 static int32_t shell_loglevel(int32_t argc, char **argv);
 static int32_t shell_cpuid(int32_t argc, char **argv);
 static int32_t shell_reboot(int32_t argc, char **argv);
@@ -125,6 +126,12 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_IOAPIC_HELP,
 		.fcn		= shell_show_ioapic_info,
 	},
+	{
+		.str		= SHELL_CMD_PIO_STAT,
+		.cmd_param	= SHELL_CMD_PIO_STAT_PARAM,
+		.help_str	= SHELL_CMD_PIO_STAT_HELP,
+		.fcn		= shell_show_pio_stat,
+	},
 	{
 		.str		= SHELL_CMD_LOG_LVL,
 		.cmd_param	= SHELL_CMD_LOG_LVL_PARAM,
@@ -1400,6 +1407,77 @@ static int32_t shell_show_vioapic_info(int32_t argc, char **argv)
 	return -EINVAL;
 }
 
+static void get_pio_stat(char *str_arg, size_t str_max, uint16_t vmid)
+{
+	char *str = str_arg;
+	size_t len, size = str_max;
+	struct acrn_vm *vm = get_vm_from_vmid(vmid);
+	const struct vm_io_handler_desc *handler;
+	uint64_t count, cycles;
+	uint32_t idx;
+
+	if (is_poweroff_vm(vm)) {
+		len = snprintf(str, size, "\r\nvm is not exist for vmid %hu", vmid);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+		goto END;
+	}
+
+	len = snprintf(str, size, "\r\nIDX\tPORT\t\tCOUNT\t\tCYCLES/ACCESS");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (idx = 0U; idx < EMUL_PIO_IDX_MAX; idx++) {
+		handler = &(vm->emul_pio[idx]);
+		if ((handler->io_read == NULL) && (handler->io_write == NULL)) {
+			continue;
+		}
+		count = handler->exit_count;
+		cycles = (uint64_t)handler->exit_cycles;
+
+		len = snprintf(str, size, "\r\n%u\t0x%04hx-0x%04hx\t%lu\t\t%lu", idx,
+				handler->port_start, handler->port_end - 1U, count,
+				(count != 0UL) ? (cycles / count) : 0UL);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+END:
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_pio_stat(int32_t argc, char **argv)
+{
+	uint16_t vmid;
+	int32_t ret;
+
+	/* User input invalidation */
+	if (argc != 2) {
+		return -EINVAL;
+	}
+	ret = strtol_deci(argv[1]);
+	if (ret >= 0) {
+		vmid = sanitize_vmid((uint16_t) ret);
+		get_pio_stat(shell_log_buf, SHELL_LOG_BUF_SIZE, vmid);
+		shell_puts(shell_log_buf);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
 /**
  * @brief Get information of ioapic
  *
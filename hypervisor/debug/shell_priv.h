@@ -96,6 +96,10 @@ struct shell {
 #define SHELL_CMD_VIOAPIC_PARAM		"<vm id>"
 #define SHELL_CMD_VIOAPIC_HELP		"Show virtual IOAPIC (vIOAPIC) information for a specific VM"
 
+#define SHELL_CMD_PIO_STAT		"pio_stat"
+#define SHELL_CMD_PIO_STAT_PARAM	"<vm id>"
+#define SHELL_CMD_PIO_STAT_HELP		"Show the accesses emulated by the port I/O handlers of the hypervisor for a specific VM"
+
 #define SHELL_CMD_LOG_LVL		"loglevel"
 #define SHELL_CMD_LOG_LVL_PARAM		"[<console_loglevel> [<mem_loglevel> [npk_loglevel]]]"
 #define SHELL_CMD_LOG_LVL_HELP		"No argument: get the level of logging for the console, memory and npk. Set "\
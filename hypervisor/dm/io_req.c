@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <logmsg.h>
 #include <sbuf.h>
+#include <asm/tsc.h>
 
 #define DBG_LEVEL_IOREQ	6U
 
@@ -57,10 +58,18 @@ __unused static void acrn_print_request(uint16_t vcpu_id, const struct acrn_io_r
 void reset_vm_ioreqs(struct acrn_vm *vm)
 {
 	uint16_t i;
+	struct acrn_io_request_buffer *req_buf;
 
 	for (i = 0U; i < ACRN_IO_REQUEST_MAX; i++) {
 		set_io_req_state(vm, i, ACRN_IOREQ_STATE_FREE);
 	}
+
+	req_buf = (struct acrn_io_request_buffer *)vm->sw.io_shared_page;
+	if (req_buf != NULL) {
+		stac();
+		req_buf->req_slot[0].pending_bitmap = 0UL;
+		clac();
+	}
 }
 
 /**
@@ -269,6 +278,13 @@ int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_
 			acrn_io_req->completion_polling = 1U;
 			is_polling = true;
 		}
+
+		/*
+		 * Publish the slot in the pending bitmap so that the clients don't
+		 * need to scan all the slots to find it.
+		 */
+		bitmap_set_lock(cur, &req_buf->req_slot[0].pending_bitmap);
+		atomic_inc64(&req_buf->req_slot[0].pending_seq);
 		clac();
 
 		/* Before updating the acrn_io_req state, enforce all fill acrn_io_req operations done */
@@ -364,6 +380,145 @@ int init_asyncio(struct acrn_vm *vm, uint64_t *hva)
 	return ret;
 }
 
+int init_coalesced_io(struct acrn_vm *vm, uint64_t *hva)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)hva;
+	int ret = -1;
+
+	stac();
+	if (sbuf != NULL) {
+		if ((sbuf->magic == SBUF_MAGIC) && (sbuf->ele_size == sizeof(struct acrn_coalesced_io))) {
+			vm->sw.coalesced_io_sbuf = sbuf;
+			ret = 0;
+		}
+	}
+	clac();
+
+	return ret;
+}
+
+int add_coalesced_io(struct acrn_vm *vm, const struct acrn_coalesced_io_zone *zone)
+{
+	uint32_t i;
+	int ret = -1;
+	struct acrn_coalesced_io_zone *iter;
+
+	if ((zone->size != 0UL) && ((zone->type == ACRN_IOREQ_TYPE_PORTIO) || (zone->type == ACRN_IOREQ_TYPE_MMIO))) {
+		spinlock_obtain(&vm->coalesced_io_lock);
+		for (i = 0U; i < ACRN_COALESCED_IO_MAX; i++) {
+			iter = &(vm->coalesced_io_zones[i]);
+			if ((iter->size != 0UL) && (iter->type == zone->type) &&
+				(zone->addr < (iter->addr + iter->size)) && (iter->addr < (zone->addr + zone->size))) {
+				pr_err("%s, [0x%lx, 0x%lx) overlaps a registered zone!", __func__,
+					zone->addr, zone->addr + zone->size);
+				break;
+			}
+		}
+
+		if (i == ACRN_COALESCED_IO_MAX) {
+			for (i = 0U; i < ACRN_COALESCED_IO_MAX; i++) {
+				iter = &(vm->coalesced_io_zones[i]);
+				if (iter->size == 0UL) {
+					*iter = *zone;
+					ret = 0;
+					break;
+				}
+			}
+			if (i == ACRN_COALESCED_IO_MAX) {
+				pr_err("%s, no free coalesced I/O zone!", __func__);
+			}
+		}
+		spinlock_release(&vm->coalesced_io_lock);
+	}
+	return ret;
+}
+
+int remove_coalesced_io(struct acrn_vm *vm, const struct acrn_coalesced_io_zone *zone)
+{
+	uint32_t i;
+	int ret = -1;
+	struct acrn_coalesced_io_zone *iter;
+
+	spinlock_obtain(&vm->coalesced_io_lock);
+	for (i = 0U; i < ACRN_COALESCED_IO_MAX; i++) {
+		iter = &(vm->coalesced_io_zones[i]);
+		if ((iter->size != 0UL) && (iter->type == zone->type) &&
+			(iter->addr == zone->addr) && (iter->size == zone->size)) {
+			(void)memset(iter, 0U, sizeof(*iter));
+			ret = 0;
+			break;
+		}
+	}
+	spinlock_release(&vm->coalesced_io_lock);
+
+	return ret;
+}
+
+/**
+ * @brief Post a write to the coalesced I/O ring of the device model
+ *
+ * The write is only posted if it falls in a coalesced I/O zone, the device
+ * model drains the ring before handling any other request.
+ *
+ * @retval 0 The write is posted, \p vcpu can resume.
+ * @retval -ENODEV The request is not a write to a coalesced I/O zone.
+ * @retval -EBUSY The ring is full, the request has to be sent to the device model.
+ */
+static int32_t acrn_insert_coalesced_io(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct shared_buf *sbuf = (struct shared_buf *)vm->sw.coalesced_io_sbuf;
+	const struct acrn_coalesced_io_zone *zone;
+	struct acrn_coalesced_io entry;
+	uint32_t i;
+	int32_t ret = -ENODEV;
+
+	if (sbuf != NULL) {
+		entry.type = io_req->io_type;
+		entry.reserved = 0UL;
+		switch (io_req->io_type) {
+		case ACRN_IOREQ_TYPE_PORTIO:
+			entry.addr = io_req->reqs.pio_request.address;
+			entry.size = (uint32_t)io_req->reqs.pio_request.size;
+			entry.value = io_req->reqs.pio_request.value;
+			if (io_req->reqs.pio_request.direction != ACRN_IOREQ_DIR_WRITE) {
+				entry.size = 0U;
+			}
+			break;
+		case ACRN_IOREQ_TYPE_MMIO:
+			entry.addr = io_req->reqs.mmio_request.address;
+			entry.size = (uint32_t)io_req->reqs.mmio_request.size;
+			entry.value = io_req->reqs.mmio_request.value;
+			if (io_req->reqs.mmio_request.direction != ACRN_IOREQ_DIR_WRITE) {
+				entry.size = 0U;
+			}
+			break;
+		default:
+			entry.size = 0U;
+			break;
+		}
+
+		if (entry.size != 0U) {
+			spinlock_obtain(&vm->coalesced_io_lock);
+			for (i = 0U; i < ACRN_COALESCED_IO_MAX; i++) {
+				zone = &(vm->coalesced_io_zones[i]);
+				if ((zone->size != 0UL) && (zone->type == entry.type) && (entry.addr >= zone->addr) &&
+					((entry.addr + entry.size) <= (zone->addr + zone->size))) {
+					if (sbuf_put(sbuf, (uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+						ret = 0;
+					} else {
+						ret = -EBUSY;
+					}
+					break;
+				}
+			}
+			spinlock_release(&vm->coalesced_io_lock);
+		}
+	}
+
+	return ret;
+}
+
 void set_hsm_notification_vector(uint32_t vector)
 {
 	acrn_hsm_notification_vector = vector;
@@ -421,6 +576,9 @@ static void complete_ioreq(struct acrn_vcpu *vcpu, struct io_request *io_req)
 		}
 	}
 
+	/* The slot must leave the pending bitmap before it can be reused. */
+	bitmap_clear_lock(vcpu->vcpu_id, &req_buf->req_slot[0].pending_bitmap);
+
 	/*
 	 * Only HV will check whether processed is ACRN_IOREQ_STATE_FREE on per-vCPU before inject a ioreq.
 	 * Only HV will set processed to ACRN_IOREQ_STATE_FREE when ioreq is done.
@@ -569,6 +727,42 @@ static int32_t mmio_default_access_handler(struct io_request *io_req,
 	return 0;
 }
 
+/**
+ * @brief Find the port I/O handler of \p port
+ *
+ * @return The handler registered for \p port, or NULL if there is none.
+ */
+static struct vm_io_handler_desc *find_pio_handler(struct acrn_vm *vm, uint16_t port)
+{
+	const struct pio_index *index = &(vm->emul_pio_index);
+	struct vm_io_handler_desc *handler = NULL;
+	uint8_t table, slot;
+	uint32_t idx;
+
+	table = index->page[port >> EMUL_PIO_PAGE_SHIFT];
+	if (table == EMUL_PIO_PAGE_SCAN) {
+		for (idx = 0U; idx < EMUL_PIO_IDX_MAX; idx++) {
+			if ((port >= vm->emul_pio[idx].port_start) && (port < vm->emul_pio[idx].port_end)) {
+				handler = &(vm->emul_pio[idx]);
+				break;
+			}
+		}
+	} else if (table != 0U) {
+		slot = index->table[table - 1U][port & (EMUL_PIO_PAGE_SIZE - 1U)];
+		if (slot != 0U) {
+			handler = &(vm->emul_pio[slot - 1U]);
+			/* the table may have been freed and given to another page meanwhile */
+			if ((port < handler->port_start) || (port >= handler->port_end)) {
+				handler = NULL;
+			}
+		}
+	} else {
+		/* no handler in this page */
+	}
+
+	return handler;
+}
+
 /**
  * Try handling the given request by any port I/O handler registered in the
  * hypervisor.
@@ -584,12 +778,13 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 {
 	int32_t status = -ENODEV;
 	uint16_t port, size;
-	uint32_t idx;
-	struct acrn_vm *vm = vcpu->vm;
 	struct acrn_pio_request *pio_req = &io_req->reqs.pio_request;
 	struct vm_io_handler_desc *handler;
 	io_read_fn_t io_read = NULL;
 	io_write_fn_t io_write = NULL;
+#ifdef HV_DEBUG
+	uint64_t start_tsc = rdtsc();
+#endif
 
 	if (is_service_vm(vcpu->vm) || is_prelaunched_vm(vcpu->vm)) {
 		io_read = pio_default_read;
@@ -599,20 +794,14 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 	port = (uint16_t)pio_req->address;
 	size = (uint16_t)pio_req->size;
 
-	for (idx = 0U; idx < EMUL_PIO_IDX_MAX; idx++) {
-		handler = &(vm->emul_pio[idx]);
-
-		if ((port < handler->port_start) || (port >= handler->port_end)) {
-			continue;
-		}
-
+	handler = find_pio_handler(vcpu->vm, port);
+	if (handler != NULL) {
 		if (handler->io_read != NULL) {
 			io_read = handler->io_read;
 		}
 		if (handler->io_write != NULL) {
 			io_write = handler->io_write;
 		}
-		break;
 	}
 
 	if ((pio_req->direction == ACRN_IOREQ_DIR_WRITE) && (io_write != NULL)) {
@@ -627,6 +816,13 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 		/* do nothing */
 	}
 
+#ifdef HV_DEBUG
+	if (handler != NULL) {
+		atomic_inc64(&handler->exit_count);
+		(void)atomic_xadd64(&handler->exit_cycles, (int64_t)(rdtsc() - start_tsc));
+	}
+#endif
+
 	pr_dbg("IO %s on port %04x, data %08x",
 		(pio_req->direction == ACRN_IOREQ_DIR_READ) ? "read" : "write", port, pio_req->value);
 
@@ -646,58 +842,35 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 static int32_t
 hv_emulate_mmio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 {
-	int32_t status = -ENODEV;
-	bool hold_lock = true;
-	uint16_t idx;
-	uint64_t address, size, base, end;
+	int32_t status;
+	bool hold_lock = false;
+	struct acrn_vm *vm = vcpu->vm;
 	struct acrn_mmio_request *mmio_req = &io_req->reqs.mmio_request;
-	struct mem_io_node *mmio_handler = NULL;
-	hv_mem_io_handler_t read_write = NULL;
-	void *handler_private_data = NULL;
+	struct mem_io_node mmio_node;
 
-	if (is_service_vm(vcpu->vm) || is_prelaunched_vm(vcpu->vm)) {
-		read_write = mmio_default_access_handler;
+	status = find_mmio_node(vm->emul_mmio, &(vm->emul_mmio_index), &(vm->emul_mmio_seq),
+			&(vcpu->mmio_hint), mmio_req->address, mmio_req->size, &mmio_node);
+	if ((status == 0) && mmio_node.hold_lock) {
+		/* This handler shall be serialized with the (un)registration of handlers */
+		spinlock_obtain(&vm->emul_mmio_lock);
+		hold_lock = true;
+		status = find_mmio_node(vm->emul_mmio, &(vm->emul_mmio_index), &(vm->emul_mmio_seq),
+				&(vcpu->mmio_hint), mmio_req->address, mmio_req->size, &mmio_node);
 	}
 
-	address = mmio_req->address;
-	size = mmio_req->size;
-
-	spinlock_obtain(&vcpu->vm->emul_mmio_lock);
-	for (idx = 0U; idx <= vcpu->vm->nr_emul_mmio_regions; idx++) {
-		mmio_handler = &(vcpu->vm->emul_mmio[idx]);
-		if (mmio_handler->read_write != NULL) {
-			base = mmio_handler->range_start;
-			end = mmio_handler->range_end;
-
-			if (((address + size) <= base) || (address >= end)) {
-				continue;
-			} else {
-				 if ((address >= base) && ((address + size) <= end)) {
-					hold_lock = mmio_handler->hold_lock;
-					read_write = mmio_handler->read_write;
-					handler_private_data = mmio_handler->handler_private_data;
-				} else {
-					pr_fatal("Err MMIO, address:0x%lx, size:%x", address, size);
-					status = -EIO;
-				}
-				break;
-			}
-		}
+	if (status == 0) {
+		status = mmio_node.read_write(io_req, mmio_node.handler_private_data);
+	} else if (status == -EIO) {
+		pr_fatal("Err MMIO, address:0x%lx, size:%x", mmio_req->address, mmio_req->size);
+	} else if ((status == -ENODEV) && (is_service_vm(vcpu->vm) || is_prelaunched_vm(vcpu->vm))) {
+		status = mmio_default_access_handler(io_req, NULL);
+	} else {
+		/* No handler in hypervisor, or invalid access */
 	}
 
-	if ((status == -ENODEV) && (read_write != NULL)) {
-		/* This mmio_handler will never modify once register, so we don't
-		 * need to hold the lock when handling the MMIO access.
-		 */
-		if (!hold_lock) {
-			spinlock_release(&vcpu->vm->emul_mmio_lock);
-		}
-		status = read_write(io_req, handler_private_data);
-		if (!hold_lock) {
-			spinlock_obtain(&vcpu->vm->emul_mmio_lock);
-		}
+	if (hold_lock) {
+		spinlock_release(&vm->emul_mmio_lock);
 	}
-	spinlock_release(&vcpu->vm->emul_mmio_lock);
 
 	return status;
 }
@@ -756,13 +929,18 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 		 *
 		 * ACRN insert request to HSM and inject upcall.
 		 */
-		aio_desc = get_asyncio_desc(vcpu, io_req);
-		if (aio_desc) {
-			status = acrn_insert_asyncio(vcpu, aio_desc->asyncio_info.fd);
+		if (acrn_insert_coalesced_io(vcpu, io_req) == 0) {
+			/* posted to the device model, nothing to complete for a write */
+			status = 0;
 		} else {
-			status = acrn_insert_request(vcpu, io_req);
-			if (status == 0) {
-				dm_emulate_io_complete(vcpu);
+			aio_desc = get_asyncio_desc(vcpu, io_req);
+			if (aio_desc) {
+				status = acrn_insert_asyncio(vcpu, aio_desc->asyncio_info.fd);
+			} else {
+				status = acrn_insert_request(vcpu, io_req);
+				if (status == 0) {
+					dm_emulate_io_complete(vcpu);
+				}
 			}
 		}
 		if (status != 0) {
@@ -781,6 +959,91 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 }
 
 
+/**
+ * @brief Take a free table of the PIO handler index
+ *
+ * @return The table number plus one, or EMUL_PIO_PAGE_SCAN if none is left.
+ */
+static uint8_t alloc_pio_table(struct pio_index *index)
+{
+	uint8_t table = EMUL_PIO_PAGE_SCAN;
+	uint32_t i;
+
+	for (i = 0U; i < EMUL_PIO_TABLE_NUM; i++) {
+		if (!index->table_used[i]) {
+			index->table_used[i] = true;
+			(void)memset(index->table[i], 0U, EMUL_PIO_PAGE_SIZE);
+			table = (uint8_t)(i + 1U);
+			break;
+		}
+	}
+
+	return table;
+}
+
+static bool is_pio_table_empty(const uint8_t *slots)
+{
+	bool empty = true;
+	uint32_t i;
+
+	for (i = 0U; i < EMUL_PIO_PAGE_SIZE; i++) {
+		if (slots[i] != 0U) {
+			empty = false;
+			break;
+		}
+	}
+
+	return empty;
+}
+
+/**
+ * @brief Set the ports in [start, end) mapped to \p old_slot to \p new_slot in the PIO handler index
+ *
+ * A table is assigned to the pages which get a handler and have none yet. It
+ * is filled before the page is switched to it, so that lookups running
+ * concurrently never see a partial table. Pages for which no table is left
+ * fall back to searching the handlers. The table of a page left without
+ * handlers is freed for other pages.
+ */
+static void update_pio_index(struct acrn_vm *vm, uint32_t start, uint32_t end, uint8_t old_slot, uint8_t new_slot)
+{
+	struct pio_index *index = &(vm->emul_pio_index);
+	uint32_t port, page, page_end;
+	uint8_t table;
+
+	port = start;
+	while (port < end) {
+		page = port >> EMUL_PIO_PAGE_SHIFT;
+		page_end = min((page + 1U) << EMUL_PIO_PAGE_SHIFT, end);
+		table = index->page[page];
+
+		if ((table == 0U) && (new_slot != 0U)) {
+			table = alloc_pio_table(index);
+			if (table == EMUL_PIO_PAGE_SCAN) {
+				pr_err("%s, vm[%d] no PIO table left for port 0x%x", __func__, vm->vm_id, port);
+			}
+		}
+
+		if ((table != 0U) && (table != EMUL_PIO_PAGE_SCAN)) {
+			for (; port < page_end; port++) {
+				if (index->table[table - 1U][port & (EMUL_PIO_PAGE_SIZE - 1U)] == old_slot) {
+					index->table[table - 1U][port & (EMUL_PIO_PAGE_SIZE - 1U)] = new_slot;
+				}
+			}
+			if ((new_slot == 0U) && is_pio_table_empty(index->table[table - 1U])) {
+				index->table_used[table - 1U] = false;
+				table = 0U;
+			}
+		}
+
+		if (index->page[page] != table) {
+			cpu_write_memory_barrier();
+			index->page[page] = table;
+		}
+		port = page_end;
+	}
+}
+
 /**
  * @brief Register a port I/O handler
  *
@@ -794,13 +1057,48 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 void register_pio_emulation_handler(struct acrn_vm *vm, uint32_t pio_idx,
 		const struct vm_io_range *range, io_read_fn_t io_read_fn_ptr, io_write_fn_t io_write_fn_ptr)
 {
+	struct vm_io_handler_desc *handler = &(vm->emul_pio[pio_idx]);
+
 	if (is_service_vm(vm)) {
 		deny_guest_pio_access(vm, range->base, range->len);
 	}
-	vm->emul_pio[pio_idx].port_start = range->base;
-	vm->emul_pio[pio_idx].port_end = range->base + range->len;
-	vm->emul_pio[pio_idx].io_read = io_read_fn_ptr;
-	vm->emul_pio[pio_idx].io_write = io_write_fn_ptr;
+
+	/* Drop the ports of a previous registration of this handler from the index */
+	update_pio_index(vm, handler->port_start, handler->port_end, (uint8_t)pio_idx + 1U, 0U);
+
+	handler->port_start = range->base;
+	handler->port_end = range->base + range->len;
+	handler->io_read = io_read_fn_ptr;
+	handler->io_write = io_write_fn_ptr;
+
+	update_pio_index(vm, range->base, (uint32_t)range->base + range->len, 0U, (uint8_t)pio_idx + 1U);
+}
+
+/**
+ * @brief Start publishing an update of the MMIO handlers
+ *
+ * Lookups running concurrently wait until publish_mmio_index() is called and
+ * retry.
+ *
+ * @pre vm->emul_mmio_lock is held
+ */
+static inline void begin_mmio_update(struct acrn_vm *vm)
+{
+	vm->emul_mmio_seq++;
+	cpu_write_memory_barrier();
+}
+
+/**
+ * @brief Rebuild the MMIO handler index from the nodes and let lookups use it
+ *
+ * @pre vm->emul_mmio_lock is held
+ * @pre begin_mmio_update() was called
+ */
+static inline void publish_mmio_index(struct acrn_vm *vm)
+{
+	build_mmio_index(vm->emul_mmio, &(vm->emul_mmio_index));
+	cpu_write_memory_barrier();
+	vm->emul_mmio_seq++;
 }
 
 /**
@@ -811,26 +1109,26 @@ void register_pio_emulation_handler(struct acrn_vm *vm, uint32_t pio_idx,
  * @param vm The VM to which the MMIO node is belong to.
  *
  * @return If there's a match mmio_node return it, otherwise return NULL;
+ *
+ * @pre vm->emul_mmio_lock is held
  */
 static inline struct mem_io_node *find_match_mmio_node(struct acrn_vm *vm,
 				uint64_t start, uint64_t end)
 {
-	bool found = false;
 	uint16_t idx;
-	struct mem_io_node *mmio_node;
+	struct mem_io_node *mmio_node = NULL;
 
 	for (idx = 0U; idx < CONFIG_MAX_EMULATED_MMIO_REGIONS; idx++) {
-		mmio_node = &(vm->emul_mmio[idx]);
-		if ((mmio_node->range_start == start) && (mmio_node->range_end == end)) {
-			found = true;
+		if ((vm->emul_mmio[idx].read_write != NULL) && (vm->emul_mmio[idx].range_start == start) &&
+				(vm->emul_mmio[idx].range_end == end)) {
+			mmio_node = &(vm->emul_mmio[idx]);
 			break;
 		}
 	}
 
-	if (!found) {
+	if (mmio_node == NULL) {
 		pr_info("%s, vm[%d] no match mmio region [0x%lx, 0x%lx] is found",
 				__func__, vm->vm_id, start, end);
-		mmio_node = NULL;
 	}
 
 	return mmio_node;
@@ -843,21 +1141,22 @@ static inline struct mem_io_node *find_match_mmio_node(struct acrn_vm *vm,
  *
  * @param vm The VM to which the MMIO node is belong to.
  *
- * @return If there's a free mmio_node return it, otherwise return NULL;
+ * @return If there's a free mmio_node return its slot, otherwise return
+ *         CONFIG_MAX_EMULATED_MMIO_REGIONS;
+ *
+ * @pre vm->emul_mmio_lock is held
  */
-static inline struct mem_io_node *find_free_mmio_node(struct acrn_vm *vm)
+static inline uint16_t find_free_mmio_node(const struct acrn_vm *vm)
 {
 	uint16_t idx;
-	struct mem_io_node *mmio_node = find_match_mmio_node(vm, 0UL, 0UL);
 
-	if (mmio_node != NULL) {
-		idx = (uint16_t)(uint64_t)(mmio_node - &(vm->emul_mmio[0U]));
-		if (vm->nr_emul_mmio_regions < idx) {
-			vm->nr_emul_mmio_regions = idx;
+	for (idx = 0U; idx < CONFIG_MAX_EMULATED_MMIO_REGIONS; idx++) {
+		if (vm->emul_mmio[idx].read_write == NULL) {
+			break;
 		}
 	}
 
-	return mmio_node;
+	return idx;
 }
 
 /**
@@ -876,18 +1175,25 @@ void register_mmio_emulation_handler(struct acrn_vm *vm,
 	uint64_t end, void *handler_private_data, bool hold_lock)
 {
 	struct mem_io_node *mmio_node;
+	uint16_t slot;
 
 	/* Ensure both a read/write handler and range check function exist */
 	if ((read_write != NULL) && (end > start)) {
 		spinlock_obtain(&vm->emul_mmio_lock);
-		mmio_node = find_free_mmio_node(vm);
-		if (mmio_node != NULL) {
+		slot = find_free_mmio_node(vm);
+		if (slot < CONFIG_MAX_EMULATED_MMIO_REGIONS) {
+			begin_mmio_update(vm);
 			/* Fill in information for this node */
+			mmio_node = &(vm->emul_mmio[slot]);
 			mmio_node->hold_lock = hold_lock;
 			mmio_node->read_write = read_write;
 			mmio_node->handler_private_data = handler_private_data;
 			mmio_node->range_start = start;
 			mmio_node->range_end = end;
+			publish_mmio_index(vm);
+		} else {
+			pr_err("%s, vm[%d] no free mmio node for region [0x%lx, 0x%lx]",
+					__func__, vm->vm_id, start, end);
 		}
 		spinlock_release(&vm->emul_mmio_lock);
 	}
@@ -911,13 +1217,26 @@ void unregister_mmio_emulation_handler(struct acrn_vm *vm,
 	spinlock_obtain(&vm->emul_mmio_lock);
 	mmio_node = find_match_mmio_node(vm, start, end);
 	if (mmio_node != NULL) {
+		begin_mmio_update(vm);
 		(void)memset(mmio_node, 0U, sizeof(struct mem_io_node));
+		publish_mmio_index(vm);
 	}
 	spinlock_release(&vm->emul_mmio_lock);
 }
 
 void deinit_emul_io(struct acrn_vm *vm)
 {
+	spinlock_obtain(&vm->emul_mmio_lock);
+	begin_mmio_update(vm);
 	(void)memset(vm->emul_mmio, 0U, sizeof(vm->emul_mmio));
+	publish_mmio_index(vm);
+	spinlock_release(&vm->emul_mmio_lock);
+
 	(void)memset(vm->emul_pio, 0U, sizeof(vm->emul_pio));
+	(void)memset(&vm->emul_pio_index, 0U, sizeof(vm->emul_pio_index));
+
+	spinlock_obtain(&vm->coalesced_io_lock);
+	vm->sw.coalesced_io_sbuf = NULL;
+	(void)memset(vm->coalesced_io_zones, 0U, sizeof(vm->coalesced_io_zones));
+	spinlock_release(&vm->coalesced_io_lock);
 }
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Sorted index of the MMIO handler nodes of a VM, and the lookup of the node
+ * handling an access. They only depend on the nodes they are given, so that
+ * they can also be built and measured on the host (see
+ * misc/debug_tools/acrn_bench).
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <asm/cpu.h>
+#include <io_req.h>
+
+/**
+ * @brief Find the position in \p index where a node starting at \p start belongs
+ *
+ * @return The number of sorted nodes in \p index whose range starts below \p start.
+ */
+static uint16_t mmio_index_lower_bound(const struct mem_io_node *nodes, const struct mem_io_index *index,
+		uint64_t start)
+{
+	uint16_t lo = 0U, hi = index->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1U);
+		if (nodes[index->slot[mid]].range_start < start) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * @brief Binary search the sorted nodes of \p index for the one covering \p address
+ *
+ * @return The slot of the node covering \p address, or
+ *         CONFIG_MAX_EMULATED_MMIO_REGIONS if there is none.
+ */
+static uint16_t search_mmio_index(const struct mem_io_node *nodes, const struct mem_io_index *index,
+		uint64_t address)
+{
+	uint16_t lo = 0U, hi = index->nr, mid, slot;
+	uint16_t ret = CONFIG_MAX_EMULATED_MMIO_REGIONS;
+	const struct mem_io_node *mmio_node;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1U);
+		slot = index->slot[mid];
+		mmio_node = &(nodes[slot]);
+		if (address < mmio_node->range_start) {
+			hi = mid;
+		} else if (address >= mmio_node->range_end) {
+			lo = mid + 1U;
+		} else {
+			ret = slot;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Build \p index from the in-use nodes of \p nodes
+ *
+ * The nodes are taken in slot order. A node overlapping one which is already
+ * sorted goes to the overlap list, so a node is sorted again as soon as the
+ * overlap goes away.
+ */
+void build_mmio_index(const struct mem_io_node *nodes, struct mem_io_index *index)
+{
+	const struct mem_io_node *mmio_node;
+	uint16_t slot, pos, i;
+
+	index->nr = 0U;
+	index->nr_overlap = 0U;
+	for (slot = 0U; slot < CONFIG_MAX_EMULATED_MMIO_REGIONS; slot++) {
+		mmio_node = &(nodes[slot]);
+		if (mmio_node->read_write == NULL) {
+			continue;
+		}
+
+		pos = mmio_index_lower_bound(nodes, index, mmio_node->range_start);
+		if (((pos > 0U) && (nodes[index->slot[pos - 1U]].range_end > mmio_node->range_start)) ||
+			((pos < index->nr) && (nodes[index->slot[pos]].range_start < mmio_node->range_end))) {
+			index->overlap[index->nr_overlap] = slot;
+			index->nr_overlap++;
+		} else {
+			for (i = index->nr; i > pos; i--) {
+				index->slot[i] = index->slot[i - 1U];
+			}
+			index->slot[pos] = slot;
+			index->nr++;
+		}
+	}
+}
+
+/**
+ * @brief Find the node handling an access of \p size bytes at \p address
+ *
+ * Like a walk of all the nodes in slot order, the node with the lowest slot
+ * which the access hits is returned, whether it covers all of the access or
+ * not.
+ *
+ * @return The slot of the node, or CONFIG_MAX_EMULATED_MMIO_REGIONS if there
+ *         is none.
+ */
+uint16_t lookup_mmio_index(const struct mem_io_node *nodes, const struct mem_io_index *index,
+		uint64_t address, uint64_t size)
+{
+	const struct mem_io_node *mmio_node;
+	uint16_t slot, last, i;
+
+	slot = search_mmio_index(nodes, index, address);
+	/* the access may also start in or before one range and end in another */
+	last = search_mmio_index(nodes, index, address + size - 1UL);
+	if (last < slot) {
+		slot = last;
+	}
+
+	for (i = 0U; i < index->nr_overlap; i++) {
+		mmio_node = &(nodes[index->overlap[i]]);
+		if ((index->overlap[i] < slot) && (address < mmio_node->range_end) &&
+				((address + size) > mmio_node->range_start)) {
+			slot = index->overlap[i];
+		}
+	}
+
+	return slot;
+}
+
+/**
+ * @brief Find the node handling an access without holding the lock of \p nodes
+ *
+ * The node of the last hit slot in \p hint is tried first, then \p index is
+ * searched. \p seq is odd while the nodes and the index are being updated:
+ * the lookup waits for it to be even and is retried if it changed meanwhile,
+ * so that \p mmio_node always gets a consistent copy of the node.
+ *
+ * @retval 0 A node covers the access, a copy of it is stored in \p mmio_node.
+ * @retval -ENODEV No node covers the access.
+ * @retval -EIO The access spans a node range and cannot be emulated.
+ */
+int32_t find_mmio_node(const struct mem_io_node *nodes, const struct mem_io_index *index,
+		const volatile uint32_t *seq, uint16_t *hint, uint64_t address, uint64_t size,
+		struct mem_io_node *mmio_node)
+{
+	const struct mem_io_node *node;
+	uint32_t start_seq;
+	uint16_t slot;
+	int32_t status;
+
+	do {
+		/* wait for an update being published */
+		start_seq = *seq;
+		while ((start_seq & 1U) != 0U) {
+			asm_pause();
+			start_seq = *seq;
+		}
+		cpu_compiler_barrier();
+
+		status = -ENODEV;
+		slot = *hint;
+		node = &(nodes[slot]);
+		/* with overlapping nodes, another one than the hint may come first */
+		if ((index->nr_overlap != 0U) || (node->read_write == NULL) ||
+				(address < node->range_start) || (address >= node->range_end)) {
+			slot = lookup_mmio_index(nodes, index, address, size);
+		}
+
+		if (slot < CONFIG_MAX_EMULATED_MMIO_REGIONS) {
+			*mmio_node = nodes[slot];
+			status = 0;
+		}
+		cpu_compiler_barrier();
+	} while (start_seq != *seq);
+
+	if (status == 0) {
+		if ((address >= mmio_node->range_start) && ((address + size) <= mmio_node->range_end)) {
+			*hint = slot;
+		} else {
+			status = -EIO;
+		}
+	}
+
+	return status;
+}
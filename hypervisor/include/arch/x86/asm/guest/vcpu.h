@@ -318,6 +318,7 @@ struct acrn_vcpu {
 
 	struct instr_emul_ctxt inst_ctxt;
 	struct io_request req; /* used by io/ept emulation */
+	uint16_t mmio_hint; /* emul_mmio slot of the last hit MMIO handler */
 
 	uint64_t reg_cached;
 	uint64_t reg_updated;
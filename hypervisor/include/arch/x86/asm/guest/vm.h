@@ -73,6 +73,7 @@ struct vm_sw_info {
 	void *io_shared_page;
 	void *asyncio_sbuf;
 	void *vm_event_sbuf;
+	void *coalesced_io_sbuf;
 	/* If enable IO completion polling mode */
 	bool is_polling_ioreq;
 };
@@ -149,6 +150,8 @@ struct acrn_vm {
 	struct list_head aiodesc_queue;
 	spinlock_t asyncio_lock; /* Spin-lock used to protect asyncio add/remove for a VM */
 	spinlock_t vm_event_lock;
+	struct acrn_coalesced_io_zone coalesced_io_zones[ACRN_COALESCED_IO_MAX];
+	spinlock_t coalesced_io_lock; /* Spin-lock used to protect the coalesced I/O zones and ring of a VM */
 
 	enum vpic_wire_mode wire_mode;
 	struct iommu_domain *iommu;	/* iommu domain of this VM */
@@ -159,11 +162,14 @@ struct acrn_vm {
 	spinlock_t wbinvd_lock;		/* Spin-lock used to serialize wbinvd emulation */
 	spinlock_t vlapic_mode_lock;	/* Spin-lock used to protect vlapic_mode modifications for a VM */
 	spinlock_t ept_lock;	/* Spin-lock used to protect ept add/modify/remove for a VM */
-	spinlock_t emul_mmio_lock;	/* Used to protect emulation mmio_node concurrent access for a VM */
-	uint16_t nr_emul_mmio_regions;	/* the emulated mmio_region number */
+	spinlock_t emul_mmio_lock;	/* Used to serialize the registration of emulation mmio_node for a VM */
+	/* Sequence count of emul_mmio updates, odd while an update is being published */
+	volatile uint32_t emul_mmio_seq;
+	struct mem_io_index emul_mmio_index;
 	struct mem_io_node emul_mmio[CONFIG_MAX_EMULATED_MMIO_REGIONS];
 
 	struct vm_io_handler_desc emul_pio[EMUL_PIO_IDX_MAX];
+	struct pio_index emul_pio_index;
 
 	char name[MAX_VM_NAME_LEN];
 	struct secure_world_control sworld_control;
@@ -28,6 +28,42 @@
 #define PIO_RESET_REG_IDX		(CF9_PIO_IDX + 1U)
 #define SLEEP_CTL_PIO_IDX		(PIO_RESET_REG_IDX + 1U)
 #define EMUL_PIO_IDX_MAX		(SLEEP_CTL_PIO_IDX + 1U)
+
+/* The port I/O space is split in pages of EMUL_PIO_PAGE_SIZE ports in the PIO handler index */
+#define EMUL_PIO_PAGE_SHIFT	8U
+#define EMUL_PIO_PAGE_SIZE	(1U << EMUL_PIO_PAGE_SHIFT)
+#define EMUL_PIO_PAGE_NUM	(0x10000U >> EMUL_PIO_PAGE_SHIFT)
+/* A handler range smaller than a page spans at most two pages */
+#define EMUL_PIO_TABLE_NUM	(EMUL_PIO_IDX_MAX * 2U)
+/* Page marker telling that the handlers of the page must be searched */
+#define EMUL_PIO_PAGE_SCAN	0xFFU
+
+/**
+ * @brief Direct-mapped index of the port I/O handlers of a VM
+ *
+ * Each page of the port I/O space with registered handlers is given a table,
+ * which maps every port of the page to its handler. An all-zero index has no
+ * handler.
+ */
+struct pio_index {
+	/**
+	 * @brief Table number plus one of each page, 0 if the page has no table
+	 *
+	 * EMUL_PIO_PAGE_SCAN if no table was left for the page.
+	 */
+	uint8_t page[EMUL_PIO_PAGE_NUM];
+
+	/**
+	 * @brief Whether each table is assigned to a page
+	 */
+	bool table_used[EMUL_PIO_TABLE_NUM];
+
+	/**
+	 * @brief Index in emul_pio plus one of the handler of each port, 0 for none
+	 */
+	uint8_t table[EMUL_PIO_TABLE_NUM][EMUL_PIO_PAGE_SIZE];
+};
+
 /**
  * @brief The handler of VM exits on I/O instructions
  *
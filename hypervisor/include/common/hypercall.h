@@ -551,6 +551,33 @@ int32_t hcall_asyncio_assign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *ta
 int32_t hcall_asyncio_deassign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 		 __unused uint64_t param1, uint64_t param2);
 
+/**
+ * @brief Assign a coalesced I/O zone to a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm which VM the coalesced I/O zone belongs.
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_coalesced_io_zone
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_coalesced_io_assign(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		 __unused uint64_t param1, uint64_t param2);
+/**
+ * @brief Deassign a coalesced I/O zone from a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm which VM the coalesced I/O zone belongs.
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_coalesced_io_zone
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_coalesced_io_deassign(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		 __unused uint64_t param1, uint64_t param2);
+
 /**
  * @brief Setup the hypervisor NPK log.
  *
@@ -112,6 +112,18 @@ struct vm_io_handler_desc {
 	 * If the pointer is null, the write access is ignored.
 	 */
 	io_write_fn_t io_write;
+
+#ifdef HV_DEBUG
+	/**
+	 * @brief Number of port I/O accesses emulated by this handler
+	 */
+	uint64_t exit_count;
+
+	/**
+	 * @brief TSC cycles spent in this handler for the accesses it emulated
+	 */
+	int64_t exit_cycles;
+#endif
 };
 
 /* Typedef for MMIO handler and range check routine */
@@ -174,6 +186,43 @@ struct mem_io_node {
 	uint64_t range_end;
 };
 
+/**
+ * @brief Sorted index of the registered MMIO handlers of a VM
+ *
+ * Lists the slots of the VM's MMIO handler nodes which are in use, ordered by
+ * their starting address, so that handlers can be looked up by binary search.
+ * Nodes overlapping one of the sorted nodes, e.g. vBARs being moved by the
+ * guest, are kept aside in \p overlap and checked on every lookup.
+ */
+struct mem_io_index {
+	/**
+	 * @brief Number of valid entries in \p slot
+	 */
+	uint16_t nr;
+
+	/**
+	 * @brief Number of valid entries in \p overlap
+	 */
+	uint16_t nr_overlap;
+
+	/**
+	 * @brief Indexes of the in-use MMIO handler nodes, sorted by range_start
+	 */
+	uint16_t slot[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+
+	/**
+	 * @brief Indexes of the in-use MMIO handler nodes left out of \p slot
+	 */
+	uint16_t overlap[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+};
+
+void build_mmio_index(const struct mem_io_node *nodes, struct mem_io_index *index);
+uint16_t lookup_mmio_index(const struct mem_io_node *nodes, const struct mem_io_index *index,
+		uint64_t address, uint64_t size);
+int32_t find_mmio_node(const struct mem_io_node *nodes, const struct mem_io_index *index,
+		const volatile uint32_t *seq, uint16_t *hint, uint64_t address, uint64_t size,
+		struct mem_io_node *mmio_node);
+
 /* External Interfaces */
 
 /**
@@ -294,6 +343,12 @@ int init_asyncio(struct acrn_vm *vm, uint64_t *hva);
 int add_asyncio(struct acrn_vm *vm, const struct acrn_asyncio_info *async_info);
 
 int remove_asyncio(struct acrn_vm *vm, const struct acrn_asyncio_info *async_info);
+
+int init_coalesced_io(struct acrn_vm *vm, uint64_t *hva);
+
+int add_coalesced_io(struct acrn_vm *vm, const struct acrn_coalesced_io_zone *zone);
+
+int remove_coalesced_io(struct acrn_vm *vm, const struct acrn_coalesced_io_zone *zone);
 /**
  * @}
  */
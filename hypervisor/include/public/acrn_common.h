@@ -27,6 +27,7 @@
 
 #define ACRN_IO_REQUEST_MAX		16U
 #define ACRN_ASYNCIO_MAX		64U
+#define ACRN_COALESCED_IO_MAX		16U
 
 #define ACRN_IOREQ_STATE_PENDING	0U
 #define ACRN_IOREQ_STATE_COMPLETE	1U
@@ -296,11 +297,34 @@ struct acrn_io_request {
 	uint32_t completion_polling;
 
 	/**
-	 * @brief Reserved.
+	 * @brief Bitmap of the vCPUs having an outstanding request.
+	 *
+	 * Only valid in req_slot[0] of the buffer. Bit n is set by the
+	 * hypervisor before slot n turns PENDING and cleared before it turns
+	 * FREE, so that clients can find pending slots with find-first-set
+	 * instead of scanning all the slots.
 	 *
 	 * Byte offset: 8.
 	 */
-	uint32_t reserved0[14];
+	uint64_t pending_bitmap;
+
+	/**
+	 * @brief Number of requests inserted so far.
+	 *
+	 * Only valid in req_slot[0] of the buffer. Incremented by the
+	 * hypervisor each time a request is inserted. Zero means that the
+	 * hypervisor doesn't maintain pending_bitmap.
+	 *
+	 * Byte offset: 16.
+	 */
+	uint64_t pending_seq;
+
+	/**
+	 * @brief Reserved.
+	 *
+	 * Byte offset: 24.
+	 */
+	uint32_t reserved0[10];
 
 	/**
 	 * @brief Details about this request.
@@ -353,6 +377,44 @@ struct acrn_asyncio_info {
 	uint64_t data;
 };
 
+/**
+ * @brief A range of PIO or MMIO space whose writes are posted to the
+ * coalesced I/O ring instead of being sent to the device model one by one.
+ */
+struct acrn_coalesced_io_zone {
+	/** ACRN_IOREQ_TYPE_PORTIO or ACRN_IOREQ_TYPE_MMIO */
+	uint32_t type;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** Base address of the range */
+	uint64_t addr;
+
+	/** Size of the range */
+	uint64_t size;
+};
+
+/**
+ * @brief A write posted to the coalesced I/O ring
+ */
+struct acrn_coalesced_io {
+	/** ACRN_IOREQ_TYPE_PORTIO or ACRN_IOREQ_TYPE_MMIO */
+	uint32_t type;
+
+	/** Width of the write in bytes */
+	uint32_t size;
+
+	/** Address of the write */
+	uint64_t addr;
+
+	/** Value written */
+	uint64_t value;
+
+	/** Reserved */
+	uint64_t reserved;
+};
+
 /**
  * @brief Info to create a VM, the parameter for HC_CREATE_VM hypercall
  */
@@ -780,6 +842,7 @@ enum {
 	ACRN_SBUF_PER_PCPU_ID_MAX,
 	ACRN_ASYNCIO = 64,
 	ACRN_VM_EVENT,
+	ACRN_COALESCED_IO,
 };
 
 /* Make sure sizeof(struct shared_buf) == SBUF_HEAD_SIZE */
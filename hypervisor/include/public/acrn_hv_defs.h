@@ -52,6 +52,8 @@
 #define HC_NOTIFY_REQUEST_FINISH    BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x01UL)
 #define HC_ASYNCIO_ASSIGN           BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x02UL)
 #define HC_ASYNCIO_DEASSIGN         BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x03UL)
+#define HC_COALESCED_IO_ASSIGN      BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x04UL)
+#define HC_COALESCED_IO_DEASSIGN    BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x05UL)
 
 
 /* Guest memory management */
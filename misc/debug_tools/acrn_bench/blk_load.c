@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * fio-like load generator for the device model's block backend: it opens an
+ * image with blockif_open(), exactly as virtio-blk does from its -s option,
+ * keeps a number of requests in flight and reports what the guest would see,
+ * e.g. to check request merging or the iops=/bps= limits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "log.h"
+#include "vmmapi.h"
+#include "iothread.h"
+#include "block_if.h"
+
+#define MAX_DEPTH	128
+
+enum rw_mode {
+	RW_READ,
+	RW_WRITE,
+	RW_RANDREAD,
+	RW_RANDWRITE,
+};
+
+struct load_req {
+	struct blockif_req	br;
+	uint64_t		start_ns;
+	int			err;
+	struct load_req		*next;
+};
+
+static struct load_req reqs[MAX_DEPTH];
+static struct load_req *done_list;
+static pthread_mutex_t done_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static bool verbose;
+
+/* The pieces of the device model the block backend calls into */
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > (verbose ? LOG_DEBUG : LOG_WARNING))
+		return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+int
+hugetlb_get_mem_regions(struct iovec *iov, int max)
+{
+	/* there is no guest memory to register as fixed buffers */
+	return 0;
+}
+
+void
+set_thread_priority(int priority, bool reset_on_fork)
+{
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Called by the blockif threads, the requests are resubmitted from main() */
+static void
+load_done(struct blockif_req *br, int err)
+{
+	struct load_req *req = br->param;
+
+	req->err = err;
+	pthread_mutex_lock(&done_mtx);
+	req->next = done_list;
+	done_list = req;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_mtx);
+}
+
+static int
+parse_rw(const char *s, enum rw_mode *rw)
+{
+	static const char * const names[] = {
+		[RW_READ] = "read",
+		[RW_WRITE] = "write",
+		[RW_RANDREAD] = "randread",
+		[RW_RANDWRITE] = "randwrite",
+	};
+	int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(s, names[i])) {
+			*rw = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <path>[,<blockif options>]\n"
+		"  -r <mode>   read, write, randread or randwrite (default randread)\n"
+		"  -b <bytes>  block size (default 4096)\n"
+		"  -q <n>      requests in flight, at most %d (default 32)\n"
+		"  -n <n>      requests submitted per batch, as one virtqueue kick (default 1)\n"
+		"  -t <sec>    run time (default 10)\n"
+		"  -i          complete requests on an iothread, needed by aio=io_uring\n"
+		"  -v          print the block backend's log\n"
+		"Writes destroy the content of the image.\n",
+		prog, MAX_DEPTH);
+}
+
+static void
+print_hist(const char *name, const uint64_t *hist, const char * const *labels)
+{
+	int i;
+
+	printf("%-8s", name);
+	for (i = 0; i < BLOCKIF_HIST_BUCKETS; i++)
+		printf(" %s:%lu", labels[i], hist[i]);
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char * const depth_labels[] = {
+		"1", "2", "4", "8", "16", "32", "64", ">64"
+	};
+	static const char * const lat_labels[] = {
+		"16us", "64us", "256us", "1ms", "4ms", "16ms", "64ms", ">64ms"
+	};
+	struct iothreads_option iot_opt;
+	struct iothreads_info iothrds_info;
+	struct blockif_ctxt *bc;
+	struct blockif_stats stats;
+	struct load_req *req, *next;
+	enum rw_mode rw = RW_RANDREAD;
+	uint64_t start, end, t, ops = 0, bytes = 0, lat_ns = 0, errors = 0;
+	uint64_t nr_blocks, next_block = 0;
+	long bs = 4096, depth = 32, batch = 1, runtime = 10;
+	bool use_iothread = false, write, plugged;
+	int c, i, n, queued, err;
+	void *buf;
+
+	while ((c = getopt(argc, argv, "r:b:q:n:t:ivh")) != -1) {
+		switch (c) {
+		case 'r':
+			if (parse_rw(optarg, &rw)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'b':
+			bs = strtol(optarg, NULL, 0);
+			break;
+		case 'q':
+			depth = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			batch = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			runtime = strtol(optarg, NULL, 0);
+			break;
+		case 'i':
+			use_iothread = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	if ((optind != argc - 1) || (bs <= 0) || (bs % 512) || (depth <= 0) ||
+			(depth > MAX_DEPTH) || (batch <= 0) || (runtime <= 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+	write = (rw == RW_WRITE) || (rw == RW_RANDWRITE);
+
+	memset(&iothrds_info, 0, sizeof(iothrds_info));
+	if (use_iothread) {
+		memset(&iot_opt, 0, sizeof(iot_opt));
+		snprintf(iot_opt.tag, sizeof(iot_opt.tag), "blkload");
+		iot_opt.num = 1;
+		iothrds_info.ioctx_base = iothread_create(&iot_opt);
+		if (iothrds_info.ioctx_base == NULL) {
+			fprintf(stderr, "failed to create the iothread\n");
+			return 1;
+		}
+		iothrds_info.num = 1;
+	}
+
+	bc = blockif_open(argv[optind], "load", 1, &iothrds_info);
+	if (bc == NULL) {
+		fprintf(stderr, "failed to open %s\n", argv[optind]);
+		return 1;
+	}
+	if (write && blockif_is_ro(bc)) {
+		fprintf(stderr, "%s is read-only\n", argv[optind]);
+		return 1;
+	}
+	nr_blocks = blockif_size(bc) / bs;
+	if (nr_blocks < depth) {
+		fprintf(stderr, "%s is too small\n", argv[optind]);
+		return 1;
+	}
+
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&buf, 4096, bs)) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		memset(buf, i, bs);
+		reqs[i].br.iov[0].iov_base = buf;
+		reqs[i].br.iov[0].iov_len = bs;
+		reqs[i].br.iovcnt = 1;
+		reqs[i].br.callback = load_done;
+		reqs[i].br.param = &reqs[i];
+		reqs[i].br.qidx = 0;
+		reqs[i].next = (i + 1 < depth) ? &reqs[i + 1] : NULL;
+	}
+
+	/* all the requests start on the completed list, with nothing to account */
+	done_list = &reqs[0];
+	start = now_ns();
+	end = start + runtime * 1000000000UL;
+	queued = 0;
+	for (;;) {
+		pthread_mutex_lock(&done_mtx);
+		while (done_list == NULL)
+			pthread_cond_wait(&done_cond, &done_mtx);
+		req = done_list;
+		done_list = NULL;
+		pthread_mutex_unlock(&done_mtx);
+
+		t = now_ns();
+		n = 0;
+		/* submit the requests which completed together in batches */
+		plugged = (t < end);
+		if (plugged)
+			blockif_plug(bc, 0);
+		for (; req != NULL; req = next) {
+			next = req->next;
+			if (req->start_ns) {
+				queued--;
+				ops++;
+				bytes += bs;
+				lat_ns += t - req->start_ns;
+				if (req->err)
+					errors++;
+				req->start_ns = 0;
+			}
+			if (t >= end)
+				continue;
+
+			if ((rw == RW_RANDREAD) || (rw == RW_RANDWRITE)) {
+				req->br.offset = (random() % nr_blocks) * bs;
+			} else {
+				req->br.offset = next_block * bs;
+				next_block = (next_block + 1) % nr_blocks;
+			}
+			req->br.iov[0].iov_len = bs;
+			req->br.resid = bs;
+			req->start_ns = now_ns();
+			err = write ? blockif_write(bc, &req->br) : blockif_read(bc, &req->br);
+			if (err) {
+				/* stop submitting, and wait for what is in flight */
+				fprintf(stderr, "failed to submit a request: %d\n", err);
+				req->start_ns = 0;
+				errors++;
+				end = t;
+				continue;
+			}
+			queued++;
+			if (++n == batch) {
+				blockif_unplug(bc, 0);
+				blockif_plug(bc, 0);
+				n = 0;
+			}
+		}
+		if (plugged)
+			blockif_unplug(bc, 0);
+		if ((t >= end) && (queued == 0))
+			break;
+	}
+	t = now_ns() - start;
+
+	printf("%lu requests in %.2fs: %.0f IOPS, %.1f MiB/s, avg latency %.1fus, %lu errors\n",
+		ops, t / 1e9, ops / (t / 1e9), bytes / (t / 1e9) / (1 << 20),
+		ops ? lat_ns / 1e3 / ops : 0, errors);
+	if (blockif_get_stats(bc, 0, &stats) == 0) {
+		printf("blockif requests: %lu\n", stats.nr_reqs);
+		print_hist("depth", stats.depth_hist, depth_labels);
+		print_hist("latency", stats.lat_hist, lat_labels);
+	}
+
+	blockif_close(bc);
+	if (use_iothread)
+		iothread_deinit();
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Compares the two ways the device model finds the requests to handle in the
+ * ioreq shared page after a wakeup (devicemodel/core/main.c, vm_loop()):
+ * checking the state of the slot of every vCPU, and walking the pending
+ * bitmap the hypervisor publishes in req_slot[0]. Both must find the same
+ * slots, in the same order, and the cost per wakeup is measured for 1 to 16
+ * vCPUs and a growing number of outstanding requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "acrn_common.h"
+#include "atomic.h"
+
+#define WAKEUPS		(1U << 22)
+
+static struct acrn_io_request_buffer req_buf __attribute__((aligned(4096)));
+static struct acrn_io_request *ioreq_buf = req_buf.req_slot;
+static int guest_ncpus;
+
+/* What acrn_insert_request() and complete_ioreq() do to the shared page */
+
+static void
+hv_insert_request(uint16_t vcpu_id, bool kernel_handled)
+{
+	struct acrn_io_request *io_req = &ioreq_buf[vcpu_id];
+
+	io_req->type = ACRN_IOREQ_TYPE_PORTIO;
+	io_req->kernel_handled = kernel_handled;
+	__atomic_fetch_or(&ioreq_buf[0].pending_bitmap, 1UL << vcpu_id,
+			__ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&ioreq_buf[0].pending_seq, 1UL, __ATOMIC_SEQ_CST);
+	/* the HSM turns PENDING requests PROCESSING before waking the client up */
+	atomic_store(&io_req->processed, ACRN_IOREQ_STATE_PROCESSING);
+}
+
+static void
+hv_complete_request(uint16_t vcpu_id)
+{
+	__atomic_fetch_and(&ioreq_buf[0].pending_bitmap, ~(1UL << vcpu_id),
+			__ATOMIC_SEQ_CST);
+	atomic_store(&ioreq_buf[vcpu_id].processed, ACRN_IOREQ_STATE_FREE);
+}
+
+static void
+hv_reset(void)
+{
+	int i;
+
+	memset(&req_buf, 0, sizeof(req_buf));
+	for (i = 0; i < ACRN_IO_REQUEST_MAX; i++)
+		ioreq_buf[i].processed = ACRN_IOREQ_STATE_FREE;
+}
+
+/* The device model side, as vm_loop() before and after the pending bitmap */
+
+static int
+scan_slots(uint16_t *found)
+{
+	struct acrn_io_request *io_req;
+	int vcpu_id, n = 0;
+
+	for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
+		io_req = &ioreq_buf[vcpu_id];
+		if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+			&& !io_req->kernel_handled)
+			found[n++] = vcpu_id;
+	}
+	return n;
+}
+
+static inline uint64_t
+ioreq_pending_vcpus(void)
+{
+	if (atomic_load(&ioreq_buf[0].pending_seq) == 0UL)
+		return (1UL << guest_ncpus) - 1UL;
+
+	return atomic_load(&ioreq_buf[0].pending_bitmap);
+}
+
+static int
+walk_bitmap(uint16_t *found)
+{
+	struct acrn_io_request *io_req;
+	uint64_t pending;
+	int vcpu_id, n = 0;
+
+	pending = ioreq_pending_vcpus();
+	while (pending != 0UL) {
+		vcpu_id = ffsl(pending) - 1;
+		pending &= ~(1UL << vcpu_id);
+
+		io_req = &ioreq_buf[vcpu_id];
+		if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+			&& !io_req->kernel_handled)
+			found[n++] = vcpu_id;
+	}
+	return n;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static bool
+same_slots(const char *what)
+{
+	uint16_t scanned[ACRN_IO_REQUEST_MAX], walked[ACRN_IO_REQUEST_MAX];
+	int n;
+
+	n = scan_slots(scanned);
+	if ((walk_bitmap(walked) != n) ||
+			memcmp(scanned, walked, n * sizeof(scanned[0]))) {
+		printf("FAIL %s: the bitmap walk and the scan differ with %d vCPUs\n",
+			what, guest_ncpus);
+		return false;
+	}
+	return true;
+}
+
+/* Random requests inserted and completed, some handled in the kernel */
+static int
+check(void)
+{
+	uint16_t vcpu_id;
+	int i;
+
+	for (guest_ncpus = 1; guest_ncpus <= ACRN_IO_REQUEST_MAX; guest_ncpus++) {
+		hv_reset();
+		/* a hypervisor which doesn't maintain the bitmap */
+		for (i = 0; i < guest_ncpus; i += 2)
+			atomic_store(&ioreq_buf[i].processed,
+					ACRN_IOREQ_STATE_PROCESSING);
+		if (!same_slots("fallback"))
+			return 1;
+
+		hv_reset();
+		for (i = 0; i < 10000; i++) {
+			vcpu_id = random() % guest_ncpus;
+			if (atomic_load(&ioreq_buf[vcpu_id].processed) ==
+					ACRN_IOREQ_STATE_FREE)
+				hv_insert_request(vcpu_id, (random() % 4) == 0);
+			else
+				hv_complete_request(vcpu_id);
+			if (!same_slots("bitmap"))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static double
+time_wakeups(int (*find)(uint16_t *found))
+{
+	uint16_t found[ACRN_IO_REQUEST_MAX];
+	uint64_t start;
+	unsigned int i;
+	int n = 0;
+
+	start = now_ns();
+	for (i = 0; i < WAKEUPS; i++)
+		n += find(found);
+	/* keep the lookups from being optimized out */
+	if (n < 0)
+		printf("%d\n", n);
+	return (double)(now_ns() - start) / WAKEUPS;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int ncpus[] = { 1, 2, 4, 8, 16 };
+	int i, j, pending;
+
+	if (check())
+		return 1;
+
+	printf("vCPUs  pending    scan ns  bitmap ns\n");
+	for (i = 0; i < sizeof(ncpus) / sizeof(ncpus[0]); i++) {
+		guest_ncpus = ncpus[i];
+		for (pending = 0; pending <= guest_ncpus;
+				pending = pending ? pending * 2 : 1) {
+			hv_reset();
+			/* outstanding requests spread over the vCPUs */
+			for (j = 0; j < pending; j++)
+				hv_insert_request(j * guest_ncpus / pending, false);
+			/* a seq of zero would take the fallback */
+			if (pending == 0)
+				ioreq_buf[0].pending_seq = 1UL;
+
+			printf("%5d  %7d  %9.1f  %9.1f\n", guest_ncpus, pending,
+				time_wakeups(scan_slots), time_wakeups(walk_bitmap));
+		}
+	}
+	return 0;
+}
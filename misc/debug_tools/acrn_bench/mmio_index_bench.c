@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Compares the hypervisor's MMIO handler lookup (find_mmio_node() in
+ * hypervisor/dm/mmio_index.c) against the linear first-match walk it
+ * replaced: every lookup must return the same handler, including with
+ * overlapping handlers and while another thread updates the handlers, and
+ * the lookup cost is measured for 8 to 256 registered regions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_REGIONS	256U
+#define NONE		MAX_REGIONS
+#define LOOKUPS		(1U << 22)
+
+void bench_mmio_reset(void);
+void bench_mmio_set(uint16_t slot, uint64_t start, uint64_t end);
+void bench_mmio_clear(uint16_t slot);
+void bench_mmio_build(void);
+void bench_mmio_begin(void);
+void bench_mmio_publish(void);
+uint16_t bench_mmio_nr_overlap(void);
+uint16_t bench_mmio_lookup(uint64_t address, uint64_t size);
+int32_t bench_mmio_find(uint64_t address, uint64_t size, uint64_t *start, uint64_t *end);
+
+struct region {
+	bool used;
+	uint64_t start;
+	uint64_t end;
+};
+
+static struct region regions[MAX_REGIONS];
+
+static uint16_t linear_lookup(uint64_t address, uint64_t size)
+{
+	uint16_t i;
+
+	for (i = 0U; i < MAX_REGIONS; i++) {
+		if (regions[i].used && ((address + size) > regions[i].start) && (address < regions[i].end)) {
+			return i;
+		}
+	}
+	return NONE;
+}
+
+static void set_region(uint16_t slot, uint64_t start, uint64_t end)
+{
+	regions[slot].used = true;
+	regions[slot].start = start;
+	regions[slot].end = end;
+	bench_mmio_set(slot, start, end);
+}
+
+static void clear_region(uint16_t slot)
+{
+	regions[slot].used = false;
+	bench_mmio_clear(slot);
+}
+
+/* Lay out nr regions of one to four pages with gaps, in shuffled slot order */
+static uint64_t layout(unsigned int nr)
+{
+	uint16_t order[MAX_REGIONS], i, j, t;
+	uint64_t base = 0xfe000000UL;
+
+	for (i = 0U; i < MAX_REGIONS; i++) {
+		regions[i].used = false;
+		order[i] = i;
+	}
+	bench_mmio_reset();
+	for (i = MAX_REGIONS - 1U; i > 0U; i--) {
+		j = (uint16_t)(rand() % (i + 1U));
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0U; i < nr; i++) {
+		base += 0x1000UL * (uint64_t)(rand() % 3);
+		set_region(order[i], base, base + 0x1000UL * (uint64_t)(1 + (rand() % 4)));
+		base = regions[order[i]].end;
+	}
+	bench_mmio_build();
+
+	return base;
+}
+
+static uint64_t random_address(uint64_t limit)
+{
+	return 0xfe000000UL - 0x100UL + ((((uint64_t)rand() << 16) ^ (uint64_t)rand()) % (limit - 0xfe000000UL + 0x200UL));
+}
+
+/* Whether find_mmio_node() agrees with the first node the walk hits */
+static bool find_matches(uint64_t address, uint64_t size)
+{
+	uint16_t slot = linear_lookup(address, size);
+	uint64_t start, end;
+
+	if (bench_mmio_find(address, size, &start, &end) != 0) {
+		/* no node, or one the access doesn't fit in */
+		return (slot == NONE) || (address < regions[slot].start) ||
+			((address + size) > regions[slot].end);
+	}
+	return (slot != NONE) && (start == regions[slot].start) && (end == regions[slot].end);
+}
+
+static int check(unsigned int nr, unsigned int nr_overlap)
+{
+	uint64_t limit, address, size, start;
+	uint16_t slot;
+	unsigned int i;
+
+	limit = layout(nr);
+	/* e.g. vBARs being moved over other ones */
+	for (i = 0U; i < nr_overlap; i++) {
+		slot = (uint16_t)(rand() % MAX_REGIONS);
+		start = random_address(limit) & ~0xfffUL;
+		set_region(slot, start, start + 0x1000UL * (uint64_t)(1 + (rand() % 8)));
+	}
+	/* and some going away again */
+	for (i = 0U; i < nr_overlap / 2U; i++) {
+		clear_region((uint16_t)(rand() % MAX_REGIONS));
+	}
+	bench_mmio_build();
+
+	for (i = 0U; i < (1U << 16); i++) {
+		address = random_address(limit);
+		size = 1UL << (rand() % 4);
+		if (bench_mmio_lookup(address, size) != linear_lookup(address, size)) {
+			printf("mismatch: %u regions, %u overlapping, access 0x%lx/%lu: index %u, linear %u\n",
+				nr, nr_overlap, address, size, bench_mmio_lookup(address, size),
+				linear_lookup(address, size));
+			return -1;
+		}
+		if (!find_matches(address, size)) {
+			printf("mismatch: %u regions, %u overlapping, access 0x%lx/%lu: find_mmio_node\n",
+				nr, nr_overlap, address, size);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#define MOVE_FROM	0xfe000000UL
+#define MOVE_TO		0xfe800000UL
+#define MOVE_SIZE	0x1000UL
+
+static volatile bool moving;
+
+/* Move a region back and forth, like a guest reprogramming a vBAR */
+static void *move_region(void *arg)
+{
+	uint64_t base = MOVE_TO;
+	unsigned int i;
+
+	while (moving) {
+		bench_mmio_begin();
+		/* a state no lookup may see, for a while */
+		bench_mmio_set(0U, MOVE_FROM, MOVE_TO + MOVE_SIZE);
+		for (i = 0U; i < 100U; i++) {
+			__builtin_ia32_pause();
+		}
+		bench_mmio_set(0U, base, base + MOVE_SIZE);
+		bench_mmio_publish();
+		base = (base == MOVE_FROM) ? MOVE_TO : MOVE_FROM;
+	}
+	return NULL;
+}
+
+/* Lookups racing with updates must see the region as a whole, or not at all */
+static int check_concurrent(void)
+{
+	uint64_t start, end;
+	unsigned int i, hits = 0U;
+	pthread_t writer;
+
+	bench_mmio_reset();
+	bench_mmio_set(0U, MOVE_FROM, MOVE_FROM + MOVE_SIZE);
+	bench_mmio_build();
+
+	moving = true;
+	if (pthread_create(&writer, NULL, move_region, NULL) != 0) {
+		return -1;
+	}
+	for (i = 0U; i < (1U << 22); i++) {
+		if (bench_mmio_find(MOVE_FROM + 0x800UL, 4UL, &start, &end) == 0) {
+			if ((start != MOVE_FROM) || (end != (MOVE_FROM + MOVE_SIZE))) {
+				break;
+			}
+			hits++;
+		}
+	}
+	moving = false;
+	pthread_join(writer, NULL);
+
+	if (i < (1U << 22)) {
+		printf("torn lookup: found [0x%lx, 0x%lx) after %u lookups\n", start, end, i);
+		return -1;
+	}
+	printf("%u of %u lookups racing with updates found the region\n", hits, i);
+
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void bench(unsigned int nr)
+{
+	static uint64_t addresses[LOOKUPS];
+	volatile uint16_t sink;
+	volatile int32_t status;
+	uint64_t limit, start, end;
+	double t0, t1, t2, t3;
+	unsigned int i;
+
+	limit = layout(nr);
+	for (i = 0U; i < LOOKUPS; i++) {
+		addresses[i] = random_address(limit);
+	}
+
+	t0 = now();
+	for (i = 0U; i < LOOKUPS; i++) {
+		sink = linear_lookup(addresses[i], 4UL);
+	}
+	t1 = now();
+	for (i = 0U; i < LOOKUPS; i++) {
+		sink = bench_mmio_lookup(addresses[i], 4UL);
+	}
+	t2 = now();
+	for (i = 0U; i < LOOKUPS; i++) {
+		status = bench_mmio_find(addresses[i], 4UL, &start, &end);
+	}
+	t3 = now();
+	(void)sink;
+	(void)status;
+
+	printf("%8u %12.1f %12.1f %12.1f\n", nr, (t1 - t0) / LOOKUPS, (t2 - t1) / LOOKUPS,
+		(t3 - t2) / LOOKUPS);
+}
+
+int main(void)
+{
+	unsigned int nr, overlap;
+
+	srand(1);
+	for (nr = 8U; nr <= MAX_REGIONS; nr *= 2U) {
+		for (overlap = 0U; overlap <= 16U; overlap += 4U) {
+			if (check(nr, overlap) != 0) {
+				return 1;
+			}
+		}
+	}
+	printf("index lookups match the linear walk\n");
+	if (check_concurrent() != 0) {
+		return 1;
+	}
+
+	printf("\n%8s %12s %12s %12s\n", "regions", "linear(ns)", "index(ns)", "find(ns)");
+	for (nr = 8U; nr <= MAX_REGIONS; nr *= 2U) {
+		bench(nr);
+	}
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Built against the hypervisor headers (freestanding, like the hypervisor
+ * itself), together with hypervisor/dm/mmio_index.c. Only fixed-size integer
+ * types cross into the hosted benchmark, since the hypervisor's size_t is not
+ * the host's. The nodes are updated as in hypervisor/dm/io_req.c, between
+ * begin_mmio_update() and publish_mmio_index().
+ */
+
+#include <types.h>
+#include <asm/cpu.h>
+#include <io_req.h>
+
+static struct mem_io_node nodes[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+static struct mem_io_index index;
+static volatile uint32_t seq;
+static uint16_t hint;
+
+static int32_t dummy_handler(__unused struct io_request *io_req, __unused void *data)
+{
+	return 0;
+}
+
+void bench_mmio_reset(void)
+{
+	uint16_t slot;
+
+	for (slot = 0U; slot < CONFIG_MAX_EMULATED_MMIO_REGIONS; slot++) {
+		nodes[slot].read_write = NULL;
+	}
+	build_mmio_index(nodes, &index);
+}
+
+void bench_mmio_set(uint16_t slot, uint64_t start, uint64_t end)
+{
+	nodes[slot].read_write = dummy_handler;
+	nodes[slot].range_start = start;
+	nodes[slot].range_end = end;
+}
+
+void bench_mmio_clear(uint16_t slot)
+{
+	nodes[slot].read_write = NULL;
+}
+
+void bench_mmio_build(void)
+{
+	build_mmio_index(nodes, &index);
+}
+
+void bench_mmio_begin(void)
+{
+	seq++;
+	cpu_write_memory_barrier();
+}
+
+void bench_mmio_publish(void)
+{
+	build_mmio_index(nodes, &index);
+	cpu_write_memory_barrier();
+	seq++;
+}
+
+uint16_t bench_mmio_nr_overlap(void)
+{
+	return index.nr_overlap;
+}
+
+uint16_t bench_mmio_lookup(uint64_t address, uint64_t size)
+{
+	return lookup_mmio_index(nodes, &index, address, size);
+}
+
+/* The status of find_mmio_node(), and the range of the node it found */
+int32_t bench_mmio_find(uint64_t address, uint64_t size, uint64_t *start, uint64_t *end)
+{
+	struct mem_io_node mmio_node;
+	int32_t status;
+
+	status = find_mmio_node(nodes, &index, &seq, &hint, address, size, &mmio_node);
+	if (status == 0) {
+		*start = mmio_node.range_start;
+		*end = mmio_node.range_end;
+	}
+
+	return status;
+}
@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Golden test and benchmark for the VGA renderer of the device model: the
+ * frames drawn by vga_render() with each planar/glyph converter the CPU can
+ * run are compared byte for byte with the former per-pixel conversion, then
+ * the frame rates are reported.
+ *
+ * vga.c is built into this file to reach its static converters.
+ */
+
+#include "vga.c"
+
+#include <stdarg.h>
+#include <time.h>
+
+#define MAX_WIDTH	1024
+#define MAX_HEIGHT	768
+
+struct variant {
+	const char *name;
+	const char *feature;	/* NULL if every x86-64 CPU has it */
+	int (*planar)(const uint8_t *plane, uint32_t *dst, const uint32_t *rgb,
+			int width);
+	void (*glyph)(uint32_t *dst, uint8_t font, uint32_t fg, uint32_t bg,
+			int dots);
+};
+
+static const struct variant variants[] = {
+	{ "scalar", NULL, NULL, vga_glyph_row_sse2 },
+	{ "ssse3", "ssse3", vga_planar_ssse3, vga_glyph_row_sse2 },
+	{ "avx2", "avx2", vga_planar_avx2, vga_glyph_row_avx2 },
+};
+
+struct mode {
+	const char *name;
+	bool graphics;
+	int dots;
+	int width;
+	int height;
+};
+
+static const struct mode modes[] = {
+	{ "graphics 640x480", true, 8, 640, 480 },
+	{ "graphics 720x480", true, 8, 720, 480 },
+	{ "text 80x25 9-dot", false, 9, 720, 400 },
+	{ "text 80x25 8-dot", false, 8, 640, 400 },
+};
+
+static uint32_t fb[MAX_WIDTH * MAX_HEIGHT];
+static uint32_t golden[MAX_WIDTH * MAX_HEIGHT];
+
+/* The pieces of the device model the VGA emulation calls into */
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_WARNING)
+		return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+int
+register_inout(struct inout_port *iop)
+{
+	return 0;
+}
+
+int
+unregister_inout(struct inout_port *iop)
+{
+	return 0;
+}
+
+int
+register_mem_fallback(struct mem_range *memp)
+{
+	return 0;
+}
+
+int
+unregister_mem_fallback(struct mem_range *memp)
+{
+	return 0;
+}
+
+int
+register_coalesced_io(uint32_t type, uint64_t base, uint64_t size)
+{
+	return 0;
+}
+
+int
+unregister_coalesced_io(uint32_t type, uint64_t base, uint64_t size)
+{
+	return 0;
+}
+
+/* The per-pixel conversion vga_render() replaced, as the reference */
+
+static uint32_t
+ref_get_pixel(struct vga_vdev *vd, int x, int y)
+{
+	int offset;
+	int bit;
+	uint8_t data;
+	uint8_t idx;
+
+	offset = (y * vd->gc_width / 8) + (x / 8);
+	bit = 7 - (x % 8);
+
+	data = (((vd->vga_ram[offset + 0 * 64*KB] >> bit) & 0x1) << 0) |
+		(((vd->vga_ram[offset + 1 * 64*KB] >> bit) & 0x1) << 1) |
+		(((vd->vga_ram[offset + 2 * 64*KB] >> bit) & 0x1) << 2) |
+		(((vd->vga_ram[offset + 3 * 64*KB] >> bit) & 0x1) << 3);
+
+	data &= vd->vga_atc.atc_color_plane_enb;
+
+	if (vd->vga_atc.atc_mode & ATC_MC_IPS) {
+		idx = vd->vga_atc.atc_palette[data] & 0x0f;
+		idx |= vd->vga_atc.atc_color_select_45;
+	} else {
+		idx = vd->vga_atc.atc_palette[data];
+	}
+	idx |= vd->vga_atc.atc_color_select_67;
+
+	return (vd->vga_dac.dac_palette_rgb[idx]);
+}
+
+static uint32_t
+ref_get_text_pixel(struct vga_vdev *vd, int x, int y)
+{
+	int dots, offset, bit, font_offset;
+	uint8_t ch, attr, font;
+	uint8_t idx;
+
+	dots = vd->vga_seq.seq_cm_dots;
+
+	offset = 2 * vd->vga_crtc.crtc_start_addr;
+	offset += (y / 16 * vd->gc_width / dots) * 2 + (x / dots) * 2;
+
+	bit = 7 - (x % dots > 7 ? 7 : x % dots);
+
+	ch = vd->vga_ram[offset + 0 * 64*KB];
+	attr = vd->vga_ram[offset + 1 * 64*KB];
+
+	if (vd->vga_crtc.crtc_cursor_on &&
+	    (offset == (vd->vga_crtc.crtc_cursor_loc * 2)) &&
+	    ((y % 16) >= (vd->vga_crtc.crtc_cursor_start & CRTC_CS_CS)) &&
+	    ((y % 16) <= (vd->vga_crtc.crtc_cursor_end & CRTC_CE_CE))) {
+		idx = vd->vga_atc.atc_palette[attr & 0xf];
+		return (vd->vga_dac.dac_palette_rgb[idx]);
+	}
+
+	if ((vd->vga_seq.seq_mm & SEQ_MM_EM) &&
+	    vd->vga_seq.seq_cmap_pri_off != vd->vga_seq.seq_cmap_sec_off) {
+		if (attr & 0x8)
+			font_offset = vd->vga_seq.seq_cmap_pri_off +
+				(ch << 5) + y % 16;
+		else
+			font_offset = vd->vga_seq.seq_cmap_sec_off +
+				(ch << 5) + y % 16;
+		attr &= ~0x8;
+	} else {
+		font_offset = (ch << 5) + y % 16;
+	}
+
+	font = vd->vga_ram[font_offset + 2 * 64*KB];
+
+	if (font & (1 << bit))
+		idx = vd->vga_atc.atc_palette[attr & 0xf];
+	else
+		idx = vd->vga_atc.atc_palette[attr >> 4];
+
+	return (vd->vga_dac.dac_palette_rgb[idx]);
+}
+
+/* __builtin_cpu_supports() only takes literals */
+static bool
+cpu_has(const char *feature)
+{
+	if (feature == NULL)
+		return true;
+	if (!strcmp(feature, "ssse3"))
+		return __builtin_cpu_supports("ssse3");
+	if (!strcmp(feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	return false;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Random VRAM and palettes, the cursor and a second font for text modes */
+static void
+setup_mode(struct vga_vdev *vd, const struct mode *m)
+{
+	int i, h = m->height - 1;
+
+	for (i = 0; i < 256 * KB; i++)
+		vd->vga_ram[i] = random();
+	for (i = 0; i < 256; i++)
+		vd->vga_dac.dac_palette_rgb[i] = random();
+	for (i = 0; i < 16; i++)
+		vd->vga_atc.atc_palette[i] = random() & 0x3f;
+
+	vd->vga_atc.atc_color_plane_enb = m->graphics ? 0xd : 0xf;
+	vd->vga_atc.atc_mode = m->graphics ? (ATC_MC_GA | ATC_MC_IPS) : 0;
+	vd->vga_atc.atc_color_select_45 = 0x10;
+	vd->vga_atc.atc_color_select_67 = 0x40;
+	vd->vga_gc.gc_misc_gm = m->graphics;
+	vd->vga_seq.seq_cm_dots = m->dots;
+	vd->vga_seq.seq_reset = 3;
+	vd->vga_seq.seq_mm = SEQ_MM_EM;
+	vd->vga_seq.seq_cmap_pri_off = 0x4000;
+	vd->vga_seq.seq_cmap_sec_off = 0;
+	vd->vga_crtc.crtc_mode_ctrl = CRTC_MC_TE;
+	vd->vga_crtc.crtc_horiz_disp_end = m->width / m->dots - 1;
+	vd->vga_crtc.crtc_vert_disp_end = h & 0xff;
+	vd->vga_crtc.crtc_overflow = ((h & 0x100) ? CRTC_OF_VDE8 : 0) |
+		((h & 0x200) ? CRTC_OF_VDE9 : 0);
+	vd->vga_crtc.crtc_start_addr = 40;
+	vd->vga_crtc.crtc_cursor_on = 1;
+	vd->vga_crtc.crtc_cursor_loc = 40 + 83;
+	vd->vga_crtc.crtc_cursor_start = 13;
+	vd->vga_crtc.crtc_cursor_end = 14;
+	vd->vga_regs_dirty = true;
+}
+
+static void
+render_golden(struct vga_vdev *vd, const struct mode *m)
+{
+	int x, y;
+
+	for (y = 0; y < m->height; y++)
+		for (x = 0; x < m->width; x++)
+			golden[y * m->width + x] = m->graphics ?
+				ref_get_pixel(vd, x, y) : ref_get_text_pixel(vd, x, y);
+}
+
+static int
+compare_frame(struct vga_vdev *vd, const struct mode *m, const char *what,
+		const struct variant *v)
+{
+	int i;
+
+	if ((vd->gc_width != m->width) || (vd->gc_height != m->height)) {
+		printf("FAIL %s %s %s: %dx%d\n", v->name, m->name, what,
+			vd->gc_width, vd->gc_height);
+		return 1;
+	}
+	for (i = 0; i < m->width * m->height; i++) {
+		if (fb[i] != golden[i]) {
+			printf("FAIL %s %s %s: pixel %d,%d is %08x, not %08x\n",
+				v->name, m->name, what, i % m->width, i / m->width,
+				fb[i], golden[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Draw @m in full, then write one byte through the guest aperture: only the
+ * lines around it may be damaged, and the frame must still match.
+ */
+static int
+check_mode(struct gfx_ctx *gc, struct vga_vdev *vd, const struct mode *m,
+		const struct variant *v)
+{
+	pixman_region16_t damage;
+	pixman_box16_t *box;
+	uint64_t addr;
+	int line, failed;
+
+	srandom(1);
+	setup_mode(vd, m);
+	memset(fb, 0, sizeof(fb));
+	pixman_region_init(&damage);
+	vga_render(gc, vd, &damage);
+	/* the reference reads the mode size vga_render() picked up */
+	render_golden(vd, m);
+	failed = compare_frame(vd, m, "full frame", v);
+	pixman_region_fini(&damage);
+	if (failed)
+		return 1;
+
+	if (m->graphics) {
+		line = 100;
+		addr = 0xa0000 + line * (m->width / 8) + 5;
+		vd->vga_gc.gc_misc_mm = 1;
+		vd->vga_gc.gc_mode_oe = 0;
+	} else {
+		/* a character of the fourth text row */
+		line = 3 * VGA_CHAR_HEIGHT;
+		addr = 0xb8000 + 2 * (40 + 3 * (m->width / m->dots)) + 10;
+		vd->vga_gc.gc_misc_mm = 3;
+		vd->vga_gc.gc_mode_oe = 1;
+	}
+	vd->vga_seq.seq_map_mask = 0x3;
+	vga_mem_wr_handler(NULL, addr, 0x5a, vd);
+	render_golden(vd, m);
+
+	pixman_region_init(&damage);
+	vga_render(gc, vd, &damage);
+	box = pixman_region_extents(&damage);
+	/*
+	 * VRAM is tracked in chunks of 1 << VGA_DIRTY_SHIFT bytes, a chunk may
+	 * straddle two lines
+	 */
+	if ((box->y1 > line) || (box->y2 <= line) ||
+			(box->y2 - box->y1 > 2 * (m->graphics ? 1 : VGA_CHAR_HEIGHT))) {
+		printf("FAIL %s %s write: damaged lines %d-%d, written %d\n",
+			v->name, m->name, box->y1, box->y2 - 1, line);
+		failed = 1;
+	} else {
+		failed = compare_frame(vd, m, "write", v);
+	}
+	pixman_region_fini(&damage);
+	return failed;
+}
+
+static double
+time_frames(struct gfx_ctx *gc, struct vga_vdev *vd, int frames)
+{
+	pixman_region16_t damage;
+	uint64_t start;
+	int i;
+
+	pixman_region_init(&damage);
+	start = now_ns();
+	for (i = 0; i < frames; i++) {
+		vd->vga_regs_dirty = true;
+		vga_render(gc, vd, &damage);
+	}
+	pixman_region_fini(&damage);
+	return (now_ns() - start) / 1e3 / frames;
+}
+
+static double
+time_golden(struct vga_vdev *vd, const struct mode *m, int frames)
+{
+	uint64_t start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < frames; i++)
+		render_golden(vd, m);
+	return (now_ns() - start) / 1e3 / frames;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct gfx_ctx *gc;
+	struct vga_vdev *vd;
+	const struct variant *v;
+	const struct mode *m;
+	int i, j, frames = 1000, failed = 0;
+
+	if (argc > 1)
+		frames = strtol(argv[1], NULL, 0);
+	if (frames <= 0) {
+		fprintf(stderr, "Usage: %s [frames]\n", argv[0]);
+		return 1;
+	}
+
+	gc = gc_init(MAX_WIDTH, MAX_HEIGHT, fb);
+	vd = vga_init(gc, 0);
+	if (vd == NULL) {
+		fprintf(stderr, "vga_init failed\n");
+		return 1;
+	}
+	for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+		v = &variants[i];
+		if (!cpu_has(v->feature)) {
+			printf("%-8s not supported by this CPU, skipped\n", v->name);
+			continue;
+		}
+		vga_planar_fast = v->planar;
+		vga_glyph_row = v->glyph;
+
+		for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++)
+			failed |= check_mode(gc, vd, &modes[j], v);
+		if (failed)
+			continue;
+
+		for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+			m = &modes[j];
+			setup_mode(vd, m);
+			printf("%-8s %-18s %8.1f us/frame\n", v->name, m->name,
+				time_frames(gc, vd, frames));
+		}
+	}
+
+	for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+		m = &modes[j];
+		setup_mode(vd, m);
+		/* one frame to switch vd to the mode */
+		time_frames(gc, vd, 1);
+		printf("%-8s %-18s %8.1f us/frame\n", "per-pixel", m->name,
+			time_golden(vd, m, frames / 10 ? frames / 10 : 1));
+	}
+
+	if (failed)
+		printf("renderer output differs from the per-pixel reference\n");
+	return failed;
+}
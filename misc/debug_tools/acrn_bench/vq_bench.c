@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2023 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Runs the device model's virtqueue code (hw/pci/virtio/virtio.c) against a
+ * driver emulated in the same process, on split and packed rings. Every used
+ * element is checked against what the driver posted, bogus buffer ids must
+ * be refused, chains fetched in batches (vq_getchains_batch) must come back
+ * in order when part of each batch is handed back (vq_retchains_batch), and
+ * the cost per chain of vq_getchain/vq_relchain is measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "log.h"
+#include "vmmapi.h"
+#include "timer.h"
+#include "pci_core.h"
+#include "virtio.h"
+
+#define QSIZE		256
+#define CHAIN_LEN	2		/* a header and a data buffer */
+#define HDR_LEN		16
+#define DATA_LEN	1500
+#define BATCH		32
+#define ROUNDS		200000
+
+#define GUEST_MEM_SIZE	(4UL << 20)
+#define RING_GPA	0x1000UL
+#define BUF_GPA		0x100000UL
+#define BUF_SIZE	2048UL
+
+static uint8_t guest_mem[GUEST_MEM_SIZE] __attribute__((aligned(4096)));
+static struct virtio_ops vops = { .name = "vq_bench" };
+static struct pci_vdev dev;
+static struct virtio_base base;
+static struct virtio_vq_info vq;
+static bool quiet;
+
+/* The pieces of the device model the virtqueue code calls into */
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (quiet || (level > LOG_WARNING))
+		return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t gaddr, size_t len)
+{
+	if ((gaddr >= GUEST_MEM_SIZE) || (len > GUEST_MEM_SIZE - gaddr))
+		return NULL;
+	return guest_mem + gaddr;
+}
+
+/* interrupts are suppressed by the driver, nothing below is used */
+int acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t), void *param) { return -1; }
+void acrn_timer_deinit(struct acrn_timer *timer) { }
+int32_t acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value) { return -1; }
+int iothread_add(struct iothread_ctx *ioctx_x, int fd, struct iothread_mevent *aevt) { return -1; }
+int iothread_del(struct iothread_ctx *ioctx_x, int fd) { return -1; }
+int vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args) { return -1; }
+int pci_emul_add_capability(struct pci_vdev *dev, u_char *capdata, int caplen) { return -1; }
+int pci_emul_find_capability(struct pci_vdev *dev, uint8_t capid, int *p_capoff) { return -1; }
+int pci_emul_add_msicap(struct pci_vdev *pi, int msgnum) { return -1; }
+int pci_emul_add_msixcap(struct pci_vdev *pi, int msgnum, int barnum) { return -1; }
+int pci_emul_alloc_bar(struct pci_vdev *pdi, int idx, enum pcibar_type type, uint64_t size) { return -1; }
+int pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size, uint64_t value) { return -1; }
+uint64_t pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset, int size) { return 0; }
+void pci_generate_msi(struct pci_vdev *dev, int index) { }
+void pci_generate_msix(struct pci_vdev *dev, int index) { }
+void pci_lintr_assert(struct pci_vdev *dev) { }
+void pci_lintr_deassert(struct pci_vdev *dev) { }
+void pci_lintr_request(struct pci_vdev *pi) { }
+int pci_msix_enabled(struct pci_vdev *pi) { return 0; }
+int pci_msix_table_bar(struct pci_vdev *pi) { return -1; }
+int pci_msix_pba_bar(struct pci_vdev *pi) { return -1; }
+
+/* The driver side */
+
+struct driver {
+	bool packed;
+	uint16_t next_avail;	/* split: avail idx, packed: slot */
+	bool avail_wrap;
+	uint16_t last_used;	/* split: used idx, packed: slot */
+	bool used_wrap;
+	uint16_t next_id;
+	int inflight;
+};
+
+static struct driver drv;
+
+static uint64_t
+buf_gpa(uint16_t id, int i)
+{
+	return BUF_GPA + (id * CHAIN_LEN + i) * BUF_SIZE;
+}
+
+static void
+vq_setup(bool packed)
+{
+	uint64_t gpa = RING_GPA;
+
+	memset(guest_mem, 0, BUF_GPA);
+	memset(&vq, 0, sizeof(vq));
+	memset(&drv, 0, sizeof(drv));
+	dev.vmctx = NULL;
+	base.vops = &vops;
+	base.dev = &dev;
+	base.negotiated_caps = 0;
+
+	vq.base = &base;
+	vq.qsize = QSIZE;
+	vq.flags = VQ_ALLOC;
+	vq.packed = packed;
+	drv.packed = packed;
+	if (packed) {
+		vq.packed_desc = (void *)(guest_mem + gpa);
+		gpa += QSIZE * sizeof(struct vring_packed_desc);
+		vq.driver_event = (void *)(guest_mem + gpa);
+		gpa += sizeof(struct vring_packed_desc_event);
+		vq.device_event = (void *)(guest_mem + gpa);
+		vq.packed_ndesc = calloc(QSIZE, sizeof(uint16_t));
+		vq.avail_wrap = true;
+		vq.used_wrap = true;
+		vq.driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+		drv.avail_wrap = true;
+		drv.used_wrap = true;
+	} else {
+		vq.desc = (void *)(guest_mem + gpa);
+		gpa += QSIZE * sizeof(struct vring_desc);
+		vq.avail = (void *)(guest_mem + gpa);
+		gpa += 4096;
+		vq.used = (void *)(guest_mem + gpa);
+		vq.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	}
+}
+
+static void
+vq_teardown(void)
+{
+	free(vq.packed_ndesc);
+	vq.packed_ndesc = NULL;
+}
+
+/* Post one chain of a header and a data buffer, with buffer id "id" */
+static void
+driver_post(uint16_t id)
+{
+	volatile struct vring_packed_desc *pd;
+	uint16_t flags, head_flags = 0, slot;
+	int i;
+
+	if (!drv.packed) {
+		for (i = 0; i < CHAIN_LEN; i++) {
+			vq.desc[id * CHAIN_LEN + i].addr = buf_gpa(id, i);
+			vq.desc[id * CHAIN_LEN + i].len = i ? DATA_LEN : HDR_LEN;
+			vq.desc[id * CHAIN_LEN + i].flags = i ? VRING_DESC_F_WRITE : VRING_DESC_F_NEXT;
+			vq.desc[id * CHAIN_LEN + i].next = id * CHAIN_LEN + i + 1;
+		}
+		vq.avail->ring[drv.next_avail++ & (QSIZE - 1)] = id * CHAIN_LEN;
+		return;
+	}
+
+	slot = drv.next_avail;
+	for (i = 0; i < CHAIN_LEN; i++) {
+		pd = &vq.packed_desc[drv.next_avail];
+		pd->addr = buf_gpa(id, i);
+		pd->len = i ? DATA_LEN : HDR_LEN;
+		pd->id = id;
+		flags = i ? VRING_DESC_F_WRITE : VRING_DESC_F_NEXT;
+		flags |= drv.avail_wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) :
+			(1 << VRING_PACKED_DESC_F_USED);
+		if (i == 0)
+			head_flags = flags;
+		else
+			pd->flags = flags;
+		if (++drv.next_avail == QSIZE) {
+			drv.next_avail = 0;
+			drv.avail_wrap = !drv.avail_wrap;
+		}
+	}
+	/* the head goes last, it makes the chain visible */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	vq.packed_desc[slot].flags = head_flags;
+}
+
+static void
+driver_kick(void)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (!drv.packed)
+		vq.avail->idx = drv.next_avail;
+}
+
+/* Take back the used elements and check them, return how many there were */
+static int
+driver_reap(uint16_t *expected_id, int *nr_expected)
+{
+	volatile struct vring_packed_desc *pd;
+	uint16_t id, flags;
+	uint32_t len;
+	int n = 0;
+
+	for (;;) {
+		if (!drv.packed) {
+			if (drv.last_used == vq.used->idx)
+				break;
+			id = vq.used->ring[drv.last_used & (QSIZE - 1)].id / CHAIN_LEN;
+			len = vq.used->ring[drv.last_used & (QSIZE - 1)].len;
+			drv.last_used++;
+		} else {
+			pd = &vq.packed_desc[drv.last_used];
+			flags = pd->flags;
+			if (!!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) != drv.used_wrap ||
+			    !!(flags & (1 << VRING_PACKED_DESC_F_USED)) != drv.used_wrap)
+				break;
+			id = pd->id;
+			len = pd->len;
+			drv.last_used += CHAIN_LEN;
+			if (drv.last_used >= QSIZE) {
+				drv.last_used -= QSIZE;
+				drv.used_wrap = !drv.used_wrap;
+			}
+		}
+		if ((n >= *nr_expected) || (id != expected_id[n]) || (len != DATA_LEN)) {
+			printf("%s ring: used element %d is id %u len %u, expected id %u len %u\n",
+				drv.packed ? "packed" : "split", n, id, len,
+				n < *nr_expected ? expected_id[n] : 0xffff, DATA_LEN);
+			exit(1);
+		}
+		n++;
+	}
+	memmove(expected_id, expected_id + n, (*nr_expected - n) * sizeof(*expected_id));
+	*nr_expected -= n;
+
+	return n;
+}
+
+/* The device side, like a virtio device model would do it */
+
+static bool
+check_chain(struct iovec *iov, int n, uint16_t idx)
+{
+	uint16_t id = drv.packed ? idx : idx / CHAIN_LEN;
+
+	return (n == CHAIN_LEN) &&
+		(iov[0].iov_base == guest_mem + buf_gpa(id, 0)) && (iov[0].iov_len == HDR_LEN) &&
+		(iov[1].iov_base == guest_mem + buf_gpa(id, 1)) && (iov[1].iov_len == DATA_LEN);
+}
+
+static int
+device_single(void)
+{
+	struct iovec iov[CHAIN_LEN];
+	uint16_t idx;
+	int n, done = 0;
+
+	while ((n = vq_getchain(&vq, &idx, iov, CHAIN_LEN, NULL)) > 0) {
+		if (!check_chain(iov, n, idx))
+			return -1;
+		vq_relchain(&vq, idx, iov[1].iov_len);
+		done++;
+	}
+	vq_endchains(&vq, 1);
+
+	return (n < 0) ? -1 : done;
+}
+
+/*
+ * Handle the first half of each batch and hand the rest back, as virtio-net
+ * rx does when the tap device runs dry.
+ */
+static int
+device_batch(void)
+{
+	static struct iovec iov[BATCH * CHAIN_LEN];
+	struct vq_chain chains[BATCH];
+	int i, n, keep, done = 0;
+
+	while ((n = vq_getchains_batch(&vq, chains, BATCH, iov, CHAIN_LEN, NULL)) > 0) {
+		keep = (n + 1) / 2;
+		for (i = 0; i < keep; i++) {
+			if (!check_chain(chains[i].iov, chains[i].n, chains[i].idx))
+				return -1;
+			vq_relchain(&vq, chains[i].idx, chains[i].iov[1].iov_len);
+		}
+		vq_retchains_batch(&vq, &chains[keep], n - keep);
+		done += keep;
+	}
+	vq_endchains(&vq, 1);
+
+	return (n < 0) ? -1 : done;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Post batches of 1 to QSIZE / CHAIN_LEN chains with rotating ids, so that
+ * the rings wrap at every possible position, and have the device handle them.
+ */
+static double
+run(bool packed, bool batch, const char *name)
+{
+	uint16_t expected[QSIZE];
+	int nr_expected = 0, burst, i, done;
+	uint64_t chains = 0;
+	double t0, t;
+
+	vq_setup(packed);
+	t = 0;
+	for (i = 0; i < ROUNDS; i++) {
+		burst = 1 + (i * 7) % (QSIZE / CHAIN_LEN);
+		while (drv.inflight < burst) {
+			expected[nr_expected++] = drv.next_id;
+			driver_post(drv.next_id);
+			drv.next_id = (drv.next_id + 1) % (QSIZE / CHAIN_LEN);
+			drv.inflight++;
+		}
+		driver_kick();
+
+		t0 = now();
+		done = batch ? device_batch() : device_single();
+		t += now() - t0;
+		if (done != drv.inflight) {
+			printf("%s: %d of %d chains handled\n", name, done, drv.inflight);
+			exit(1);
+		}
+		chains += done;
+		drv.inflight -= driver_reap(expected, &nr_expected);
+		if (drv.inflight || nr_expected) {
+			printf("%s: %d chains not returned\n", name, drv.inflight);
+			exit(1);
+		}
+	}
+	vq_teardown();
+
+	return t / chains;
+}
+
+/* A buffer id beyond the ring must be refused without being handed out */
+static void
+check_bad_id(void)
+{
+	struct iovec iov[CHAIN_LEN];
+	uint16_t idx = 0xbeef;
+	int n;
+
+	/* the error about it is expected */
+	quiet = true;
+	vq_setup(true);
+	driver_post(QSIZE / CHAIN_LEN - 1);
+	vq.packed_desc[1].id = QSIZE + 1;
+	driver_kick();
+	n = vq_getchain(&vq, &idx, iov, CHAIN_LEN, NULL);
+	if ((n >= 0) || (idx != 0xbeef)) {
+		printf("packed ring: bogus buffer id accepted (n %d, id %u)\n", n, idx);
+		exit(1);
+	}
+	/* the broken chain is skipped, the next one goes through */
+	drv.next_id = 0;
+	driver_post(0);
+	driver_kick();
+	n = vq_getchain(&vq, &idx, iov, CHAIN_LEN, NULL);
+	if ((n != CHAIN_LEN) || (idx != 0)) {
+		printf("packed ring: chain after a bogus one lost\n");
+		exit(1);
+	}
+	vq_teardown();
+	quiet = false;
+}
+
+int
+main(void)
+{
+	double split, packed;
+
+	check_bad_id();
+	run(false, true, "split batch");
+	run(true, true, "packed batch");
+	split = run(false, false, "split");
+	packed = run(true, false, "packed");
+	printf("used elements match the posted chains\n\n");
+
+	printf("%-8s %12s\n", "ring", "chain(ns)");
+	printf("%-8s %12.1f\n", "split", split);
+	printf("%-8s %12.1f\n", "packed", packed);
+
+	return 0;
+}
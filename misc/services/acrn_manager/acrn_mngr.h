@@ -36,7 +36,7 @@ struct mngr_msg {
 	unsigned long timestamp;
 	union {
 
-		/* Arguments to rescan virtio-blk device */
+		/* Arguments to rescan virtio-blk device, ack of DM_BLKSTAT */
 		char devargs[PARAM_LEN];
 
 		/* ack of DM_STOP, DM_SUSPEND, DM_RESUME,
@@ -96,6 +96,9 @@ enum dm_msgid {
 	DM_RESUME,		/* Resume this UOS from suspend state */
 	DM_QUERY,		/* Ask power state of this UOS */
 	DM_BLKRESCAN,		/* Rescan virtio-blk device for any changes in UOS */
+	DM_BLKQOS,		/* Set I/O limits of a virtio-blk device */
+	DM_BLKSTAT,		/* Get queue statistics of a virtio-blk device */
+	DM_BLKSNAP,		/* Take or commit a live snapshot of a virtio-blk device */
 	DM_MAX,
 };
 
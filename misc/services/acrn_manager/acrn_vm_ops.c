@@ -18,6 +18,9 @@
 #include "mevent.h"
 #include "pm.h"
 
+/* seconds to wait for a device model to take or commit a disk snapshot */
+#define BLKSNAP_TIMEOUT	600
+
 const char *state_str[] = {
 	[VM_STATE_UNKNOWN] = "unknown",
 	[VM_CREATED] = "stopped",
@@ -313,8 +316,9 @@ int shell_cmd(const char *cmd, char *outbuf, int len)
 	return ret;
 }
 
-static int send_msg(const char *vmname, struct mngr_msg *req,
-		    struct mngr_msg *ack)
+/* @timeout is in seconds, 0 waits for the ack as long as it takes */
+static int send_msg_timeout(const char *vmname, struct mngr_msg *req,
+		    struct mngr_msg *ack, unsigned timeout)
 {
 	int fd, ret;
 
@@ -329,7 +333,7 @@ static int send_msg(const char *vmname, struct mngr_msg *req,
 		return -1;
 	}
 
-	ret = mngr_send_msg(fd, req, ack, 1);
+	ret = mngr_send_msg(fd, req, ack, timeout);
 	if (ret < 0) {
 		printf("Unable to send msg to vm %s socket. It may have been shutdown\n", vmname);
 		mngr_close(fd);
@@ -341,6 +345,12 @@ static int send_msg(const char *vmname, struct mngr_msg *req,
 	return 0;
 }
 
+static int send_msg(const char *vmname, struct mngr_msg *req,
+		    struct mngr_msg *ack)
+{
+	return send_msg_timeout(vmname, req, ack, 1);
+}
+
 int list_vm()
 {
 	struct vmmngr_struct *s;
@@ -428,3 +438,81 @@ int blkrescan_vm(const char *vmname, char *devargs)
 
 	return ack.data.err;
 }
+
+int blkqos_vm(const char *vmname, char *devargs)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_BLKQOS;
+	req.timestamp = time(NULL);
+	strncpy(req.data.devargs, devargs, PARAM_LEN - 1);
+	req.data.devargs[PARAM_LEN - 1] = '\0';
+
+	send_msg(vmname, &req, &ack);
+
+	if (ack.data.err) {
+		printf("Unable to set I/O limits of virtio-blk device in vm. errno(%d)\n", ack.data.err);
+	}
+
+	return ack.data.err;
+}
+
+int blkstat_vm(const char *vmname, const char *slot)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	int queue, ret;
+
+	/* ask for one queue after another, until the DM has no more */
+	for (queue = 0; ; queue++) {
+		req.magic = MNGR_MSG_MAGIC;
+		req.msgid = DM_BLKSTAT;
+		req.timestamp = time(NULL);
+		snprintf(req.data.devargs, PARAM_LEN, "%s,%d", slot, queue);
+
+		ret = send_msg(vmname, &req, &ack);
+		if (ret)
+			return ret;
+
+		ack.data.devargs[PARAM_LEN - 1] = '\0';
+		if (ack.data.devargs[0] == '\0')
+			break;
+		printf("%s\n", ack.data.devargs);
+	}
+
+	if (queue == 0) {
+		printf("No statistics of virtio-blk device at slot %s in vm\n", slot);
+		return -1;
+	}
+
+	return 0;
+}
+
+int blksnap_vm(const char *vmname, char *devargs)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	int ret;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_BLKSNAP;
+	req.timestamp = time(NULL);
+	strncpy(req.data.devargs, devargs, PARAM_LEN - 1);
+	req.data.devargs[PARAM_LEN - 1] = '\0';
+
+	/* a commit copies all the writes since the snapshot, give it time */
+	ret = send_msg_timeout(vmname, &req, &ack, BLKSNAP_TIMEOUT);
+	if (ret) {
+		printf("No answer from vm %s within %d seconds, a commit may still be "
+			"in progress, see the device model's log\n", vmname, BLKSNAP_TIMEOUT);
+		return ret;
+	}
+
+	if (ack.data.err) {
+		printf("Unable to snapshot virtio-blk device in vm. errno(%d)\n", ack.data.err);
+	}
+
+	return ack.data.err;
+}
@@ -34,6 +34,9 @@
 #define ADD_DESC       "Add one virtual machine with SCRIPTS and OPTIONS"
 #define RESET_DESC     "Stop and then start virtual machine VM_NAME"
 #define BLKRESCAN_DESC  "Rescan virtio-blk device attached to a virtual machine"
+#define BLKQOS_DESC	"Set I/O limits of a virtio-blk device attached to a virtual machine"
+#define BLKSTAT_DESC	"Show queue statistics of a virtio-blk device attached to a virtual machine"
+#define BLKSNAP_DESC	"Take or commit a live snapshot of a virtio-blk device attached to a virtual machine"
 
 #define VM_NAME (1)
 #define CMD_ARGS (2)
@@ -427,6 +430,60 @@ static int acrnctl_do_blkrescan(int argc, char *argv[])
 	return 0;
 }
 
+static int acrnctl_do_blkqos(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for blkqos\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return blkqos_vm(argv[VM_NAME], argv[CMD_ARGS]);
+}
+
+static int acrnctl_do_blkstat(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for blkstat\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return blkstat_vm(argv[VM_NAME], argv[CMD_ARGS]);
+}
+
+static int acrnctl_do_blksnap(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for blksnap\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return blksnap_vm(argv[VM_NAME], argv[CMD_ARGS]);
+}
+
 static int acrnctl_do_stop(int argc, char *argv[])
 {
 	struct vmmngr_struct *s;
@@ -641,6 +698,42 @@ static int valid_blkrescan_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+static int valid_blkqos_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME slot,[iops=N][,bps=N][,burst=MS][,qos_weight=W][,qos_lat=US]";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_blkstat_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME slot";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_blksnap_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME slot,snapshot=overlay | slot,commit";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int valid_add_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
 	char df_opt[32] = "launch_scripts options";
@@ -683,6 +776,9 @@ struct acrnctl_cmd acmds[] = {
 	ACMD("add", acrnctl_do_add, ADD_DESC, valid_add_args),
 	ACMD("reset", acrnctl_do_reset, RESET_DESC, df_valid_args),
 	ACMD("blkrescan", acrnctl_do_blkrescan, BLKRESCAN_DESC, valid_blkrescan_args),
+	ACMD("blkqos", acrnctl_do_blkqos, BLKQOS_DESC, valid_blkqos_args),
+	ACMD("blkstat", acrnctl_do_blkstat, BLKSTAT_DESC, valid_blkstat_args),
+	ACMD("blksnap", acrnctl_do_blksnap, BLKSNAP_DESC, valid_blksnap_args),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
@@ -58,5 +58,8 @@ int pause_vm(const char *vmname);
 int continue_vm(const char *vmname);
 int resume_vm(const char *vmname, unsigned reason);
 int blkrescan_vm(const char *vmname, char *devargs);
+int blkqos_vm(const char *vmname, char *devargs);
+int blkstat_vm(const char *vmname, const char *slot);
+int blksnap_vm(const char *vmname, char *devargs);
 
 #endif				/* _ACRNCTL_H_ */